@@ -85,6 +85,21 @@ void AzureDeviceUpdateCoreInterface_ReportStateAndResultAsync(ADUCITF_State upda
  */
 void AzureDeviceUpdateCoreInterface_ReportUpdateIdAndIdleAsync(const struct tagADUC_UpdateId* updateId);
 
+/**
+ * @brief Report the download progress of the current update to the server.
+ *
+ * @param downloadProgress Object with one member per file, keyed by file ID.
+ * @return _Bool True if the report was queued in the IoT Hub client.
+ */
+_Bool AzureDeviceUpdateCoreInterface_ReportDownloadProgressAsync(const JSON_Value* downloadProgress);
+
+/**
+ * @brief Report the timing report of the last workflow to the server.
+ *
+ * @param workflowTiming The report, see aduc/workflow_timing.h.
+ */
+void AzureDeviceUpdateCoreInterface_ReportWorkflowTimingAsync(const JSON_Value* workflowTiming);
+
 EXTERN_C_END
 
 #endif // ADUC_ADU_CORE_INTERFACE_H
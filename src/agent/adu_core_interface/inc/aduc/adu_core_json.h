@@ -90,6 +90,16 @@ const char* ADUCITF_StateToString(ADUCITF_State updateState);
  */
 #define ADUCITF_FIELDNAME_INSTALLEDUPDATEID "installedUpdateId"
 
+/**
+ * @brief JSON field name for the download progress of the files of the current update.
+ */
+#define ADUCITF_FIELDNAME_DOWNLOADPROGRESS "downloadProgress"
+
+/**
+ * @brief JSON field name for the timing report of the last workflow.
+ */
+#define ADUCITF_FIELDNAME_WORKFLOWTIMING "workflowTiming"
+
 /**
  * @brief JSON field name for DeviceProperties
  */
@@ -137,6 +147,10 @@ const char* ADUCITF_StateToString(ADUCITF_State updateState);
  * @brief JSON field name for the updateManifest's updateType
  */
 #define ADUCITF_FIELDNAME_UPDATETYPE "updateType"
+/**
+ * @brief JSON field name for the updateManifest's autoAdvance flag
+ */
+#define ADUCITF_FIELDNAME_AUTOADVANCE "autoAdvance"
 /**
  * @brief JSON field name for the updateManifest's UpdateId
  */
@@ -199,6 +213,8 @@ _Bool ADUC_Json_GetUpdateType(const JSON_Value* updateActionJson, char** updateT
 
 _Bool ADUC_Json_GetUpdateId(const JSON_Value* updateActionJson, struct tagADUC_UpdateId** updateId);
 
+_Bool ADUC_Json_GetAutoAdvance(const JSON_Value* updateActionJson);
+
 _Bool ADUC_Json_GetFiles(
     const JSON_Value* updateActionJson, unsigned int* fileCount, struct tagADUC_FileEntity** files);
 
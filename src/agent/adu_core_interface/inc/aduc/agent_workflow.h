@@ -9,6 +9,7 @@
 
 #include <limits.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include <parson.h>
 
@@ -24,6 +25,7 @@ typedef struct tagADUC_ContentData
     ADUC_UpdateId* ExpectedUpdateId; /**< The expected/desired update Id. Required. */
     char* InstalledCriteria; /**< The installed criteria string used to evaluate if content is installed. Required. */
     char* UpdateType; /**< The content type string. Required. */
+    _Bool AutoAdvance; /**< The manifest asks to run Install and Apply without waiting for their actions. */
 } ADUC_ContentData;
 
 typedef enum tagADUC_AgentRestartState
@@ -88,6 +90,14 @@ typedef struct tagADUC_WorkflowData
     ADUC_DownloadProgressCallback DownloadProgressCallback; /**< Callback for download progress */
 
     ADUC_ContentData* ContentData; /**< The content specific data for this workflow */
+
+    _Bool AutoAdvanceConfigured; /**< 'auto_advance_workflow' is enabled in the config file. */
+
+    _Bool AutoAdvancePending; /**< The next phase is to be started by ADUC_WorkflowData_DoWork. */
+
+    ADUCITF_UpdateAction AutoAdvancedAction; /**< Auto-advanced phase in progress or succeeded, Download if none. */
+
+    uint64_t OperationStartNs; /**< When the operation in progress started, see aduc/workflow_timing.h. */
 } ADUC_WorkflowData;
 
 _Bool ADUC_WorkflowData_Init(ADUC_WorkflowData* workflowData, int argc, char** argv);
@@ -8,18 +8,57 @@
 
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <parson.h>
 
 #include "aduc/adu_core_interface.h"
 #include "aduc/c_utils.h"
+#include "workflow_journal.h"
 #include <aduc/logging.h>
 #include <aduc/string_c_utils.h>
+#include <aduc/workflow_timing.h>
 #include <sys/wait.h> // for waitpid
 #include <unistd.h>
 
 void ADUC_MethodCall_Idle(ADUC_WorkflowData* workflowData);
 
+/**
+ * @brief Closes the timing report of the workflow, and reports it to the service if 'report_workflow_timing' is
+ * enabled in the config file.
+ *
+ * @param[in] workflowData Workflow data.
+ * @param[in] updateId The update of the workflow (optional, can be NULL).
+ * @param[in] outcome How the workflow ended.
+ */
+static void
+EndWorkflowTiming(const ADUC_WorkflowData* workflowData, const ADUC_UpdateId* updateId, const char* outcome)
+{
+    char updateIdString[ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID] = "";
+    if (updateId == NULL && workflowData->ContentData != NULL)
+    {
+        updateId = workflowData->ContentData->ExpectedUpdateId;
+    }
+
+    ADUC_WorkflowJournal_FormatUpdateId(updateId, updateIdString, sizeof(updateIdString));
+
+    JSON_Value* report = ADUC_WorkflowTiming_End(updateIdString, outcome);
+    if (report == NULL)
+    {
+        return;
+    }
+
+    char reportTiming[8];
+    if (ReadDelimitedValueFromFile(
+            ADUC_CONF_FILE_PATH, "report_workflow_timing", reportTiming, ARRAY_SIZE(reportTiming))
+        && strcmp(reportTiming, "true") == 0)
+    {
+        AzureDeviceUpdateCoreInterface_ReportWorkflowTimingAsync(report);
+    }
+
+    json_value_free(report);
+}
+
 /**
  * @brief Move state machine to a new stage.
  *
@@ -55,6 +94,9 @@ ADUC_SetUpdateStateHelper(ADUC_WorkflowData* workflowData, ADUCITF_State updateS
                 return;
             }
 
+            // Recorded with the pending reboot or restart, so startup probes the update state.
+            ADUC_WorkflowJournal_Append(workflowData, updateState, NULL /*installedUpdateId*/);
+
             if (workflowData->SystemRebootState == ADUC_SystemRebootState_InProgress)
             {
                 // Reboot is required, and successfully initiated (device is shutting down and restarting).
@@ -86,6 +128,16 @@ ADUC_SetUpdateStateHelper(ADUC_WorkflowData* workflowData, ADUCITF_State updateS
             // Device failed to reboot, or the agent failed to restart, consider update failed.
             // Fall through to report Idle without InstalledUpdateId.
         }
+        else
+        {
+            ADUC_WorkflowJournal_Append(workflowData, updateState, NULL /*installedUpdateId*/);
+        }
+
+        EndWorkflowTiming(workflowData, NULL /*updateId*/, workflowData->OperationCancelled ? "Cancelled" : "Failed");
+
+        // The deployment did not complete, so later actions for it are no longer behind auto-advance.
+        workflowData->AutoAdvancePending = false;
+        workflowData->AutoAdvancedAction = ADUCITF_UpdateAction_Download;
 
         AzureDeviceUpdateCoreInterface_ReportStateAndResultAsync(updateState, result);
         ADUC_MethodCall_Idle(workflowData);
@@ -94,7 +146,17 @@ ADUC_SetUpdateStateHelper(ADUC_WorkflowData* workflowData, ADUCITF_State updateS
     }
     else
     {
+        ADUC_WorkflowJournal_Append(workflowData, updateState, NULL /*installedUpdateId*/);
         AzureDeviceUpdateCoreInterface_ReportStateAndResultAsync(updateState, result);
+
+        if (updateState == ADUCITF_State_Failed)
+        {
+            EndWorkflowTiming(workflowData, NULL /*updateId*/, "Failed");
+
+            // The orchestrator may retry the failed phase, which auto-advance must not ignore.
+            workflowData->AutoAdvancePending = false;
+            workflowData->AutoAdvancedAction = ADUCITF_UpdateAction_Download;
+        }
     }
 
     workflowData->LastReportedState = updateState;
@@ -131,7 +193,9 @@ void ADUC_SetUpdateStateWithResult(ADUC_WorkflowData* workflowData, ADUCITF_Stat
  */
 void ADUC_SetInstalledUpdateIdAndGoToIdle(ADUC_WorkflowData* workflowData, const ADUC_UpdateId* updateId)
 {
+    ADUC_WorkflowJournal_Append(workflowData, ADUCITF_State_Idle, updateId);
     AzureDeviceUpdateCoreInterface_ReportUpdateIdAndIdleAsync(updateId);
+    EndWorkflowTiming(workflowData, updateId, "Installed");
 
     workflowData->LastReportedState = ADUCITF_State_Idle;
 
@@ -722,6 +786,7 @@ int ADUC_MethodCall_RebootSystem()
 {
     Log_Info("Calling ADUC_RebootSystem");
 
+    ADUC_WorkflowTiming_Suspend("reboot");
     return ADUC_RebootSystem();
 }
 
@@ -736,6 +801,7 @@ int ADUC_MethodCall_RestartAgent()
 {
     Log_Info("Calling ADUC_RestartAgent");
 
+    ADUC_WorkflowTiming_Suspend("restart");
     return ADUC_RestartAgent();
 }
 
@@ -869,8 +935,10 @@ ADUC_Result ADUC_MethodCall_Download(ADUC_MethodCall_Data* methodCallData)
 
     // Note: It's okay for SandboxCreate to return NULL for the work folder.
     // NULL likely indicates an OS without a file system.
+    const uint64_t sandboxStartNs = ADUC_WorkflowTiming_Now();
     result = registerData->SandboxCreateCallback(
         registerData->Token, workflowData->WorkflowId, &(workflowData->WorkFolder));
+    ADUC_WorkflowTiming_AddSpan("sandbox", sandboxStartNs);
     if (IsAducResultCodeFailure(result.ResultCode))
     {
         goto done;
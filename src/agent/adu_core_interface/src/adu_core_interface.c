@@ -12,6 +12,8 @@
 #include "aduc/client_handle_helper.h"
 #include "aduc/hash_utils.h"
 #include "startup_msg_helper.h"
+#include "workflow_action_queue.h"
+#include <aduc/event_loop.h>
 #include <aduc/logging.h>
 #include <aduc/string_c_utils.h>
 
@@ -51,12 +53,14 @@ void ClientReportedStateCallback(int statusCode, void* context)
     }
 }
 
-static void ReportClientJsonProperty(const char* json_value)
+static _Bool ReportClientJsonProperty(const char* json_value)
 {
+    _Bool succeeded = false;
+
     if (g_iotHubClientHandleForADUComponent == NULL)
     {
         Log_Error("ReportClientJsonProperty called with invalid IoTHub Device Client handle! Can't report!");
-        return;
+        return false;
     }
 
     IOTHUB_CLIENT_RESULT iothubClientResult;
@@ -89,11 +93,17 @@ static void ReportClientJsonProperty(const char* json_value)
         goto done;
     }
 
+    // The report is only sent by the main loop, which may be sleeping if this runs on a worker thread.
+    ADUC_EventLoop_Wake();
+    succeeded = true;
+
 done:
     if (jsonToSend != NULL)
     {
         STRING_delete(jsonToSend);
     }
+
+    return succeeded;
 }
 
 /**
@@ -211,6 +221,22 @@ void AzureDeviceUpdateCoreInterface_Connected(void* componentContext)
 void AzureDeviceUpdateCoreInterface_DoWork(void* componentContext)
 {
     ADUC_WorkflowData* workflowData = (ADUC_WorkflowData*)componentContext;
+
+    // One queued update action per iteration. While a cancelled operation winds down, the action after the Cancel
+    // waits, as it would be rejected with the operation still in progress.
+    if (!(workflowData->OperationInProgress && workflowData->OperationCancelled))
+    {
+        char* updateActionJson = ADUC_WorkflowActionQueue_Pop();
+        if (updateActionJson != NULL)
+        {
+            ADUC_Workflow_HandlePropertyUpdate(workflowData, (const unsigned char*)updateActionJson);
+            free(updateActionJson);
+
+            // Come back right away for the next queued action, if any.
+            ADUC_EventLoop_Wake();
+        }
+    }
+
     ADUC_WorkflowData_DoWork(workflowData);
 }
 
@@ -220,6 +246,7 @@ void AzureDeviceUpdateCoreInterface_Destroy(void** componentContext)
 
     Log_Info("ADUC agent stopping");
 
+    ADUC_WorkflowActionQueue_Clear();
     ADUC_WorkflowData_Free(workflowData);
     free(workflowData);
 
@@ -229,11 +256,12 @@ void AzureDeviceUpdateCoreInterface_Destroy(void** componentContext)
 void OrchestratorUpdateCallback(
     ADUC_ClientHandle clientHandle, JSON_Value* propertyValue, int propertyVersion, void* context)
 {
-    ADUC_WorkflowData* workflowData = (ADUC_WorkflowData*)context;
+    UNREFERENCED_PARAMETER(context);
+
     STRING_HANDLE jsonToSend = NULL;
 
     // Reads out the json string so we can Log Out what we've got.
-    // The value will be parsed and handled in ADUC_Workflow_HandlePropertyUpdate.
+    // The value is queued, and parsed and handled in ADUC_Workflow_HandlePropertyUpdate from the main loop.
     char* jsonString = json_serialize_to_string(propertyValue);
     if (jsonString == NULL)
     {
@@ -248,9 +276,10 @@ void OrchestratorUpdateCallback(
         jsonString,
         propertyVersion);
 
-    ADUC_Workflow_HandlePropertyUpdate(workflowData, (const unsigned char*)jsonString);
+    ADUC_WorkflowActionQueue_Push(propertyVersion, jsonString);
 
-    // ACK the request.
+    // ACK the request. Actions superseded in the queue are acknowledged as well, as the service only needs to know
+    // that the version was received.
     jsonToSend = PnP_CreateReportedPropertyWithStatus(
         g_aduPnPComponentName,
         g_aduPnPComponentOrchestratorPropertyName,
@@ -298,6 +327,8 @@ void AzureDeviceUpdateCoreInterface_PropertyUpdateCallback(
 {
     if (strcmp(propertyName, g_aduPnPComponentOrchestratorPropertyName) == 0)
     {
+        // Keeps the main loop at its active rate while the update action is worked on.
+        ADUC_EventLoop_Wake();
         OrchestratorUpdateCallback(clientHandle, propertyValue, version, context);
     }
     else
@@ -488,3 +519,84 @@ done:
     json_free_serialized_string(jsonString);
     json_value_free(rootValue);
 }
+
+/**
+ * @brief Reports a copy of @p value as the field @p fieldName of the client property.
+ *
+ * @param fieldName The name of the field.
+ * @param value The value of the field.
+ * @return _Bool True if the report was queued in the IoT Hub client.
+ */
+static _Bool ReportClientJsonField(const char* fieldName, const JSON_Value* value)
+{
+    JSON_Value* rootValue = json_value_init_object();
+    JSON_Object* rootObject = json_value_get_object(rootValue);
+    char* jsonString = NULL;
+    _Bool succeeded = false;
+
+    JSON_Value* fieldValue = json_value_deep_copy(value);
+    if (fieldValue == NULL)
+    {
+        Log_Error("Copying %s failed", fieldName);
+        goto done;
+    }
+
+    JSON_Status jsonStatus = json_object_set_value(rootObject, fieldName, fieldValue);
+    if (jsonStatus != JSONSuccess)
+    {
+        Log_Error("Could not serialize JSON field: %s", fieldName);
+        json_value_free(fieldValue);
+        goto done;
+    }
+
+    jsonString = json_serialize_to_string(rootValue);
+    if (jsonString == NULL)
+    {
+        Log_Error("Serializing JSON to string failed");
+        goto done;
+    }
+
+    succeeded = ReportClientJsonProperty(jsonString);
+
+done:
+
+    json_free_serialized_string(jsonString);
+    json_value_free(rootValue);
+
+    return succeeded;
+}
+
+/**
+ * @brief Report the download progress of the current update to service.
+ *
+ * The progress of all files is sent in a single patch, so callers control the reporting rate.
+ *
+ * @param[in] downloadProgress Object with one member per file, keyed by file ID.
+ * @return _Bool True if the report was queued in the IoT Hub client.
+ */
+_Bool AzureDeviceUpdateCoreInterface_ReportDownloadProgressAsync(const JSON_Value* downloadProgress)
+{
+    if (g_iotHubClientHandleForADUComponent == NULL)
+    {
+        Log_Error("ReportDownloadProgressAsync called before registration! Can't report!");
+        return false;
+    }
+
+    return ReportClientJsonField(ADUCITF_FIELDNAME_DOWNLOADPROGRESS, downloadProgress);
+}
+
+/**
+ * @brief Report the timing report of the last workflow to service.
+ *
+ * @param[in] workflowTiming The report, see aduc/workflow_timing.h.
+ */
+void AzureDeviceUpdateCoreInterface_ReportWorkflowTimingAsync(const JSON_Value* workflowTiming)
+{
+    if (g_iotHubClientHandleForADUComponent == NULL)
+    {
+        Log_Error("ReportWorkflowTimingAsync called before registration! Can't report!");
+        return;
+    }
+
+    ReportClientJsonField(ADUCITF_FIELDNAME_WORKFLOWTIMING, workflowTiming);
+}
@@ -400,6 +400,24 @@ _Bool ADUC_Json_GetUpdateType(const JSON_Value* updateActionJson, char** updateT
     return ADUC_JSON_GetUpdateManifestStringField(updateActionJson, ADUCITF_FIELDNAME_UPDATETYPE, updateTypeStr);
 }
 
+/**
+ * @brief Retrieves the autoAdvance flag from @p updateActionJson's updateManifest.
+ * When set, the agent runs Install and Apply as soon as the previous phase succeeded, without waiting for the
+ * orchestrator to send the next action.
+ *
+ * @param updateActionJson UpdateAction JSON to parse
+ * @returns True if the flag is present and true.
+ */
+_Bool ADUC_Json_GetAutoAdvance(const JSON_Value* updateActionJson)
+{
+    JSON_Value* updateManifestValue = ADUC_JSON_GetUpdateManifestRoot(updateActionJson);
+    const _Bool autoAdvance =
+        json_object_get_boolean(json_value_get_object(updateManifestValue), ADUCITF_FIELDNAME_AUTOADVANCE) == 1;
+
+    json_value_free(updateManifestValue);
+    return autoAdvance;
+}
+
 /**
  * @brief Gets a string field from the update action JSON.
  *
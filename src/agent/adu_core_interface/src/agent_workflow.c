@@ -74,22 +74,35 @@
  *                    │CBO│                                     │Client│
  *                    └───┘                                     └──────┘
  *
+ * With auto-advance, enabled by 'autoAdvance' in the update manifest or 'auto_advance_workflow' in the config file,
+ * the client starts Install right after DownloadSucceeded, and Apply right after InstallSucceeded. The intermediate
+ * states are still reported; the CBO's Install and Apply actions that arrive afterwards are ignored.
+ *
  * @copyright Copyright (c) 2019, Microsoft Corp.
  */
 #include "aduc/agent_workflow.h"
 
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h> // PRIu64
 #include <time.h>
+#include <unistd.h>
 
 #include "aduc/adu_core_export_helpers.h"
 #include "aduc/adu_core_interface.h"
 #include "aduc/c_utils.h"
 #include "aduc/logging.h"
 #include "aduc/result.h"
+#include "aduc/string_c_utils.h"
 
 #include "agent_workflow_utils.h"
+#include "workflow_journal.h"
+
+#include <aduc/event_loop.h>
+#include <aduc/workflow_timing.h>
+#include <azure_c_shared_utility/crt_abstractions.h>
 
 /**
  * @brief Generate a unique identifier.
@@ -111,6 +124,12 @@ static void DownloadProgressCallback(
     uint64_t bytesTransferred,
     uint64_t bytesTotal);
 
+static void DownloadProgress_Report(void);
+
+static void DownloadProgress_Clear(void);
+
+static void ADUC_Workflow_AutoAdvance(ADUC_WorkflowData* workflowData);
+
 /**
  * @brief Signature of method to perform an update action.
  */
@@ -282,6 +301,8 @@ _Bool ADUC_ContentData_Update(ADUC_ContentData* contentData, const JSON_Value* u
         goto done;
     }
 
+    contentData->AutoAdvance = ADUC_Json_GetAutoAdvance(updateActionJson);
+
     succeeded = true;
 
 done:
@@ -334,6 +355,13 @@ _Bool ADUC_WorkflowData_Init(ADUC_WorkflowData* workflowData, int argc, char** a
 
     workflowData->DownloadProgressCallback = DownloadProgressCallback;
 
+    // Optional: run every deployment's phases back to back, see ADUC_Json_GetAutoAdvance.
+    char autoAdvance[8];
+    workflowData->AutoAdvanceConfigured =
+        ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "auto_advance_workflow", autoAdvance, ARRAY_SIZE(autoAdvance))
+        && strcmp(autoAdvance, "true") == 0;
+    workflowData->AutoAdvancedAction = ADUCITF_UpdateAction_Download;
+
     succeeded = true;
 
 done:
@@ -384,6 +412,15 @@ void ADUC_WorkflowData_DoWork(ADUC_WorkflowData* workflowData)
     const ADUC_RegisterData* registerData = &(workflowData->RegisterData);
 
     registerData->DoWorkCallback(registerData->Token, workflowData->WorkflowId);
+
+    // The completion callback of the previous phase may run on a worker thread, so the next phase is started here.
+    if (workflowData->AutoAdvancePending && !workflowData->OperationInProgress)
+    {
+        workflowData->AutoAdvancePending = false;
+        ADUC_Workflow_AutoAdvance(workflowData);
+    }
+
+    DownloadProgress_Report();
 }
 
 /**
@@ -402,6 +439,8 @@ void ADUC_WorkflowData_Free(ADUC_WorkflowData* workflowData)
 
     ADUC_ContentData_Free(workflowData->ContentData);
 
+    DownloadProgress_Clear();
+
     if (workflowData->IsRegistered)
     {
         ADUC_MethodCall_Unregister(&(workflowData->RegisterData));
@@ -412,6 +451,70 @@ void ADUC_WorkflowData_Free(ADUC_WorkflowData* workflowData)
 
 static void ADUC_Workflow_WorkCompletionCallback(const void* workCompletionToken, ADUC_Result result);
 
+static void ADUC_Workflow_StartAction(ADUC_WorkflowData* workflowData, const ADUC_WorkflowHandlerMapEntry* entry);
+
+/**
+ * @brief Returns true if the phases of the current deployment run back to back.
+ *
+ * @param workflowData Workflow metadata.
+ */
+static _Bool IsAutoAdvanceEnabled(const ADUC_WorkflowData* workflowData)
+{
+    return workflowData->AutoAdvanceConfigured
+           || (workflowData->ContentData != NULL && workflowData->ContentData->AutoAdvance);
+}
+
+/**
+ * @brief Starts the phase after the one that just succeeded, as if the orchestrator had sent its action.
+ * Download is followed by Install, and Install by Apply.
+ *
+ * @param workflowData Workflow metadata.
+ */
+static void ADUC_Workflow_AutoAdvance(ADUC_WorkflowData* workflowData)
+{
+    const ADUC_WorkflowHandlerMapEntry* entry = GetWorkflowHandlerMapEntryForAction(workflowData->CurrentAction);
+    if (entry == NULL || entry + 1 >= workflowHandlerMap + ARRAY_SIZE(workflowHandlerMap))
+    {
+        return;
+    }
+
+    ++entry;
+    Log_Info("Auto-advancing to '%s'", ADUCITF_UpdateActionToString(entry->Action));
+    workflowData->AutoAdvancedAction = entry->Action;
+    ADUC_Workflow_StartAction(workflowData, entry);
+}
+
+/**
+ * @brief Continues the journaled workflow of the expected update with its workflow ID and sandbox, if the journal
+ * has one. Otherwise starts a new workflow ID.
+ *
+ * @param[in,out] workflowData The workflow data.
+ * @param journal The last journal record, zeroed if there is none.
+ */
+static void ResumeJournaledWorkflow(ADUC_WorkflowData* workflowData, const ADUC_WorkflowJournalEntry* journal)
+{
+    char expectedUpdateId[ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID];
+    ADUC_WorkflowJournal_FormatUpdateId(
+        workflowData->ContentData->ExpectedUpdateId, expectedUpdateId, sizeof(expectedUpdateId));
+
+    if (journal->WorkflowId[0] == '\0' || expectedUpdateId[0] == '\0'
+        || strcmp(journal->UpdateId, expectedUpdateId) != 0)
+    {
+        GenerateUniqueId(workflowData->WorkflowId, ARRAY_SIZE(workflowData->WorkflowId));
+        return;
+    }
+
+    Log_Info("Resuming workflow %s from the workflow journal", journal->WorkflowId);
+    memcpy(workflowData->WorkflowId, journal->WorkflowId, sizeof(workflowData->WorkflowId));
+    ADUC_WorkflowTiming_Resume();
+
+    // The sandbox is destroyed when the workflow ends, if it survived the restart.
+    if (workflowData->WorkFolder == NULL && journal->WorkFolder[0] != '\0' && access(journal->WorkFolder, F_OK) == 0)
+    {
+        workflowData->WorkFolder = strdup(journal->WorkFolder);
+    }
+}
+
 void ADUC_Workflow_HandleStartupWorkflowData(ADUC_WorkflowData* workflowData)
 {
     // The default result for Idle state.
@@ -440,15 +543,41 @@ void ADUC_Workflow_HandleStartupWorkflowData(ADUC_WorkflowData* workflowData)
     // In this case, we will update the 'InstalledContentId' to match 'ExpectedContentId'
     // and transition to Idle state.
 
-    ADUC_Result isInstalledResult = ADUC_MethodCall_IsInstalled(workflowData);
-    ADUC_Result getUrsResult = ADUC_MethodCall_GetUpdateRebootState(workflowData);
-
     unsigned int desiredAction;
     if (!ADUC_Json_GetUpdateAction(workflowData->UpdateActionJson, &desiredAction))
     {
         goto done;
     }
 
+    // A journal that ends with a completed workflow answers the common cases without probing the device.
+    ADUC_WorkflowJournalEntry journal;
+    if (ADUC_WorkflowJournal_Load(&journal) && journal.State == ADUCITF_State_Idle && !journal.RebootPending
+        && journal.InstalledUpdateId[0] != '\0')
+    {
+        char expectedUpdateId[ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID];
+        ADUC_WorkflowJournal_FormatUpdateId(
+            workflowData->ContentData->ExpectedUpdateId, expectedUpdateId, sizeof(expectedUpdateId));
+
+        if (strcmp(journal.InstalledUpdateId, expectedUpdateId) == 0)
+        {
+            Log_Info("Workflow journal: %s is installed, setting state to Idle", expectedUpdateId);
+            ADUC_SetInstalledUpdateIdAndGoToIdle(workflowData, workflowData->ContentData->ExpectedUpdateId);
+            ADUC_SetUpdateStateWithResult(workflowData, ADUCITF_State_Idle, result);
+            goto done;
+        }
+
+        if (desiredAction == ADUCITF_UpdateAction_Download)
+        {
+            Log_Info("Workflow journal: %s is installed, starting the pending download", journal.InstalledUpdateId);
+            workflowData->StartupIdleCallSent = true;
+            ADUC_Workflow_HandleUpdateAction(workflowData);
+            goto done;
+        }
+    }
+
+    ADUC_Result isInstalledResult = ADUC_MethodCall_IsInstalled(workflowData);
+    ADUC_Result getUrsResult = ADUC_MethodCall_GetUpdateRebootState(workflowData);
+
     if (isInstalledResult.ResultCode == ADUC_IsInstalledResult_NotInstalled)
     {
         Log_Info("Update was not installed");
@@ -531,7 +660,7 @@ void ADUC_Workflow_HandleStartupWorkflowData(ADUC_WorkflowData* workflowData)
                  * Normal workflow. Apply the update and go idle.
                  */
                 Log_Info("Applying new update");
-                GenerateUniqueId(workflowData->WorkflowId, ARRAY_SIZE(workflowData->WorkflowId));
+                ResumeJournaledWorkflow(workflowData, &journal);
 
                 workflowData->LastReportedState = ADUCITF_State_InstallSucceeded;
                 workflowData->CurrentAction = ADUCITF_State_ApplyStarted;
@@ -666,6 +795,9 @@ void ADUC_Workflow_HandleUpdateAction(ADUC_WorkflowData* workflowData)
 
     if (desiredAction == ADUCITF_UpdateAction_Cancel)
     {
+        workflowData->AutoAdvancePending = false;
+        workflowData->AutoAdvancedAction = ADUCITF_UpdateAction_Download;
+
         if (workflowData->OperationInProgress)
         {
             Log_Info("Cancel requested - notifying operation in progress.");
@@ -736,6 +868,17 @@ void ADUC_Workflow_HandleUpdateAction(ADUC_WorkflowData* workflowData)
         goto done;
     }
 
+    // With auto-advance the orchestrator's Install and Apply actions trail behind the agent. Those for a phase the
+    // agent started on its own, and that is still in progress or succeeded, are ignored. A cancelled or failed
+    // phase resets AutoAdvancedAction, so the orchestrator can retry it.
+    if (entry->Action != ADUCITF_UpdateAction_Download && entry->Action <= workflowData->AutoAdvancedAction)
+    {
+        Log_Info(
+            "'%s' action received. Already started by auto-advance. Ignoring this action.",
+            ADUCITF_UpdateActionToString(entry->Action));
+        goto done;
+    }
+
     //
     // Workaround:
     // Connections to the service may disconnect after a period of time (e.g. 40 minutes)
@@ -756,6 +899,24 @@ void ADUC_Workflow_HandleUpdateAction(ADUC_WorkflowData* workflowData)
         goto done;
     }
 
+    ADUC_Workflow_StartAction(workflowData, entry);
+
+done:
+    if (workflowData->UpdateActionJson != NULL)
+    {
+        json_value_free(workflowData->UpdateActionJson);
+        workflowData->UpdateActionJson = NULL;
+    }
+}
+
+/**
+ * @brief Calls the upper-layer method of @p entry's action.
+ *
+ * @param workflowData Workflow metadata.
+ * @param entry The action to start.
+ */
+static void ADUC_Workflow_StartAction(ADUC_WorkflowData* workflowData, const ADUC_WorkflowHandlerMapEntry* entry)
+{
     // Fail if we have already have an operation in progress.
     // This check happens after the check for duplicates, so we don't log a warning in our logs for an operation
     // that is currently being processed.
@@ -764,7 +925,7 @@ void ADUC_Workflow_HandleUpdateAction(ADUC_WorkflowData* workflowData)
         Log_Error(
             "Cannot process action '%s' - async operation already in progress.",
             ADUCITF_UpdateActionToString(entry->Action));
-        goto done;
+        return;
     }
 
     Log_Info("Processing '%s' action", ADUCITF_UpdateActionToString(entry->Action));
@@ -773,7 +934,7 @@ void ADUC_Workflow_HandleUpdateAction(ADUC_WorkflowData* workflowData)
     ADUC_MethodCall_Data* methodCallData = calloc(1, sizeof(ADUC_MethodCall_Data));
     if (methodCallData == NULL)
     {
-        goto done;
+        return;
     }
 
     methodCallData->WorkflowData = workflowData;
@@ -794,11 +955,17 @@ void ADUC_Workflow_HandleUpdateAction(ADUC_WorkflowData* workflowData)
     bool shouldCallOperationFunc = true;
     ADUC_Result result;
 
+    workflowData->OperationStartNs = ADUC_WorkflowTiming_Now();
+
     if (entry->Action == ADUCITF_UpdateAction_Download)
     {
+        // A new deployment starts with no phase auto-advanced yet.
+        workflowData->AutoAdvancedAction = ADUCITF_UpdateAction_Download;
+
         // Generate workflowId when we start downloading.
         GenerateUniqueId(workflowData->WorkflowId, ARRAY_SIZE(workflowData->WorkflowId));
         Log_Info("Start the workflow - downloading, with WorkflowId %s", workflowData->WorkflowId);
+        ADUC_WorkflowTiming_Begin(workflowData->WorkflowId);
 
         result = ADUC_MethodCall_Prepare(workflowData);
         shouldCallOperationFunc = IsAducResultCodeSuccess(result.ResultCode);
@@ -831,13 +998,6 @@ void ADUC_Workflow_HandleUpdateAction(ADUC_WorkflowData* workflowData)
         Log_Info("---TMP---ADUC_Workflow_WorkCompletionCallback");
         ADUC_Workflow_WorkCompletionCallback(methodCallData, result);
     }
-
-done:
-    if (workflowData->UpdateActionJson != NULL)
-    {
-        json_value_free(workflowData->UpdateActionJson);
-        workflowData->UpdateActionJson = NULL;
-    }
 }
 
 /**
@@ -881,6 +1041,8 @@ static void ADUC_Workflow_WorkCompletionCallback(const void* workCompletionToken
     Log_Info("---TMP---Hier Wechsel von workflow zu helper ?");
     entry->OperationCompleteFunc(methodCallData, result);
 
+    ADUC_WorkflowTiming_AddSpan(ADUCITF_UpdateActionToString(entry->Action), workflowData->OperationStartNs);
+
     if (IsAducResultCodeSuccess(result.ResultCode))
     {
         // Operation succeeded -- go to next state.
@@ -893,6 +1055,13 @@ static void ADUC_Workflow_WorkCompletionCallback(const void* workCompletionToken
             ADUCITF_StateToString(nextUpdateState));
 
         ADUC_SetUpdateState(workflowData, nextUpdateState);
+
+        // The intermediate state is reported above; the next phase starts without waiting for its action.
+        if (entry->Action != ADUCITF_UpdateAction_Apply && IsAutoAdvanceEnabled(workflowData))
+        {
+            workflowData->AutoAdvancePending = true;
+            ADUC_EventLoop_Wake();
+        }
     }
     else
     {
@@ -960,6 +1129,126 @@ static const char* DownloadProgressStateToString(ADUC_DownloadProgressState stat
     return "<Unknown>";
 }
 
+/**
+ * @brief Minimum time between two download progress reports to the service.
+ */
+static const uint64_t c_downloadProgressIntervalMs = 10 * 1000;
+
+/**
+ * @brief Minimum progress of a file, in percent, before it is reported again.
+ * Files of unknown size are only throttled by time.
+ */
+static const unsigned int c_downloadProgressMinPercentDelta = 5;
+
+/**
+ * @brief Weight of the latest sample in the smoothed transfer rate, in percent.
+ */
+static const uint64_t c_downloadRateSmoothingPercent = 30;
+
+/**
+ * @brief Maximum number of files whose download progress is reported.
+ */
+#define ADUC_MAX_DOWNLOAD_PROGRESS_FILES 32
+
+/**
+ * @brief Download progress of a single file.
+ */
+typedef struct tagADUC_DownloadProgressEntry
+{
+    char* FileId; /**< File ID from the update manifest. */
+    ADUC_DownloadProgressState State; /**< Latest state. */
+    uint64_t BytesTransferred; /**< Latest number of bytes transferred. */
+    uint64_t BytesTotal; /**< Size of the file, 0 if unknown. */
+    uint64_t BytesPerSecond; /**< Smoothed transfer rate. */
+    uint64_t LastSampleTimeMs; /**< Time of the previous callback, for the rate. */
+    uint64_t LastSampleBytes; /**< Bytes transferred at the previous callback, for the rate. */
+    uint64_t LastAcceptedTimeMs; /**< Time the progress was last queued for reporting. */
+    unsigned int LastAcceptedPercent; /**< Percentage that was last queued for reporting. */
+    _Bool Pending; /**< Queued for the next report. */
+    uint64_t PendingSequence; /**< Value of s_downloadProgress.Sequence when the progress was last queued. */
+} ADUC_DownloadProgressEntry;
+
+/**
+ * @brief Download progress of the current workflow.
+ * Updated from the download threads and reported from the main loop, so all access is under Lock.
+ */
+static struct
+{
+    pthread_mutex_t Lock;
+    char WorkflowId[sizeof("191121010203")]; /**< Workflow the entries belong to. */
+    ADUC_DownloadProgressEntry Entries[ADUC_MAX_DOWNLOAD_PROGRESS_FILES];
+    unsigned int EntryCount;
+    _Bool Pending; /**< At least one entry is queued for the next report. */
+    uint64_t Sequence; /**< Counts queued progress, to tell it apart from progress queued during a report. */
+    uint64_t LastReportTimeMs; /**< Time of the last report to the service. */
+} s_downloadProgress = { .Lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t GetMonotonicTimeMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Drops all download progress. Must be called with s_downloadProgress.Lock held.
+ *
+ * @param workflowId Workflow that new progress will belong to.
+ */
+static void DownloadProgress_ResetLocked(const char* workflowId)
+{
+    for (unsigned int index = 0; index < s_downloadProgress.EntryCount; ++index)
+    {
+        free(s_downloadProgress.Entries[index].FileId);
+    }
+
+    memset(s_downloadProgress.Entries, 0, sizeof(s_downloadProgress.Entries));
+    s_downloadProgress.EntryCount = 0;
+    s_downloadProgress.Pending = false;
+
+    strncpy(s_downloadProgress.WorkflowId, workflowId, ARRAY_SIZE(s_downloadProgress.WorkflowId) - 1);
+    s_downloadProgress.WorkflowId[ARRAY_SIZE(s_downloadProgress.WorkflowId) - 1] = '\0';
+}
+
+/**
+ * @brief Finds the entry for @p fileId, adding it if it does not exist yet.
+ * Must be called with s_downloadProgress.Lock held.
+ *
+ * @param fileId The file ID.
+ * @return ADUC_DownloadProgressEntry* The entry, or NULL if there is no room.
+ */
+static ADUC_DownloadProgressEntry* DownloadProgress_GetEntryLocked(const char* fileId)
+{
+    for (unsigned int index = 0; index < s_downloadProgress.EntryCount; ++index)
+    {
+        if (strcmp(s_downloadProgress.Entries[index].FileId, fileId) == 0)
+        {
+            return s_downloadProgress.Entries + index;
+        }
+    }
+
+    if (s_downloadProgress.EntryCount == ADUC_MAX_DOWNLOAD_PROGRESS_FILES)
+    {
+        return NULL;
+    }
+
+    ADUC_DownloadProgressEntry* entry = s_downloadProgress.Entries + s_downloadProgress.EntryCount;
+    if (mallocAndStrcpy_s(&(entry->FileId), fileId) != 0)
+    {
+        return NULL;
+    }
+
+    ++s_downloadProgress.EntryCount;
+    return entry;
+}
+
+/**
+ * @brief Records the download progress of a file. Called from the download threads.
+ *
+ * Every call updates the transfer rate estimate. The progress is only queued for reporting when the state changed,
+ * or when at least c_downloadProgressIntervalMs passed and the file advanced by c_downloadProgressMinPercentDelta
+ * since it was last queued. Queued progress is sent by DownloadProgress_Report().
+ */
 static void DownloadProgressCallback(
     const char* workflowId,
     const char* fileId,
@@ -967,13 +1256,193 @@ static void DownloadProgressCallback(
     uint64_t bytesTransferred,
     uint64_t bytesTotal)
 {
-    Log_Info(
-        "ProgressCallback: workflowId: %s; Id %s; State: %s; Bytes: %" PRIu64 "/%" PRIu64,
-        workflowId,
-        fileId,
-        DownloadProgressStateToString(state),
-        bytesTransferred,
-        bytesTotal);
+    if (state == ADUC_DownloadProgressState_InProgress)
+    {
+        Log_Debug(
+            "ProgressCallback: workflowId: %s; Id %s; State: %s; Bytes: %" PRIu64 "/%" PRIu64,
+            workflowId,
+            fileId,
+            DownloadProgressStateToString(state),
+            bytesTransferred,
+            bytesTotal);
+    }
+    else
+    {
+        Log_Info(
+            "ProgressCallback: workflowId: %s; Id %s; State: %s; Bytes: %" PRIu64 "/%" PRIu64,
+            workflowId,
+            fileId,
+            DownloadProgressStateToString(state),
+            bytesTransferred,
+            bytesTotal);
+    }
+
+    if (workflowId == NULL || fileId == NULL)
+    {
+        return;
+    }
+
+    const uint64_t nowMs = GetMonotonicTimeMs();
+
+    pthread_mutex_lock(&s_downloadProgress.Lock);
+
+    if (strcmp(s_downloadProgress.WorkflowId, workflowId) != 0)
+    {
+        DownloadProgress_ResetLocked(workflowId);
+    }
+
+    ADUC_DownloadProgressEntry* entry = DownloadProgress_GetEntryLocked(fileId);
+    if (entry == NULL)
+    {
+        goto done;
+    }
+
+    if (entry->LastSampleTimeMs != 0 && nowMs > entry->LastSampleTimeMs && bytesTransferred >= entry->LastSampleBytes)
+    {
+        const uint64_t sample = (bytesTransferred - entry->LastSampleBytes) * 1000 / (nowMs - entry->LastSampleTimeMs);
+        entry->BytesPerSecond = (entry->BytesPerSecond == 0)
+                                    ? sample
+                                    : (sample * c_downloadRateSmoothingPercent
+                                       + entry->BytesPerSecond * (100 - c_downloadRateSmoothingPercent))
+                                          / 100;
+    }
+
+    entry->LastSampleTimeMs = nowMs;
+    entry->LastSampleBytes = bytesTransferred;
+
+    const _Bool stateChanged = entry->State != state;
+    entry->State = state;
+    entry->BytesTransferred = bytesTransferred;
+    entry->BytesTotal = bytesTotal;
+
+    const unsigned int percent = (bytesTotal > 0) ? (unsigned int)(bytesTransferred * 100 / bytesTotal) : 0;
+    _Bool accept = stateChanged;
+    if (!accept && nowMs - entry->LastAcceptedTimeMs >= c_downloadProgressIntervalMs)
+    {
+        accept = bytesTotal == 0 || percent >= entry->LastAcceptedPercent + c_downloadProgressMinPercentDelta;
+    }
+
+    if (accept)
+    {
+        entry->LastAcceptedTimeMs = nowMs;
+        entry->LastAcceptedPercent = percent;
+        entry->Pending = true;
+        entry->PendingSequence = ++s_downloadProgress.Sequence;
+        s_downloadProgress.Pending = true;
+    }
+
+done:
+    pthread_mutex_unlock(&s_downloadProgress.Lock);
+}
+
+/**
+ * @brief Dequeues the progress that was reported. Progress queued while the report was sent stays queued.
+ *
+ * @param reportedSequence Value of s_downloadProgress.Sequence when the report was built.
+ */
+static void DownloadProgress_MarkReported(uint64_t reportedSequence)
+{
+    pthread_mutex_lock(&s_downloadProgress.Lock);
+
+    _Bool pending = false;
+    for (unsigned int index = 0; index < s_downloadProgress.EntryCount; ++index)
+    {
+        ADUC_DownloadProgressEntry* entry = s_downloadProgress.Entries + index;
+        if (entry->Pending && entry->PendingSequence <= reportedSequence)
+        {
+            entry->Pending = false;
+        }
+
+        pending = pending || entry->Pending;
+    }
+
+    s_downloadProgress.Pending = pending;
+
+    pthread_mutex_unlock(&s_downloadProgress.Lock);
+}
+
+/**
+ * @brief Reports queued download progress to the service. Called regularly from the main loop.
+ *
+ * The progress of all files is batched into a single twin patch, sent at most once per
+ * c_downloadProgressIntervalMs. Progress stays queued until a report with it was handed to the IoT Hub client.
+ */
+static void DownloadProgress_Report(void)
+{
+    const uint64_t nowMs = GetMonotonicTimeMs();
+    JSON_Value* progressValue = NULL;
+    _Bool built = false;
+    uint64_t reportedSequence = 0;
+
+    pthread_mutex_lock(&s_downloadProgress.Lock);
+
+    if (!s_downloadProgress.Pending
+        || (s_downloadProgress.LastReportTimeMs != 0
+            && nowMs - s_downloadProgress.LastReportTimeMs < c_downloadProgressIntervalMs))
+    {
+        goto done;
+    }
+
+    // Also when the report fails, so a failing report is retried at the same rate.
+    s_downloadProgress.LastReportTimeMs = nowMs;
+
+    progressValue = json_value_init_object();
+    JSON_Object* progressObject = json_value_get_object(progressValue);
+    if (progressObject == NULL)
+    {
+        goto done;
+    }
+
+    for (unsigned int index = 0; index < s_downloadProgress.EntryCount; ++index)
+    {
+        ADUC_DownloadProgressEntry* entry = s_downloadProgress.Entries + index;
+        if (!entry->Pending)
+        {
+            continue;
+        }
+
+        JSON_Value* fileValue = json_value_init_object();
+        JSON_Object* fileObject = json_value_get_object(fileValue);
+        if (fileObject == NULL)
+        {
+            goto done;
+        }
+
+        json_object_set_string(fileObject, "state", DownloadProgressStateToString(entry->State));
+        json_object_set_number(fileObject, "bytesTransferred", (double)entry->BytesTransferred);
+        json_object_set_number(fileObject, "bytesTotal", (double)entry->BytesTotal);
+        json_object_set_number(fileObject, "bytesPerSecond", (double)entry->BytesPerSecond);
+
+        if (json_object_set_value(progressObject, entry->FileId, fileValue) != JSONSuccess)
+        {
+            json_value_free(fileValue);
+            goto done;
+        }
+    }
+
+    reportedSequence = s_downloadProgress.Sequence;
+    built = true;
+
+done:
+    pthread_mutex_unlock(&s_downloadProgress.Lock);
+
+    // Report outside of the lock, so download threads are not held up by the IoT Hub client.
+    if (built && AzureDeviceUpdateCoreInterface_ReportDownloadProgressAsync(progressValue))
+    {
+        DownloadProgress_MarkReported(reportedSequence);
+    }
+
+    json_value_free(progressValue);
+}
+
+/**
+ * @brief Frees all download progress.
+ */
+static void DownloadProgress_Clear(void)
+{
+    pthread_mutex_lock(&s_downloadProgress.Lock);
+    DownloadProgress_ResetLocked("");
+    pthread_mutex_unlock(&s_downloadProgress.Lock);
 }
 
 _Bool IsDuplicateRequest(ADUCITF_UpdateAction action, ADUCITF_State lastReportedState)
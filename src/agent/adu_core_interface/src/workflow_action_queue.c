@@ -0,0 +1,173 @@
+/**
+ * @file workflow_action_queue.c
+ * @brief Implements the queue of update actions.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "workflow_action_queue.h"
+
+#include "aduc/adu_core_json.h"
+
+#include <aduc/logging.h>
+#include <parson.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief A queued update action.
+ */
+typedef struct tagADUC_WorkflowAction
+{
+    int PropertyVersion; /**< The twin $version of the action. */
+    _Bool IsCancel; /**< The action is a Cancel. */
+    char* Json; /**< The update action, as received. */
+} ADUC_WorkflowAction;
+
+/**
+ * @brief The queue, oldest action first. The SDK callbacks push, the main loop pops.
+ */
+static struct
+{
+    pthread_mutex_t Lock;
+    ADUC_WorkflowAction Actions[ADUC_WORKFLOW_ACTION_QUEUE_CAPACITY];
+    unsigned int Count;
+    int LastPropertyVersion; /**< Newest $version pushed, 0 if none. */
+} s_queue = { .Lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief Removes the action at @p index. Caller holds the lock.
+ */
+static void RemoveActionLocked(unsigned int index)
+{
+    free(s_queue.Actions[index].Json);
+    memmove(
+        s_queue.Actions + index,
+        s_queue.Actions + index + 1,
+        (s_queue.Count - index - 1) * sizeof(s_queue.Actions[0]));
+    --s_queue.Count;
+}
+
+/**
+ * @brief Returns true if @p updateActionJson is a Cancel action.
+ * An action that cannot be parsed is not a Cancel; the workflow reports it as invalid when it is popped.
+ */
+static _Bool IsCancelAction(const char* updateActionJson)
+{
+    _Bool isCancel = false;
+    JSON_Value* root = ADUC_Json_GetRoot(updateActionJson);
+    unsigned int action;
+    if (root != NULL && ADUC_Json_GetUpdateAction(root, &action))
+    {
+        isCancel = (action == ADUCITF_UpdateAction_Cancel);
+    }
+
+    json_value_free(root);
+    return isCancel;
+}
+
+/**
+ * @brief Queues an update action received from the service.
+ * An action that is not newer than the last one, e.g. the same twin re-sent after a reconnect, is dropped.
+ * Queued actions that are superseded by this one are dropped as well.
+ *
+ * @param propertyVersion The twin $version of the action, or 0 if unknown.
+ * @param updateActionJson The update action.
+ * @return _Bool True if the action was queued.
+ */
+_Bool ADUC_WorkflowActionQueue_Push(int propertyVersion, const char* updateActionJson)
+{
+    _Bool queued = false;
+    const _Bool isCancel = IsCancelAction(updateActionJson);
+    char* json = strdup(updateActionJson);
+    if (json == NULL)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&s_queue.Lock);
+
+    if (propertyVersion > 0 && propertyVersion <= s_queue.LastPropertyVersion)
+    {
+        Log_Info(
+            "Ignoring update action of version %d, version %d was already received.",
+            propertyVersion,
+            s_queue.LastPropertyVersion);
+        goto done;
+    }
+
+    // A Cancel supersedes everything queued before it. Any other action supersedes the queued actions except a
+    // Cancel, which still has to stop the operation in progress first.
+    for (unsigned int index = s_queue.Count; index > 0; --index)
+    {
+        if (isCancel || !s_queue.Actions[index - 1].IsCancel)
+        {
+            Log_Info(
+                "Update action of version %d superseded by version %d.",
+                s_queue.Actions[index - 1].PropertyVersion,
+                propertyVersion);
+            RemoveActionLocked(index - 1);
+        }
+    }
+
+    if (s_queue.Count == ADUC_WORKFLOW_ACTION_QUEUE_CAPACITY)
+    {
+        Log_Warn("Update action queue is full, dropping version %d.", s_queue.Actions[0].PropertyVersion);
+        RemoveActionLocked(0);
+    }
+
+    ADUC_WorkflowAction* action = s_queue.Actions + s_queue.Count;
+    action->PropertyVersion = propertyVersion;
+    action->IsCancel = isCancel;
+    action->Json = json;
+    json = NULL;
+    ++s_queue.Count;
+
+    if (propertyVersion > 0)
+    {
+        s_queue.LastPropertyVersion = propertyVersion;
+    }
+
+    queued = true;
+
+done:
+    pthread_mutex_unlock(&s_queue.Lock);
+    free(json);
+    return queued;
+}
+
+/**
+ * @brief Takes the oldest action off the queue.
+ *
+ * @return char* The update action, to be freed by the caller, or NULL if the queue is empty.
+ */
+char* ADUC_WorkflowActionQueue_Pop(void)
+{
+    char* json = NULL;
+
+    pthread_mutex_lock(&s_queue.Lock);
+    if (s_queue.Count > 0)
+    {
+        json = s_queue.Actions[0].Json;
+        s_queue.Actions[0].Json = NULL;
+        RemoveActionLocked(0);
+    }
+
+    pthread_mutex_unlock(&s_queue.Lock);
+    return json;
+}
+
+/**
+ * @brief Drops all queued actions.
+ */
+void ADUC_WorkflowActionQueue_Clear(void)
+{
+    pthread_mutex_lock(&s_queue.Lock);
+    while (s_queue.Count > 0)
+    {
+        RemoveActionLocked(s_queue.Count - 1);
+    }
+
+    s_queue.LastPropertyVersion = 0;
+    pthread_mutex_unlock(&s_queue.Lock);
+}
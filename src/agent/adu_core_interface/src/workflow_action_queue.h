@@ -0,0 +1,32 @@
+/**
+ * @file workflow_action_queue.h
+ * @brief Private header for the queue of update actions between the twin callback and the workflow engine.
+ *
+ * Update actions received from the service are queued by their twin $version and executed by the main loop.
+ * A newer action supersedes the queued ones, so the engine only executes the newest one. A queued Cancel is kept
+ * ahead of a newer action, as it stops the operation that would otherwise reject the newer action.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef WORKFLOW_ACTION_QUEUE_H
+#define WORKFLOW_ACTION_QUEUE_H
+
+#include <aduc/c_utils.h>
+#include <stdbool.h>
+
+EXTERN_C_BEGIN
+
+/**
+ * @brief Most actions queued at a time. Coalescing keeps at most a Cancel and one newer action.
+ */
+#define ADUC_WORKFLOW_ACTION_QUEUE_CAPACITY 4
+
+_Bool ADUC_WorkflowActionQueue_Push(int propertyVersion, const char* updateActionJson);
+
+char* ADUC_WorkflowActionQueue_Pop(void);
+
+void ADUC_WorkflowActionQueue_Clear(void);
+
+EXTERN_C_END
+
+#endif // WORKFLOW_ACTION_QUEUE_H
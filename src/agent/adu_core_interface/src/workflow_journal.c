@@ -0,0 +1,401 @@
+/**
+ * @file workflow_journal.c
+ * @brief Implements the workflow journal.
+ *
+ * Each record is a line of tab-separated fields:
+ * sequence, state, reboot pending, workflow ID, update ID, installed update ID, sandbox, CRC-32 of the line before it.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "workflow_journal.h"
+
+#include <aduc/logging.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WORKFLOW_JOURNAL_FOLDER ADUC_DATA_FOLDER
+#define WORKFLOW_JOURNAL_PATH WORKFLOW_JOURNAL_FOLDER "/workflow.journal"
+
+/**
+ * @brief Upper bound for the journal size. A journal is compacted at the end of each workflow, so it stays far
+ * smaller; anything larger is not a journal written by the agent.
+ */
+static const size_t c_maxJournalSize = 1024 * 1024;
+
+/**
+ * @brief Number of tab-separated fields of a record, including the CRC.
+ */
+#define WORKFLOW_JOURNAL_FIELD_COUNT 8
+
+static _Bool s_loaded = false;
+static _Bool s_needsRewrite = false;
+static unsigned int s_sequence = 0;
+static char s_installedUpdateId[ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID];
+
+/**
+ * @brief Computes the CRC-32 (IEEE 802.3) of @p size bytes at @p data.
+ */
+static uint32_t JournalCrc32(const char* data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; ++i)
+    {
+        crc ^= (uint8_t)data[i];
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320U : (crc >> 1);
+        }
+    }
+
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/**
+ * @brief Returns @p value, or "" if it cannot be stored in a record.
+ */
+static const char* JournalField(const char* value)
+{
+    if (value == NULL || strpbrk(value, "\t\n") != NULL)
+    {
+        return "";
+    }
+
+    return value;
+}
+
+/**
+ * @brief Copies the string field @p value into @p buffer.
+ * @return _Bool True if it fits.
+ */
+static _Bool CopyJournalField(char* buffer, size_t bufferSize, const char* value)
+{
+    const size_t length = strlen(value);
+    if (length >= bufferSize)
+    {
+        return false;
+    }
+
+    memcpy(buffer, value, length + 1);
+    return true;
+}
+
+/**
+ * @brief Formats @p updateId as provider:name:version, the way it is stored in the journal.
+ *
+ * @param updateId The update ID, can be NULL.
+ * @param buffer Receives the formatted ID, "" if there is none or it does not fit.
+ * @param bufferSize Size of @p buffer.
+ */
+void ADUC_WorkflowJournal_FormatUpdateId(const ADUC_UpdateId* updateId, char* buffer, size_t bufferSize)
+{
+    buffer[0] = '\0';
+
+    if (updateId == NULL || updateId->Provider == NULL || updateId->Name == NULL || updateId->Version == NULL)
+    {
+        return;
+    }
+
+    const int length =
+        snprintf(buffer, bufferSize, "%s:%s:%s", updateId->Provider, updateId->Name, updateId->Version);
+    if (length < 0 || (size_t)length >= bufferSize)
+    {
+        buffer[0] = '\0';
+    }
+}
+
+/**
+ * @brief Writes @p size bytes of @p data to @p fd and syncs them to disk.
+ * @return _Bool True on success.
+ */
+static _Bool WriteAndSync(int fd, const char* data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t written = write(fd, data + done, size - done);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (written <= 0)
+        {
+            return false;
+        }
+
+        done += (size_t)written;
+    }
+
+    return fdatasync(fd) == 0;
+}
+
+/**
+ * @brief Replaces the journal with a journal holding just @p record.
+ * The new journal is written next to it and renamed over it, so a crash leaves either the old or the new journal.
+ *
+ * @return _Bool True on success.
+ */
+static _Bool RewriteJournal(const char* record, size_t recordSize)
+{
+    static const char tempPath[] = WORKFLOW_JOURNAL_PATH ".tmp";
+    _Bool succeeded = false;
+
+    const int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd == -1)
+    {
+        goto done;
+    }
+
+    const _Bool written = WriteAndSync(fd, record, recordSize);
+    close(fd);
+
+    if (!written || rename(tempPath, WORKFLOW_JOURNAL_PATH) != 0)
+    {
+        unlink(tempPath);
+        goto done;
+    }
+
+    // Makes the rename itself durable.
+    const int folderFd = open(WORKFLOW_JOURNAL_FOLDER, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (folderFd != -1)
+    {
+        fsync(folderFd);
+        close(folderFd);
+    }
+
+    succeeded = true;
+
+done:
+    return succeeded;
+}
+
+/**
+ * @brief Records a transition of @p workflowData to @p state. Returns once the record is on disk.
+ * A failure to write is logged, the workflow goes on without the journal.
+ *
+ * @param workflowData The workflow.
+ * @param state The state the workflow moves to.
+ * @param installedUpdateId The update that is reported as installed with this transition, NULL if none.
+ */
+void ADUC_WorkflowJournal_Append(
+    const ADUC_WorkflowData* workflowData, ADUCITF_State state, const ADUC_UpdateId* installedUpdateId)
+{
+    if (!s_loaded)
+    {
+        ADUC_WorkflowJournalEntry previous;
+        (void)ADUC_WorkflowJournal_Load(&previous);
+    }
+
+    char updateId[ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID];
+    ADUC_WorkflowJournal_FormatUpdateId(
+        workflowData->ContentData != NULL ? workflowData->ContentData->ExpectedUpdateId : NULL,
+        updateId,
+        sizeof(updateId));
+
+    if (installedUpdateId != NULL)
+    {
+        ADUC_WorkflowJournal_FormatUpdateId(installedUpdateId, s_installedUpdateId, sizeof(s_installedUpdateId));
+    }
+
+    const _Bool rebootPending = workflowData->SystemRebootState != ADUC_SystemRebootState_None
+                                || workflowData->AgentRestartState != ADUC_AgentRestartState_None;
+
+    char record[2 * ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID + PATH_MAX + 64];
+    int length = snprintf(
+        record,
+        sizeof(record),
+        "%u\t%d\t%d\t%s\t%s\t%s\t%s",
+        ++s_sequence,
+        (int)state,
+        rebootPending ? 1 : 0,
+        JournalField(workflowData->WorkflowId),
+        JournalField(updateId),
+        JournalField(s_installedUpdateId),
+        JournalField(workflowData->WorkFolder));
+    if (length < 0 || (size_t)length + sizeof("\t00000000\n") > sizeof(record))
+    {
+        Log_Warn("Workflow journal record too long, not recorded");
+        return;
+    }
+
+    length += snprintf(
+        record + length, sizeof(record) - length, "\t%08x\n", (unsigned int)JournalCrc32(record, (size_t)length));
+
+    // A finished workflow only leaves its outcome behind.
+    if (s_needsRewrite || state == ADUCITF_State_Idle)
+    {
+        if (!RewriteJournal(record, (size_t)length))
+        {
+            Log_Warn("Cannot rewrite workflow journal %s, errno %d", WORKFLOW_JOURNAL_PATH, errno);
+            return;
+        }
+
+        s_needsRewrite = false;
+        return;
+    }
+
+    const int fd = open(WORKFLOW_JOURNAL_PATH, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if (fd == -1 || !WriteAndSync(fd, record, (size_t)length))
+    {
+        Log_Warn("Cannot append to workflow journal %s, errno %d", WORKFLOW_JOURNAL_PATH, errno);
+
+        // The record may be torn, start over with the next one.
+        s_needsRewrite = true;
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+}
+
+/**
+ * @brief Parses one record into @p entry.
+ *
+ * @param line The record, without the line break. Modified.
+ * @param entry Receives the record.
+ * @param sequence Receives the sequence number.
+ * @return _Bool True if the record is complete and its CRC matches.
+ */
+static _Bool ParseRecord(char* line, ADUC_WorkflowJournalEntry* entry, unsigned int* sequence)
+{
+    char* fields[WORKFLOW_JOURNAL_FIELD_COUNT];
+    size_t fieldCount = 0;
+    char* crcField = strrchr(line, '\t');
+
+    if (crcField == NULL)
+    {
+        return false;
+    }
+
+    char* end = NULL;
+    const unsigned long storedCrc = strtoul(crcField + 1, &end, 16);
+    if (end == crcField + 1 || *end != '\0' || storedCrc != JournalCrc32(line, (size_t)(crcField - line)))
+    {
+        return false;
+    }
+
+    for (char* field = line; fieldCount < WORKFLOW_JOURNAL_FIELD_COUNT; ++fieldCount)
+    {
+        fields[fieldCount] = field;
+        char* separator = strchr(field, '\t');
+        if (separator == NULL)
+        {
+            ++fieldCount;
+            break;
+        }
+
+        *separator = '\0';
+        field = separator + 1;
+    }
+
+    if (fieldCount != WORKFLOW_JOURNAL_FIELD_COUNT)
+    {
+        return false;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    *sequence = (unsigned int)strtoul(fields[0], NULL, 10);
+    entry->State = (ADUCITF_State)atoi(fields[1]);
+    entry->RebootPending = atoi(fields[2]) != 0;
+
+    return CopyJournalField(entry->WorkflowId, sizeof(entry->WorkflowId), fields[3])
+           && CopyJournalField(entry->UpdateId, sizeof(entry->UpdateId), fields[4])
+           && CopyJournalField(entry->InstalledUpdateId, sizeof(entry->InstalledUpdateId), fields[5])
+           && CopyJournalField(entry->WorkFolder, sizeof(entry->WorkFolder), fields[6]);
+}
+
+/**
+ * @brief Reads the last record of the journal.
+ *
+ * @param entry Receives the last record.
+ * @return _Bool True if the journal exists and all of its records are intact. False if it is missing, or a record
+ * was torn and the last transition is unknown; the workflow state must then be probed.
+ */
+_Bool ADUC_WorkflowJournal_Load(ADUC_WorkflowJournalEntry* entry)
+{
+    _Bool succeeded = false;
+    _Bool hasRecord = false;
+    char* content = NULL;
+    FILE* file = NULL;
+
+    s_loaded = true;
+    memset(entry, 0, sizeof(*entry));
+
+    file = fopen(WORKFLOW_JOURNAL_PATH, "re");
+    if (file == NULL)
+    {
+        if (errno != ENOENT)
+        {
+            Log_Warn("Cannot open workflow journal %s, errno %d", WORKFLOW_JOURNAL_PATH, errno);
+        }
+        goto done;
+    }
+
+    content = malloc(c_maxJournalSize + 1);
+    if (content == NULL)
+    {
+        goto done;
+    }
+
+    const size_t size = fread(content, 1, c_maxJournalSize + 1, file);
+    if (size > c_maxJournalSize || ferror(file))
+    {
+        Log_Warn("Ignoring workflow journal %s, it cannot be read", WORKFLOW_JOURNAL_PATH);
+        s_needsRewrite = true;
+        goto done;
+    }
+
+    content[size] = '\0';
+
+    for (char* line = content; *line != '\0';)
+    {
+        char* lineEnd = strchr(line, '\n');
+        unsigned int sequence = 0;
+
+        // A record without a line break was torn while it was written.
+        if (lineEnd == NULL)
+        {
+            Log_Warn("Workflow journal ends with a torn record");
+            s_needsRewrite = true;
+            goto done;
+        }
+
+        *lineEnd = '\0';
+        if (!ParseRecord(line, entry, &sequence))
+        {
+            Log_Warn("Workflow journal has a corrupt record");
+            s_needsRewrite = true;
+            goto done;
+        }
+
+        s_sequence = sequence;
+        memcpy(s_installedUpdateId, entry->InstalledUpdateId, sizeof(s_installedUpdateId));
+        hasRecord = true;
+        line = lineEnd + 1;
+    }
+
+    succeeded = hasRecord;
+
+done:
+    if (file != NULL)
+    {
+        fclose(file);
+    }
+
+    free(content);
+
+    if (!succeeded)
+    {
+        memset(entry, 0, sizeof(*entry));
+    }
+
+    return succeeded;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file workflow_journal.h
+ * @brief Private header for the workflow journal, which lets the agent pick up a workflow after a restart.
+ *
+ * Every update state transition is appended to ADUC_DATA_FOLDER/workflow.journal and synced to disk before it is
+ * reported. Each record has a CRC, so a record torn by a power loss is detected. The journal is compacted to a
+ * single record whenever a workflow ends.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef WORKFLOW_JOURNAL_H
+#define WORKFLOW_JOURNAL_H
+
+#include "aduc/agent_workflow.h"
+
+#include <aduc/c_utils.h>
+#include <limits.h>
+#include <stdbool.h>
+
+EXTERN_C_BEGIN
+
+/**
+ * @brief Longest update ID in the journal, formatted as provider:name:version.
+ */
+#define ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID 256
+
+/**
+ * @brief The last record of the journal.
+ */
+typedef struct tagADUC_WorkflowJournalEntry
+{
+    ADUCITF_State State; /**< The state the workflow moved to. */
+    _Bool RebootPending; /**< A system reboot or agent restart was required or in progress. */
+    char WorkflowId[sizeof("191121010203")]; /**< The workflow. */
+    char UpdateId[ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID]; /**< The update of the workflow, empty if unknown. */
+    char InstalledUpdateId[ADUC_WORKFLOW_JOURNAL_MAX_UPDATE_ID]; /**< Last update reported as installed. */
+    char WorkFolder[PATH_MAX]; /**< The sandbox of the workflow, empty if none. */
+} ADUC_WorkflowJournalEntry;
+
+void ADUC_WorkflowJournal_FormatUpdateId(const ADUC_UpdateId* updateId, char* buffer, size_t bufferSize);
+
+void ADUC_WorkflowJournal_Append(
+    const ADUC_WorkflowData* workflowData, ADUCITF_State state, const ADUC_UpdateId* installedUpdateId);
+
+_Bool ADUC_WorkflowJournal_Load(ADUC_WorkflowJournalEntry* entry);
+
+EXTERN_C_END
+
+#endif // WORKFLOW_JOURNAL_H
@@ -10,14 +10,18 @@
 #include "aduc/c_utils.h"
 #include "aduc/client_handle_helper.h"
 #include "aduc/device_info_interface.h"
+#include "aduc/event_loop.h"
 #include "aduc/health_management.h"
 #include "aduc/logging.h"
 #include "aduc/string_c_utils.h"
 #include "aduc/system_utils.h"
 #include <azure_c_shared_utility/shared_util_options.h>
 #include <azure_c_shared_utility/threadapi.h> // ThreadAPI_Sleep
+#include <arpa/inet.h> // ntohs
 #include <ctype.h>
+#include <dirent.h>
 #ifndef ADUC_PLATFORM_SIMULATOR // DO is not used in sim mode
+#    include <aduc/privileged_broker.h>
 #    include <do_config.h>
 #endif
 #include <getopt.h>
@@ -25,10 +29,13 @@
 #include <iothub_client_options.h>
 #include <iothubtransportmqtt.h>
 #include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h> // strtol
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -810,6 +817,163 @@ void OnRestartSignal(int sig)
     g_shutdownSignal = sig;
 }
 
+/**
+ * @brief Period of the main loop while there is work, e.g. messages to send to or receive from the IoT Hub.
+ */
+#define MAIN_LOOP_ACTIVE_PERIOD_MS 100
+
+/**
+ * @brief Upper bound of 'main_loop_max_idle_ms'. The SDK's timers, e.g. for retries and message timeouts, only
+ * advance in the main loop.
+ */
+#define MAIN_LOOP_MAX_IDLE_PERIOD_CEILING_MS 5000
+
+/**
+ * @brief Port of the IoT Hub connection, see MQTT_Protocol.
+ */
+#define IOTHUB_MQTT_PORT 8883
+
+/**
+ * @brief Reads the longest period of the main loop while the agent is idle from the config file.
+ * 'main_loop_max_idle_ms' defaults to 1000 ms, and is limited to MAIN_LOOP_MAX_IDLE_PERIOD_CEILING_MS.
+ *
+ * @return unsigned int The period in milliseconds.
+ */
+static unsigned int GetMainLoopMaxIdleMs()
+{
+    char value[16];
+    unsigned int maxIdleMs = 0;
+    if (!ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "main_loop_max_idle_ms", value, ARRAY_SIZE(value))
+        || !atoui(value, &maxIdleMs) || maxIdleMs < MAIN_LOOP_ACTIVE_PERIOD_MS)
+    {
+        maxIdleMs = 1000;
+    }
+
+    if (maxIdleMs > MAIN_LOOP_MAX_IDLE_PERIOD_CEILING_MS)
+    {
+        Log_Warn(
+            "main_loop_max_idle_ms %u is too long, using %u ms.", maxIdleMs, MAIN_LOOP_MAX_IDLE_PERIOD_CEILING_MS);
+        maxIdleMs = MAIN_LOOP_MAX_IDLE_PERIOD_CEILING_MS;
+    }
+
+    return maxIdleMs;
+}
+
+/**
+ * @brief Socket of the IoT Hub connection that wakes the main loop, and its inode to recognize a reconnect.
+ */
+static int g_iotHubSocket = -1;
+static ino_t g_iotHubSocketInode = 0;
+
+/**
+ * @brief Checks whether @p fd is a socket connected to the IoT Hub port.
+ *
+ * @param fd The descriptor.
+ * @param[out] inode Receives the inode of the socket.
+ * @return _Bool True if it is.
+ */
+static _Bool IsIotHubSocket(int fd, ino_t* inode)
+{
+    struct stat st;
+    struct sockaddr_storage peer;
+    socklen_t peerLength = sizeof(peer);
+
+    if (fstat(fd, &st) != 0 || !S_ISSOCK(st.st_mode) || getpeername(fd, (struct sockaddr*)&peer, &peerLength) != 0)
+    {
+        return false;
+    }
+
+    in_port_t port = 0;
+    if (peer.ss_family == AF_INET)
+    {
+        port = ((const struct sockaddr_in*)&peer)->sin_port;
+    }
+    else if (peer.ss_family == AF_INET6)
+    {
+        port = ((const struct sockaddr_in6*)&peer)->sin6_port;
+    }
+
+    *inode = st.st_ino;
+    return ntohs(port) == IOTHUB_MQTT_PORT;
+}
+
+/**
+ * @brief Makes the main loop wake up when the IoT Hub connection has data, so that incoming messages, e.g. twin
+ * updates, are processed right away instead of on the next timer tick. The SDK does not expose its socket, so it
+ * is looked up among the descriptors of the process, and again after a reconnect.
+ */
+static void WatchIotHubSocket()
+{
+    ino_t inode;
+    if (g_iotHubSocket != -1 && IsIotHubSocket(g_iotHubSocket, &inode) && inode == g_iotHubSocketInode)
+    {
+        return;
+    }
+
+    g_iotHubSocket = -1;
+
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL)
+    {
+        return;
+    }
+
+    const struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        unsigned int fd;
+        if (!atoui(entry->d_name, &fd) || (int)fd == dirfd(dir) || !IsIotHubSocket((int)fd, &inode))
+        {
+            continue;
+        }
+
+        if (ADUC_EventLoop_WatchFd((int)fd))
+        {
+            Log_Debug("Main loop wakes on the IoT Hub connection, descriptor %u.", fd);
+            g_iotHubSocket = (int)fd;
+            g_iotHubSocketInode = inode;
+        }
+
+        break;
+    }
+
+    closedir(dir);
+}
+
+/**
+ * @brief One iteration of the main loop.
+ *
+ * @param context Non-NULL when called by the event loop, which then also watches the IoT Hub connection.
+ */
+static void DoMainLoopWork(void* context)
+{
+    // If any components have requested a DoWork callback, regularly call it.
+    for (unsigned index = 0; index < ARRAY_SIZE(componentList); ++index)
+    {
+        PnPComponentEntry* entry = componentList + index;
+
+        if (entry->DoWork != NULL)
+        {
+            entry->DoWork(entry->Context);
+        }
+    }
+
+    ClientHandle_DoWork(g_iotHubClientHandle);
+
+    // NOTE: When using low level samples (iothub_ll_*), the IoTHubDeviceClient_LL_DoWork
+    // function must be called regularly (eg. every 100 milliseconds) for the IoT device client to work properly.
+    // See: https://github.com/Azure/azure-iot-sdk-c/tree/master/iothub_client/samples
+    // NOTE: For this example the above has been wrapped to support module and device client methods using
+    // the clienty_handle_helper.h function ClientHandle_DoWork()
+    // The event loop calls this every 100 ms while messages are in flight, and backs off to
+    // 'main_loop_max_idle_ms' while nothing happens, which still serves the MQTT keep-alive.
+    // Incoming messages wake it up right away.
+    if (context != NULL)
+    {
+        WatchIotHubSocket();
+    }
+}
+
 //
 // Main.
 //
@@ -841,6 +1005,28 @@ int main(int argc, char** argv)
         return 0;
     }
 
+    //
+    // Shutdown (SIGINT, SIGTERM) and restart (SIGUSR1, raised by a workflow) signals end the main loop, so we do a
+    // best effort of cleanup. They are blocked before any thread is started, e.g. the log flush thread, so every
+    // thread inherits the mask and the signals are only received through the main loop.
+    //
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+
+    if (!launchArgs.healthCheckOnly)
+    {
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    }
+
+#ifndef ADUC_PLATFORM_SIMULATOR
+    // Root-only commands are run by the privileged broker. It is forked before any thread is started, including
+    // the log flush thread, and sets up its own logging.
+    const _Bool brokerStarted = !launchArgs.healthCheckOnly && ADUC_PrivilegedBroker_Start(launchArgs.logLevel);
+#endif
+
     ADUC_Logging_Init(launchArgs.logLevel);
 
     if (launchArgs.healthCheckOnly)
@@ -870,16 +1056,24 @@ int main(int argc, char** argv)
         goto done;
     }
 
-    //
-    // Catch ctrl-C and shutdown signals so we do a best effort of cleanup.
-    //
-    signal(SIGINT, OnShutdownSignal);
-    signal(SIGTERM, OnShutdownSignal);
+#ifndef ADUC_PLATFORM_SIMULATOR
+    // With the broker running, the agent drops its privileges.
+    if (!brokerStarted || !ADUC_PrivilegedBroker_DropPrivileges())
+    {
+        Log_Warn("Privileged broker not started, the agent keeps its privileges.");
+    }
+#endif
 
-    //
-    // Catch restart (SIGUSR1) signal raised by a workflow.
-    //
-    signal(SIGUSR1, OnRestartSignal);
+    const _Bool eventLoopStarted = ADUC_EventLoop_Init(&signals, MAIN_LOOP_ACTIVE_PERIOD_MS, GetMainLoopMaxIdleMs());
+    if (!eventLoopStarted)
+    {
+        // The threads started so far keep the signals blocked, so the handlers run on this thread.
+        Log_Warn("Falling back to polling every %u ms.", MAIN_LOOP_ACTIVE_PERIOD_MS);
+        signal(SIGINT, OnShutdownSignal);
+        signal(SIGTERM, OnShutdownSignal);
+        signal(SIGUSR1, OnRestartSignal);
+        pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+    }
 
     if (!StartupAgent(&launchArgs))
     {
@@ -891,29 +1085,28 @@ int main(int argc, char** argv)
     //
 
     Log_Info("Agent running.");
-    while (g_shutdownSignal == 0)
+    if (eventLoopStarted)
     {
-        // If any components have requested a DoWork callback, regularly call it.
-        for (unsigned index = 0; index < ARRAY_SIZE(componentList); ++index)
+        const int sig = ADUC_EventLoop_Run(DoMainLoopWork, &eventLoopStarted);
+        if (sig == SIGUSR1)
         {
-            PnPComponentEntry* entry = componentList + index;
-
-            if (entry->DoWork != NULL)
-            {
-                entry->DoWork(entry->Context);
-            }
+            OnRestartSignal(sig);
+        }
+        else
+        {
+            OnShutdownSignal(sig);
         }
 
-        ClientHandle_DoWork(g_iotHubClientHandle);
-
-        // NOTE: When using low level samples (iothub_ll_*), the IoTHubDeviceClient_LL_DoWork
-        // function must be called regularly (eg. every 100 milliseconds) for the IoT device client to work properly.
-        // See: https://github.com/Azure/azure-iot-sdk-c/tree/master/iothub_client/samples
-        // NOTE: For this example the above has been wrapped to support module and device client methods using
-        // the clienty_handle_helper.h function ClientHandle_DoWork()
-
-        ThreadAPI_Sleep(100);
-    };
+        ADUC_EventLoop_LogStatistics();
+    }
+    else
+    {
+        while (g_shutdownSignal == 0)
+        {
+            DoMainLoopWork(NULL);
+            ThreadAPI_Sleep(MAIN_LOOP_ACTIVE_PERIOD_MS);
+        }
+    }
 
     ret = 0; // Success.
 
@@ -924,5 +1117,7 @@ done:
 
     IoTHub_Deinit();
 
+    ADUC_EventLoop_Uninit();
+
     return ret;
 }
@@ -10,6 +10,7 @@
 #include "aduc/content_handler.hpp"
 #include "aduc/content_handler_factory.hpp"
 #include <aduc/result.h>
+#include <atomic>
 #include <memory>
 #include <string>
 
@@ -19,6 +20,12 @@
  */
 std::unique_ptr<ContentHandler> fus_fsupdate_CreateFunc(const ContentHandlerCreateData& data);
 
+/**
+ * @brief handler creation function for delta updates
+ * The update file is a delta against the installed image, see fsupdate_delta.hpp.
+ */
+std::unique_ptr<ContentHandler> fus_fsdelta_CreateFunc(const ContentHandlerCreateData& data);
+
 /**
  * @class fsUpdateHandlerImpl
  * @brief The fsupdate specific implementation of ContentHandler interface.
@@ -30,7 +37,8 @@ public:
         const std::string& workFolder,
         const std::string& logFolder,
         const std::string& filename,
-        const std::string& fileType);
+        const std::string& fileType,
+        bool isDelta = false);
 
     // Delete copy ctor, copy assignment, move ctor and move assignment operators.
     FSUpdateHandlerImpl(const FSUpdateHandlerImpl&) = delete;
@@ -55,27 +63,32 @@ protected:
         const std::string& workFolder,
         const std::string& logFolder,
         const std::string& filename,
-        const std::string& fileType) :
+        const std::string& fileType,
+        bool isDelta) :
         _workFolder{ workFolder },
-        _logFolder{ logFolder }, _filename{ filename }, _fileType{ fileType }
+        _logFolder{ logFolder }, _filename{ filename }, _fileType{ fileType }, _isDelta{ isDelta }
     {
     }
 
 private:
+    std::string GetBaseImagePath() const;
+    void RetainInstalledImage(const std::string& imagePath) const;
+    void PromoteRetainedImage() const;
+
     std::string _workFolder;
     std::string _logFolder;
     std::string _filename;
     std::string _fileType;
+    bool _isDelta{ false };
     bool _isApply{ false };
 
-    const std::string _pathToFsUpdate = "/usr/bin/FS-Update";
-    const std::string _installFirmwareFile = "-ff";
+    /**
+     * @brief Set by Cancel() to kill a running FS-Update install.
+     */
+    std::atomic_bool _abortInstall{ false };
+
     const std::string _firmwareFile = "firmware";
-    const std::string _installApplicationFile = "-af";
     const std::string _applicationFile = "application";
-    const std::string _commitUpdate = "-cu";
-    const std::string _getRebootState = "-urs";
-    const std::string _debugMode = "--debug";
 };
 
 #endif // ADUC_FSUPDATE_HANDLER_HPP
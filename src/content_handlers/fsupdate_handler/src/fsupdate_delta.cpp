@@ -0,0 +1,220 @@
+/**
+ * @file fsupdate_delta.cpp
+ * @brief Implements FSUpdate_ApplyDelta.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "fsupdate_delta.hpp"
+
+#include <aduc/adu_core_exports.h>
+#include <aduc/hash_utils.h>
+#include <aduc/logging.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+const char c_deltaMagic[8] = { 'F', 'S', 'D', 'E', 'L', 'T', 'A', '1' };
+const size_t c_targetHashSize = 64;
+const size_t c_bufferSize = 256 * 1024;
+
+enum DeltaOperation : uint8_t
+{
+    DeltaOperation_End = 0x00,
+    DeltaOperation_Copy = 0x01,
+    DeltaOperation_Insert = 0x02,
+};
+
+using FilePtr = std::unique_ptr<FILE, decltype(&fclose)>;
+
+bool ReadUInt64(FILE* file, uint64_t* value)
+{
+    uint8_t bytes[8];
+    if (fread(bytes, 1, sizeof(bytes), file) != sizeof(bytes))
+    {
+        return false;
+    }
+
+    *value = 0;
+    for (size_t i = 0; i < sizeof(bytes); ++i)
+    {
+        *value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Writes @p size bytes to the image and the running hash.
+ */
+bool Emit(FILE* target, ADUC_HashUtils_Stream* stream, const uint8_t* data, size_t size)
+{
+    return fwrite(data, 1, size, target) == size && ADUC_HashUtils_StreamUpdate(stream, data, size);
+}
+} // namespace
+
+/**
+ * @brief Rebuilds an image from @p basePath and the delta at @p deltaPath into @p targetPath, and verifies it
+ * against the hash in the delta. See fsupdate_delta.hpp for the delta format.
+ *
+ * @param basePath The installed image the delta was created against.
+ * @param deltaPath The delta file.
+ * @param targetPath Where to write the rebuilt image. Removed again if rebuilding fails.
+ * @return ADUC_Result Download result.
+ */
+ADUC_Result FSUpdate_ApplyDelta(const std::string& basePath, const std::string& deltaPath, const std::string& targetPath)
+{
+    ADUC_Result result{ ADUC_DownloadResult_Failure, ADUC_ERC_SWUPDATE_HANDLER_DELTA_INVALID };
+    ADUC_HashUtils_Stream stream;
+    std::vector<uint8_t> buffer(c_bufferSize);
+    char magic[sizeof(c_deltaMagic)];
+    char targetHash[c_targetHashSize + 1] = {};
+    uint64_t targetSize = 0;
+    bool ended = false;
+
+    const int baseFd = open(basePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (baseFd == -1)
+    {
+        Log_Error("Cannot open base image %s, errno = %d", basePath.c_str(), errno);
+        return ADUC_Result{ ADUC_DownloadResult_Failure, ADUC_ERC_SWUPDATE_HANDLER_DELTA_BASE_MISSING };
+    }
+
+    FilePtr delta{ fopen(deltaPath.c_str(), "rbe"), fclose };
+    FilePtr target{ fopen(targetPath.c_str(), "wbe"), fclose };
+    if (!delta || !target)
+    {
+        Log_Error("Cannot open delta %s or image %s, errno = %d", deltaPath.c_str(), targetPath.c_str(), errno);
+        result.ExtendedResultCode = MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno);
+        goto done;
+    }
+
+    setvbuf(delta.get(), nullptr, _IOFBF, c_bufferSize);
+    setvbuf(target.get(), nullptr, _IOFBF, c_bufferSize);
+
+    if (fread(magic, 1, sizeof(magic), delta.get()) != sizeof(magic)
+        || memcmp(magic, c_deltaMagic, sizeof(magic)) != 0 || !ReadUInt64(delta.get(), &targetSize)
+        || fread(targetHash, 1, c_targetHashSize, delta.get()) != c_targetHashSize)
+    {
+        Log_Error("%s is not a valid delta file", deltaPath.c_str());
+        goto done;
+    }
+
+    if (!ADUC_HashUtils_StreamInit(&stream, SHA256))
+    {
+        goto done;
+    }
+
+    while (!ended)
+    {
+        const int opcode = fgetc(delta.get());
+        uint64_t offset = 0;
+        uint64_t length = 0;
+
+        switch (opcode)
+        {
+        case DeltaOperation_End:
+            ended = true;
+            break;
+
+        case DeltaOperation_Copy:
+            if (!ReadUInt64(delta.get(), &offset) || !ReadUInt64(delta.get(), &length))
+            {
+                Log_Error("Truncated copy operation in delta");
+                goto done;
+            }
+
+            while (length > 0)
+            {
+                const size_t chunk = (length < buffer.size()) ? static_cast<size_t>(length) : buffer.size();
+                const ssize_t readSize = pread(baseFd, buffer.data(), chunk, static_cast<off_t>(offset));
+                if (readSize <= 0)
+                {
+                    // Either the base is not the image the delta was made for, or it cannot be read.
+                    Log_Error("Cannot read base image at offset %llu", static_cast<unsigned long long>(offset));
+                    result.ExtendedResultCode = ADUC_ERC_SWUPDATE_HANDLER_DELTA_BASE_MISMATCH;
+                    goto done;
+                }
+
+                if (!Emit(target.get(), &stream, buffer.data(), static_cast<size_t>(readSize)))
+                {
+                    result.ExtendedResultCode = MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno);
+                    goto done;
+                }
+
+                offset += static_cast<uint64_t>(readSize);
+                length -= static_cast<uint64_t>(readSize);
+            }
+            break;
+
+        case DeltaOperation_Insert:
+            if (!ReadUInt64(delta.get(), &length))
+            {
+                Log_Error("Truncated insert operation in delta");
+                goto done;
+            }
+
+            while (length > 0)
+            {
+                const size_t chunk = (length < buffer.size()) ? static_cast<size_t>(length) : buffer.size();
+                if (fread(buffer.data(), 1, chunk, delta.get()) != chunk)
+                {
+                    Log_Error("Truncated insert data in delta");
+                    goto done;
+                }
+
+                if (!Emit(target.get(), &stream, buffer.data(), chunk))
+                {
+                    result.ExtendedResultCode = MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno);
+                    goto done;
+                }
+
+                length -= chunk;
+            }
+            break;
+
+        default:
+            Log_Error("Unknown delta operation %d", opcode);
+            goto done;
+        }
+
+        if (stream.BytesHashed > targetSize)
+        {
+            Log_Error("Delta produces more than the expected %llu bytes", static_cast<unsigned long long>(targetSize));
+            goto done;
+        }
+    }
+
+    if (fflush(target.get()) != 0 || fsync(fileno(target.get())) != 0)
+    {
+        result.ExtendedResultCode = MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno);
+        goto done;
+    }
+
+    if (stream.BytesHashed != targetSize || !ADUC_HashUtils_StreamIsValid(&stream, targetHash))
+    {
+        Log_Error("Rebuilt image does not match the target hash, the installed image is not the delta base");
+        result.ExtendedResultCode = ADUC_ERC_SWUPDATE_HANDLER_DELTA_BASE_MISMATCH;
+        goto done;
+    }
+
+    Log_Info("Rebuilt %llu byte image from delta", static_cast<unsigned long long>(targetSize));
+    result = ADUC_Result{ ADUC_DownloadResult_Success };
+
+done:
+    close(baseFd);
+
+    if (IsAducResultCodeFailure(result.ResultCode) && target)
+    {
+        target.reset();
+        unlink(targetPath.c_str());
+    }
+
+    return result;
+}
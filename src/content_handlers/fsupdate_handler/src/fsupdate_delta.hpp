@@ -0,0 +1,29 @@
+/**
+ * @file fsupdate_delta.hpp
+ * @brief Rebuilds an FS-Update image from a delta against the installed image.
+ *
+ * Delta file layout, all integers little-endian:
+ *
+ *     char     Magic[8]              "FSDELTA1"
+ *     uint64   TargetSize            Size of the rebuilt image.
+ *     char     TargetSha256[64]      Base64 SHA-256 of the rebuilt image, NUL padded.
+ *     ...      Operations, each starting with a one byte opcode:
+ *       0x00   End                   Must be the last operation.
+ *       0x01   Copy    uint64 BaseOffset, uint64 Length
+ *                                    Copies Length bytes of the base image starting at BaseOffset.
+ *       0x02   Insert  uint64 Length, Length bytes of data
+ *                                    Appends the data that follows.
+ *
+ * The image is written strictly in order, so it can be hashed while it is written.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef ADUC_FSUPDATE_DELTA_HPP
+#define ADUC_FSUPDATE_DELTA_HPP
+
+#include <aduc/result.h>
+#include <string>
+
+ADUC_Result FSUpdate_ApplyDelta(const std::string& basePath, const std::string& deltaPath, const std::string& targetPath);
+
+#endif // ADUC_FSUPDATE_DELTA_HPP
@@ -2,18 +2,32 @@
 
 #include "aduc/adu_core_exports.h"
 #include "aduc/logging.h"
+#include "aduc/privileged_broker.hpp"
 #include "aduc/process_utils.hpp"
 #include "aduc/string_utils.hpp"
 #include "aduc/system_utils.h"
+#include "fsupdate_delta.hpp"
+#include "uboot_env.hpp"
+
+#include <aduc/c_utils.h>
+#include <aduc/string_c_utils.h>
 
 #include <algorithm>
-#include <dirent.h>
+#include <cctype>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
-#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
 
 /**
  * @brief handler creation function
@@ -28,6 +42,214 @@ std::unique_ptr<ContentHandler> fus_fsupdate_CreateFunc(const ContentHandlerCrea
         data.WorkFolder(), data.LogFolder(), data.Filename(), data.FileType()) };
 }
 
+/**
+ * @brief handler creation function for delta updates
+ * This function calls CreateContentHandler from handler factory
+ */
+std::unique_ptr<ContentHandler> fus_fsdelta_CreateFunc(const ContentHandlerCreateData& data)
+{
+    Log_Info("fsdelta_handler_create-called.");
+    return std::unique_ptr<ContentHandler>{ FSUpdateHandlerImpl::CreateContentHandler(
+        data.WorkFolder(), data.LogFolder(), data.Filename(), data.FileType(), true) };
+}
+
+/**
+ * @brief Folder holding the installed images that deltas are applied against.
+ */
+static const char* c_baseImageFolder = ADUC_DATA_FOLDER "/fsupdate";
+
+/**
+ * @brief Reads from the config file whether installed images are kept as base for delta updates.
+ *
+ * @return bool True if 'keep_delta_base' is set to true.
+ */
+static bool IsKeepDeltaBaseEnabled()
+{
+    char value[8] = {};
+    if (ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "keep_delta_base", value, ARRAY_SIZE(value)))
+    {
+        return strcmp(value, "true") == 0 || strcmp(value, "1") == 0;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Reads the deadline and resource limits of FS-Update processes from the config file.
+ * 'fsupdate_timeout_s' stops FS-Update after that many seconds. 'fsupdate_cgroup' is a cgroup v2 to run FS-Update
+ * below, limited by 'fsupdate_cpu_max', 'fsupdate_io_max' and 'fsupdate_memory_max', so an install cannot starve
+ * the device's own workload. The limits use the syntax of the cgroup v2 files of the same names.
+ *
+ * @return ADUC_ChildProcessOptions The options, without cancellation.
+ */
+static ADUC_ChildProcessOptions GetFSUpdateProcessOptions()
+{
+    ADUC_ChildProcessOptions options;
+    char value[PATH_MAX] = {};
+    unsigned int timeoutSeconds = 0;
+
+    if (ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "fsupdate_timeout_s", value, ARRAY_SIZE(value))
+        && atoui(value, &timeoutSeconds))
+    {
+        options.Timeout = std::chrono::seconds{ timeoutSeconds };
+    }
+
+    const std::pair<const char*, std::string*> settings[] = { { "fsupdate_cgroup", &options.CgroupParent },
+                                                              { "fsupdate_cpu_max", &options.CpuMax },
+                                                              { "fsupdate_io_max", &options.IoMax },
+                                                              { "fsupdate_memory_max", &options.MemoryMax } };
+    for (const auto& setting : settings)
+    {
+        value[0] = '\0';
+        if (ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, setting.first, value, ARRAY_SIZE(value)))
+        {
+            *setting.second = value;
+        }
+    }
+
+    return options;
+}
+
+/**
+ * @brief Ignores output lines; the launcher logs them already.
+ */
+static void IgnoreOutputLine(ADUC_ChildProcessStream /*stream*/, const std::string& /*line*/)
+{
+}
+
+/**
+ * @brief Longest time a cached 'FS-Update -urs' result is used. The agent drops the cached result itself whenever
+ * it runs an FS-Update command that changes the update state, so this only bounds how long a change made outside
+ * the agent can go unnoticed.
+ */
+static const std::chrono::seconds c_rebootStateMaxAge{ 60 };
+
+/**
+ * @brief Last 'FS-Update -urs' exit code, shared by all handler instances.
+ * The state lives in the U-Boot environment and only changes on install, apply or reboot, so repeated queries,
+ * e.g. on startup and at each workflow step, are answered without a fork, exec and environment read each.
+ */
+static std::mutex s_rebootStateMutex;
+static bool s_rebootStateCached = false;
+static int s_rebootStateExitCode = 0;
+static std::chrono::steady_clock::time_point s_rebootStateTime;
+
+/**
+ * @brief Returns the cached 'FS-Update -urs' exit code, if it is recent enough.
+ *
+ * @param exitCode Receives the exit code.
+ * @return bool True if there was a usable cached result.
+ */
+static bool GetCachedRebootState(int* exitCode)
+{
+    std::lock_guard<std::mutex> lock{ s_rebootStateMutex };
+    if (!s_rebootStateCached || std::chrono::steady_clock::now() - s_rebootStateTime > c_rebootStateMaxAge)
+    {
+        return false;
+    }
+
+    *exitCode = s_rebootStateExitCode;
+    return true;
+}
+
+/**
+ * @brief Caches an 'FS-Update -urs' exit code.
+ */
+static void CacheRebootState(int exitCode)
+{
+    std::lock_guard<std::mutex> lock{ s_rebootStateMutex };
+    s_rebootStateCached = true;
+    s_rebootStateExitCode = exitCode;
+    s_rebootStateTime = std::chrono::steady_clock::now();
+}
+
+/**
+ * @brief Drops the cached 'FS-Update -urs' result. Called whenever FS-Update may have changed the update state.
+ */
+static void InvalidateRebootState()
+{
+    std::lock_guard<std::mutex> lock{ s_rebootStateMutex };
+    s_rebootStateCached = false;
+    FSUpdate_InvalidateUBootEnv();
+}
+
+/**
+ * @brief Reads the reboot state directly from the U-Boot environment, if the native reader is configured.
+ * FS-Update keeps the state that 'FS-Update -urs' reports in the 'update_reboot_state' variable, as the same code.
+ *
+ * @param exitCode Receives the code 'FS-Update -urs' would exit with.
+ * @return bool True if the state was read, false to fall back to FS-Update.
+ */
+static bool ReadRebootStateFromUBootEnv(int* exitCode)
+{
+    FSUpdate_UBootEnvLocation location;
+    if (!FSUpdate_GetUBootEnvLocation(&location))
+    {
+        return false;
+    }
+
+    std::string rebootState;
+    std::string update;
+    if (!FSUpdate_GetUBootEnvVariable(location, "update_reboot_state", &rebootState)
+        || !FSUpdate_GetUBootEnvVariable(location, "update", &update))
+    {
+        Log_Warn("U-Boot environment in %s has no update state, using FS-Update", location.Path.c_str());
+        return false;
+    }
+
+    char* end = nullptr;
+    const long state = strtol(rebootState.c_str(), &end, 10);
+    if (end == rebootState.c_str() || *end != '\0' || state < 0 || state > 6)
+    {
+        Log_Warn("Unknown update_reboot_state '%s', using FS-Update", rebootState.c_str());
+        return false;
+    }
+
+    Log_Debug("U-Boot environment: update=%s, update_reboot_state=%ld", update.c_str(), state);
+    *exitCode = static_cast<int>(state);
+    return true;
+}
+
+/**
+ * @brief Smallest change of the install progress that is reported.
+ */
+static const unsigned int c_installProgressStep = 5;
+
+/**
+ * @brief Finds an FS-Update progress marker, a percentage such as "42%", in an output line.
+ * The last percentage in the line is used, so prefixes like "step 2/3" do not matter.
+ *
+ * @param line A line of FS-Update output.
+ * @param percent Receives the percentage.
+ * @return bool True if the line has a percentage of at most 100.
+ */
+static bool ParseProgressMarker(const std::string& line, unsigned int* percent)
+{
+    size_t end = line.rfind('%');
+    while (end != std::string::npos && end > 0)
+    {
+        size_t start = end;
+        while (start > 0 && isdigit(static_cast<unsigned char>(line[start - 1])) != 0)
+        {
+            --start;
+        }
+
+        if (start < end && end - start <= 3)
+        {
+            const unsigned long value = std::stoul(line.substr(start, end - start));
+            if (value <= 100)
+            {
+                *percent = static_cast<unsigned int>(value);
+                return true;
+            }
+        }
+
+        end = line.rfind('%', end - 1);
+    }
+
+    return false;
+}
+
 // Forward declarations.
 static ADUC_Result CancelApply(const char* logFolder);
 
@@ -38,15 +260,19 @@ static ADUC_Result CancelApply(const char* logFolder);
  * @param workFolder The folder where content will be downloaded.
  * @param logFolder The folder where operational logs can be placed.
  * @param filename The .fsu image file to be installed by fsupdate.
+ * @param fileType application or firmware.
+ * @param isDelta True if @p filename is a delta against the installed image instead of a full image.
  * @return std::unique_ptr<ContentHandler> SimulatorHandlerImpl object as a ContentHandler.
  */
 std::unique_ptr<ContentHandler> FSUpdateHandlerImpl::CreateContentHandler(
     const std::string& workFolder,
     const std::string& logFolder,
     const std::string& filename,
-    const std::string& fileType)
+    const std::string& fileType,
+    bool isDelta)
 {
-    return std::unique_ptr<ContentHandler>{ new FSUpdateHandlerImpl(workFolder, logFolder, filename, fileType) };
+    return std::unique_ptr<ContentHandler>{ new FSUpdateHandlerImpl(
+        workFolder, logFolder, filename, fileType, isDelta) };
 }
 
 /**
@@ -65,7 +291,8 @@ ADUC_Result FSUpdateHandlerImpl::Prepare(const ADUC_PrepareInfo* prepareInfo)
                             ADUC_ERC_SWUPDATE_HANDLER_PACKAGE_PREPARE_FAILURE_WRONG_VERSION };
     }
 
-    if (prepareInfo->fileCount != 1)
+    // The first file is the image to install, any further files are sidecars (e.g. signatures or release notes).
+    if (prepareInfo->fileCount < 1)
     {
         Log_Error("FsUpdate packages prepare failed. Wrong File Count %d", prepareInfo->fileCount);
         return ADUC_Result{ ADUC_PrepareResult_Failure,
@@ -77,22 +304,51 @@ ADUC_Result FSUpdateHandlerImpl::Prepare(const ADUC_PrepareInfo* prepareInfo)
 }
 
 /**
- * @brief Download implementation for fsupdate (no-op)
+ * @brief Download implementation for fsupdate
  * fsupdate does not need to download additional content.
- * This method is a no-op.
+ * For delta updates, the full image is rebuilt from the downloaded delta and the installed image,
+ * and is installed instead of the delta.
  *
- * @return ADUC_Result The result of the download (always success)
+ * @return ADUC_Result The result of the download
  */
 ADUC_Result FSUpdateHandlerImpl::Download()
 {
     _isApply = false;
-    Log_Info("Download called - no-op for fsupdate");
-    return ADUC_Result{ ADUC_DownloadResult_Success };
+    _abortInstall = false;
+    if (!_isDelta)
+    {
+        Log_Info("Download called - no-op for fsupdate");
+        return ADUC_Result{ ADUC_DownloadResult_Success };
+    }
+
+    const std::string deltaPath{ _workFolder + "/" + _filename };
+    const std::string imageFilename{ _filename + ".fsu" };
+    const std::string imagePath{ _workFolder + "/" + imageFilename };
+
+    Log_Info("Rebuilding image %s from delta %s", imagePath.c_str(), deltaPath.c_str());
+
+    const ADUC_Result result{ FSUpdate_ApplyDelta(GetBaseImagePath(), deltaPath, imagePath) };
+    if (IsAducResultCodeFailure(result.ResultCode))
+    {
+        if (result.ExtendedResultCode == ADUC_ERC_SWUPDATE_HANDLER_DELTA_BASE_MISSING)
+        {
+            Log_Error("No installed %s image is kept, deploy a full image first", _fileType.c_str());
+        }
+
+        return result;
+    }
+
+    // The delta is no longer needed, install the rebuilt image.
+    unlink(deltaPath.c_str());
+    _filename = imageFilename;
+
+    return result;
 }
 
 /**
  * @brief Install implementation for fsupdate.
  * Calls into the fsupdate wrapper script to install an image file.
+ * The image may also be a FIFO that the platform layer streams the download into, see Cancel().
  *
  * @return ADUC_Result The result of the install.
  */
@@ -101,58 +357,44 @@ ADUC_Result FSUpdateHandlerImpl::Install()
     _isApply = false;
     Log_Info("Installing from %s", _workFolder.c_str());
 
-    std::unique_ptr<DIR, std::function<int(DIR*)>> directory(
-        opendir(_workFolder.c_str()), [](DIR* dirp) -> int { return closedir(dirp); });
-
-    if (directory == nullptr)
+    // The work folder may also hold sidecar files of the update, so install the file the handler was created for.
+    if (_filename.empty())
     {
-        Log_Error("opendir failed, errno = %d", errno);
-
-        return ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+        Log_Error("No image file specified");
+        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_NOTRECOVERABLE };
     }
 
-    const char* filename = nullptr;
-    const dirent* entry = nullptr;
+    std::stringstream data;
+    data << _workFolder << "/" << _filename;
+    const std::string imagePath{ data.str() };
 
-    while ((entry = readdir(directory.get())) != nullptr)
+    struct stat st
     {
-        if (entry->d_type == DT_REG)
-        {
-            if (filename == nullptr)
-            {
-                filename = entry->d_name;
-            }
-            else
-            {
-                Log_Error("More than one file in work folder");
-                return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_NOTPERMITTED };
-            }
-        }
-    }
-
-    if (filename == nullptr)
+    };
+    if (stat(imagePath.c_str(), &st) != 0)
     {
-        Log_Error("No file in work folder");
-        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+        Log_Error("Cannot find image file %s, errno = %d", imagePath.c_str(), errno);
+        return ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
     }
 
-    if (_filename != filename)
+    const bool isStreamed = S_ISFIFO(st.st_mode);
+    if (!S_ISREG(st.st_mode) && !isStreamed)
     {
-        Log_Warn("Specified filename %s does not match actual filename %s.", _filename.c_str(), filename);
+        Log_Error("Image %s is not a regular file", imagePath.c_str());
+        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_NOTPERMITTED };
     }
 
-    Log_Info("Installing image file: '%s' type: '%s'", filename, _fileType.c_str());
+    Log_Info("Installing image file: '%s' type: '%s'", _filename.c_str(), _fileType.c_str());
 
-    std::string command = _pathToFsUpdate;
-    std::vector<std::string> args{};
+    ADUC_PrivilegedOperation operation;
 
     if (_fileType == _applicationFile)
     {
-        args.emplace_back(_installApplicationFile);
+        operation = ADUC_PrivilegedOperation::FSUpdateInstallApplication;
     }
     else if (_fileType == _firmwareFile)
     {
-        args.emplace_back(_installFirmwareFile);
+        operation = ADUC_PrivilegedOperation::FSUpdateInstallFirmware;
     }
     else if (_fileType.empty())
     {
@@ -165,13 +407,31 @@ ADUC_Result FSUpdateHandlerImpl::Install()
         return ADUC_Result{ ADUC_InstallResult_Failure };
     }
 
-    std::stringstream data;
-    data << _workFolder << "/" << filename;
-    args.emplace_back(data.str().c_str());
-    args.emplace_back(_debugMode);
-    std::string output;
+    // The launcher logs FS-Update's output as it is written; only progress markers are handled here.
+    unsigned int reportedPercent = 0;
+    ADUC_ChildProcessOptions options{ GetFSUpdateProcessOptions() };
+    options.CancellationRequested = &_abortInstall;
+
+    const int exitCode = ADUC_PrivilegedBroker_Run(
+        operation,
+        imagePath,
+        [&reportedPercent](ADUC_ChildProcessStream /*stream*/, const std::string& line) {
+            unsigned int percent = 0;
+            if (ParseProgressMarker(line, &percent)
+                && (percent >= reportedPercent + c_installProgressStep || (percent == 100 && reportedPercent < 100)))
+            {
+                reportedPercent = percent;
+                Log_Info("Install progress: %u%%", percent);
+            }
+        },
+        options);
+    InvalidateRebootState();
 
-    const int exitCode = ADUC_LaunchChildProcess(command, args, output);
+    if (_abortInstall)
+    {
+        Log_Error("Install was aborted");
+        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    }
 
     if (exitCode != 0)
     {
@@ -180,6 +440,13 @@ ADUC_Result FSUpdateHandlerImpl::Install()
     }
 
     Log_Info("Install succeeded");
+
+    // A streamed image was consumed by FS-Update, there is nothing left to keep.
+    if (!isStreamed && IsKeepDeltaBaseEnabled())
+    {
+        RetainInstalledImage(imagePath);
+    }
+
     return ADUC_Result{ ADUC_InstallResult_Success };
 }
 
@@ -197,11 +464,9 @@ ADUC_Result FSUpdateHandlerImpl::Apply()
     Log_Info("Apply action called");
     _isApply = true;
 
-    std::string command = _pathToFsUpdate;
-    std::vector<std::string> args{ _commitUpdate, _debugMode };
-    std::string output;
-
-    const int exitCode = ADUC_LaunchChildProcess(command, args, output);
+    const int exitCode = ADUC_PrivilegedBroker_Run(
+        ADUC_PrivilegedOperation::FSUpdateCommit, std::string{}, IgnoreOutputLine, GetFSUpdateProcessOptions());
+    InvalidateRebootState();
 
     if (exitCode != 0)
     {
@@ -209,21 +474,84 @@ ADUC_Result FSUpdateHandlerImpl::Apply()
         return ADUC_Result{ ADUC_ApplyResult_Failure, exitCode };
     }
 
+    PromoteRetainedImage();
+
     return ADUC_Result{ ADUC_ApplyResult_Success };
 }
 
+/**
+ * @brief Path of the kept installed image of this handler's file type, used as base for delta updates.
+ */
+std::string FSUpdateHandlerImpl::GetBaseImagePath() const
+{
+    return std::string{ c_baseImageFolder } + "/" + _fileType + ".fsu";
+}
+
+/**
+ * @brief Keeps a copy of the image that was just installed. It becomes the delta base once the update is applied,
+ * so a failed or rolled back update does not replace the base.
+ *
+ * @param imagePath The installed image.
+ */
+void FSUpdateHandlerImpl::RetainInstalledImage(const std::string& imagePath) const
+{
+    const std::string pendingPath{ GetBaseImagePath() + ".pending" };
+
+    if (ADUC_SystemUtils_MkDirRecursiveDefault(c_baseImageFolder) != 0)
+    {
+        Log_Warn("Cannot create %s, delta updates will not be possible", c_baseImageFolder);
+        return;
+    }
+
+    unlink(pendingPath.c_str());
+
+    // The sandbox is removed after the deployment, so a hardlink is enough when on the same file system.
+    if (link(imagePath.c_str(), pendingPath.c_str()) == 0)
+    {
+        return;
+    }
+
+    std::error_code ec;
+    std::filesystem::copy_file(imagePath, pendingPath, ec);
+    if (ec)
+    {
+        Log_Warn("Cannot keep installed image %s: %s", imagePath.c_str(), ec.message().c_str());
+        unlink(pendingPath.c_str());
+    }
+}
+
+/**
+ * @brief Makes the image kept at install time the base for future delta updates.
+ */
+void FSUpdateHandlerImpl::PromoteRetainedImage() const
+{
+    const std::string basePath{ GetBaseImagePath() };
+    const std::string pendingPath{ basePath + ".pending" };
+
+    if (rename(pendingPath.c_str(), basePath.c_str()) == 0)
+    {
+        Log_Info("Kept installed %s image as delta base", _fileType.c_str());
+    }
+    else if (errno != ENOENT)
+    {
+        Log_Warn("Cannot keep installed image as delta base, errno = %d", errno);
+    }
+}
+
 /**
  * @brief Cancel implementation for fsupdate.
- * We don't have many hooks into fsupdate to cancel an ongoing install.
- * We can cancel apply by reverting the bootloader flag to boot into the original partition.
- * Calls into the fsupdate wrapper script to cancel apply.
+ * An ongoing install is aborted by stopping FS-Update and the processes it started, with SIGTERM and SIGKILL if
+ * they do not exit in time. FS-Update has not switched the boot partition at that point.
+ * This is also how a streamed install is stopped when the image fails validation.
  * Cancel after or during any other operation is a no-op.
+ * May be called from another thread than Install().
  *
  * @return ADUC_Result The result of the cancel.
  */
 ADUC_Result FSUpdateHandlerImpl::Cancel()
 {
-    Log_Info("Cancel called - no-op for fsupdate");
+    Log_Info("Cancel called, aborting any running install");
+    _abortInstall = true;
     return ADUC_Result{ ADUC_CancelResult_Success };
 }
 
@@ -278,11 +606,29 @@ ADUC_Result FSUpdateHandlerImpl::GetUpdateRebootState()
 
     ADUC_Result result;
 
-    std::string command = _pathToFsUpdate;
-    std::vector<std::string> args{ _getRebootState };
-    std::string output;
-
-    const int exitCode = ADUC_LaunchChildProcess(command, args, output);
+    int exitCode = 0;
+    if (GetCachedRebootState(&exitCode))
+    {
+        Log_Debug("Using cached FS-Update -urs result");
+    }
+    else if (ReadRebootStateFromUBootEnv(&exitCode))
+    {
+        CacheRebootState(exitCode);
+    }
+    else
+    {
+        exitCode = ADUC_PrivilegedBroker_Run(
+            ADUC_PrivilegedOperation::FSUpdateRebootState,
+            std::string{},
+            IgnoreOutputLine,
+            GetFSUpdateProcessOptions());
+
+        // Only definite answers are cached, a failed query is retried next time.
+        if (exitCode >= 0 && exitCode <= 6)
+        {
+            CacheRebootState(exitCode);
+        }
+    }
 
     switch (exitCode)
     {
@@ -0,0 +1,356 @@
+/**
+ * @file uboot_env.cpp
+ * @brief Implements the in-process U-Boot environment reader.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "uboot_env.hpp"
+
+#include "aduc/logging.h"
+
+#include <aduc/c_utils.h>
+#include <aduc/string_c_utils.h>
+
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Upper bound for uboot_env_size, to reject misconfigurations before allocating.
+ */
+static const size_t c_maxEnvSize = 4 * 1024 * 1024;
+
+/**
+ * @brief Parsed environment, reused until the storage changes or FSUpdate_InvalidateUBootEnv() is called.
+ */
+struct UBootEnvSnapshot
+{
+    bool Valid;
+    std::string Path;
+    uint64_t Offset;
+    size_t Size;
+    bool HasRedundant;
+    uint64_t RedundantOffset;
+    struct stat FileStatus; /**< Identifies the content of a file image, unused for devices. */
+    std::unordered_map<std::string, std::string> Variables;
+};
+
+static std::mutex s_snapshotMutex;
+static UBootEnvSnapshot s_snapshot{};
+
+/**
+ * @brief Set once an unreadable uboot_env_path was logged, as the location is read for every reboot state query.
+ */
+static std::atomic_bool s_unreadableLogged{ false };
+
+/**
+ * @brief Computes the CRC-32 (IEEE 802.3, reflected) that U-Boot uses for its environment.
+ */
+static uint32_t Crc32(const uint8_t* data, size_t size)
+{
+    static const std::array<uint32_t, 256> table = []() {
+        std::array<uint32_t, 256> entries{};
+        for (uint32_t i = 0; i < entries.size(); ++i)
+        {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320U : (crc >> 1);
+            }
+            entries[i] = crc;
+        }
+        return entries;
+    }();
+
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; ++i)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/**
+ * @brief Reads a config value that holds a size or offset, in decimal or 0x-prefixed hex.
+ *
+ * @param key The config key.
+ * @param value Receives the value.
+ * @return bool True if the key is set to a valid number.
+ */
+static bool ReadNumberFromConfig(const char* key, uint64_t* value)
+{
+    char text[24] = {};
+    if (!ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, key, text, ARRAY_SIZE(text)) || text[0] == '\0')
+    {
+        return false;
+    }
+
+    char* end = nullptr;
+    errno = 0;
+    const unsigned long long number = strtoull(text, &end, 0);
+    if (errno != 0 || end == text || *end != '\0')
+    {
+        Log_Warn("Ignoring invalid %s '%s'", key, text);
+        return false;
+    }
+
+    *value = number;
+    return true;
+}
+
+/**
+ * @brief Reads the location of the U-Boot environment from the agent config.
+ *
+ * @param location Receives the location.
+ * @return bool True if the native reader is configured and the agent can read the environment.
+ */
+bool FSUpdate_GetUBootEnvLocation(FSUpdate_UBootEnvLocation* location)
+{
+    char path[PATH_MAX] = {};
+    uint64_t size = 0;
+
+    if (!ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "uboot_env_path", path, ARRAY_SIZE(path)) || path[0] == '\0')
+    {
+        return false;
+    }
+
+    if (access(path, R_OK) != 0)
+    {
+        // Devices are usually only readable by root, which the agent no longer is after dropping its privileges.
+        // FS-Update, run through the privileged broker, reads them instead.
+        if (!s_unreadableLogged.exchange(true))
+        {
+            Log_Info("U-Boot environment %s is not readable, errno = %d, using FS-Update", path, errno);
+        }
+        return false;
+    }
+
+    if (!ReadNumberFromConfig("uboot_env_size", &size) || size == 0 || size > c_maxEnvSize)
+    {
+        Log_Warn("uboot_env_path is set, but uboot_env_size is missing or invalid");
+        return false;
+    }
+
+    location->Path = path;
+    location->Size = static_cast<size_t>(size);
+    location->Offset = 0;
+    ReadNumberFromConfig("uboot_env_offset", &location->Offset);
+    location->HasRedundant = ReadNumberFromConfig("uboot_env_redundant_offset", &location->RedundantOffset);
+
+    return true;
+}
+
+/**
+ * @brief Reads one copy of the environment and checks its CRC.
+ *
+ * @param fd The open device or file image.
+ * @param offset Offset of the copy.
+ * @param size Size of the copy.
+ * @param redundant True if the header has a flags byte.
+ * @param data Receives the copy.
+ * @param flags Receives the flags byte, 0 without one.
+ * @return bool True if the copy was read and its CRC matches.
+ */
+static bool
+ReadEnvCopy(int fd, uint64_t offset, size_t size, bool redundant, std::vector<uint8_t>* data, uint8_t* flags)
+{
+    const size_t headerSize = redundant ? 5 : 4;
+    if (size <= headerSize)
+    {
+        return false;
+    }
+
+    data->resize(size);
+    size_t done = 0;
+    while (done < size)
+    {
+        const ssize_t bytesRead = pread(fd, data->data() + done, size - done, static_cast<off_t>(offset + done));
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesRead <= 0)
+        {
+            return false;
+        }
+
+        done += static_cast<size_t>(bytesRead);
+    }
+
+    const uint8_t* bytes = data->data();
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    const uint32_t storedCrc = static_cast<uint32_t>(bytes[0]) | (static_cast<uint32_t>(bytes[1]) << 8)
+                               | (static_cast<uint32_t>(bytes[2]) << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    *flags = redundant ? bytes[4] : 0;
+
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    return Crc32(bytes + headerSize, size - headerSize) == storedCrc;
+}
+
+/**
+ * @brief Splits the "name=value" strings of an environment copy.
+ *
+ * @param data The environment data after the header.
+ * @param size Size of @p data.
+ * @param variables Receives the variables.
+ */
+static void
+ParseEnvData(const uint8_t* data, size_t size, std::unordered_map<std::string, std::string>* variables)
+{
+    const char* next = reinterpret_cast<const char*>(data);
+    const char* end = next + size; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+
+    while (next < end && *next != '\0')
+    {
+        const char* entryEnd = static_cast<const char*>(memchr(next, '\0', static_cast<size_t>(end - next)));
+        if (entryEnd == nullptr)
+        {
+            break;
+        }
+
+        const std::string entry{ next, entryEnd };
+        const size_t separator = entry.find('=');
+        if (separator != std::string::npos)
+        {
+            (*variables)[entry.substr(0, separator)] = entry.substr(separator + 1);
+        }
+
+        next = entryEnd + 1; // NOLINT(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    }
+}
+
+/**
+ * @brief Reads and parses the environment at @p location into @p snapshot.
+ *
+ * @return bool True if a copy with a valid CRC was found.
+ */
+static bool LoadSnapshot(const FSUpdate_UBootEnvLocation& location, int fd, UBootEnvSnapshot* snapshot)
+{
+    std::vector<uint8_t> first;
+    std::vector<uint8_t> second;
+    uint8_t firstFlags = 0;
+    uint8_t secondFlags = 0;
+
+    const bool firstValid =
+        ReadEnvCopy(fd, location.Offset, location.Size, location.HasRedundant, &first, &firstFlags);
+    const bool secondValid = location.HasRedundant
+                             && ReadEnvCopy(fd, location.RedundantOffset, location.Size, true, &second, &secondFlags);
+
+    if (!firstValid && !secondValid)
+    {
+        Log_Error("No U-Boot environment with a valid CRC in %s", location.Path.c_str());
+        return false;
+    }
+
+    // Same choice as U-Boot: the higher generation wins, allowing for the wrap from 255 to 0.
+    bool useSecond = !firstValid;
+    if (firstValid && secondValid && firstFlags != secondFlags)
+    {
+        if (firstFlags == 0xFF && secondFlags == 0)
+        {
+            useSecond = true;
+        }
+        else if (!(secondFlags == 0xFF && firstFlags == 0))
+        {
+            useSecond = secondFlags > firstFlags;
+        }
+    }
+
+    const std::vector<uint8_t>& copy = useSecond ? second : first;
+    const size_t headerSize = location.HasRedundant ? 5 : 4;
+
+    snapshot->Variables.clear();
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    ParseEnvData(copy.data() + headerSize, copy.size() - headerSize, &snapshot->Variables);
+    return true;
+}
+
+/**
+ * @brief Gets a variable of the U-Boot environment.
+ * The environment is read and CRC-checked once, then served from a snapshot. The snapshot of a file image is
+ * refreshed when the file changes; the snapshot of a device until FSUpdate_InvalidateUBootEnv() is called.
+ *
+ * @param location Where the environment is stored.
+ * @param name The variable.
+ * @param value Receives the value.
+ * @return bool True if the environment could be read and has the variable.
+ */
+bool FSUpdate_GetUBootEnvVariable(
+    const FSUpdate_UBootEnvLocation& location, const std::string& name, std::string* value)
+{
+    std::lock_guard<std::mutex> lock{ s_snapshotMutex };
+
+    struct stat st
+    {
+    };
+    const int fd = open(location.Path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        Log_Error("Cannot open U-Boot environment %s, errno = %d", location.Path.c_str(), errno);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return false;
+    }
+
+    const bool isFile = S_ISREG(st.st_mode);
+    const bool sameLocation = s_snapshot.Valid && s_snapshot.Path == location.Path
+                              && s_snapshot.Offset == location.Offset && s_snapshot.Size == location.Size
+                              && s_snapshot.HasRedundant == location.HasRedundant
+                              && (!location.HasRedundant || s_snapshot.RedundantOffset == location.RedundantOffset);
+    const struct stat& cached = s_snapshot.FileStatus;
+    const bool fileUnchanged = !isFile
+                               || (cached.st_ino == st.st_ino && cached.st_size == st.st_size
+                                   && cached.st_mtim.tv_sec == st.st_mtim.tv_sec
+                                   && cached.st_mtim.tv_nsec == st.st_mtim.tv_nsec);
+
+    if (!sameLocation || !fileUnchanged)
+    {
+        s_snapshot.Valid = LoadSnapshot(location, fd, &s_snapshot);
+        s_snapshot.Path = location.Path;
+        s_snapshot.Offset = location.Offset;
+        s_snapshot.Size = location.Size;
+        s_snapshot.HasRedundant = location.HasRedundant;
+        s_snapshot.RedundantOffset = location.RedundantOffset;
+        s_snapshot.FileStatus = st;
+    }
+
+    close(fd);
+
+    if (!s_snapshot.Valid)
+    {
+        return false;
+    }
+
+    const auto entry = s_snapshot.Variables.find(name);
+    if (entry == s_snapshot.Variables.end())
+    {
+        return false;
+    }
+
+    *value = entry->second;
+    return true;
+}
+
+/**
+ * @brief Drops the environment snapshot. Called whenever FS-Update may have changed the environment.
+ */
+void FSUpdate_InvalidateUBootEnv()
+{
+    std::lock_guard<std::mutex> lock{ s_snapshotMutex };
+    s_snapshot.Valid = false;
+}
@@ -0,0 +1,49 @@
+/**
+ * @file uboot_env.hpp
+ * @brief Reads the U-Boot environment in-process instead of through FS-Update and fw_printenv.
+ *
+ * The environment is read from a device (MTD, eMMC) or a file holding an image of it, at a configurable offset:
+ *
+ *     uint32   Crc                   CRC-32 (IEEE) of everything after the header, little-endian.
+ *     uint8    Flags                 Only with a redundant environment: generation of this copy.
+ *     char     Data[]                "name=value" strings, each NUL terminated, ended by an empty string.
+ *
+ * With a redundant environment, the valid copy with the newer generation is used, as U-Boot does.
+ *
+ * Configured in the agent config, with the same values as fw_env.config:
+ *   - uboot_env_path               Device or file image. Unset disables the native reader.
+ *   - uboot_env_offset             Offset of the environment, decimal or 0x-prefixed hex. Default 0.
+ *   - uboot_env_size               Size of one copy of the environment. Required.
+ *   - uboot_env_redundant_offset   Offset of the redundant copy, if there is one.
+ *
+ * A uboot_env_path the agent cannot read, e.g. a device once privileges are dropped, also disables the native reader.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef ADUC_UBOOT_ENV_HPP
+#define ADUC_UBOOT_ENV_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * @brief Where the U-Boot environment is stored.
+ */
+struct FSUpdate_UBootEnvLocation
+{
+    std::string Path; /**< Device or file image. */
+    uint64_t Offset; /**< Offset of the environment in Path. */
+    size_t Size; /**< Size of one copy, including the header. */
+    bool HasRedundant; /**< True if there is a redundant copy. */
+    uint64_t RedundantOffset; /**< Offset of the redundant copy in Path. */
+};
+
+bool FSUpdate_GetUBootEnvLocation(FSUpdate_UBootEnvLocation* location);
+
+bool FSUpdate_GetUBootEnvVariable(
+    const FSUpdate_UBootEnvLocation& location, const std::string& name, std::string* value);
+
+void FSUpdate_InvalidateUBootEnv();
+
+#endif // ADUC_UBOOT_ENV_HPP
@@ -0,0 +1,8 @@
+/**
+ * @file main.cpp
+ * @brief Entry point of the fsupdate_handler unit tests.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>
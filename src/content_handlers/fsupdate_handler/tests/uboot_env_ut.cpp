@@ -0,0 +1,235 @@
+/**
+ * @file uboot_env_ut.cpp
+ * @brief Unit tests for the in-process U-Boot environment reader.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "uboot_env.hpp"
+
+#include <catch2/catch.hpp>
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * @brief Size of one environment copy in the fixtures.
+ */
+static const size_t c_envSize = 256;
+
+/**
+ * @brief Reference CRC-32 (IEEE 802.3, reflected), computed bitwise to stay independent of the table-driven reader.
+ */
+static uint32_t ReferenceCrc32(const uint8_t* data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFFU;
+    for (size_t i = 0; i < size; ++i)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; ++bit)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320U : (crc >> 1);
+        }
+    }
+
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/**
+ * @brief Builds one environment copy as U-Boot stores it.
+ *
+ * @param variables The "name=value" strings.
+ * @param redundant True to add the flags byte of a redundant environment.
+ * @param flags Generation of the copy, with @p redundant.
+ * @return std::vector<uint8_t> The copy, c_envSize bytes.
+ */
+static std::vector<uint8_t> MakeEnvCopy(const std::vector<std::string>& variables, bool redundant, uint8_t flags)
+{
+    const size_t headerSize = redundant ? 5 : 4;
+    std::vector<uint8_t> copy(headerSize);
+    if (redundant)
+    {
+        copy[4] = flags;
+    }
+
+    for (const std::string& variable : variables)
+    {
+        copy.insert(copy.end(), variable.begin(), variable.end());
+        copy.push_back('\0');
+    }
+
+    // The empty string that ends the data, then the padding U-Boot fills with zeros as well.
+    copy.resize(c_envSize, 0);
+
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    const uint32_t crc = ReferenceCrc32(copy.data() + headerSize, copy.size() - headerSize);
+    copy[0] = static_cast<uint8_t>(crc);
+    copy[1] = static_cast<uint8_t>(crc >> 8);
+    copy[2] = static_cast<uint8_t>(crc >> 16);
+    copy[3] = static_cast<uint8_t>(crc >> 24);
+    return copy;
+}
+
+/**
+ * @brief A file image of an environment, removed when the test ends.
+ */
+class EnvImage
+{
+public:
+    explicit EnvImage(const std::vector<uint8_t>& content)
+    {
+        char path[] = "/tmp/uboot_env_ut_XXXXXX";
+        const int fd = mkstemp(path);
+        REQUIRE(fd != -1);
+        REQUIRE(write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()));
+        close(fd);
+        _path = path;
+
+        // Every image has its own path, but the reader must not serve a snapshot of an earlier test either way.
+        FSUpdate_InvalidateUBootEnv();
+    }
+
+    ~EnvImage()
+    {
+        unlink(_path.c_str());
+    }
+
+    EnvImage(const EnvImage&) = delete;
+    EnvImage& operator=(const EnvImage&) = delete;
+    EnvImage(EnvImage&&) = delete;
+    EnvImage& operator=(EnvImage&&) = delete;
+
+    FSUpdate_UBootEnvLocation Location(bool hasRedundant) const
+    {
+        FSUpdate_UBootEnvLocation location{};
+        location.Path = _path;
+        location.Offset = 0;
+        location.Size = c_envSize;
+        location.HasRedundant = hasRedundant;
+        location.RedundantOffset = hasRedundant ? c_envSize : 0;
+        return location;
+    }
+
+private:
+    std::string _path;
+};
+
+/**
+ * @brief Joins the two copies of a redundant environment into one image.
+ */
+static std::vector<uint8_t> MakeRedundantImage(const std::vector<uint8_t>& first, const std::vector<uint8_t>& second)
+{
+    std::vector<uint8_t> image{ first };
+    image.insert(image.end(), second.begin(), second.end());
+    return image;
+}
+
+TEST_CASE("ReferenceCrc32 matches the CRC-32 check value")
+{
+    const std::string checkInput{ "123456789" };
+    CHECK(ReferenceCrc32(reinterpret_cast<const uint8_t*>(checkInput.data()), checkInput.size()) == 0xCBF43926U);
+}
+
+TEST_CASE("FSUpdate_GetUBootEnvVariable reads a single environment")
+{
+    const EnvImage image{ MakeEnvCopy({ "update=0000", "update_reboot_state=3", "bootargs=a=b c" }, false, 0) };
+    const FSUpdate_UBootEnvLocation location{ image.Location(false) };
+
+    std::string value;
+    CHECK(FSUpdate_GetUBootEnvVariable(location, "update_reboot_state", &value));
+    CHECK(value == "3");
+
+    CHECK(FSUpdate_GetUBootEnvVariable(location, "update", &value));
+    CHECK(value == "0000");
+
+    // Only the first '=' separates the name from the value.
+    CHECK(FSUpdate_GetUBootEnvVariable(location, "bootargs", &value));
+    CHECK(value == "a=b c");
+
+    CHECK_FALSE(FSUpdate_GetUBootEnvVariable(location, "missing", &value));
+}
+
+TEST_CASE("FSUpdate_GetUBootEnvVariable rejects a single environment with a CRC mismatch")
+{
+    std::vector<uint8_t> copy{ MakeEnvCopy({ "update_reboot_state=3" }, false, 0) };
+    copy[4] ^= 0x01;
+
+    const EnvImage image{ copy };
+
+    std::string value;
+    CHECK_FALSE(FSUpdate_GetUBootEnvVariable(image.Location(false), "update_reboot_state", &value));
+}
+
+TEST_CASE("FSUpdate_GetUBootEnvVariable uses the newer redundant copy")
+{
+    const std::vector<uint8_t> older{ MakeEnvCopy({ "update_reboot_state=1" }, true, 4) };
+    const std::vector<uint8_t> newer{ MakeEnvCopy({ "update_reboot_state=2" }, true, 5) };
+
+    SECTION("Newer copy second")
+    {
+        const EnvImage image{ MakeRedundantImage(older, newer) };
+
+        std::string value;
+        CHECK(FSUpdate_GetUBootEnvVariable(image.Location(true), "update_reboot_state", &value));
+        CHECK(value == "2");
+    }
+
+    SECTION("Newer copy first")
+    {
+        const EnvImage image{ MakeRedundantImage(newer, older) };
+
+        std::string value;
+        CHECK(FSUpdate_GetUBootEnvVariable(image.Location(true), "update_reboot_state", &value));
+        CHECK(value == "2");
+    }
+
+    SECTION("Generation wrapped from 255 to 0")
+    {
+        const EnvImage image{ MakeRedundantImage(
+            MakeEnvCopy({ "update_reboot_state=1" }, true, 0xFF), MakeEnvCopy({ "update_reboot_state=2" }, true, 0)) };
+
+        std::string value;
+        CHECK(FSUpdate_GetUBootEnvVariable(image.Location(true), "update_reboot_state", &value));
+        CHECK(value == "2");
+    }
+}
+
+TEST_CASE("FSUpdate_GetUBootEnvVariable falls back to the redundant copy with a valid CRC")
+{
+    const std::vector<uint8_t> older{ MakeEnvCopy({ "update_reboot_state=1" }, true, 4) };
+    std::vector<uint8_t> newer{ MakeEnvCopy({ "update_reboot_state=2" }, true, 5) };
+
+    // An interrupted write of the newer copy.
+    newer[c_envSize - 1] ^= 0xFF;
+
+    SECTION("Corrupt copy second")
+    {
+        const EnvImage image{ MakeRedundantImage(older, newer) };
+
+        std::string value;
+        CHECK(FSUpdate_GetUBootEnvVariable(image.Location(true), "update_reboot_state", &value));
+        CHECK(value == "1");
+    }
+
+    SECTION("Corrupt copy first")
+    {
+        const EnvImage image{ MakeRedundantImage(newer, older) };
+
+        std::string value;
+        CHECK(FSUpdate_GetUBootEnvVariable(image.Location(true), "update_reboot_state", &value));
+        CHECK(value == "1");
+    }
+
+    SECTION("Both copies corrupt")
+    {
+        std::vector<uint8_t> corruptOlder{ older };
+        corruptOlder[5] ^= 0x01;
+        const EnvImage image{ MakeRedundantImage(corruptOlder, newer) };
+
+        std::string value;
+        CHECK_FALSE(FSUpdate_GetUBootEnvVariable(image.Location(true), "update_reboot_state", &value));
+    }
+}
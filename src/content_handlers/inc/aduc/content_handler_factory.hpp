@@ -78,6 +78,12 @@ public:
         return _fileType;
     }
 
+    bool operator==(const ContentHandlerCreateData& other) const
+    {
+        return _workFolder == other._workFolder && _logFolder == other._logFolder && _fileType == other._fileType
+               && _filename == other._filename && _fileHash == other._fileHash;
+    }
+
 private:
     std::string _workFolder;
     std::string _logFolder;
@@ -90,9 +96,34 @@ private:
     std::string _fileHash;
 };
 
+/**
+ * @brief Creates a content handler for one update type name, e.g. "fus/fsupdate".
+ */
+using ContentHandlerCreateFunc = std::unique_ptr<ContentHandler> (*)(const ContentHandlerCreateData& data);
+
+/**
+ * @brief Passed to the entry point of a handler plugin, which calls it once per update type name it handles.
+ */
+using ContentHandlerRegisterFunc = void (*)(const char* updateTypeName, ContentHandlerCreateFunc createFunc);
+
+/**
+ * @brief Name of the entry point a handler plugin exports, with the signature
+ * extern "C" void ADUC_RegisterContentHandlers(ContentHandlerRegisterFunc registerFunc).
+ */
+#define ADUC_CONTENT_HANDLER_PLUGIN_ENTRY "ADUC_RegisterContentHandlers"
+
 namespace ContentHandlerFactory
 {
 std::unique_ptr<ContentHandler> Create(const char* updateType, const ContentHandlerCreateData& data);
+
+std::shared_ptr<ContentHandler>
+GetOrCreate(const std::string& workflowId, const char* updateType, const ContentHandlerCreateData& data);
+
+void ReleaseWorkflows();
+
+void Register(const char* updateTypeName, ContentHandlerCreateFunc createFunc);
+
+void LoadPlugins();
 } // namespace ContentHandlerFactory
 
 #endif // ADUC_CONTENT_HANDLER_FACTORY_HPP
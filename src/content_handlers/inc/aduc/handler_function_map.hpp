@@ -68,6 +68,7 @@ const TypeFuncMap handlerCreateFuncs[] = {
 #endif
 #if ADUC_FSUPDATE_HANDLER
     FUNCMAPENTRY(fus, fsupdate),
+    FUNCMAPENTRY(fus, fsdelta),
 #endif
 };
 
@@ -11,11 +11,51 @@
 #include <aduc/c_utils.h>
 #include <aduc/exceptions.hpp>
 #include <aduc/logging.h>
+#include <aduc/string_c_utils.h>
 #include <aduc/string_utils.hpp>
+#include <climits>
 #include <cstring>
+#include <dlfcn.h>
+#include <mutex>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <iostream>
 
+/**
+ * @brief A handler instance of the cache, with the data it was created with.
+ */
+struct CachedContentHandler
+{
+    ContentHandlerCreateData Data;
+    std::shared_ptr<ContentHandler> Handler;
+};
+
+/**
+ * @brief Create functions by update type name, and cached handler instances by workflow and update type.
+ */
+struct ContentHandlerRegistry
+{
+    ContentHandlerRegistry()
+    {
+        for (const auto& mapEntry : handlerCreateFuncs)
+        {
+            CreateFuncs.emplace(mapEntry.UpdateType, mapEntry.CreateFunc);
+        }
+    }
+
+    std::mutex Mutex;
+    std::unordered_map<std::string, CreateFuncType> CreateFuncs;
+    std::unordered_map<std::string, std::vector<CachedContentHandler>> Handlers;
+};
+
+static ContentHandlerRegistry& GetRegistry()
+{
+    static ContentHandlerRegistry registry;
+    return registry;
+}
+
 /**
  * @brief Creates a ContentHandler
  *
@@ -32,15 +72,24 @@ ContentHandlerFactory::Create(const char* updateType, const ContentHandlerCreate
     const std::vector<std::string> typeInfo = ADUC::StringUtils::Split(updateTypeStr, ':');
     if (typeInfo.size() == 2)
     {
-        const std::string& updateTypeName = typeInfo[0];
-        for (const auto& mapEntry : handlerCreateFuncs)
+        CreateFuncType createFunc;
         {
-            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-            if (updateTypeName == mapEntry.UpdateType) // provider/name matching is case sensitive
+            ContentHandlerRegistry& registry = GetRegistry();
+            std::lock_guard<std::mutex> lock{ registry.Mutex };
+
+            // provider/name matching is case sensitive
+            const auto entry = registry.CreateFuncs.find(typeInfo[0]);
+            if (entry != registry.CreateFuncs.end())
             {
-                return mapEntry.CreateFunc(data);
+                createFunc = entry->second;
             }
         }
+
+        // Outside of the lock, a handler may create another handler.
+        if (createFunc)
+        {
+            return createFunc(data);
+        }
     }
     else
     {
@@ -49,4 +98,139 @@ ContentHandlerFactory::Create(const char* updateType, const ContentHandlerCreate
 
     ADUC::Exception::ThrowErrc(std::errc::operation_not_supported, "Unknown updateType");
     return nullptr;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Returns the handler of @p workflowId for @p updateType and @p data, creating it on first use.
+ * All phases of a workflow share one instance as long as they pass the same data. Handlers used outside of a
+ * deployment are not cached, as no Idle releases them.
+ *
+ * @param workflowId The workflow the handler belongs to, empty outside of a deployment.
+ * @param updateType The update type, e.g. "fus/fsupdate:1".
+ * @param data The data needed to create the content handler.
+ *
+ * @return std::shared_ptr<ContentHandler> The content handler.
+ */
+std::shared_ptr<ContentHandler> ContentHandlerFactory::GetOrCreate(
+    const std::string& workflowId, const char* updateType, const ContentHandlerCreateData& data)
+{
+    if (workflowId.empty())
+    {
+        return std::shared_ptr<ContentHandler>{ Create(updateType, data) };
+    }
+
+    ContentHandlerRegistry& registry = GetRegistry();
+    const std::string key{ workflowId + '\n' + updateType };
+
+    {
+        std::lock_guard<std::mutex> lock{ registry.Mutex };
+        const auto entry = registry.Handlers.find(key);
+        if (entry != registry.Handlers.end())
+        {
+            for (const CachedContentHandler& cached : entry->second)
+            {
+                if (cached.Data == data)
+                {
+                    return cached.Handler;
+                }
+            }
+        }
+    }
+
+    std::shared_ptr<ContentHandler> handler{ Create(updateType, data) };
+
+    std::lock_guard<std::mutex> lock{ registry.Mutex };
+    registry.Handlers[key].push_back(CachedContentHandler{ data, handler });
+    return handler;
+}
+
+/**
+ * @brief Drops the cached handlers of all workflows, once the deployment ended. Callers may still hold on to them.
+ * A deployment changes its workflow ID along the way, e.g. on Apply, so the handlers are not released by ID.
+ */
+void ContentHandlerFactory::ReleaseWorkflows()
+{
+    ContentHandlerRegistry& registry = GetRegistry();
+
+    std::lock_guard<std::mutex> lock{ registry.Mutex };
+    registry.Handlers.clear();
+}
+
+/**
+ * @brief Adds a create function for an update type name. Handlers built into the agent cannot be replaced.
+ *
+ * @param updateTypeName The update type without version, e.g. "fus/fsupdate".
+ * @param createFunc Creates the handler.
+ */
+void ContentHandlerFactory::Register(const char* updateTypeName, ContentHandlerCreateFunc createFunc)
+{
+    if (updateTypeName == nullptr || createFunc == nullptr)
+    {
+        return;
+    }
+
+    ContentHandlerRegistry& registry = GetRegistry();
+    std::lock_guard<std::mutex> lock{ registry.Mutex };
+    if (!registry.CreateFuncs.emplace(updateTypeName, createFunc).second)
+    {
+        Log_Warn("Content handler for %s is already registered", updateTypeName);
+        return;
+    }
+
+    Log_Info("Registered content handler for %s", updateTypeName);
+}
+
+/**
+ * @brief Loads the handler plugins listed in the config file.
+ * 'content_handler_plugins' is a comma-separated list of absolute paths to shared objects that export
+ * ADUC_CONTENT_HANDLER_PLUGIN_ENTRY. Plugins that are writable by group or others are not loaded.
+ * Plugins stay loaded until the agent exits.
+ */
+void ContentHandlerFactory::LoadPlugins()
+{
+    char value[PATH_MAX] = {};
+    if (!ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "content_handler_plugins", value, ARRAY_SIZE(value)))
+    {
+        return;
+    }
+
+    for (std::string path : ADUC::StringUtils::Split(value, ','))
+    {
+        ADUC::StringUtils::Trim(path);
+        if (path.empty())
+        {
+            continue;
+        }
+
+        struct stat st
+        {
+        };
+        if (path[0] != '/' || stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)
+            || (st.st_mode & (S_IWGRP | S_IWOTH)) != 0)
+        {
+            Log_Error(
+                "Not loading content handler plugin %s, it must be an absolute path to a protected file",
+                path.c_str());
+            continue;
+        }
+
+        void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (library == nullptr)
+        {
+            Log_Error("Cannot load content handler plugin %s: %s", path.c_str(), dlerror());
+            continue;
+        }
+
+        using EntryFunc = void (*)(ContentHandlerRegisterFunc registerFunc);
+        const auto entry = reinterpret_cast<EntryFunc>(dlsym(library, ADUC_CONTENT_HANDLER_PLUGIN_ENTRY));
+        if (entry == nullptr)
+        {
+            Log_Error("%s does not export %s", path.c_str(), ADUC_CONTENT_HANDLER_PLUGIN_ENTRY);
+            dlclose(library);
+            continue;
+        }
+
+        Log_Info("Loading content handler plugin %s", path.c_str());
+        entry(Register);
+    }
+}
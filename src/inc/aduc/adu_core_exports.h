@@ -21,6 +21,8 @@ typedef void* ADUC_Token;
 
 /**
  * @brief Method called from upper-layer when async work is completed.
+ * The workflow state is not thread-safe, so this must be called on the agent's main loop, e.g. from DoWorkCallback,
+ * rather than from the thread that did the work.
  *
  * @param workCompletionToken Token received at method call.
  * @param result Result of work.
@@ -48,6 +48,8 @@ typedef enum tagADUC_Facility
     ADUC_FACILITY_SWUPDATE_HANDLER = 0x1,
     /*indicates errors from APT Handler. */
     ADUC_FACILITY_APT_HANDLER = 0xA,
+    /*indicates errors from the libcurl based downloader. */
+    ADUC_FACILITY_CURL = 0xB,
     /*indicates errors from cryptographic validation*/
     ADUC_FACILITY_CRYPTO = 0xC,
     /*indicates errors from Delivery Optimization downloader. */
@@ -90,6 +92,14 @@ static inline ADUC_Result_t MAKE_ADUC_DELIVERY_OPTIMIZATION_EXTENDEDRESULTCODE(c
     return MAKE_ADUC_EXTENDEDRESULTCODE(ADUC_FACILITY_DELIVERY_OPTIMIZATION, value);
 }
 
+/**
+ * @brief Macros to convert libcurl results and HTTP status codes to extended result code values.
+ */
+static inline ADUC_Result_t MAKE_ADUC_CURL_EXTENDEDRESULTCODE(const int32_t value)
+{
+    return MAKE_ADUC_EXTENDEDRESULTCODE(ADUC_FACILITY_CURL, value);
+}
+
 /**
  * @brief Macros to convert errno values to extended result code values.
  */
@@ -137,11 +147,17 @@ static inline ADUC_Result_t MAKE_ADUC_LOWERLAYER_EXTENDEDRESULTCODE(const int va
     MAKE_ADUC_SWUPDATE_HANDLER_EXTENDEDRESULTCODE(1)
 #define ADUC_ERC_SWUPDATE_HANDLER_PACKAGE_PREPARE_FAILURE_WRONG_FILECOUNT \
     MAKE_ADUC_SWUPDATE_HANDLER_EXTENDEDRESULTCODE(2)
+#define ADUC_ERC_SWUPDATE_HANDLER_DELTA_BASE_MISSING MAKE_ADUC_SWUPDATE_HANDLER_EXTENDEDRESULTCODE(3)
+#define ADUC_ERC_SWUPDATE_HANDLER_DELTA_BASE_MISMATCH MAKE_ADUC_SWUPDATE_HANDLER_EXTENDEDRESULTCODE(4)
+#define ADUC_ERC_SWUPDATE_HANDLER_DELTA_INVALID MAKE_ADUC_SWUPDATE_HANDLER_EXTENDEDRESULTCODE(5)
 
 #define ADUC_ERC_VALIDATION_FILE_HASH_IS_EMPTY MAKE_ADUC_VALIDATION_EXTENDEDRESULTCODE(1)
 #define ADUC_ERC_VALIDATION_FILE_HASH_TYPE_NOT_SUPPORTED MAKE_ADUC_VALIDATION_EXTENDEDRESULTCODE(2)
 #define ADUC_ERC_VALIDATION_FILE_HASH_INVALID_HASH MAKE_ADUC_VALIDATION_EXTENDEDRESULTCODE(3)
 
+// libcurl error codes are below 0x1000, HTTP status codes are reported with this offset.
+#define ADUC_ERC_CURL_HTTP_STATUS(status) MAKE_ADUC_CURL_EXTENDEDRESULTCODE(0x1000 + (status))
+
 #define ADUC_ERC_LOWERLEVEL_INVALID_UPDATE_ACTION MAKE_ADUC_LOWERLAYER_EXTENDEDRESULTCODE(1)
 #define ADUC_ERC_LOWERLEVEL_UPDATE_MANIFEST_VALIDATION_INVALID_HASH MAKE_ADUC_VALIDATION_EXTENDEDRESULTCODE(2)
 
@@ -0,0 +1,760 @@
+/**
+ * @file curl_download_engine.cpp
+ * @brief Implements CurlDownloadEngine.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "curl_download_engine.hpp"
+
+#include <aduc/adu_core_exports.h>
+#include <aduc/logging.h>
+#include <aduc/system_utils.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include <curl/curl.h>
+
+using ADUC::CurlDownloadEngine;
+
+/**
+ * @brief Identifies a journal file and the layout of its record.
+ */
+static const uint32_t c_journalMagic = 0x4A434441; // "ADCJ"
+static const uint32_t c_journalVersion = 2;
+
+/**
+ * @brief The partial file is synced and the journal is written each time this many bytes were received.
+ */
+static const uint64_t c_journalSyncInterval = 4 * 1024 * 1024;
+
+/**
+ * @brief Number of attempts per Run() and the delay before the first retry, doubled on each retry.
+ */
+static const unsigned int c_maxAttempts = 5;
+static const unsigned int c_initialRetryDelaySeconds = 2;
+
+/**
+ * @brief A transfer that stays below 1 byte/s for this long is aborted and retried.
+ */
+static const long c_lowSpeedTimeSeconds = 60;
+
+/**
+ * @brief On-disk layout of the journal.
+ * The hash state is stored as-is, StreamSize guards against a layout change between agent versions.
+ */
+struct CurlDownloadEngineJournal
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint32_t StreamSize;
+    char ETag[256];
+    ADUC_HashUtils_Stream Stream;
+};
+
+/**
+ * @brief State shared with the libcurl callbacks of a single transfer.
+ */
+struct CurlDownloadEngine::TransferContext
+{
+    CurlDownloadEngine* Download;
+    CURL* Handle;
+    const std::atomic_bool* CancellationRequested;
+    const ProgressCallback* Progress;
+    uint64_t StartOffset;
+    bool ResponseChecked;
+    bool WriteFailed;
+
+    /**
+     * @brief Appends a chunk of the response body to the partial file and the running hash.
+     */
+    bool OnData(const char* data, size_t size)
+    {
+        if (!ResponseChecked)
+        {
+            ResponseChecked = true;
+
+            long status = 0;
+            curl_easy_getinfo(Handle, CURLINFO_RESPONSE_CODE, &status);
+            if (StartOffset != 0 && status != 206)
+            {
+                // The server sent the whole file, because it ignores ranges or the content changed.
+                Log_Info(
+                    "Server did not resume at offset %llu (HTTP %ld), restarting",
+                    static_cast<unsigned long long>(StartOffset),
+                    status);
+                Download->ResetJournal();
+                if (ftruncate(Download->_partFd, 0) != 0 || lseek(Download->_partFd, 0, SEEK_SET) != 0)
+                {
+                    return false;
+                }
+                StartOffset = 0;
+            }
+        }
+
+        const char* next = data;
+        size_t remaining = size;
+        while (remaining > 0)
+        {
+            const ssize_t written = write(Download->_partFd, next, remaining);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                Log_Error("Cannot write %s, errno %d", Download->_partPath.c_str(), errno);
+                return false;
+            }
+
+            next += written;
+            remaining -= static_cast<size_t>(written);
+        }
+
+        if (!ADUC_HashUtils_StreamUpdate(&Download->_stream, reinterpret_cast<const uint8_t*>(data), size))
+        {
+            return false;
+        }
+
+        Download->_bytesSinceSync += size;
+        if (Download->_bytesSinceSync >= c_journalSyncInterval)
+        {
+            // Data must be on disk before the journal claims it.
+            if (!Download->SyncPartFile() || !Download->SaveJournal())
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static size_t WriteCallback(char* data, size_t size, size_t count, void* userData)
+    {
+        auto* context = static_cast<TransferContext*>(userData);
+        if (!context->OnData(data, size * count))
+        {
+            context->WriteFailed = true;
+            return 0;
+        }
+
+        return size * count;
+    }
+
+    static int TransferInfoCallback(
+        void* userData, curl_off_t dlTotal, curl_off_t dlNow, curl_off_t /*ulTotal*/, curl_off_t /*ulNow*/)
+    {
+        auto* context = static_cast<TransferContext*>(userData);
+        if (*context->CancellationRequested)
+        {
+            return 1;
+        }
+
+        if (*context->Progress)
+        {
+            (*context->Progress)(
+                context->StartOffset + static_cast<uint64_t>(dlNow),
+                (dlTotal > 0) ? context->StartOffset + static_cast<uint64_t>(dlTotal) : 0);
+        }
+
+        return 0;
+    }
+};
+
+static int SocketOptionCallback(void* userData, curl_socket_t socket, curlsocktype purpose)
+{
+    const int receiveBufferSize = *static_cast<const int*>(userData);
+    if (purpose == CURLSOCKTYPE_IPCXN
+        && setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize)) != 0)
+    {
+        Log_Warn("Cannot set socket receive buffer to %d, errno %d", receiveBufferSize, errno);
+    }
+
+    return CURL_SOCKOPT_OK;
+}
+
+static size_t HeaderCallback(char* data, size_t size, size_t count, void* userData)
+{
+    auto* etag = static_cast<std::string*>(userData);
+    const size_t length = size * count;
+    const char c_etagHeader[] = "etag:";
+    const size_t c_etagHeaderLength = sizeof(c_etagHeader) - 1;
+
+    if (length > c_etagHeaderLength && strncasecmp(data, c_etagHeader, c_etagHeaderLength) == 0)
+    {
+        std::string value{ data + c_etagHeaderLength, length - c_etagHeaderLength };
+        const auto isSpace = [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; };
+        value.erase(value.begin(), std::find_if_not(value.begin(), value.end(), isSpace));
+        value.erase(std::find_if_not(value.rbegin(), value.rend(), isSpace).base(), value.end());
+        *etag = value;
+    }
+
+    return length;
+}
+
+/**
+ * @brief State of a FetchRange() request.
+ */
+struct RangeContext
+{
+    CURL* Handle;
+    const std::atomic_bool* CancellationRequested;
+    int Fd;
+    uint64_t Offset;
+    uint64_t Remaining;
+    bool ResponseChecked;
+
+    static size_t WriteCallback(char* data, size_t size, size_t count, void* userData)
+    {
+        auto* context = static_cast<RangeContext*>(userData);
+        const size_t length = size * count;
+
+        if (!context->ResponseChecked)
+        {
+            context->ResponseChecked = true;
+
+            // Anything but the range, e.g. the whole file after the content changed, must not be written.
+            long status = 0;
+            curl_easy_getinfo(context->Handle, CURLINFO_RESPONSE_CODE, &status);
+            if (status != 206)
+            {
+                Log_Error("Server did not send the requested range (HTTP %ld)", status);
+                return 0;
+            }
+        }
+
+        if (length > context->Remaining)
+        {
+            return 0;
+        }
+
+        const char* next = data;
+        size_t remaining = length;
+        while (remaining > 0)
+        {
+            const ssize_t written = pwrite(context->Fd, next, remaining, static_cast<off_t>(context->Offset));
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                return 0;
+            }
+
+            next += written;
+            remaining -= static_cast<size_t>(written);
+            context->Offset += static_cast<uint64_t>(written);
+            context->Remaining -= static_cast<uint64_t>(written);
+        }
+
+        return length;
+    }
+
+    static int TransferInfoCallback(
+        void* userData, curl_off_t /*dlTotal*/, curl_off_t /*dlNow*/, curl_off_t /*ulTotal*/, curl_off_t /*ulNow*/)
+    {
+        return *static_cast<RangeContext*>(userData)->CancellationRequested ? 1 : 0;
+    }
+};
+
+/**
+ * @brief Construct a download whose journal and partial file are named after @p key in @p journalFolder.
+ *
+ * @param journalFolder Folder that persists across agent restarts.
+ * @param key Identifies the download, unique among concurrent downloads, see DownloadEngine::Create().
+ * @param algorithm Hash algorithm to compute while downloading.
+ * @param options Transfer tuning.
+ */
+CurlDownloadEngine::CurlDownloadEngine(
+    const std::string& journalFolder, const std::string& key, SHAversion algorithm, const Options& options) :
+    _journalPath{ journalFolder + "/" + key + ".journal" },
+    _partPath{ journalFolder + "/" + key + ".part" }, _algorithm{ algorithm }, _options(options)
+{
+    static std::once_flag curlInitialized;
+    std::call_once(curlInitialized, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+    ADUC_SystemUtils_MkDirRecursiveDefault(journalFolder.c_str());
+    ADUC_HashUtils_StreamInit(&_stream, _algorithm);
+}
+
+CurlDownloadEngine::~CurlDownloadEngine()
+{
+    if (_partFd != -1)
+    {
+        close(_partFd);
+    }
+}
+
+/**
+ * @brief Removes journals and partial files that were not touched for @p maxAgeSeconds, so abandoned updates do
+ * not fill up the disk.
+ *
+ * @param journalFolder Folder holding the journals.
+ * @param maxAgeSeconds Age after which an entry is removed.
+ */
+/*static*/
+void CurlDownloadEngine::RemoveStale(const std::string& journalFolder, unsigned int maxAgeSeconds)
+{
+    std::error_code ec;
+    std::filesystem::directory_iterator entries{ journalFolder, ec };
+    if (ec)
+    {
+        return;
+    }
+
+    const time_t now = time(nullptr);
+    for (const auto& entry : entries)
+    {
+        struct stat st
+        {
+        };
+        const std::string path{ entry.path() };
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime > static_cast<time_t>(maxAgeSeconds))
+        {
+            Log_Info("Removing stale partial download %s", path.c_str());
+            unlink(path.c_str());
+        }
+    }
+}
+
+/**
+ * @brief Downloads @p url, resuming from the journal if there is one, and moves the result to @p targetPath.
+ * Transient failures are retried, resuming where the previous attempt stopped.
+ *
+ * @param url The URL to download.
+ * @param targetPath Where to put the completed file.
+ * @param cancellationRequested Aborts the download when set.
+ * @param progress Called while the download is in progress. May be empty.
+ * @return ADUC_Result The download result.
+ */
+ADUC_Result CurlDownloadEngine::Run(
+    const std::string& url,
+    const std::string& targetPath,
+    std::atomic_bool& cancellationRequested,
+    const ProgressCallback& progress)
+{
+    if (!LoadJournal())
+    {
+        ResetJournal();
+    }
+
+    if (!OpenPartFile())
+    {
+        return ADUC_Result{ ADUC_DownloadResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+    }
+
+    ADUC_Result result{ ADUC_DownloadResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    unsigned int retryDelaySeconds = c_initialRetryDelaySeconds;
+    for (unsigned int attempt = 1; attempt <= c_maxAttempts; ++attempt)
+    {
+        result = Transfer(url, cancellationRequested, progress);
+        if (result.ResultCode != ADUC_DownloadResult_Failure
+            || result.ExtendedResultCode == MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(ENOSPC) || attempt == c_maxAttempts)
+        {
+            break;
+        }
+
+        Log_Warn(
+            "Download attempt %u of %u failed, extendedCode: %d. Retrying in %us",
+            attempt,
+            c_maxAttempts,
+            result.ExtendedResultCode,
+            retryDelaySeconds);
+
+        for (unsigned int waited = 0; waited < retryDelaySeconds && !cancellationRequested; ++waited)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+
+        if (cancellationRequested)
+        {
+            result = ADUC_Result{ ADUC_DownloadResult_Cancelled, ADUC_ERC_NOTRECOVERABLE };
+            break;
+        }
+
+        retryDelaySeconds *= 2;
+    }
+
+    if (result.ResultCode == ADUC_DownloadResult_Success)
+    {
+        return Complete(targetPath);
+    }
+
+    // Keep what we have for the next attempt.
+    if (SyncPartFile())
+    {
+        SaveJournal();
+    }
+
+    return result;
+}
+
+/**
+ * @brief Completes the hash over the downloaded file and compares it to @p hashBase64.
+ *
+ * @param hashBase64 The expected hash.
+ * @return bool True if the file hashes to @p hashBase64.
+ */
+bool CurlDownloadEngine::IsValid(const char* hashBase64)
+{
+    return ADUC_HashUtils_StreamIsValid(&_stream, hashBase64);
+}
+
+/**
+ * @brief Restores the hash state, ETag and offset of a previous download.
+ *
+ * @return bool False if there is no usable journal.
+ */
+bool CurlDownloadEngine::LoadJournal()
+{
+    CurlDownloadEngineJournal journal{};
+
+    // The hash state is only meaningful to the backend that wrote it.
+    ADUC_HashUtils_Stream freshStream{};
+    ADUC_HashUtils_StreamInit(&freshStream, _algorithm);
+
+    const int fd = open(_journalPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    const ssize_t readSize = read(fd, &journal, sizeof(journal));
+    close(fd);
+
+    if (readSize != static_cast<ssize_t>(sizeof(journal)) || journal.Magic != c_journalMagic
+        || journal.Version != c_journalVersion || journal.StreamSize != sizeof(journal.Stream)
+        || journal.Stream.Algorithm != _algorithm || journal.Stream.Backend != freshStream.Backend)
+    {
+        Log_Warn("Ignoring unusable download journal %s", _journalPath.c_str());
+        return false;
+    }
+
+    // The partial file may be longer than the journal says, but never shorter.
+    struct stat st
+    {
+    };
+    if (stat(_partPath.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) < journal.Stream.BytesHashed)
+    {
+        Log_Warn("Partial download %s is missing or truncated", _partPath.c_str());
+        return false;
+    }
+
+    journal.ETag[sizeof(journal.ETag) - 1] = '\0';
+    _etag = journal.ETag;
+    _stream = journal.Stream;
+
+    Log_Info("Resuming download from byte %llu", static_cast<unsigned long long>(_stream.BytesHashed));
+    return true;
+}
+
+/**
+ * @brief Atomically replaces the journal with the current state.
+ *
+ * @return bool True on success.
+ */
+bool CurlDownloadEngine::SaveJournal()
+{
+    CurlDownloadEngineJournal journal{};
+    journal.Magic = c_journalMagic;
+    journal.Version = c_journalVersion;
+    journal.StreamSize = sizeof(journal.Stream);
+    strncpy(journal.ETag, _etag.c_str(), sizeof(journal.ETag) - 1);
+    journal.Stream = _stream;
+
+    const std::string tempPath{ _journalPath + ".tmp" };
+    const int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (fd == -1)
+    {
+        Log_Error("Cannot create %s, errno %d", tempPath.c_str(), errno);
+        return false;
+    }
+
+    const bool written = write(fd, &journal, sizeof(journal)) == static_cast<ssize_t>(sizeof(journal));
+    const bool synced = written && fsync(fd) == 0;
+    close(fd);
+
+    if (!synced || rename(tempPath.c_str(), _journalPath.c_str()) != 0)
+    {
+        Log_Error("Cannot write %s, errno %d", _journalPath.c_str(), errno);
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Forgets any previous progress and starts over at byte 0.
+ */
+void CurlDownloadEngine::ResetJournal()
+{
+    unlink(_journalPath.c_str());
+    _etag.clear();
+    _bytesSinceSync = 0;
+    ADUC_HashUtils_StreamInit(&_stream, _algorithm);
+}
+
+/**
+ * @brief Opens the partial file and cuts it back to the bytes covered by the hash state.
+ *
+ * @return bool True on success, errno is set otherwise.
+ */
+bool CurlDownloadEngine::OpenPartFile()
+{
+    if (_partFd == -1)
+    {
+        _partFd = open(_partPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (_partFd == -1)
+        {
+            Log_Error("Cannot open %s, errno %d", _partPath.c_str(), errno);
+            return false;
+        }
+    }
+
+    const off_t offset = static_cast<off_t>(_stream.BytesHashed);
+    if (ftruncate(_partFd, offset) != 0 || lseek(_partFd, offset, SEEK_SET) != offset)
+    {
+        Log_Error("Cannot resume %s at %lld, errno %d", _partPath.c_str(), static_cast<long long>(offset), errno);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Flushes the partial file to disk.
+ *
+ * @return bool True on success.
+ */
+bool CurlDownloadEngine::SyncPartFile()
+{
+    if (_partFd == -1 || fdatasync(_partFd) != 0)
+    {
+        return false;
+    }
+
+    _bytesSinceSync = 0;
+    return true;
+}
+
+/**
+ * @brief Performs a single HTTP request, continuing at the current offset.
+ *
+ * @return ADUC_Result Success once the server sent the rest of the file.
+ */
+ADUC_Result CurlDownloadEngine::Transfer(
+    const std::string& url, const std::atomic_bool& cancellationRequested, const ProgressCallback& progress)
+{
+    // A previous attempt may have written bytes that were not hashed.
+    if (!OpenPartFile())
+    {
+        return ADUC_Result{ ADUC_DownloadResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+    }
+
+    std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> handle{ curl_easy_init(), curl_easy_cleanup };
+    if (!handle)
+    {
+        return ADUC_Result{ ADUC_DownloadResult_Failure, ADUC_ERC_NOMEM };
+    }
+
+    TransferContext context{ this, handle.get(), &cancellationRequested, &progress, _stream.BytesHashed, false, false };
+
+    std::string ifRange;
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> headers{ nullptr, curl_slist_free_all };
+    if (context.StartOffset != 0)
+    {
+        curl_easy_setopt(handle.get(), CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(context.StartOffset));
+
+        // Only take the range if the content did not change, otherwise the server sends the whole file.
+        if (!_etag.empty())
+        {
+            ifRange = "If-Range: " + _etag;
+            headers.reset(curl_slist_append(nullptr, ifRange.c_str()));
+            curl_easy_setopt(handle.get(), CURLOPT_HTTPHEADER, headers.get());
+        }
+    }
+
+    std::string etag;
+    curl_easy_setopt(handle.get(), CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle.get(), CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_TIME, c_lowSpeedTimeSeconds);
+    curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION, TransferContext::WriteCallback);
+    curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &context);
+    curl_easy_setopt(handle.get(), CURLOPT_HEADERFUNCTION, HeaderCallback);
+    curl_easy_setopt(handle.get(), CURLOPT_HEADERDATA, &etag);
+    curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, TransferContext::TransferInfoCallback);
+    curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &context);
+
+    if (_options.BufferSize > 0)
+    {
+        curl_easy_setopt(handle.get(), CURLOPT_BUFFERSIZE, _options.BufferSize);
+    }
+
+    if (_options.SocketReceiveBufferSize > 0)
+    {
+        curl_easy_setopt(handle.get(), CURLOPT_SOCKOPTFUNCTION, SocketOptionCallback);
+        curl_easy_setopt(handle.get(), CURLOPT_SOCKOPTDATA, &_options.SocketReceiveBufferSize);
+    }
+
+    const CURLcode curlResult = curl_easy_perform(handle.get());
+
+    if (!etag.empty())
+    {
+        _etag = etag;
+    }
+
+    if (curlResult == CURLE_OK)
+    {
+        return ADUC_Result{ ADUC_DownloadResult_Success };
+    }
+
+    if (curlResult == CURLE_ABORTED_BY_CALLBACK && cancellationRequested)
+    {
+        Log_Info("Download was cancelled");
+        return ADUC_Result{ ADUC_DownloadResult_Cancelled, ADUC_ERC_NOTRECOVERABLE };
+    }
+
+    if (curlResult == CURLE_WRITE_ERROR && context.WriteFailed)
+    {
+        return ADUC_Result{ ADUC_DownloadResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+    }
+
+    long status = 0;
+    curl_easy_getinfo(handle.get(), CURLINFO_RESPONSE_CODE, &status);
+    if (curlResult == CURLE_HTTP_RETURNED_ERROR && status == 416)
+    {
+        // Nothing left at our offset: the file changed or we already had all of it. Start over to be sure.
+        Log_Info("Server rejected range at %llu, restarting", static_cast<unsigned long long>(context.StartOffset));
+        ResetJournal();
+    }
+
+    Log_Error("Download failed: %s (HTTP %ld)", curl_easy_strerror(curlResult), status);
+    return ADUC_Result{ ADUC_DownloadResult_Failure,
+                        (curlResult == CURLE_HTTP_RETURNED_ERROR) ? ADUC_ERC_CURL_HTTP_STATUS(status)
+                                                                  : MAKE_ADUC_CURL_EXTENDEDRESULTCODE(curlResult) };
+}
+
+/**
+ * @brief Moves the finished file to @p targetPath and removes the journal.
+ *
+ * @return ADUC_Result The download result.
+ */
+ADUC_Result CurlDownloadEngine::Complete(const std::string& targetPath)
+{
+    const bool synced = SyncPartFile();
+    close(_partFd);
+    _partFd = -1;
+
+    if (!synced)
+    {
+        return ADUC_Result{ ADUC_DownloadResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(_partPath, targetPath, ec);
+    if (ec == std::errc::cross_device_link)
+    {
+        // The journal folder and the sandbox are on different file systems.
+        ec.clear();
+        if (std::filesystem::copy_file(
+                _partPath, targetPath, std::filesystem::copy_options::overwrite_existing, ec))
+        {
+            std::filesystem::remove(_partPath, ec);
+            ec.clear();
+        }
+    }
+
+    if (ec)
+    {
+        Log_Error("Cannot move %s to %s: %s", _partPath.c_str(), targetPath.c_str(), ec.message().c_str());
+        return ADUC_Result{ ADUC_DownloadResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(ec.value()) };
+    }
+
+    unlink(_journalPath.c_str());
+    return ADUC_Result{ ADUC_DownloadResult_Success };
+}
+
+/**
+ * @brief Downloads a range of @p url again with an HTTP range request and writes it into @p targetPath.
+ * The request is guarded by If-Range, so a changed file is never mixed into the completed one.
+ */
+bool CurlDownloadEngine::FetchRange(
+    const std::string& url,
+    const std::string& targetPath,
+    uint64_t offset,
+    uint64_t length,
+    const std::atomic_bool& cancellationRequested)
+{
+    if (length == 0)
+    {
+        return true;
+    }
+
+    const int fd = open(targetPath.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        Log_Error("Cannot open %s, errno %d", targetPath.c_str(), errno);
+        return false;
+    }
+
+    std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> handle{ curl_easy_init(), curl_easy_cleanup };
+    RangeContext context{ handle.get(), &cancellationRequested, fd, offset, length, false };
+    CURLcode curlResult = CURLE_OUT_OF_MEMORY;
+
+    const std::string range{ std::to_string(offset) + "-" + std::to_string(offset + length - 1) };
+    const std::string ifRange{ "If-Range: " + _etag };
+    std::unique_ptr<curl_slist, decltype(&curl_slist_free_all)> headers{ nullptr, curl_slist_free_all };
+
+    if (handle)
+    {
+        if (!_etag.empty())
+        {
+            headers.reset(curl_slist_append(nullptr, ifRange.c_str()));
+            curl_easy_setopt(handle.get(), CURLOPT_HTTPHEADER, headers.get());
+        }
+
+        curl_easy_setopt(handle.get(), CURLOPT_URL, url.c_str());
+        curl_easy_setopt(handle.get(), CURLOPT_RANGE, range.c_str());
+        curl_easy_setopt(handle.get(), CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(handle.get(), CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(handle.get(), CURLOPT_NOSIGNAL, 1L);
+        curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_LIMIT, 1L);
+        curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_TIME, c_lowSpeedTimeSeconds);
+        curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION, RangeContext::WriteCallback);
+        curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &context);
+        curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, RangeContext::TransferInfoCallback);
+        curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &context);
+
+        curlResult = curl_easy_perform(handle.get());
+    }
+
+    const bool success = curlResult == CURLE_OK && context.Remaining == 0 && fdatasync(fd) == 0;
+    if (!success)
+    {
+        Log_Error("Cannot refetch bytes %s of %s, curl code %d", range.c_str(), url.c_str(), curlResult);
+    }
+
+    close(fd);
+    return success;
+}
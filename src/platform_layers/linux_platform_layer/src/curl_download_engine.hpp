@@ -0,0 +1,93 @@
+/**
+ * @file curl_download_engine.hpp
+ * @brief libcurl download engine that keeps a journal of its progress so it can be resumed after a restart.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef CURL_DOWNLOAD_ENGINE_HPP
+#define CURL_DOWNLOAD_ENGINE_HPP
+
+#include "download_engine.hpp"
+
+#include <cstdint>
+#include <string>
+
+namespace ADUC
+{
+/**
+ * @brief Downloads a file over HTTP(S) into a persistent partial file.
+ *
+ * The partial file and a journal holding the number of bytes already on disk, the hash state over those bytes
+ * and the server's ETag are kept in a folder that survives agent restarts and sandbox recreation. A later Run()
+ * for the same key continues with a range request (guarded by If-Range) instead of starting over. If the server
+ * ignores the range or the content changed, the download restarts from the beginning.
+ *
+ * On success the file is moved to the target path and the journal is removed.
+ */
+class CurlDownloadEngine : public DownloadEngine
+{
+public:
+    /**
+     * @brief Transfer tuning. Zero keeps the libcurl or kernel default.
+     */
+    struct Options
+    {
+        long BufferSize; /**< Size of the chunks handed to the write callback (CURLOPT_BUFFERSIZE). */
+        int SocketReceiveBufferSize; /**< SO_RCVBUF of the connection. */
+    };
+
+    CurlDownloadEngine(
+        const std::string& journalFolder, const std::string& key, SHAversion algorithm, const Options& options);
+    ~CurlDownloadEngine() override;
+
+    CurlDownloadEngine(const CurlDownloadEngine&) = delete;
+    CurlDownloadEngine& operator=(const CurlDownloadEngine&) = delete;
+    CurlDownloadEngine(CurlDownloadEngine&&) = delete;
+    CurlDownloadEngine& operator=(CurlDownloadEngine&&) = delete;
+
+    const char* Name() const override
+    {
+        return "curl";
+    }
+
+    ADUC_Result Run(
+        const std::string& url,
+        const std::string& targetPath,
+        std::atomic_bool& cancellationRequested,
+        const ProgressCallback& progress) override;
+
+    bool IsValid(const char* hashBase64) override;
+
+    bool FetchRange(
+        const std::string& url,
+        const std::string& targetPath,
+        uint64_t offset,
+        uint64_t length,
+        const std::atomic_bool& cancellationRequested) override;
+
+    static void RemoveStale(const std::string& journalFolder, unsigned int maxAgeSeconds);
+
+private:
+    struct TransferContext;
+
+    bool LoadJournal();
+    bool SaveJournal();
+    void ResetJournal();
+    bool OpenPartFile();
+    bool SyncPartFile();
+    ADUC_Result Transfer(
+        const std::string& url, const std::atomic_bool& cancellationRequested, const ProgressCallback& progress);
+    ADUC_Result Complete(const std::string& targetPath);
+
+    std::string _journalPath;
+    std::string _partPath;
+    SHAversion _algorithm;
+    Options _options;
+    int _partFd{ -1 };
+    uint64_t _bytesSinceSync{ 0 };
+    std::string _etag;
+    ADUC_HashUtils_Stream _stream{};
+};
+} // namespace ADUC
+
+#endif // CURL_DOWNLOAD_ENGINE_HPP
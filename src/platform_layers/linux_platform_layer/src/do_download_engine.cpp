@@ -0,0 +1,97 @@
+/**
+ * @file do_download_engine.cpp
+ * @brief Implements DODownloadEngine.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "do_download_engine.hpp"
+
+#include <aduc/adu_core_exports.h>
+#include <aduc/logging.h>
+
+#include <cerrno>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <system_error>
+
+#include <do_download.h>
+#include <do_exceptions.h>
+
+#include <unistd.h>
+
+namespace MSDO = microsoft::deliveryoptimization;
+
+using ADUC::DODownloadEngine;
+
+DODownloadEngine::DODownloadEngine(SHAversion algorithm) : _algorithm{ algorithm }
+{
+}
+
+ADUC_Result DODownloadEngine::Run(
+    const std::string& url,
+    const std::string& targetPath,
+    std::atomic_bool& cancellationRequested,
+    const ProgressCallback& progress)
+{
+    // The sink opens whatever is at targetPath once it exists, so a file left over from an earlier attempt must not
+    // be there when the download starts.
+    if (unlink(targetPath.c_str()) != 0 && errno != ENOENT)
+    {
+        const int unlinkErrno = errno;
+        Log_Error("Cannot remove stale %s, errno %d", targetPath.c_str(), unlinkErrno);
+        return ADUC_Result{ ADUC_DownloadResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(unlinkErrno) };
+    }
+
+    _hashingSink.reset(new HashingDownloadSink{ targetPath, _algorithm });
+
+    try
+    {
+        std::future<void> download{ std::async(std::launch::async, [&]() {
+            MSDO::download::download_url_to_path(url, targetPath, std::ref(cancellationRequested));
+        }) };
+
+        while (download.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready)
+        {
+            _hashingSink->CatchUp();
+            if (progress)
+            {
+                progress(_hashingSink->BytesHashed(), 0);
+            }
+        }
+
+        // Rethrows any exception thrown by the download.
+        download.get();
+
+        _hashingSink->CatchUp();
+    }
+    // Catch DO exception only to get extended result code. Other exceptions are handled by the caller.
+    catch (const MSDO::exception& e)
+    {
+        const int32_t doErrorCode = e.error_code();
+
+        Log_Info("Caught DO exception, msg: %s, code: %d", e.what(), doErrorCode);
+
+        if (doErrorCode == static_cast<int32_t>(std::errc::operation_canceled))
+        {
+            Log_Info("Download was cancelled");
+            return ADUC_Result{ ADUC_DownloadResult_Cancelled,
+                                MAKE_ADUC_DELIVERY_OPTIMIZATION_EXTENDEDRESULTCODE(doErrorCode) };
+        }
+
+        if (doErrorCode == static_cast<int32_t>(std::errc::timed_out))
+        {
+            Log_Error("Download failed due to DO timeout");
+        }
+
+        return ADUC_Result{ ADUC_DownloadResult_Failure,
+                            MAKE_ADUC_DELIVERY_OPTIMIZATION_EXTENDEDRESULTCODE(doErrorCode) };
+    }
+
+    return ADUC_Result{ ADUC_DownloadResult_Success };
+}
+
+bool DODownloadEngine::IsValid(const char* hashBase64)
+{
+    return _hashingSink && _hashingSink->IsValid(hashBase64);
+}
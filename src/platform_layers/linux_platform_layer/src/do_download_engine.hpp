@@ -0,0 +1,47 @@
+/**
+ * @file do_download_engine.hpp
+ * @brief Download engine using the Delivery Optimization agent.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef DO_DOWNLOAD_ENGINE_HPP
+#define DO_DOWNLOAD_ENGINE_HPP
+
+#include "download_engine.hpp"
+#include "hashing_download_sink.hpp"
+
+#include <memory>
+
+namespace ADUC
+{
+/**
+ * @brief Downloads through the Delivery Optimization agent.
+ *
+ * The DO agent writes the file from its own process, so the payload never passes through us. The file is hashed
+ * while it grows instead, so validation does not need a second pass over it.
+ */
+class DODownloadEngine : public DownloadEngine
+{
+public:
+    explicit DODownloadEngine(SHAversion algorithm);
+
+    const char* Name() const override
+    {
+        return "do";
+    }
+
+    ADUC_Result Run(
+        const std::string& url,
+        const std::string& targetPath,
+        std::atomic_bool& cancellationRequested,
+        const ProgressCallback& progress) override;
+
+    bool IsValid(const char* hashBase64) override;
+
+private:
+    SHAversion _algorithm;
+    std::unique_ptr<HashingDownloadSink> _hashingSink;
+};
+} // namespace ADUC
+
+#endif // DO_DOWNLOAD_ENGINE_HPP
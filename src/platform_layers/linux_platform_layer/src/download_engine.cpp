@@ -0,0 +1,185 @@
+/**
+ * @file download_engine.cpp
+ * @brief Selects and creates download engines.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "download_engine.hpp"
+#include "curl_download_engine.hpp"
+#include "do_download_engine.hpp"
+#include "file_download_engine.hpp"
+#include "streaming_download.hpp"
+
+#include <aduc/c_utils.h>
+#include <aduc/logging.h>
+#include <aduc/string_c_utils.h>
+
+#include <climits>
+#include <cstring>
+
+using ADUC::DownloadEngine;
+
+/**
+ * @brief Folder holding journals and partial files of the curl engine. Unlike the sandbox, it survives
+ * agent restarts and new workflows.
+ */
+static const char* c_downloadJournalFolder = ADUC_DATA_FOLDER "/downloads";
+
+/**
+ * @brief Journals of downloads that were not resumed for this long are removed.
+ */
+static const unsigned int c_downloadJournalMaxAgeSeconds = 7 * 24 * 60 * 60;
+
+/**
+ * @brief Read size of the file engine.
+ */
+static const size_t c_fileEngineBufferSize = 1024 * 1024;
+
+/**
+ * @brief Bytes of a streamed image that are withheld from the installer until its hash is verified.
+ */
+static const size_t c_streamingHoldBackSize = 1024 * 1024;
+
+/**
+ * @brief Reads a size in KiB from the config file.
+ *
+ * @param key The config key.
+ * @return unsigned int The size in bytes, or 0 if not set or invalid.
+ */
+static unsigned int ReadSizeKbFromConfig(const char* key)
+{
+    char value[12] = {};
+    unsigned int sizeKb = 0;
+    if (!ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, key, value, ARRAY_SIZE(value)) || !atoui(value, &sizeKb))
+    {
+        return 0;
+    }
+
+    return sizeKb * 1024;
+}
+
+/**
+ * @brief Checks whether @p url names a local file. Those are only served by the file engine, and only when it is
+ * configured, as an update manifest must not be able to make the agent read arbitrary local files.
+ *
+ * @param url The URL to check.
+ * @return bool True for a file:// URL.
+ */
+static bool IsFileUrl(const std::string& url)
+{
+    return url.compare(0, 7, "file://") == 0;
+}
+
+/**
+ * @brief Creates the engine to download @p url with, as configured by 'download_engine' in the config file.
+ *
+ * @param url The file that will be downloaded.
+ * @param downloadKey Identifies the download across agent restarts, e.g. to name a journal to resume it from.
+ * @param algorithm Hash algorithm to compute during the transfer.
+ * @return std::unique_ptr<DownloadEngine> The engine, or nullptr for a file:// URL if the file engine is not
+ * configured.
+ */
+/*static*/
+std::unique_ptr<DownloadEngine>
+DownloadEngine::Create(const std::string& url, const std::string& downloadKey, SHAversion algorithm)
+{
+    char engineName[8] = {};
+    char sourceFolder[PATH_MAX] = {};
+
+    ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "download_engine", engineName, ARRAY_SIZE(engineName));
+    ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "file_engine_folder", sourceFolder, ARRAY_SIZE(sourceFolder));
+
+    if (strcmp(engineName, "file") == 0)
+    {
+        return std::unique_ptr<DownloadEngine>{ new FileDownloadEngine{ sourceFolder,
+                                                                         algorithm,
+                                                                         c_fileEngineBufferSize } };
+    }
+
+    if (IsFileUrl(url))
+    {
+        Log_Error("Refusing to download %s, download_engine is not 'file'", url.c_str());
+        return nullptr;
+    }
+
+    if (strcmp(engineName, "curl") == 0)
+    {
+        CurlDownloadEngine::Options options{};
+        options.BufferSize = static_cast<long>(ReadSizeKbFromConfig("curl_buffer_size_kb"));
+        options.SocketReceiveBufferSize = static_cast<int>(ReadSizeKbFromConfig("curl_socket_buffer_kb"));
+
+        return std::unique_ptr<DownloadEngine>{ new CurlDownloadEngine{
+            c_downloadJournalFolder, downloadKey, algorithm, options } };
+    }
+
+    if (engineName[0] != '\0' && strcmp(engineName, "do") != 0)
+    {
+        Log_Warn("Unknown download_engine '%s', using Delivery Optimization", engineName);
+    }
+
+    return std::unique_ptr<DownloadEngine>{ new DODownloadEngine{ algorithm } };
+}
+
+/**
+ * @brief Checks whether the engine configured for @p url can stream it straight into the installer.
+ * The Delivery Optimization agent writes files from its own process, so its downloads are always staged.
+ *
+ * @param url The file that would be streamed.
+ * @return bool True if CreateStreaming() can be used for @p url.
+ */
+/*static*/
+bool DownloadEngine::CanStream(const std::string& url)
+{
+    char engineName[8] = {};
+    ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "download_engine", engineName, ARRAY_SIZE(engineName));
+
+    return strcmp(engineName, "file") == 0 || (strcmp(engineName, "curl") == 0 && !IsFileUrl(url));
+}
+
+/**
+ * @brief Creates a download that streams @p url straight into the installer, using the transport of the
+ * configured engine.
+ *
+ * @param url The file that will be streamed.
+ * @param algorithm Hash algorithm of the expected hash.
+ * @return std::unique_ptr<StreamingDownload> The download, or nullptr if the configured engine cannot stream.
+ */
+/*static*/
+std::unique_ptr<ADUC::StreamingDownload> DownloadEngine::CreateStreaming(const std::string& url, SHAversion algorithm)
+{
+    char engineName[8] = {};
+    char sourceFolder[PATH_MAX] = {};
+
+    ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "download_engine", engineName, ARRAY_SIZE(engineName));
+    ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "file_engine_folder", sourceFolder, ARRAY_SIZE(sourceFolder));
+
+    if (strcmp(engineName, "file") == 0)
+    {
+        const std::string sourcePath{ FileDownloadEngine::GetSourcePath(url, sourceFolder) };
+        if (sourcePath.empty())
+        {
+            Log_Error("Cannot map %s to a local file, set file_engine_folder", url.c_str());
+            return nullptr;
+        }
+
+        return std::unique_ptr<StreamingDownload>{ new StreamingDownload{
+            sourcePath, algorithm, c_streamingHoldBackSize } };
+    }
+
+    if (strcmp(engineName, "curl") == 0 && !IsFileUrl(url))
+    {
+        return std::unique_ptr<StreamingDownload>{ new StreamingDownload{
+            std::string{}, algorithm, c_streamingHoldBackSize } };
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Removes download state that engines keep across workflows and that was abandoned.
+ */
+/*static*/
+void DownloadEngine::RemoveStaleState()
+{
+    CurlDownloadEngine::RemoveStale(c_downloadJournalFolder, c_downloadJournalMaxAgeSeconds);
+}
@@ -0,0 +1,101 @@
+/**
+ * @file download_engine.hpp
+ * @brief Interface of the engines that transfer update files into the sandbox.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef DOWNLOAD_ENGINE_HPP
+#define DOWNLOAD_ENGINE_HPP
+
+#include <aduc/hash_utils.h>
+#include <aduc/result.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace ADUC
+{
+class StreamingDownload;
+
+/**
+ * @brief Transfers a single file and computes its hash on the way.
+ *
+ * An engine object is used for one file: Run() performs the transfer, IsValid() then checks the hash computed
+ * during the transfer. A failed IsValid() is not final; callers confirm it with a full pass over the file, as not
+ * every engine can observe the file strictly in order.
+ *
+ * Engines are selected with 'download_engine' in the agent config:
+ *   - "do"   Delivery Optimization (default).
+ *   - "curl" Native libcurl engine, resumable across restarts, with tunable buffer sizes.
+ *   - "file" Copies from a local folder, for offline benchmarks and tests.
+ * file:// URLs are only accepted by the file engine.
+ */
+class DownloadEngine
+{
+public:
+    /**
+     * @brief Called with the number of bytes transferred and the total size, or 0 if unknown.
+     * May be called often; callers are expected to throttle reporting.
+     */
+    using ProgressCallback = std::function<void(uint64_t bytesDownloaded, uint64_t bytesTotal)>;
+
+    virtual ~DownloadEngine() = default;
+
+    /**
+     * @brief Name of the engine, for logging.
+     */
+    virtual const char* Name() const = 0;
+
+    /**
+     * @brief Transfers @p url to @p targetPath.
+     *
+     * @param url The file to download.
+     * @param targetPath Where to put the file.
+     * @param cancellationRequested Aborts the transfer when set.
+     * @param progress Called while the transfer is in progress. May be empty.
+     * @return ADUC_Result A download result.
+     */
+    virtual ADUC_Result Run(
+        const std::string& url,
+        const std::string& targetPath,
+        std::atomic_bool& cancellationRequested,
+        const ProgressCallback& progress) = 0;
+
+    /**
+     * @brief Compares the hash computed during Run() to @p hashBase64. Can be called once.
+     */
+    virtual bool IsValid(const char* hashBase64) = 0;
+
+    /**
+     * @brief Transfers @p length bytes at @p offset of @p url again, into the same range of @p targetPath.
+     * Repairs chunks of a completed download that failed verification, see aduc/hash_chunks.h.
+     *
+     * @param url The file that was downloaded.
+     * @param targetPath The file Run() completed.
+     * @param offset Start of the range.
+     * @param length Length of the range.
+     * @param cancellationRequested Aborts the transfer when set.
+     * @return bool True if the range was written. Engines that cannot transfer ranges return false.
+     */
+    virtual bool FetchRange(
+        const std::string& /*url*/,
+        const std::string& /*targetPath*/,
+        uint64_t /*offset*/,
+        uint64_t /*length*/,
+        const std::atomic_bool& /*cancellationRequested*/)
+    {
+        return false;
+    }
+
+    static std::unique_ptr<DownloadEngine>
+    Create(const std::string& url, const std::string& downloadKey, SHAversion algorithm);
+    static bool CanStream(const std::string& url);
+    static std::unique_ptr<StreamingDownload> CreateStreaming(const std::string& url, SHAversion algorithm);
+    static void RemoveStaleState();
+};
+} // namespace ADUC
+
+#endif // DOWNLOAD_ENGINE_HPP
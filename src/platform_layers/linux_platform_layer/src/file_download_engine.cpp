@@ -0,0 +1,208 @@
+/**
+ * @file file_download_engine.cpp
+ * @brief Implements FileDownloadEngine.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "file_download_engine.hpp"
+
+#include <aduc/adu_core_exports.h>
+#include <aduc/logging.h>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using ADUC::FileDownloadEngine;
+
+FileDownloadEngine::FileDownloadEngine(std::string sourceFolder, SHAversion algorithm, size_t bufferSize) :
+    _sourceFolder{ std::move(sourceFolder) }, _bufferSize{ bufferSize }
+{
+    _hashed = ADUC_HashUtils_StreamInit(&_stream, algorithm);
+}
+
+/**
+ * @brief Maps @p url to a local path.
+ *
+ * @param url A file:// URL, or any URL whose last path segment names a file in @p sourceFolder.
+ * @param sourceFolder Folder to look up non-file URLs in.
+ * @return std::string The local path, or an empty string if @p url cannot be mapped.
+ */
+/*static*/
+std::string FileDownloadEngine::GetSourcePath(const std::string& url, const std::string& sourceFolder)
+{
+    const std::string fileScheme{ "file://" };
+    if (url.compare(0, fileScheme.size(), fileScheme) == 0)
+    {
+        return url.substr(fileScheme.size());
+    }
+
+    if (sourceFolder.empty())
+    {
+        return std::string{};
+    }
+
+    const std::string path{ url.substr(0, url.find_first_of("?#")) };
+    const size_t nameStart = path.find_last_of('/');
+    return sourceFolder + "/" + ((nameStart == std::string::npos) ? path : path.substr(nameStart + 1));
+}
+
+ADUC_Result FileDownloadEngine::Run(
+    const std::string& url,
+    const std::string& targetPath,
+    std::atomic_bool& cancellationRequested,
+    const ProgressCallback& progress)
+{
+    const std::string sourcePath{ GetSourcePath(url, _sourceFolder) };
+    if (sourcePath.empty())
+    {
+        Log_Error("Cannot map %s to a local file, set file_engine_folder", url.c_str());
+        return ADUC_Result{ ADUC_DownloadResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    }
+
+    ADUC_Result result{ ADUC_DownloadResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    std::vector<uint8_t> buffer(_bufferSize);
+    struct stat st
+    {
+    };
+    uint64_t copied = 0;
+
+    const int sourceFd = open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+    const int targetFd = open(targetPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (sourceFd == -1 || targetFd == -1 || fstat(sourceFd, &st) != 0)
+    {
+        Log_Error("Cannot copy %s to %s, errno %d", sourcePath.c_str(), targetPath.c_str(), errno);
+        result.ExtendedResultCode = MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno);
+        goto done;
+    }
+
+    for (;;)
+    {
+        if (cancellationRequested)
+        {
+            Log_Info("Download was cancelled");
+            result.ResultCode = ADUC_DownloadResult_Cancelled;
+            goto done;
+        }
+
+        const ssize_t readSize = read(sourceFd, buffer.data(), buffer.size());
+        if (readSize == 0)
+        {
+            break;
+        }
+
+        if (readSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            result.ExtendedResultCode = MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno);
+            goto done;
+        }
+
+        if (write(targetFd, buffer.data(), static_cast<size_t>(readSize)) != readSize)
+        {
+            result.ExtendedResultCode = MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno);
+            goto done;
+        }
+
+        if (_hashed && !ADUC_HashUtils_StreamUpdate(&_stream, buffer.data(), static_cast<size_t>(readSize)))
+        {
+            _hashed = false;
+        }
+
+        copied += static_cast<uint64_t>(readSize);
+        if (progress)
+        {
+            progress(copied, static_cast<uint64_t>(st.st_size));
+        }
+    }
+
+    result = ADUC_Result{ ADUC_DownloadResult_Success };
+
+done:
+    if (sourceFd != -1)
+    {
+        close(sourceFd);
+    }
+
+    if (targetFd != -1)
+    {
+        close(targetFd);
+    }
+
+    return result;
+}
+
+bool FileDownloadEngine::IsValid(const char* hashBase64)
+{
+    if (!_hashed)
+    {
+        return false;
+    }
+
+    _hashed = false;
+    return ADUC_HashUtils_StreamIsValid(&_stream, hashBase64);
+}
+
+/**
+ * @brief Copies a range of the source file into the same range of @p targetPath.
+ */
+bool FileDownloadEngine::FetchRange(
+    const std::string& url,
+    const std::string& targetPath,
+    uint64_t offset,
+    uint64_t length,
+    const std::atomic_bool& cancellationRequested)
+{
+    const std::string sourcePath{ GetSourcePath(url, _sourceFolder) };
+    std::vector<uint8_t> buffer(_bufferSize);
+    bool success = false;
+
+    const int sourceFd = sourcePath.empty() ? -1 : open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+    const int targetFd = open(targetPath.c_str(), O_WRONLY | O_CLOEXEC);
+    if (sourceFd == -1 || targetFd == -1)
+    {
+        Log_Error("Cannot copy range of %s to %s, errno %d", sourcePath.c_str(), targetPath.c_str(), errno);
+        goto done;
+    }
+
+    while (length > 0 && !cancellationRequested)
+    {
+        const size_t readSize = (length > buffer.size()) ? buffer.size() : static_cast<size_t>(length);
+        const ssize_t bytesRead = pread(sourceFd, buffer.data(), readSize, static_cast<off_t>(offset));
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytesRead <= 0
+            || pwrite(targetFd, buffer.data(), static_cast<size_t>(bytesRead), static_cast<off_t>(offset)) != bytesRead)
+        {
+            goto done;
+        }
+
+        offset += static_cast<uint64_t>(bytesRead);
+        length -= static_cast<uint64_t>(bytesRead);
+    }
+
+    success = (length == 0) && fdatasync(targetFd) == 0;
+
+done:
+    if (sourceFd != -1)
+    {
+        close(sourceFd);
+    }
+
+    if (targetFd != -1)
+    {
+        close(targetFd);
+    }
+
+    return success;
+}
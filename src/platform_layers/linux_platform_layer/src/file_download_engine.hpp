@@ -0,0 +1,58 @@
+/**
+ * @file file_download_engine.hpp
+ * @brief Download engine that copies update files from the local file system.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef FILE_DOWNLOAD_ENGINE_HPP
+#define FILE_DOWNLOAD_ENGINE_HPP
+
+#include "download_engine.hpp"
+
+#include <string>
+
+namespace ADUC
+{
+/**
+ * @brief Copies update files from a local path instead of the network.
+ *
+ * file:// URLs are opened directly. Any other URL is mapped to the file with the same name in the source folder,
+ * so a deployment can be replayed from a local mirror without a DO agent or network connection, e.g. to benchmark
+ * the rest of the download path.
+ */
+class FileDownloadEngine : public DownloadEngine
+{
+public:
+    FileDownloadEngine(std::string sourceFolder, SHAversion algorithm, size_t bufferSize);
+
+    const char* Name() const override
+    {
+        return "file";
+    }
+
+    ADUC_Result Run(
+        const std::string& url,
+        const std::string& targetPath,
+        std::atomic_bool& cancellationRequested,
+        const ProgressCallback& progress) override;
+
+    bool IsValid(const char* hashBase64) override;
+
+    bool FetchRange(
+        const std::string& url,
+        const std::string& targetPath,
+        uint64_t offset,
+        uint64_t length,
+        const std::atomic_bool& cancellationRequested) override;
+
+    static std::string GetSourcePath(const std::string& url, const std::string& sourceFolder);
+
+private:
+    std::string _sourceFolder;
+    size_t _bufferSize;
+    bool _hashed{ false };
+    ADUC_HashUtils_Stream _stream{};
+};
+} // namespace ADUC
+
+#endif // FILE_DOWNLOAD_ENGINE_HPP
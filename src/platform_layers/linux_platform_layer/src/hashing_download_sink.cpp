@@ -0,0 +1,150 @@
+/**
+ * @file hashing_download_sink.cpp
+ * @brief Implements HashingDownloadSink.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "hashing_download_sink.hpp"
+
+#include <aduc/logging.h>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+using ADUC::HashingDownloadSink;
+
+/**
+ * @brief Size of the reads used to catch up with the downloader.
+ */
+static const size_t c_catchUpReadSize = 64 * 1024;
+
+/**
+ * @brief Construct a sink for the file at @p filePath. The file does not need to exist yet.
+ *
+ * @param filePath Path of the file being downloaded.
+ * @param algorithm Hash algorithm to compute.
+ */
+HashingDownloadSink::HashingDownloadSink(std::string filePath, SHAversion algorithm) :
+    _filePath{ std::move(filePath) }, _buffer(c_catchUpReadSize)
+{
+    _healthy = ADUC_HashUtils_StreamInit(&_stream, algorithm);
+}
+
+HashingDownloadSink::~HashingDownloadSink()
+{
+    if (_fd != -1)
+    {
+        close(_fd);
+    }
+}
+
+/**
+ * @brief Feed a chunk of downloaded data, in file order, into the hash.
+ *
+ * @param data The chunk.
+ * @param size Size of @p data in bytes.
+ * @return bool False if hashing failed.
+ */
+bool HashingDownloadSink::Update(const uint8_t* data, size_t size)
+{
+    if (_healthy && !ADUC_HashUtils_StreamUpdate(&_stream, data, size))
+    {
+        _healthy = false;
+    }
+
+    return _healthy;
+}
+
+/**
+ * @brief Hash all bytes that were appended to the file since the last call.
+ *
+ * @return bool False if the file could not be read; the sink is no longer usable in that case.
+ */
+bool HashingDownloadSink::CatchUp()
+{
+    if (!_healthy)
+    {
+        return false;
+    }
+
+    if (_fd == -1)
+    {
+        _fd = open(_filePath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (_fd == -1)
+        {
+            // The downloader has not created the file yet.
+            return errno == ENOENT;
+        }
+    }
+
+    for (;;)
+    {
+        const ssize_t readSize = pread(_fd, _buffer.data(), _buffer.size(), static_cast<off_t>(BytesHashed()));
+        if (readSize == 0)
+        {
+            return true;
+        }
+
+        if (readSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            Log_Error("Cannot read %s while hashing, errno %d", _filePath.c_str(), errno);
+            _healthy = false;
+            return false;
+        }
+
+        if (!Update(_buffer.data(), static_cast<size_t>(readSize)))
+        {
+            return false;
+        }
+    }
+}
+
+/**
+ * @brief Checks that the file hashed so far is the one now at the file path, and not e.g. a file that the downloader
+ * replaced by renaming its own.
+ *
+ * @return bool True if the hashed file and the file at the path are the same inode.
+ */
+bool HashingDownloadSink::IsHashedFileAtPath() const
+{
+    struct stat hashed;
+    struct stat atPath;
+    if (_fd == -1 || fstat(_fd, &hashed) != 0 || stat(_filePath.c_str(), &atPath) != 0)
+    {
+        return false;
+    }
+
+    return hashed.st_dev == atPath.st_dev && hashed.st_ino == atPath.st_ino;
+}
+
+/**
+ * @brief Completes the hash and compares it to @p hashBase64. Call CatchUp() first if another process wrote the file.
+ *
+ * @param hashBase64 The expected hash.
+ * @return bool True if all bytes seen so far hash to @p hashBase64, and they were read from the file now at the path.
+ */
+bool HashingDownloadSink::IsValid(const char* hashBase64)
+{
+    if (!_healthy)
+    {
+        return false;
+    }
+
+    // The stream is finished by this call, so nothing can be added afterwards.
+    _healthy = false;
+    if (!IsHashedFileAtPath())
+    {
+        Log_Info("%s is not the file that was hashed while downloading", _filePath.c_str());
+        return false;
+    }
+
+    return ADUC_HashUtils_StreamIsValid(&_stream, hashBase64);
+}
@@ -0,0 +1,73 @@
+/**
+ * @file hashing_download_sink.hpp
+ * @brief Hashes downloaded content while it is being written, so it does not have to be re-read for validation.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef HASHING_DOWNLOAD_SINK_HPP
+#define HASHING_DOWNLOAD_SINK_HPP
+
+#include <aduc/hash_utils.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ADUC
+{
+/**
+ * @brief Keeps a running hash over a file that is being downloaded.
+ *
+ * The downloader (e.g. the DO agent) writes the file at @p filePath; CatchUp() hashes whatever was appended since
+ * the previous call, while those pages are still in the page cache. Once the download finished and a final CatchUp()
+ * reached the end of the file, IsValid() completes the verification without another pass over the file.
+ *
+ * The file must not exist when the download starts, as the sink hashes whatever it finds at @p filePath. IsValid()
+ * fails if the file hashed is no longer the one at @p filePath.
+ *
+ * Bytes are hashed in the order they appear in the file, so a downloader that writes pieces out of order or
+ * pre-allocates the file will produce a mismatch here. Callers must treat a mismatch as "unknown" and confirm it
+ * with ADUC_HashUtils_IsValidFileHash.
+ */
+class HashingDownloadSink
+{
+public:
+    HashingDownloadSink(std::string filePath, SHAversion algorithm);
+    ~HashingDownloadSink();
+
+    HashingDownloadSink(const HashingDownloadSink&) = delete;
+    HashingDownloadSink& operator=(const HashingDownloadSink&) = delete;
+    HashingDownloadSink(HashingDownloadSink&&) = delete;
+    HashingDownloadSink& operator=(HashingDownloadSink&&) = delete;
+
+    bool Update(const uint8_t* data, size_t size);
+    bool CatchUp();
+    bool IsValid(const char* hashBase64);
+    bool IsHashedFileAtPath() const;
+
+    /**
+     * @brief Number of bytes fed into the hash so far.
+     */
+    uint64_t BytesHashed() const
+    {
+        return _stream.BytesHashed;
+    }
+
+    /**
+     * @brief False once hashing failed, e.g. because the file could not be read. IsValid() then always fails.
+     */
+    bool IsHealthy() const
+    {
+        return _healthy;
+    }
+
+private:
+    std::string _filePath;
+    int _fd{ -1 };
+    bool _healthy{ false };
+    ADUC_HashUtils_Stream _stream{};
+    std::vector<uint8_t> _buffer;
+};
+} // namespace ADUC
+
+#endif // HASHING_DOWNLOAD_SINK_HPP
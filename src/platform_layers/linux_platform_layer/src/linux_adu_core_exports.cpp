@@ -6,11 +6,12 @@
  */
 #include "aduc/adu_core_exports.h"
 #include "aduc/c_utils.h"
+#include "aduc/content_handler_factory.hpp"
 #include "aduc/logging.h"
-#include "aduc/process_utils.hpp"
+#include "aduc/privileged_broker.hpp"
 #include "linux_adu_core_impl.hpp"
 #include <memory>
-#include <signal.h> // raise()
+#include <signal.h> // kill()
 #include <string>
 #include <sys/reboot.h> // reboot()
 #include <time.h>
@@ -28,6 +29,8 @@ ADUC_Result ADUC_Register(ADUC_RegisterData* data, unsigned int /*argc*/, const
 {
     try
     {
+        ContentHandlerFactory::LoadPlugins();
+
         std::unique_ptr<ADUC::LinuxPlatformLayer> pImpl{ ADUC::LinuxPlatformLayer::Create() };
         ADUC_Result result{ pImpl->SetRegisterData(data) };
         // The platform layer object is now owned by the RegisterData object.
@@ -100,21 +103,19 @@ int ADUC_RebootSystem()
     // Commit buffer cache to disk.
     sync();
 
-    std::string output;
-    std::vector<std::string> args{ "--reboot", "--no-wall" };
     //delay();
-    int exitStatus = ADUC_LaunchChildProcess("/sbin/reboot", args, output);
+    // The launcher logs the output of reboot.
+    int exitStatus = ADUC_PrivilegedBroker_Run(
+        ADUC_PrivilegedOperation::Reboot,
+        std::string{},
+        [](ADUC_ChildProcessStream /*stream*/, const std::string& /*line*/) {},
+        ADUC_ChildProcessOptions{});
 
     if (exitStatus != 0)
     {
         Log_Error("Reboot failed.");
     }
 
-    if (!output.empty())
-    {
-        Log_Info(output.c_str());
-    }
-
     return exitStatus;
 }
 
@@ -131,7 +132,9 @@ int ADUC_RestartAgent()
     sync();
 
     // Using SGIUSR1 to indicates a desire for shutdown and restart.
-    const int exitStatus = raise(SIGUSR1);
+    // Sent to the process rather than raised in this thread, as the main loop reads it from a signalfd. Every
+    // thread of the agent blocks it, as it is blocked before the first thread is started.
+    const int exitStatus = kill(getpid(), SIGUSR1);
     if (exitStatus != 0)
     {
         Log_Error("ADU Agent restart failed.");
@@ -5,32 +5,42 @@
  * @copyright Copyright (c) 2019, Microsoft Corporation.
  */
 #include "linux_adu_core_impl.hpp"
+#include "aduc/privileged_broker.hpp"
 #include "aduc/process_utils.hpp"
+#include "download_engine.hpp"
+#include "payload_cache.hpp"
+#include "streaming_download.hpp"
 #include <aduc/content_handler_factory.hpp>
+#include <aduc/hash_chunks.h>
 #include <aduc/hash_utils.h>
 #include <aduc/string_utils.hpp>
 #include <aduc/system_utils.h>
+#include <aduc/workflow_timing.h>
 #include <aduc/string_c_utils.h>
 
+#include <cctype>
+#include <cerrno>
+#include <csignal>
 #include <cstring>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <memory>
 #include <sstream>
 #include <system_error>
 #include <vector>
 
-#include <do_download.h>
-#include <do_exceptions.h>
-
 #include <fstream>
 #include <iostream>
 #include <filesystem>
 
-namespace MSDO = microsoft::deliveryoptimization;
-
+using ADUC::DownloadEngine;
 using ADUC::LinuxPlatformLayer;
+using ADUC::PayloadCache;
+using ADUC::StreamingDownload;
 
 /**
  * @brief Factory method for LinuxPlatformLayer
@@ -41,6 +51,14 @@ std::unique_ptr<LinuxPlatformLayer> LinuxPlatformLayer::Create()
     return std::unique_ptr<LinuxPlatformLayer>{ new LinuxPlatformLayer() };
 }
 
+/**
+ * @brief Cancels any running operation and waits for it to stop.
+ */
+LinuxPlatformLayer::~LinuxPlatformLayer()
+{
+    _IsCancellationRequested = true;
+}
+
 /**
  * @brief Set the ADUC_RegisterData object
  *
@@ -73,6 +91,16 @@ ADUC_Result LinuxPlatformLayer::SetRegisterData(ADUC_RegisterData* data)
     return ADUC_Result{ ADUC_RegisterResult_Success };
 }
 
+/**
+ * @brief Class implementation of DoWork method.
+ * Reports the results of operations that finished on the worker thread. Runs on the agent's main loop, so the
+ * workflow state is only changed from there.
+ */
+void LinuxPlatformLayer::DoWork(const char* /*workflowId*/)
+{
+    _workQueue.DeliverCompletions();
+}
+
 /**
  * @brief Class implementation of Idle method.
  */
@@ -80,6 +108,8 @@ void LinuxPlatformLayer::Idle(const char* workflowId)
 {
     Log_Info("Now idle. workflowId: %s", workflowId);
     _IsCancellationRequested = false;
+
+    ContentHandlerFactory::ReleaseWorkflows();
 }
 
 /**
@@ -100,15 +130,17 @@ ADUC_Result LinuxPlatformLayer::Prepare(const char* workflowId, const ADUC_Prepa
 
     ADUC_Result result{ ADUC_PrepareResult_Failure, ADUC_ERC_NOTRECOVERABLE };
 
-    _contentHandler = ContentHandlerFactory::Create(prepareInfo->updateType, ContentHandlerCreateData{});
+    const std::shared_ptr<ContentHandler> contentHandler{ ContentHandlerFactory::GetOrCreate(
+        workflowId, prepareInfo->updateType, ContentHandlerCreateData{}) };
+    SetContentHandler(contentHandler);
 
-    if (!_contentHandler)
+    if (!contentHandler)
     {
         Log_Error("Failed to create content handler for update type %s.", prepareInfo->updateType);
         return ADUC_Result{ ADUC_PrepareResult_Failure, ADUC_ERC_NOTRECOVERABLE };
     }
 
-    result = _contentHandler->Prepare(prepareInfo);
+    result = contentHandler->Prepare(prepareInfo);
     if (result.ResultCode == ADUC_PrepareResult_Failure)
     {
         Log_Error(
@@ -120,20 +152,392 @@ ADUC_Result LinuxPlatformLayer::Prepare(const char* workflowId, const ADUC_Prepa
     return result;
 }
 
+/**
+ * @brief Reads the maximum number of files to download at the same time from the config file.
+ *
+ * @return unsigned int The configured value, clamped to [1, c_maxDownloadConcurrency].
+ */
+static unsigned int GetDownloadConcurrency()
+{
+    const unsigned int c_defaultDownloadConcurrency = 2;
+    const unsigned int c_maxDownloadConcurrency = 8;
+
+    char value[12] = {};
+    unsigned int concurrency = c_defaultDownloadConcurrency;
+    if (ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "download_concurrency", value, ARRAY_SIZE(value)))
+    {
+        if (!atoui(value, &concurrency) || concurrency == 0)
+        {
+            Log_Warn("Invalid download_concurrency '%s', using %u", value, c_defaultDownloadConcurrency);
+            concurrency = c_defaultDownloadConcurrency;
+        }
+    }
+
+    return (concurrency > c_maxDownloadConcurrency) ? c_maxDownloadConcurrency : concurrency;
+}
+
+/**
+ * @brief Folder holding the payload cache.
+ */
+static const char* c_payloadCacheFolder = ADUC_DATA_FOLDER "/cache";
+
+/**
+ * @brief Creates the payload cache if 'payload_cache_size_mb' is set to a non-zero value in the config file.
+ *
+ * @return std::unique_ptr<PayloadCache> The cache, or nullptr if caching is disabled.
+ */
+static std::unique_ptr<PayloadCache> CreatePayloadCache()
+{
+    char value[12] = {};
+    unsigned int sizeMb = 0;
+    if (!ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "payload_cache_size_mb", value, ARRAY_SIZE(value))
+        || !atoui(value, &sizeMb) || sizeMb == 0)
+    {
+        return nullptr;
+    }
+
+    return std::unique_ptr<PayloadCache>{ new PayloadCache{ c_payloadCacheFolder,
+                                                            static_cast<uint64_t>(sizeMb) * 1024 * 1024 } };
+}
+
+/**
+ * @brief Reads from the config file whether the image is streamed into the installer instead of being staged
+ * in the work folder.
+ *
+ * @return bool True if 'streaming_install' is set to true.
+ */
+static bool IsStreamingInstallEnabled()
+{
+    char value[8] = {};
+    if (ReadDelimitedValueFromFile(ADUC_CONF_FILE_PATH, "streaming_install", value, ARRAY_SIZE(value)))
+    {
+        return strcmp(value, "true") == 0 || strcmp(value, "1") == 0;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Checks the file at @p path against every hash of @p entity, reading it only once.
+ * Hashes of unsupported types are skipped; the caller has checked that the first one is supported.
+ *
+ * @param path The downloaded file.
+ * @param entity The file entity listing the expected hashes.
+ * @param useVerifiedRecord Accept the file's verified-hash record instead of reading it, see hash_utils.
+ * @return bool True if all supported hashes match.
+ */
+static bool
+IsValidFileEntityHash(const std::string& path, const ADUC_FileEntity& entity, bool useVerifiedRecord = true)
+{
+    SHAversion algorithms[ADUC_HASH_UTILS_MAX_ALGORITHMS];
+    const char* hashes[ADUC_HASH_UTILS_MAX_ALGORITHMS];
+    size_t hashCount = 0;
+
+    for (size_t i = 0; i < entity.HashCount && hashCount < ADUC_HASH_UTILS_MAX_ALGORITHMS; ++i)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        const ADUC_Hash& hash = entity.Hash[i];
+        if (!ADUC_HashUtils_GetShaVersionForTypeString(hash.type, &algorithms[hashCount]))
+        {
+            Log_Warn("Ignoring unsupported hash type %s of %s", hash.type, entity.TargetFilename);
+            continue;
+        }
+
+        hashes[hashCount] = hash.value;
+        ++hashCount;
+    }
+
+    if (hashCount == 0)
+    {
+        return false;
+    }
+
+    const uint64_t startNs = ADUC_WorkflowTiming_Now();
+    const bool isValid = useVerifiedRecord
+                             ? ADUC_HashUtils_IsValidFileHashes(path.c_str(), hashes, algorithms, hashCount)
+                             : ADUC_HashUtils_IsValidFileHashesUncached(path.c_str(), hashes, algorithms, hashCount);
+    ADUC_WorkflowTiming_AddSpan("hash", startNs);
+    return isValid;
+}
+
+/**
+ * @brief Builds the key that names the journal and partial file of a download of @p entity.
+ * Files of an update with identical content are downloaded concurrently, so the key of the content alone is not
+ * unique; the file ID is added, keeping only characters that are safe in a file name.
+ *
+ * @param contentKey Key of the content, see PayloadCache::MakeKey().
+ * @param entity The file to download.
+ * @return std::string The key.
+ */
+static std::string MakeDownloadKey(const std::string& contentKey, const ADUC_FileEntity& entity)
+{
+    std::string key{ contentKey };
+    key += '.';
+    for (const char* c = entity.FileId; c != nullptr && *c != '\0'; ++c)
+    {
+        if (std::isalnum(static_cast<unsigned char>(*c)) || *c == '-' || *c == '_')
+        {
+            key += *c;
+        }
+    }
+
+    return key;
+}
+
+/**
+ * @brief Suffix that names the optional chunk manifest of another file of the update, see aduc/hash_chunks.h.
+ */
+static const char c_chunkManifestSuffix[] = ".chunks";
+
+/**
+ * @brief Finds the file of @p info whose target name is @p targetFilename.
+ *
+ * @return const ADUC_FileEntity* The file, or nullptr.
+ */
+static const ADUC_FileEntity* FindFileEntity(const ADUC_DownloadInfo* info, const std::string& targetFilename)
+{
+    for (unsigned int i = 0; i < info->FileCount; ++i)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        const ADUC_FileEntity& entity = info->Files[i];
+        if (targetFilename == entity.TargetFilename)
+        {
+            return &entity;
+        }
+    }
+
+    return nullptr;
+}
+
+/**
+ * @brief Checks whether @p entity is the chunk manifest of another file of the update.
+ * Such files are downloaded by DownloadFile() of the file they describe, before that file.
+ */
+static bool IsChunkManifestOfOtherFile(const ADUC_DownloadInfo* info, const ADUC_FileEntity& entity)
+{
+    const std::string name{ entity.TargetFilename };
+    const size_t suffixLength = sizeof(c_chunkManifestSuffix) - 1;
+
+    return name.size() > suffixLength
+           && name.compare(name.size() - suffixLength, suffixLength, c_chunkManifestSuffix) == 0
+           && FindFileEntity(info, name.substr(0, name.size() - suffixLength)) != nullptr;
+}
+
+/**
+ * @brief Verifies @p filePath against its chunk manifest on all cores and downloads corrupt chunks again.
+ *
+ * @param filePath The downloaded file.
+ * @param manifest Its chunk manifest.
+ * @param downloadUri Where the file was downloaded from.
+ * @param engine The engine that downloaded it.
+ * @param cancellationRequested Aborts the repair when set.
+ * @return bool True if the file matches the manifest, after repairs if needed.
+ */
+static bool VerifyAndRepairChunks(
+    const std::string& filePath,
+    const ADUC_HashUtils_ChunkManifest& manifest,
+    const char* downloadUri,
+    DownloadEngine& engine,
+    const std::atomic_bool& cancellationRequested)
+{
+    std::vector<bool> needsRefetch;
+    {
+        std::unique_ptr<bool[]> chunkIsValid{ new bool[manifest.ChunkCount + 1] };
+        if (ADUC_HashUtils_VerifyFileChunks(filePath.c_str(), &manifest, 0, chunkIsValid.get()))
+        {
+            return true;
+        }
+
+        needsRefetch.assign(manifest.ChunkCount, false);
+        for (size_t i = 0; i < manifest.ChunkCount; ++i)
+        {
+            needsRefetch[i] = !chunkIsValid[i];
+        }
+    }
+
+    // Drops excess bytes, or extends a short file so the missing chunks can be written in place.
+    if (truncate(filePath.c_str(), static_cast<off_t>(manifest.FileSize)) != 0)
+    {
+        return false;
+    }
+
+    const size_t refetchCount = static_cast<size_t>(std::count(needsRefetch.begin(), needsRefetch.end(), true));
+    Log_Info("Downloading %zu of %zu chunks of %s again", refetchCount, manifest.ChunkCount, filePath.c_str());
+
+    for (size_t i = 0; i < manifest.ChunkCount; ++i)
+    {
+        if (!needsRefetch[i])
+        {
+            continue;
+        }
+
+        const uint64_t offset = i * manifest.ChunkSize;
+        const uint64_t length = std::min(manifest.ChunkSize, manifest.FileSize - offset);
+        if (cancellationRequested || !engine.FetchRange(downloadUri, filePath, offset, length, cancellationRequested))
+        {
+            Log_Warn("Cannot download chunk %zu of %s again using the %s engine", i, filePath.c_str(), engine.Name());
+            return false;
+        }
+    }
+
+    return ADUC_HashUtils_VerifyFileChunks(filePath.c_str(), &manifest, 0, nullptr);
+}
+
 /**
  * @brief Class implementation of Download method.
+ * Downloads and validates all files of the update using a bounded pool of workers, then hands the
+ * first file to the content handler as the image to install. Additional files are kept in the work folder
+ * as sidecars.
+ *
+ * With streaming_install enabled, the image is not downloaded here but streamed into the installer by Install().
+ *
  * @return ADUC_Result
  */
 ADUC_Result LinuxPlatformLayer::Download(const char* workflowId, const char* updateType, const ADUC_DownloadInfo* info)
 {
     Log_Debug("Downloading %d files to %s", info->FileCount, info->WorkFolder);
 
+    if (info->FileCount == 0)
+    {
+        Log_Error("Update does not contain any file to download.");
+        return ADUC_Result{ ADUC_DownloadResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    }
+
+    // Only the full image FS-Update handler reads its image in a single sequential pass, and only engines that
+    // transfer in-process can stream.
+    _streamedImage.reset();
+    const bool streamImage = IsStreamingInstallEnabled() && strncmp(updateType, "fus/fsupdate:", 13) == 0
+                             && info->Files[0].HashCount > 0
+                             && DownloadEngine::CanStream(info->Files[0].DownloadUri);
+    if (streamImage)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        const ADUC_FileEntity& image = info->Files[0];
+        _streamedImage.reset(new StreamedImage{
+            image.DownloadUri, image.Hash[0].type, image.Hash[0].value, image.TargetFilename });
+
+        Log_Info("Image %s will be streamed into the installer", image.TargetFilename);
+    }
+
+    const unsigned int fileCount = info->FileCount;
+    const unsigned int firstFile = streamImage ? 1 : 0;
+    const unsigned int concurrency = std::max(std::min(GetDownloadConcurrency(), fileCount - firstFile), 1u);
+
+    std::vector<ADUC_Result> fileResults(
+        fileCount, ADUC_Result{ ADUC_DownloadResult_Failure, ADUC_ERC_NOTRECOVERABLE });
+    std::atomic_uint nextFile{ firstFile };
+    if (streamImage)
+    {
+        fileResults[0] = ADUC_Result{ ADUC_DownloadResult_Success };
+    }
+    std::atomic_bool downloadFailed{ false };
+
+    // Each worker takes the next pending file until all files are done or one of them failed.
+    // Files that are already in flight when another one fails are allowed to finish.
+    const auto worker = [&]() {
+        for (unsigned int index = nextFile++; index < fileCount && !downloadFailed; index = nextFile++)
+        {
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            if (IsChunkManifestOfOtherFile(info, info->Files[index]))
+            {
+                fileResults[index] = ADUC_Result{ ADUC_DownloadResult_Success };
+                continue;
+            }
+
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            fileResults[index] = DownloadFile(workflowId, info, info->Files[index]);
+            if (fileResults[index].ResultCode != ADUC_DownloadResult_Success)
+            {
+                downloadFailed = true;
+            }
+        }
+    };
+
+    Log_Info("Downloading %u files using %u workers", fileCount - firstFile, concurrency);
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < concurrency; ++i)
+    {
+        try
+        {
+            workers.emplace_back(worker);
+        }
+        catch (const std::system_error& e)
+        {
+            Log_Warn("Cannot start download worker, continuing with %zu: %s", workers.size() + 1, e.what());
+            break;
+        }
+    }
+
+    // The calling thread is a worker as well.
+    worker();
+
+    for (std::thread& thread : workers)
+    {
+        thread.join();
+    }
+
+    // Report the first file that did not succeed, preferring a failure over a cancellation.
+    ADUC_Result result{ ADUC_DownloadResult_Success };
+    for (const ADUC_Result& fileResult : fileResults)
+    {
+        if (fileResult.ResultCode == ADUC_DownloadResult_Failure)
+        {
+            result = fileResult;
+            break;
+        }
+
+        if (fileResult.ResultCode != ADUC_DownloadResult_Success && result.ResultCode == ADUC_DownloadResult_Success)
+        {
+            result = fileResult;
+        }
+    }
+
+    // Call into content handler
+    if (result.ResultCode == ADUC_DownloadResult_Success)
+    {
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        const ADUC_FileEntity& entity = info->Files[0];
+
+        // We create the content handler as part of the Download phase since this is the start of the rollout workflow
+        // and we need to call into the content handler for any additional downloads it may need.
+        char* typeName[12]; // fus/fsupdate
+        char* typeVersion[11]; // application or firmware
+        ADUC_ParseUpdateType(updateType, typeName, typeVersion);
+
+        const std::shared_ptr<ContentHandler> contentHandler{ ContentHandlerFactory::GetOrCreate(
+            workflowId,
+            updateType,
+            { info->WorkFolder, ADUC_LOG_FOLDER, entity.TargetFilename, entity.FileId, *typeVersion }) };
+        SetContentHandler(contentHandler);
+
+        result = contentHandler->Download();
+
+        Log_Info(
+            "Content Handler Download resultCode: %d, extendedCode: %d",
+            result.ResultCode,
+            result.ExtendedResultCode);
+    }
+
+    Log_Info("Download resultCode: %d, extendedCode: %d", result.ResultCode, result.ExtendedResultCode);
+    return result;
+}
+
+/**
+ * @brief Downloads a single file of the update into the work folder and validates its hash.
+ * Called concurrently from the download workers.
+ *
+ * @param workflowId The workflow ID.
+ * @param info The download info the file belongs to.
+ * @param entity The file to download.
+ * @return ADUC_Result
+ */
+ADUC_Result LinuxPlatformLayer::DownloadFile(
+    const char* workflowId, const ADUC_DownloadInfo* info, const ADUC_FileEntity& entity)
+{
     ADUC_Result_t resultCode = ADUC_DownloadResult_Failure;
     ADUC_Result_t extendedResultCode = ADUC_ERC_NOTRECOVERABLE;
 
-    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-    const ADUC_FileEntity& entity = info->Files[0];
-
     if (entity.HashCount == 0)
     {
         Log_Error("File entity does not contain a file hash! Cannot validate cancelling download.");
@@ -154,48 +558,120 @@ ADUC_Result LinuxPlatformLayer::Download(const char* workflowId, const char* upd
     std::stringstream fullFilePath;
     fullFilePath << info->WorkFolder << "/" << entity.TargetFilename;
 
-    Log_Info(
-        "Downloading File '%s' from '%s' to '%s'",
-        entity.TargetFilename,
-        entity.DownloadUri,
-        fullFilePath.str().c_str());
-
-    try
+    // The running hash of the transfer covers the first hash. Whenever the file is read in full, all of its
+    // hashes are checked in the same pass.
+    SHAversion algVersion;
+    if (!ADUC_HashUtils_GetShaVersionForTypeString(
+            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+            entity.Hash[0].type,
+            &algVersion))
     {
-        MSDO::download::download_url_to_path(
-            entity.DownloadUri, fullFilePath.str(), std::ref(_IsCancellationRequested));
+        // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+        Log_Error("FileEntity for %s has unsupported hash type %s", fullFilePath.str().c_str(), entity.Hash[0].type);
+        resultCode = ADUC_DownloadResult_Failure;
+        extendedResultCode = ADUC_ERC_VALIDATION_FILE_HASH_TYPE_NOT_SUPPORTED;
 
-        resultCode = ADUC_DownloadResult_Success;
+        info->NotifyDownloadProgress(workflowId, entity.FileId, ADUC_DownloadProgressState_Error, 0, 0);
+        return ADUC_Result{ resultCode, extendedResultCode };
     }
-    // Catch DO exception only to get extended result code. Other exceptions will be caught by CallResultMethodAndHandleExceptions
-    catch (const MSDO::exception& e)
-    {
-        const int32_t doErrorCode = e.error_code();
 
-        Log_Info("Caught DO exception, msg: %s, code: %d", e.what(), doErrorCode);
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    const char* expectedHash = entity.Hash[0].value;
+
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
+    const std::string cacheKey{ PayloadCache::MakeKey(entity.Hash[0].type, expectedHash) };
+    const std::unique_ptr<PayloadCache> payloadCache{ CreatePayloadCache() };
 
-        if (doErrorCode == static_cast<int32_t>(std::errc::operation_canceled))
+    if (payloadCache && payloadCache->Fetch(cacheKey, fullFilePath.str()))
+    {
+        // The cached file shares its inode with files of earlier sandboxes, whose owner, e.g. the downloader, can
+        // rewrite its content together with the verified-hash record. So it is read in full.
+        if (IsValidFileEntityHash(fullFilePath.str(), entity, false /*useVerifiedRecord*/))
         {
-            Log_Info("Download was cancelled");
-            info->NotifyDownloadProgress(workflowId, entity.FileId, ADUC_DownloadProgressState_Cancelled, 0, 0);
+            Log_Info("Using cached payload for %s, skipping download", entity.TargetFilename);
 
-            resultCode = ADUC_DownloadResult_Cancelled;
+            struct stat st
+            {
+            };
+            const off_t fileSize{ (stat(fullFilePath.str().c_str(), &st) == 0) ? st.st_size : 0 };
+            info->NotifyDownloadProgress(
+                workflowId, entity.FileId, ADUC_DownloadProgressState_Completed, fileSize, fileSize);
+            return ADUC_Result{ ADUC_DownloadResult_Success };
         }
-        else
+
+        Log_Warn("Cached payload for %s is corrupt, downloading it again", entity.TargetFilename);
+        payloadCache->Remove(cacheKey);
+        unlink(fullFilePath.str().c_str());
+    }
+
+    // A chunk manifest lets a corrupt download be verified on all cores and repaired chunk by chunk.
+    const auto freeChunkManifest = [](ADUC_HashUtils_ChunkManifest* manifest) {
+        ADUC_HashUtils_ChunkManifest_Uninit(manifest);
+        delete manifest;
+    };
+    std::unique_ptr<ADUC_HashUtils_ChunkManifest, decltype(freeChunkManifest)> chunkManifest{ nullptr,
+                                                                                              freeChunkManifest };
+    const ADUC_FileEntity* chunkManifestEntity{ FindFileEntity(
+        info, std::string{ entity.TargetFilename } + c_chunkManifestSuffix) };
+    if (chunkManifestEntity != nullptr)
+    {
+        const ADUC_Result manifestResult{ DownloadFile(workflowId, info, *chunkManifestEntity) };
+        if (manifestResult.ResultCode != ADUC_DownloadResult_Success)
         {
-            if (doErrorCode == static_cast<int32_t>(std::errc::timed_out))
-            {
-                Log_Error("Download failed due to DO timeout");
-            }
+            return manifestResult;
+        }
 
-            resultCode = ADUC_DownloadResult_Failure;
+        const std::string manifestPath{ std::string{ info->WorkFolder } + "/" + chunkManifestEntity->TargetFilename };
+        chunkManifest.reset(new ADUC_HashUtils_ChunkManifest{});
+        if (!ADUC_HashUtils_ChunkManifest_Load(manifestPath.c_str(), chunkManifest.get()))
+        {
+            Log_Warn("Ignoring unusable chunk manifest of %s", entity.TargetFilename);
+            chunkManifest.reset();
         }
+    }
 
-        extendedResultCode = MAKE_ADUC_DELIVERY_OPTIMIZATION_EXTENDEDRESULTCODE(doErrorCode);
+    const std::unique_ptr<DownloadEngine> engine{ DownloadEngine::Create(
+        entity.DownloadUri, MakeDownloadKey(cacheKey, entity), algVersion) };
+    if (!engine)
+    {
+        info->NotifyDownloadProgress(workflowId, entity.FileId, ADUC_DownloadProgressState_Error, 0, 0);
+        return ADUC_Result{ ADUC_DownloadResult_Failure, ADUC_ERC_NOTPERMITTED };
+    }
+
+    Log_Info(
+        "Downloading File '%s' from '%s' to '%s' using the %s engine",
+        entity.TargetFilename,
+        entity.DownloadUri,
+        fullFilePath.str().c_str(),
+        engine->Name());
+
+    try
+    {
+        auto lastReport = std::chrono::steady_clock::now();
+        const ADUC_Result transferResult{ engine->Run(
+            entity.DownloadUri,
+            fullFilePath.str(),
+            _IsCancellationRequested,
+            [&](uint64_t bytesDownloaded, uint64_t bytesTotal) {
+                const auto now = std::chrono::steady_clock::now();
+                if (now - lastReport >= std::chrono::seconds(1))
+                {
+                    lastReport = now;
+                    info->NotifyDownloadProgress(
+                        workflowId,
+                        entity.FileId,
+                        ADUC_DownloadProgressState_InProgress,
+                        bytesDownloaded,
+                        bytesTotal);
+                }
+            }) };
+
+        resultCode = transferResult.ResultCode;
+        extendedResultCode = transferResult.ExtendedResultCode;
     }
     catch (const std::exception& e)
     {
-        Log_Error("DO download failed with an unhandled std exception: %s", e.what());
+        Log_Error("Download failed with an unhandled std exception: %s", e.what());
 
         resultCode = ADUC_DownloadResult_Failure;
         if (errno != 0)
@@ -209,7 +685,7 @@ ADUC_Result LinuxPlatformLayer::Download(const char* workflowId, const char* upd
     }
     catch (...)
     {
-        Log_Error("DO download failed due to an unknown exception");
+        Log_Error("Download failed due to an unknown exception");
 
         resultCode = ADUC_DownloadResult_Failure;
 
@@ -226,33 +702,42 @@ ADUC_Result LinuxPlatformLayer::Download(const char* workflowId, const char* upd
     // If we downloaded successfully, validate the file hash.
     if (resultCode == ADUC_DownloadResult_Success)
     {
-        // TODO(Nic): 28241106 - Add crypto agility for hash validation
-        // Note: Currently we expect there to be only one hash, but
-        // support for multiple hashes is already built in.
         Log_Info("Validating file hash");
 
-        SHAversion algVersion;
-        if (!ADUC_HashUtils_GetShaVersionForTypeString(
-                // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-                entity.Hash[0].type,
-                &algVersion))
+        bool isValid = engine->IsValid(expectedHash);
+        bool allHashesChecked = entity.HashCount <= 1;
+        if (isValid)
         {
-            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-            Log_Error(
-                "FileEntity for %s has unsupported hash type %s", fullFilePath.str().c_str(), entity.Hash[0].type);
-            resultCode = ADUC_DownloadResult_Failure;
-            extendedResultCode = ADUC_ERC_VALIDATION_FILE_HASH_TYPE_NOT_SUPPORTED;
+            // Spares the next full validation, e.g. of the cached payload after a restart.
+            ADUC_HashUtils_RecordVerifiedFileHash(fullFilePath.str().c_str(), expectedHash, algVersion);
+        }
+        else if (chunkManifest)
+        {
+            // The running hash only sees the file in append order. The chunks confirm or pinpoint corruption in
+            // parallel, and only corrupt chunks are downloaded again.
+            Log_Info("Running hash of %s did not match, verifying its chunks", entity.TargetFilename);
 
-            info->NotifyDownloadProgress(
-                workflowId, entity.FileId, ADUC_DownloadProgressState_Error, resultCode, extendedResultCode);
-            return ADUC_Result{ resultCode, extendedResultCode };
+            isValid = VerifyAndRepairChunks(
+                fullFilePath.str(), *chunkManifest, entity.DownloadUri, *engine, _IsCancellationRequested);
+        }
+        else
+        {
+            // The running hash only sees the file in append order. Confirm with a full pass before failing, in case
+            // the downloader wrote it out of order or could not be followed.
+            Log_Info("Running hash of %s did not match, re-reading the file", entity.TargetFilename);
+
+            isValid = IsValidFileEntityHash(fullFilePath.str(), entity);
+            allHashesChecked = true;
+        }
+
+        if (isValid && !allHashesChecked)
+        {
+            // The running hash and the chunks only cover the first hash of the manifest, but all of them must match.
+            Log_Info("Validating the other hashes of %s", entity.TargetFilename);
+
+            isValid = IsValidFileEntityHash(fullFilePath.str(), entity);
         }
 
-        const bool isValid = ADUC_HashUtils_IsValidFileHash(
-            fullFilePath.str().c_str(),
-            // NOLINTNEXTLINE(cppcoreguidelines-pro-bounds-pointer-arithmetic)
-            entity.Hash[0].value,
-            algVersion);
         if (!isValid)
         {
             Log_Error("Hash for %s is not valid", entity.TargetFilename);
@@ -260,29 +745,14 @@ ADUC_Result LinuxPlatformLayer::Download(const char* workflowId, const char* upd
             resultCode = ADUC_DownloadResult_Failure;
             extendedResultCode = ADUC_ERC_VALIDATION_FILE_HASH_INVALID_HASH;
 
-            info->NotifyDownloadProgress(
-                workflowId, entity.FileId, ADUC_DownloadProgressState_Error, resultCode, extendedResultCode);
+            info->NotifyDownloadProgress(workflowId, entity.FileId, ADUC_DownloadProgressState_Error, 0, 0);
             return ADUC_Result{ resultCode, extendedResultCode };
         }
-    }
 
-    // Call into content handler
-    if (resultCode == ADUC_DownloadResult_Success)
-    {
-        // We create the content handler as part of the Download phase since this is the start of the rollout workflow
-        // and we need to call into the content handler for any additional downloads it may need.
-        char* typeName[12]; // fus/fsupdate
-        char* typeVersion[11]; // application or firmware
-        ADUC_ParseUpdateType(updateType, typeName, typeVersion);
-
-        _contentHandler = ContentHandlerFactory::Create(
-            updateType, { info->WorkFolder, ADUC_LOG_FOLDER, entity.TargetFilename, entity.FileId, *typeVersion });
-
-        const ADUC_Result contentHandlerResult{ _contentHandler->Download() };
-        resultCode = contentHandlerResult.ResultCode;
-        extendedResultCode = contentHandlerResult.ExtendedResultCode;
-
-        Log_Info("Content Handler Download resultCode: %d, extendedCode: %d", resultCode, extendedResultCode);
+        if (payloadCache)
+        {
+            payloadCache->Insert(cacheKey, fullFilePath.str());
+        }
     }
 
     // Report progress.
@@ -307,7 +777,8 @@ ADUC_Result LinuxPlatformLayer::Download(const char* workflowId, const char* upd
             fileSize);
     }
 
-    Log_Info("Download resultCode: %d, extendedCode: %d", resultCode, extendedResultCode);
+    Log_Info(
+        "Download of %s resultCode: %d, extendedCode: %d", entity.TargetFilename, resultCode, extendedResultCode);
     return ADUC_Result{ resultCode, extendedResultCode };
 }
 
@@ -315,13 +786,14 @@ ADUC_Result LinuxPlatformLayer::Download(const char* workflowId, const char* upd
  * @brief Class implementation of Install method.
  * @return ADUC_Result
  */
-ADUC_Result LinuxPlatformLayer::Install(const char* workflowId, const ADUC_InstallInfo* /*info*/)
+ADUC_Result LinuxPlatformLayer::Install(const char* workflowId, const ADUC_InstallInfo* info)
 {
-    ADUC_Result result{ _contentHandler->Install() };
+    const std::shared_ptr<ContentHandler> contentHandler{ GetContentHandler() };
+    ADUC_Result result{ _streamedImage ? InstallStreamed(workflowId, info) : contentHandler->Install() };
     if (_IsCancellationRequested)
     {
         Log_Info("Cancellation requested. Cancelling install. workflowId: %s", workflowId);
-        result = _contentHandler->Cancel();
+        result = contentHandler->Cancel();
         if (IsAducResultCodeSuccess(result.ResultCode))
         {
             result = ADUC_Result{ ADUC_InstallResult_Cancelled };
@@ -335,17 +807,100 @@ ADUC_Result LinuxPlatformLayer::Install(const char* workflowId, const ADUC_Insta
     return result;
 }
 
+/**
+ * @brief Installs the image while it is being downloaded.
+ * The image is passed to the content handler as a FIFO in the work folder. A producer thread downloads it into the
+ * FIFO and withholds the end of the image until its hash is verified. If the download or the verification fails,
+ * the content handler is cancelled, which kills the installer before it ever sees a complete image.
+ *
+ * @return ADUC_Result
+ */
+ADUC_Result LinuxPlatformLayer::InstallStreamed(const char* workflowId, const ADUC_InstallInfo* info)
+{
+    SHAversion algorithm;
+    if (!ADUC_HashUtils_GetShaVersionForTypeString(_streamedImage->HashType.c_str(), &algorithm))
+    {
+        Log_Error("Image has unsupported hash type %s", _streamedImage->HashType.c_str());
+        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_VALIDATION_FILE_HASH_TYPE_NOT_SUPPORTED };
+    }
+
+    std::unique_ptr<StreamingDownload> download{ DownloadEngine::CreateStreaming(
+        _streamedImage->DownloadUri, algorithm) };
+    if (!download)
+    {
+        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    }
+
+    const std::string fifoPath{ std::string{ info->WorkFolder } + "/" + _streamedImage->TargetFilename };
+    unlink(fifoPath.c_str());
+    if (mkfifo(fifoPath.c_str(), S_IRUSR | S_IWUSR) != 0)
+    {
+        Log_Error("Cannot create %s, errno %d", fifoPath.c_str(), errno);
+        return ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+    }
+
+    Log_Info(
+        "{%s} Streaming %s into the installer through %s",
+        workflowId,
+        _streamedImage->DownloadUri.c_str(),
+        fifoPath.c_str());
+
+    const std::shared_ptr<ContentHandler> contentHandler{ GetContentHandler() };
+    std::atomic_bool installDone{ false };
+    ADUC_Result streamResult{ ADUC_InstallResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    std::thread producer{ [&]() {
+        // Report an installer that exits early as EPIPE rather than being killed by SIGPIPE.
+        sigset_t pipeSignal;
+        sigemptyset(&pipeSignal);
+        sigaddset(&pipeSignal, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &pipeSignal, nullptr);
+
+        streamResult = download->Run(
+            _streamedImage->DownloadUri,
+            fifoPath,
+            _streamedImage->Hash.c_str(),
+            _IsCancellationRequested,
+            installDone);
+        if (IsAducResultCodeFailure(streamResult.ResultCode))
+        {
+            // The FIFO stays open until the installer is gone, so it cannot finish with a partial image.
+            contentHandler->Cancel();
+        }
+    } };
+
+    ADUC_Result result{ contentHandler->Install() };
+
+    installDone = true;
+    producer.join();
+    download.reset();
+    unlink(fifoPath.c_str());
+
+    // Keep the installer's own error if it stopped reading the image, the stream only failed as a consequence.
+    const bool installerFailedFirst = IsAducResultCodeFailure(result.ResultCode)
+                                      && (streamResult.ExtendedResultCode == MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(EPIPE)
+                                          || streamResult.ExtendedResultCode
+                                                 == MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(ECANCELED));
+    if (IsAducResultCodeFailure(streamResult.ResultCode) && !installerFailedFirst)
+    {
+        Log_Error("Streaming the image failed, extendedCode: %d", streamResult.ExtendedResultCode);
+        result = ADUC_Result{ ADUC_InstallResult_Failure, streamResult.ExtendedResultCode };
+    }
+
+    return result;
+}
+
 /**
  * @brief Class implementation of Apply method.
  * @return ADUC_Result
  */
 ADUC_Result LinuxPlatformLayer::Apply(const char* workflowId, const ADUC_ApplyInfo* /*info*/)
 {
-    ADUC_Result result{ _contentHandler->Apply() };
+    const std::shared_ptr<ContentHandler> contentHandler{ GetContentHandler() };
+    ADUC_Result result{ contentHandler->Apply() };
     if (_IsCancellationRequested)
     {
         Log_Info("Cancellation requested. Cancelling apply. workflowId: %s", workflowId);
-        result = _contentHandler->Cancel();
+        result = contentHandler->Cancel();
         if (IsAducResultCodeSuccess(result.ResultCode))
         {
             result = ADUC_Result{ ADUC_ApplyResult_Cancelled };
@@ -359,6 +914,24 @@ ADUC_Result LinuxPlatformLayer::Apply(const char* workflowId, const ADUC_ApplyIn
     return result;
 }
 
+/**
+ * @brief Returns the content handler of the current workflow, or nullptr if there is none yet.
+ */
+std::shared_ptr<ContentHandler> LinuxPlatformLayer::GetContentHandler()
+{
+    std::lock_guard<std::mutex> lock{ _contentHandlerMutex };
+    return _contentHandler;
+}
+
+/**
+ * @brief Replaces the content handler of the current workflow.
+ */
+void LinuxPlatformLayer::SetContentHandler(std::shared_ptr<ContentHandler> contentHandler)
+{
+    std::lock_guard<std::mutex> lock{ _contentHandlerMutex };
+    _contentHandler = std::move(contentHandler);
+}
+
 /**
  * @brief Class implementation of Cancel method.
  */
@@ -366,6 +939,14 @@ void LinuxPlatformLayer::Cancel(const char* workflowId)
 {
     Log_Info("Cancelling. workflowId: %s", workflowId);
     _IsCancellationRequested = true;
+
+    // Stop a running install right away instead of when it is done. The worker thread may replace the content
+    // handler meanwhile, so take a reference under the lock; its Cancel may be called while Install runs.
+    const std::shared_ptr<ContentHandler> contentHandler{ GetContentHandler() };
+    if (contentHandler)
+    {
+        contentHandler->Cancel();
+    }
 }
 
 /**
@@ -383,7 +964,8 @@ LinuxPlatformLayer::IsInstalled(const char* workflowId, const char* updateType,
 
     // If we don't currently have a content handler, create one that will get replaced once
     // we are in a deployment.
-    if (!_contentHandler)
+    std::shared_ptr<ContentHandler> contentHandler{ GetContentHandler() };
+    if (!contentHandler)
     {
         try
         {
@@ -391,7 +973,9 @@ LinuxPlatformLayer::IsInstalled(const char* workflowId, const char* updateType,
             char* typeVersion[11]; // application or firmware
             ADUC_ParseUpdateType(updateType, typeName, typeVersion);
 
-            _contentHandler = ContentHandlerFactory::Create(updateType, { *typeVersion });
+            contentHandler = ContentHandlerFactory::GetOrCreate(
+                workflowId != nullptr ? workflowId : "", updateType, ContentHandlerCreateData{ *typeVersion });
+            SetContentHandler(contentHandler);
 
             // _contentHandler = ContentHandlerFactory::Create(updateType, ContentHandlerCreateData{});
         }
@@ -411,7 +995,7 @@ LinuxPlatformLayer::IsInstalled(const char* workflowId, const char* updateType,
         }
     }
 
-    return _contentHandler->IsInstalled(installedCriteria);
+    return contentHandler->IsInstalled(installedCriteria);
 }
 
 /**
@@ -429,11 +1013,14 @@ LinuxPlatformLayer::GetUpdateRebootState(const char* workflowId, const char* upd
 
     // If we don't currently have a content handler, create one that will get replaced once
     // we are in a deployment.
-    if (!_contentHandler)
+    std::shared_ptr<ContentHandler> contentHandler{ GetContentHandler() };
+    if (!contentHandler)
     {
         try
         {
-            _contentHandler = ContentHandlerFactory::Create(updateType, ContentHandlerCreateData{});
+            contentHandler = ContentHandlerFactory::GetOrCreate(
+                workflowId != nullptr ? workflowId : "", updateType, ContentHandlerCreateData{});
+            SetContentHandler(contentHandler);
         }
         catch (const ADUC::Exception& e)
         {
@@ -451,9 +1038,14 @@ LinuxPlatformLayer::GetUpdateRebootState(const char* workflowId, const char* upd
         }
     }
 
-    return _contentHandler->GetUpdateRebootState();
+    return contentHandler->GetUpdateRebootState();
 }
 
+/**
+ * @brief Longest time a restart of the DO agent may take before systemctl is stopped.
+ */
+static const std::chrono::seconds c_systemctlTimeout{ 120 };
+
 ADUC_Result LinuxPlatformLayer::SandboxCreate(const char* workflowId, char** workFolder)
 {
     *workFolder = nullptr;
@@ -492,6 +1084,9 @@ ADUC_Result LinuxPlatformLayer::SandboxCreate(const char* workflowId, char** wor
         }
     }
 
+    // Partial downloads are kept outside of the sandbox so they can be resumed, only drop abandoned ones.
+    DownloadEngine::RemoveStaleState();
+
     /**
      * If there was a sandbox folder that had to be deleted, we also have to restart
      * the do-agent service, otherwise do-agent will crash with an out_of_memory error
@@ -499,19 +1094,20 @@ ADUC_Result LinuxPlatformLayer::SandboxCreate(const char* workflowId, char** wor
     */
     if (restartDoAgent == true)
     {
-        std::vector<std::string> args{ "restart", "deliveryoptimization-agent.service" };
-        std::string output;
-        int exitStatus = ADUC_LaunchChildProcess("/bin/systemctl", args, output);
+        ADUC_ChildProcessOptions options;
+        options.Timeout = c_systemctlTimeout;
+
+        // The launcher logs the output of systemctl.
+        int exitStatus = ADUC_PrivilegedBroker_Run(
+            ADUC_PrivilegedOperation::RestartDeliveryOptimization,
+            std::string{},
+            [](ADUC_ChildProcessStream /*stream*/, const std::string& /*line*/) {},
+            options);
 
         if (exitStatus != 0)
         {
             Log_Error("DO-Agent restared failed.");
         }
-
-        if (!output.empty())
-        {
-            Log_Info(output.c_str());
-        }
     }
 
     // Create the sandbox folder with ownership as the same as this process.
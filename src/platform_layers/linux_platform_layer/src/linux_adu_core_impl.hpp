@@ -9,6 +9,9 @@
 
 #include <atomic>
 #include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <thread>
 
 #include <aduc/adu_core_exports.h>
@@ -19,6 +22,8 @@
 #include <aduc/content_handler.hpp>
 #include <aduc/content_handler_factory.hpp>
 
+#include "work_queue.hpp"
+
 namespace ADUC
 {
 /**
@@ -29,6 +34,13 @@ class LinuxPlatformLayer
 public:
     static std::unique_ptr<LinuxPlatformLayer> Create();
 
+    ~LinuxPlatformLayer();
+
+    LinuxPlatformLayer(const LinuxPlatformLayer&) = delete;
+    LinuxPlatformLayer& operator=(const LinuxPlatformLayer&) = delete;
+    LinuxPlatformLayer(LinuxPlatformLayer&&) = delete;
+    LinuxPlatformLayer& operator=(LinuxPlatformLayer&&) = delete;
+
     ADUC_Result SetRegisterData(ADUC_RegisterData* data);
 
 private:
@@ -66,24 +78,19 @@ private:
     {
         try
         {
-            Log_Info("Download thread started");
+            Log_Info("Queueing download");
 
             // Pointers passed to this method are guaranteed to be valid until WorkCompletionCallback is called.
-            std::thread worker{ [token, workflowId, updateType, workCompletionData, info] {
-                const ADUC_Result result{ ADUC::ExceptionUtils::CallResultMethodAndHandleExceptions(
-                    ADUC_DownloadResult_Failure,
-                    [&token, &workflowId, &updateType, &workCompletionData, &info]() -> ADUC_Result {
-                        return static_cast<LinuxPlatformLayer*>(token)->Download(workflowId, updateType, info);
-                    }) };
-
-                // Report result to main thread.
-                workCompletionData->WorkCompletionCallback(workCompletionData->WorkCompletionToken, result);
-            } };
-
-            // Allow the thread to work independently of this main thread.
-            worker.detach();
-
-            // Indicate that we've spun off a thread to do the actual work.
+            static_cast<LinuxPlatformLayer*>(token)->_workQueue.Post(
+                [token, workflowId, updateType, info] {
+                    return ADUC::ExceptionUtils::CallResultMethodAndHandleExceptions(
+                        ADUC_DownloadResult_Failure, [&token, &workflowId, &updateType, &info]() -> ADUC_Result {
+                            return static_cast<LinuxPlatformLayer*>(token)->Download(workflowId, updateType, info);
+                        });
+                },
+                workCompletionData);
+
+            // Indicate that the worker thread does the actual work, the result is reported from DoWork.
             return ADUC_Result{ ADUC_DownloadResult_InProgress };
         }
         catch (const ADUC::Exception& e)
@@ -118,23 +125,19 @@ private:
     {
         try
         {
-            Log_Info("Install thread started");
+            Log_Info("Queueing install");
 
             // Pointers passed to this method are guaranteed to be valid until WorkCompletionCallback is called.
-            std::thread worker{ [token, workflowId, workCompletionData, info] {
-                const ADUC_Result result{ ADUC::ExceptionUtils::CallResultMethodAndHandleExceptions(
-                    ADUC_InstallResult_Failure, [&token, &workflowId, &workCompletionData, &info]() -> ADUC_Result {
-                        return static_cast<LinuxPlatformLayer*>(token)->Install(workflowId, info);
-                    }) };
-
-                // Report result to main thread.
-                workCompletionData->WorkCompletionCallback(workCompletionData->WorkCompletionToken, result);
-            } };
-
-            // Allow the thread to work independently of this main thread.
-            worker.detach();
-
-            // Indicate that we've spun off a thread to do the actual work.
+            static_cast<LinuxPlatformLayer*>(token)->_workQueue.Post(
+                [token, workflowId, info] {
+                    return ADUC::ExceptionUtils::CallResultMethodAndHandleExceptions(
+                        ADUC_InstallResult_Failure, [&token, &workflowId, &info]() -> ADUC_Result {
+                            return static_cast<LinuxPlatformLayer*>(token)->Install(workflowId, info);
+                        });
+                },
+                workCompletionData);
+
+            // Indicate that the worker thread does the actual work, the result is reported from DoWork.
             return ADUC_Result{ ADUC_InstallResult_InProgress };
         }
         catch (const ADUC::Exception& e)
@@ -169,22 +172,19 @@ private:
     {
         try
         {
-            Log_Info("Apply thread started");
+            Log_Info("Queueing apply");
 
             // Pointers passed to this method are guaranteed to be valid until WorkCompletionCallback is called.
-            std::thread worker{ [token, workflowId, workCompletionData, info] {
-                const ADUC_Result result{ ADUC::ExceptionUtils::CallResultMethodAndHandleExceptions(
-                    ADUC_ApplyResult_Failure, [&token, &workflowId, &workCompletionData, &info]() -> ADUC_Result {
-                        return static_cast<LinuxPlatformLayer*>(token)->Apply(workflowId, info);
-                    }) };
-                // Report result to main thread.
-                workCompletionData->WorkCompletionCallback(workCompletionData->WorkCompletionToken, result);
-            } };
-
-            // Allow the thread to work independently of this main thread.
-            worker.detach();
-
-            // Indicate that we've spun off a thread to do the actual work.
+            static_cast<LinuxPlatformLayer*>(token)->_workQueue.Post(
+                [token, workflowId, info] {
+                    return ADUC::ExceptionUtils::CallResultMethodAndHandleExceptions(
+                        ADUC_ApplyResult_Failure, [&token, &workflowId, &info]() -> ADUC_Result {
+                            return static_cast<LinuxPlatformLayer*>(token)->Apply(workflowId, info);
+                        });
+                },
+                workCompletionData);
+
+            // Indicate that the worker thread does the actual work, the result is reported from DoWork.
             return ADUC_Result{ ADUC_ApplyResult_InProgress };
         }
         catch (const ADUC::Exception& e)
@@ -294,15 +294,15 @@ private:
 
     /**
      * @brief Implements DoWork callback.
+     * Called regularly from the agent's main loop, reports the results of finished operations.
      *
      * @param token Opaque token.
      * @param workflowId Current workflow identifier.
      */
     static void DoWorkCallback(ADUC_Token token, const char* workflowId) noexcept
     {
-        // Not used in this code.
-        UNREFERENCED_PARAMETER(token);
-        UNREFERENCED_PARAMETER(workflowId);
+        ADUC::ExceptionUtils::CallVoidMethodAndHandleExceptions(
+            [&token, &workflowId]() -> void { static_cast<LinuxPlatformLayer*>(token)->DoWork(workflowId); });
     }
 
     //
@@ -314,9 +314,12 @@ private:
 
     void Idle(const char* workflowId);
     ADUC_Result Download(const char* workflowId, const char* updateType, const ADUC_DownloadInfo* info);
+    ADUC_Result DownloadFile(const char* workflowId, const ADUC_DownloadInfo* info, const ADUC_FileEntity& entity);
     ADUC_Result Install(const char* workflowId, const ADUC_InstallInfo* info);
+    ADUC_Result InstallStreamed(const char* workflowId, const ADUC_InstallInfo* info);
     ADUC_Result Apply(const char* workflowId, const ADUC_ApplyInfo* info);
     void Cancel(const char* workflowId);
+    void DoWork(const char* workflowId);
 
     ADUC_Result IsInstalled(const char* workflowId, const char* updateType, const char* installedCriteria);
     ADUC_Result GetUpdateRebootState(const char* workflowId, const char* updateType, const char* installedCriteria);
@@ -347,12 +350,40 @@ private:
      */
     ADUC_Result Prepare(const char* workflowId, const ADUC_PrepareInfo* prepareInfo);
 
+    std::shared_ptr<ContentHandler> GetContentHandler();
+    void SetContentHandler(std::shared_ptr<ContentHandler> contentHandler);
+
     /**
      * @brief Was Cancel called?
      */
     std::atomic_bool _IsCancellationRequested{ false };
 
-    std::unique_ptr<ContentHandler> _contentHandler;
+    /**
+     * @brief Handler of the current workflow, owned together with the ContentHandlerFactory cache.
+     * Replaced by the worker thread and read by Cancel on the main thread, so only accessed under
+     * _contentHandlerMutex, see GetContentHandler and SetContentHandler.
+     */
+    std::shared_ptr<ContentHandler> _contentHandler;
+    std::mutex _contentHandlerMutex;
+
+    /**
+     * @brief The image that Download() left to be streamed into the installer by Install().
+     */
+    struct StreamedImage
+    {
+        std::string DownloadUri;
+        std::string HashType;
+        std::string Hash;
+        std::string TargetFilename;
+    };
+
+    std::unique_ptr<StreamedImage> _streamedImage;
+
+    /**
+     * @brief Runs Download, Install and Apply. Declared last so it is destroyed, and its thread joined, before
+     * the state the operations use.
+     */
+    WorkQueue _workQueue;
 };
 } // namespace ADUC
 
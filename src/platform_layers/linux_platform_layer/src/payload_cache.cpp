@@ -0,0 +1,277 @@
+/**
+ * @file payload_cache.cpp
+ * @brief Implements PayloadCache.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "payload_cache.hpp"
+
+#include <aduc/logging.h>
+#include <aduc/system_utils.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <filesystem>
+#include <linux/fs.h>
+#include <mutex>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using ADUC::PayloadCache;
+
+/**
+ * @brief Serializes changes to the cache folder between concurrent downloads.
+ */
+static std::mutex s_cacheMutex;
+
+/**
+ * @brief Sets the access time of @p path, the LRU timestamp of a cache entry, to now.
+ * The modification time is left alone, as it is part of the verified-hash record of the file, and entries share
+ * their inode with the sandbox file.
+ */
+static void MarkUsed(const std::string& path)
+{
+    const struct timespec times[2] = { { 0, UTIME_NOW }, { 0, UTIME_OMIT } };
+    utimensat(AT_FDCWD, path.c_str(), times, 0);
+}
+
+/**
+ * @brief Makes @p targetPath refer to the same content as @p sourcePath.
+ * Tries a hardlink first, then a reflink, and copies the file if neither is supported.
+ *
+ * @return bool True on success.
+ */
+static bool ShareFile(const std::string& sourcePath, const std::string& targetPath)
+{
+    unlink(targetPath.c_str());
+
+    if (link(sourcePath.c_str(), targetPath.c_str()) == 0)
+    {
+        return true;
+    }
+
+    const int sourceFd = open(sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd == -1)
+    {
+        return false;
+    }
+
+    const int targetFd = open(targetPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (targetFd == -1)
+    {
+        close(sourceFd);
+        return false;
+    }
+
+    const bool cloned = ioctl(targetFd, FICLONE, sourceFd) == 0;
+    close(targetFd);
+    close(sourceFd);
+
+    if (cloned)
+    {
+        return true;
+    }
+
+    std::error_code ec;
+    std::filesystem::copy_file(sourcePath, targetPath, std::filesystem::copy_options::overwrite_existing, ec);
+    if (ec)
+    {
+        Log_Error("Cannot copy %s to %s: %s", sourcePath.c_str(), targetPath.c_str(), ec.message().c_str());
+        unlink(targetPath.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Construct a cache in @p cacheFolder.
+ *
+ * @param cacheFolder Folder holding the cached payloads. Created on first insert.
+ * @param maxSizeBytes Total size the cache may grow to.
+ */
+PayloadCache::PayloadCache(std::string cacheFolder, uint64_t maxSizeBytes) :
+    _cacheFolder{ std::move(cacheFolder) }, _maxSizeBytes{ maxSizeBytes }
+{
+}
+
+/**
+ * @brief Builds a cache key from a file hash of the update manifest.
+ *
+ * @param hashType The hash algorithm name from the update manifest.
+ * @param hashBase64 The expected hash of the file.
+ * @return std::string The key, only containing characters that are safe in a file name.
+ */
+/*static*/
+std::string PayloadCache::MakeKey(const char* hashType, const char* hashBase64)
+{
+    std::string key{ hashType };
+    key += '-';
+    for (const char* c = hashBase64; *c != '\0'; ++c)
+    {
+        if (std::isalnum(static_cast<unsigned char>(*c)))
+        {
+            key += *c;
+        }
+        else if (*c == '+')
+        {
+            key += '-';
+        }
+        else if (*c == '/')
+        {
+            key += '_';
+        }
+    }
+
+    return key;
+}
+
+/**
+ * @brief Places the cached payload for @p key at @p targetPath and marks it as recently used.
+ * The caller must still validate the file by reading it, as the cache is not protected against modification,
+ * not even by the verified-hash record of the file.
+ *
+ * @param key Key of the payload, see MakeKey().
+ * @param targetPath Where to put the payload.
+ * @return bool True on a cache hit.
+ */
+bool PayloadCache::Fetch(const std::string& key, const std::string& targetPath) const
+{
+    const std::string entryPath{ _cacheFolder + "/" + key };
+
+    std::lock_guard<std::mutex> lock{ s_cacheMutex };
+
+    struct stat st
+    {
+    };
+    if (stat(entryPath.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return false;
+    }
+
+    if (!ShareFile(entryPath, targetPath))
+    {
+        return false;
+    }
+
+    MarkUsed(entryPath);
+    return true;
+}
+
+/**
+ * @brief Adds the verified payload at @p sourcePath to the cache, then evicts old entries to stay within the
+ * size limit.
+ *
+ * @param key Key of the payload, see MakeKey().
+ * @param sourcePath The payload.
+ * @return bool True if the payload was added.
+ */
+bool PayloadCache::Insert(const std::string& key, const std::string& sourcePath) const
+{
+    const std::string entryPath{ _cacheFolder + "/" + key };
+    const std::string tempPath{ entryPath + ".tmp" };
+
+    struct stat st
+    {
+    };
+    if (stat(sourcePath.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) > _maxSizeBytes)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock{ s_cacheMutex };
+
+    if (ADUC_SystemUtils_MkDirRecursiveDefault(_cacheFolder.c_str()) != 0)
+    {
+        Log_Error("Cannot create cache folder %s", _cacheFolder.c_str());
+        return false;
+    }
+
+    // Go through a temporary name so an interrupted copy never shows up as a valid entry.
+    if (!ShareFile(sourcePath, tempPath) || rename(tempPath.c_str(), entryPath.c_str()) != 0)
+    {
+        unlink(tempPath.c_str());
+        return false;
+    }
+
+    MarkUsed(entryPath);
+    Log_Info("Added %s to the payload cache", key.c_str());
+
+    Evict(entryPath);
+    return true;
+}
+
+/**
+ * @brief Removes the entry for @p key, e.g. because it failed validation.
+ *
+ * @param key Key of the payload, see MakeKey().
+ */
+void PayloadCache::Remove(const std::string& key) const
+{
+    const std::string entryPath{ _cacheFolder + "/" + key };
+
+    std::lock_guard<std::mutex> lock{ s_cacheMutex };
+    unlink(entryPath.c_str());
+}
+
+/**
+ * @brief Removes the least recently used entries until the cache fits its size limit.
+ * Must be called with s_cacheMutex held.
+ *
+ * @param keepPath An entry that must not be evicted.
+ */
+void PayloadCache::Evict(const std::string& keepPath) const
+{
+    struct Entry
+    {
+        std::string Path;
+        uint64_t Size;
+        struct timespec LastUse;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t totalSize = 0;
+
+    std::error_code ec;
+    for (const auto& dirEntry : std::filesystem::directory_iterator{ _cacheFolder, ec })
+    {
+        struct stat st
+        {
+        };
+        const std::string path{ dirEntry.path() };
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        {
+            entries.push_back(Entry{ path, static_cast<uint64_t>(st.st_size), st.st_atim });
+            totalSize += static_cast<uint64_t>(st.st_size);
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return (a.LastUse.tv_sec != b.LastUse.tv_sec) ? (a.LastUse.tv_sec < b.LastUse.tv_sec)
+                                                      : (a.LastUse.tv_nsec < b.LastUse.tv_nsec);
+    });
+
+    for (const Entry& entry : entries)
+    {
+        if (totalSize <= _maxSizeBytes)
+        {
+            break;
+        }
+
+        if (entry.Path == keepPath)
+        {
+            continue;
+        }
+
+        Log_Info("Evicting %s from the payload cache", entry.Path.c_str());
+        if (unlink(entry.Path.c_str()) == 0 || errno == ENOENT)
+        {
+            totalSize -= entry.Size;
+        }
+    }
+}
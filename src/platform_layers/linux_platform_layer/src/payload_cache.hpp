@@ -0,0 +1,43 @@
+/**
+ * @file payload_cache.hpp
+ * @brief Content-addressed cache of downloaded update payloads.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef PAYLOAD_CACHE_HPP
+#define PAYLOAD_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace ADUC
+{
+/**
+ * @brief Keeps verified payloads in a folder, named after their hash, so a redeployment of the same content does
+ * not need to download it again.
+ *
+ * Entries are hardlinked (or reflinked, or copied as a last resort) between the cache and the sandbox. The cache
+ * is bounded by size; the least recently used entries are evicted first. The access time of an entry is set
+ * explicitly on each use and serves as its last use time; the modification time is left alone, so the
+ * verified-hash record of the shared inode stays valid.
+ */
+class PayloadCache
+{
+public:
+    PayloadCache(std::string cacheFolder, uint64_t maxSizeBytes);
+
+    bool Fetch(const std::string& key, const std::string& targetPath) const;
+    bool Insert(const std::string& key, const std::string& sourcePath) const;
+    void Remove(const std::string& key) const;
+
+    static std::string MakeKey(const char* hashType, const char* hashBase64);
+
+private:
+    void Evict(const std::string& keepPath) const;
+
+    std::string _cacheFolder;
+    uint64_t _maxSizeBytes;
+};
+} // namespace ADUC
+
+#endif // PAYLOAD_CACHE_HPP
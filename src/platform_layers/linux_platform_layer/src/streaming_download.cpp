@@ -0,0 +1,444 @@
+/**
+ * @file streaming_download.cpp
+ * @brief Implements StreamingDownload.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "streaming_download.hpp"
+
+#include <aduc/adu_core_exports.h>
+#include <aduc/logging.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+#include <curl/curl.h>
+
+using ADUC::StreamingDownload;
+
+/**
+ * @brief Number of attempts per Run() and the delay before the first retry, doubled on each retry.
+ */
+static const unsigned int c_maxAttempts = 5;
+static const unsigned int c_initialRetryDelaySeconds = 2;
+
+/**
+ * @brief A transfer that stays below 1 byte/s for this long is aborted and retried.
+ */
+static const long c_lowSpeedTimeSeconds = 60;
+
+/**
+ * @brief Read size when streaming from a local file.
+ */
+static const size_t c_fileReadSize = 64 * 1024;
+
+/**
+ * @brief State shared with the libcurl callbacks of a single transfer.
+ */
+struct StreamingDownload::TransferContext
+{
+    StreamingDownload* Download;
+    CURL* Handle;
+    const std::atomic_bool* CancellationRequested;
+    uint64_t StartOffset;
+    bool ResponseChecked;
+    bool WriteFailed;
+
+    static size_t WriteCallback(char* data, size_t size, size_t count, void* userData)
+    {
+        auto* context = static_cast<TransferContext*>(userData);
+        if (!context->ResponseChecked)
+        {
+            context->ResponseChecked = true;
+
+            // What was already sent to the installer cannot be taken back, so a retry must continue exactly
+            // where the previous attempt stopped.
+            long status = 0;
+            curl_easy_getinfo(context->Handle, CURLINFO_RESPONSE_CODE, &status);
+            if (context->StartOffset != 0 && status != 206)
+            {
+                Log_Error(
+                    "Server did not resume at offset %llu (HTTP %ld), cannot continue the stream",
+                    static_cast<unsigned long long>(context->StartOffset),
+                    status);
+                context->WriteFailed = true;
+                return 0;
+            }
+        }
+
+        if (!context->Download->OnData(reinterpret_cast<const uint8_t*>(data), size * count))
+        {
+            context->WriteFailed = true;
+            return 0;
+        }
+
+        return size * count;
+    }
+
+    static int TransferInfoCallback(
+        void* userData, curl_off_t /*dlTotal*/, curl_off_t /*dlNow*/, curl_off_t /*ulTotal*/, curl_off_t /*ulNow*/)
+    {
+        auto* context = static_cast<TransferContext*>(userData);
+        return (*context->CancellationRequested) ? 1 : 0;
+    }
+};
+
+/**
+ * @brief Construct a streaming download.
+ *
+ * @param sourcePath Local file to stream, or empty to stream the URL passed to Run() over HTTP(S).
+ * @param algorithm Hash algorithm of the expected hash.
+ * @param holdBackSize Number of bytes withheld from the installer until the hash is verified.
+ */
+StreamingDownload::StreamingDownload(std::string sourcePath, SHAversion algorithm, size_t holdBackSize) :
+    _sourcePath{ std::move(sourcePath) }, _holdBackSize{ holdBackSize }
+{
+    static std::once_flag curlInitialized;
+    std::call_once(curlInitialized, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+    ADUC_HashUtils_StreamInit(&_stream, algorithm);
+    _pending.reserve(2 * _holdBackSize);
+}
+
+/**
+ * @brief Closes the FIFO if Run() did not complete. The installer then sees a truncated image, so it must have been
+ * aborted before.
+ */
+StreamingDownload::~StreamingDownload()
+{
+    if (_fifoFd != -1)
+    {
+        close(_fifoFd);
+    }
+}
+
+/**
+ * @brief Streams @p url into @p fifoPath and verifies it against @p hashBase64.
+ * The FIFO is closed after the held back tail was written, so only a verified image reaches its end.
+ * On failure the FIFO is left open until this object is destroyed, keeping the installer waiting for the rest
+ * of the image until it was aborted.
+ *
+ * @param url The file to download.
+ * @param fifoPath The FIFO the installer reads the image from.
+ * @param hashBase64 The expected hash.
+ * @param cancellationRequested Aborts the transfer when set.
+ * @param readerDone Set once the installer exited, e.g. before it opened the FIFO.
+ * @return ADUC_Result An install result.
+ */
+ADUC_Result StreamingDownload::Run(
+    const std::string& url,
+    const std::string& fifoPath,
+    const char* hashBase64,
+    const std::atomic_bool& cancellationRequested,
+    const std::atomic_bool& readerDone)
+{
+    if (!OpenFifo(fifoPath, cancellationRequested, readerDone))
+    {
+        return ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+    }
+
+    const ADUC_Result result{ _sourcePath.empty() ? StreamUrl(url, cancellationRequested)
+                                                  : StreamFile(cancellationRequested) };
+    if (IsAducResultCodeFailure(result.ResultCode))
+    {
+        return result;
+    }
+
+    if (!ADUC_HashUtils_StreamIsValid(&_stream, hashBase64))
+    {
+        Log_Error(
+            "Hash of streamed image is not valid, withholding the last %zu of %llu bytes",
+            _pending.size(),
+            static_cast<unsigned long long>(_stream.BytesHashed));
+        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_VALIDATION_FILE_HASH_INVALID_HASH };
+    }
+
+    if (!WriteAll(_pending.data(), _pending.size()))
+    {
+        return ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(_writeErrno) };
+    }
+
+    close(_fifoFd);
+    _fifoFd = -1;
+
+    Log_Info("Streamed %llu bytes into the installer", static_cast<unsigned long long>(_stream.BytesHashed));
+    return ADUC_Result{ ADUC_InstallResult_Success };
+}
+
+/**
+ * @brief Waits for the installer to open the FIFO for reading, then opens it for blocking writes.
+ *
+ * @return bool True on success, errno is set otherwise.
+ */
+bool StreamingDownload::OpenFifo(
+    const std::string& fifoPath, const std::atomic_bool& cancellationRequested, const std::atomic_bool& readerDone)
+{
+    // A non-blocking open fails with ENXIO until there is a reader, which lets us notice an installer that exits
+    // without ever opening the FIFO.
+    for (;;)
+    {
+        _fifoFd = open(fifoPath.c_str(), O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (_fifoFd != -1)
+        {
+            break;
+        }
+
+        if (errno != ENXIO)
+        {
+            Log_Error("Cannot open %s, errno %d", fifoPath.c_str(), errno);
+            return false;
+        }
+
+        if (cancellationRequested || readerDone)
+        {
+            Log_Error("Installer did not open %s", fifoPath.c_str());
+            errno = ECANCELED;
+            return false;
+        }
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    const int flags = fcntl(_fifoFd, F_GETFL);
+    if (flags == -1 || fcntl(_fifoFd, F_SETFL, flags & ~O_NONBLOCK) == -1)
+    {
+        Log_Error("Cannot make %s blocking, errno %d", fifoPath.c_str(), errno);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Hashes a chunk of the image and passes everything but the last HoldBackSize bytes on to the installer.
+ * Pending bytes are only flushed once they reach twice the hold-back size, so the buffer is compacted once per
+ * HoldBackSize bytes rather than on every chunk.
+ *
+ * @return bool False if the installer stopped reading.
+ */
+bool StreamingDownload::OnData(const uint8_t* data, size_t size)
+{
+    if (!ADUC_HashUtils_StreamUpdate(&_stream, data, size))
+    {
+        _writeErrno = EINVAL;
+        return false;
+    }
+
+    // A chunk larger than the buffer is passed through directly, except for its tail.
+    if (_pending.size() + size > 2 * _holdBackSize)
+    {
+        const size_t total = _pending.size() + size;
+        const size_t flushSize = total - _holdBackSize;
+        const size_t fromPending = std::min(flushSize, _pending.size());
+
+        if (!WriteAll(_pending.data(), fromPending) || !WriteAll(data, flushSize - fromPending))
+        {
+            return false;
+        }
+
+        _pending.erase(_pending.begin(), _pending.begin() + static_cast<std::ptrdiff_t>(fromPending));
+        data += flushSize - fromPending;
+        size -= flushSize - fromPending;
+    }
+
+    _pending.insert(_pending.end(), data, data + size);
+    return true;
+}
+
+/**
+ * @brief Writes @p data to the FIFO, blocking while the installer is busy.
+ *
+ * @return bool False if the installer stopped reading, _writeErrno holds the reason.
+ */
+bool StreamingDownload::WriteAll(const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t written = write(_fifoFd, data, size);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // EPIPE if the installer exited. The caller has SIGPIPE blocked.
+            _writeErrno = errno;
+            Log_Error("Installer stopped reading the image, errno %d", errno);
+            return false;
+        }
+
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Streams the local source file.
+ *
+ * @return ADUC_Result An install result.
+ */
+ADUC_Result StreamingDownload::StreamFile(const std::atomic_bool& cancellationRequested)
+{
+    const int sourceFd = open(_sourcePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (sourceFd == -1)
+    {
+        Log_Error("Cannot open %s, errno %d", _sourcePath.c_str(), errno);
+        return ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+    }
+
+    ADUC_Result result{ ADUC_InstallResult_Success };
+    std::vector<uint8_t> buffer(c_fileReadSize);
+    for (;;)
+    {
+        if (cancellationRequested)
+        {
+            Log_Info("Streaming was cancelled");
+            result = ADUC_Result{ ADUC_InstallResult_Cancelled, ADUC_ERC_NOTRECOVERABLE };
+            break;
+        }
+
+        const ssize_t readSize = read(sourceFd, buffer.data(), buffer.size());
+        if (readSize == 0)
+        {
+            break;
+        }
+
+        if (readSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            result = ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(errno) };
+            break;
+        }
+
+        if (!OnData(buffer.data(), static_cast<size_t>(readSize)))
+        {
+            result = ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(_writeErrno) };
+            break;
+        }
+    }
+
+    close(sourceFd);
+    return result;
+}
+
+/**
+ * @brief Streams @p url over HTTP(S). Transient failures are retried with a range request that continues at the
+ * first byte the installer has not seen yet.
+ *
+ * @return ADUC_Result An install result.
+ */
+ADUC_Result StreamingDownload::StreamUrl(const std::string& url, const std::atomic_bool& cancellationRequested)
+{
+    ADUC_Result result{ ADUC_InstallResult_Failure, ADUC_ERC_NOTRECOVERABLE };
+    unsigned int retryDelaySeconds = c_initialRetryDelaySeconds;
+    for (unsigned int attempt = 1; attempt <= c_maxAttempts; ++attempt)
+    {
+        result = Transfer(url, cancellationRequested);
+        if (result.ResultCode != ADUC_InstallResult_Failure || _writeErrno != 0 || attempt == c_maxAttempts)
+        {
+            break;
+        }
+
+        Log_Warn(
+            "Streaming attempt %u of %u failed at byte %llu, extendedCode: %d. Retrying in %us",
+            attempt,
+            c_maxAttempts,
+            static_cast<unsigned long long>(_stream.BytesHashed),
+            result.ExtendedResultCode,
+            retryDelaySeconds);
+
+        for (unsigned int waited = 0; waited < retryDelaySeconds && !cancellationRequested; ++waited)
+        {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+        }
+
+        if (cancellationRequested)
+        {
+            result = ADUC_Result{ ADUC_InstallResult_Cancelled, ADUC_ERC_NOTRECOVERABLE };
+            break;
+        }
+
+        retryDelaySeconds *= 2;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Performs a single HTTP request, continuing at the number of bytes received so far.
+ *
+ * @return ADUC_Result Success once the server sent the rest of the file.
+ */
+ADUC_Result StreamingDownload::Transfer(const std::string& url, const std::atomic_bool& cancellationRequested)
+{
+    std::unique_ptr<CURL, decltype(&curl_easy_cleanup)> handle{ curl_easy_init(), curl_easy_cleanup };
+    if (!handle)
+    {
+        return ADUC_Result{ ADUC_InstallResult_Failure, ADUC_ERC_NOMEM };
+    }
+
+    TransferContext context{ this, handle.get(), &cancellationRequested, _stream.BytesHashed, false, false };
+
+    if (context.StartOffset != 0)
+    {
+        curl_easy_setopt(handle.get(), CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(context.StartOffset));
+    }
+
+    curl_easy_setopt(handle.get(), CURLOPT_URL, url.c_str());
+    curl_easy_setopt(handle.get(), CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(handle.get(), CURLOPT_LOW_SPEED_TIME, c_lowSpeedTimeSeconds);
+    curl_easy_setopt(handle.get(), CURLOPT_WRITEFUNCTION, TransferContext::WriteCallback);
+    curl_easy_setopt(handle.get(), CURLOPT_WRITEDATA, &context);
+    curl_easy_setopt(handle.get(), CURLOPT_NOPROGRESS, 0L);
+    curl_easy_setopt(handle.get(), CURLOPT_XFERINFOFUNCTION, TransferContext::TransferInfoCallback);
+    curl_easy_setopt(handle.get(), CURLOPT_XFERINFODATA, &context);
+
+    const CURLcode curlResult = curl_easy_perform(handle.get());
+    if (curlResult == CURLE_OK)
+    {
+        return ADUC_Result{ ADUC_InstallResult_Success };
+    }
+
+    if (curlResult == CURLE_ABORTED_BY_CALLBACK && cancellationRequested)
+    {
+        Log_Info("Streaming was cancelled");
+        return ADUC_Result{ ADUC_InstallResult_Cancelled, ADUC_ERC_NOTRECOVERABLE };
+    }
+
+    if (curlResult == CURLE_WRITE_ERROR && context.WriteFailed)
+    {
+        // Either the installer went away or the server cannot continue the stream, neither is worth a retry.
+        if (_writeErrno == 0)
+        {
+            _writeErrno = ESPIPE;
+        }
+
+        return ADUC_Result{ ADUC_InstallResult_Failure, MAKE_ADUC_ERRNO_EXTENDEDRESULTCODE(_writeErrno) };
+    }
+
+    long status = 0;
+    curl_easy_getinfo(handle.get(), CURLINFO_RESPONSE_CODE, &status);
+
+    Log_Error("Streaming failed: %s (HTTP %ld)", curl_easy_strerror(curlResult), status);
+    return ADUC_Result{ ADUC_InstallResult_Failure,
+                        (curlResult == CURLE_HTTP_RETURNED_ERROR) ? ADUC_ERC_CURL_HTTP_STATUS(status)
+                                                                  : MAKE_ADUC_CURL_EXTENDEDRESULTCODE(curlResult) };
+}
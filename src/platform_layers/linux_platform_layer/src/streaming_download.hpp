@@ -0,0 +1,78 @@
+/**
+ * @file streaming_download.hpp
+ * @brief Downloads an update file straight into the installer instead of the sandbox.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef STREAMING_DOWNLOAD_HPP
+#define STREAMING_DOWNLOAD_HPP
+
+#include <aduc/hash_utils.h>
+#include <aduc/result.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ADUC
+{
+/**
+ * @brief Feeds a download through a FIFO into an installer that reads it in a single pass.
+ *
+ * Every byte is hashed on the way, so the image is never staged on disk. Because the installer consumes the data
+ * before the hash is known, the last HoldBackSize bytes are withheld until the hash over the whole file is
+ * verified. The installer therefore never sees the end of a corrupt or tampered image; on a mismatch the caller
+ * aborts the installer while it is still waiting for the tail.
+ *
+ * Memory use is bounded by twice the hold-back size, independent of the image size.
+ */
+class StreamingDownload
+{
+public:
+    StreamingDownload(std::string sourcePath, SHAversion algorithm, size_t holdBackSize);
+    ~StreamingDownload();
+
+    StreamingDownload(const StreamingDownload&) = delete;
+    StreamingDownload& operator=(const StreamingDownload&) = delete;
+    StreamingDownload(StreamingDownload&&) = delete;
+    StreamingDownload& operator=(StreamingDownload&&) = delete;
+
+    ADUC_Result Run(
+        const std::string& url,
+        const std::string& fifoPath,
+        const char* hashBase64,
+        const std::atomic_bool& cancellationRequested,
+        const std::atomic_bool& readerDone);
+
+    /**
+     * @brief Number of bytes received so far.
+     */
+    uint64_t BytesReceived() const
+    {
+        return _stream.BytesHashed;
+    }
+
+private:
+    struct TransferContext;
+
+    bool OpenFifo(
+        const std::string& fifoPath,
+        const std::atomic_bool& cancellationRequested,
+        const std::atomic_bool& readerDone);
+    bool OnData(const uint8_t* data, size_t size);
+    bool WriteAll(const uint8_t* data, size_t size);
+    ADUC_Result StreamFile(const std::atomic_bool& cancellationRequested);
+    ADUC_Result StreamUrl(const std::string& url, const std::atomic_bool& cancellationRequested);
+    ADUC_Result Transfer(const std::string& url, const std::atomic_bool& cancellationRequested);
+
+    std::string _sourcePath;
+    size_t _holdBackSize;
+    std::vector<uint8_t> _pending;
+    int _fifoFd{ -1 };
+    int _writeErrno{ 0 };
+    ADUC_HashUtils_Stream _stream{};
+};
+} // namespace ADUC
+
+#endif // STREAMING_DOWNLOAD_HPP
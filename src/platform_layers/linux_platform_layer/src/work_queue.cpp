@@ -0,0 +1,107 @@
+/**
+ * @file work_queue.cpp
+ * @brief Implements WorkQueue.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "work_queue.hpp"
+
+#include <aduc/event_loop.h>
+#include <aduc/logging.h>
+
+#include <utility>
+
+using ADUC::WorkQueue;
+
+WorkQueue::WorkQueue() : _thread{ &WorkQueue::Run, this }
+{
+}
+
+/**
+ * @brief Stops the worker thread. An operation that is running is waited for, so callers should request
+ * cancellation first. Operations that have not started are dropped without completion.
+ */
+WorkQueue::~WorkQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock{ _mutex };
+        _stopping = true;
+
+        if (!_pending.empty())
+        {
+            Log_Warn("Dropping %zu queued operations", _pending.size());
+        }
+    }
+
+    _workAvailable.notify_one();
+    _thread.join();
+}
+
+/**
+ * @brief Queues @p work to run on the worker thread.
+ * Its result is reported to @p workCompletionData by a later DeliverCompletions() call.
+ *
+ * @param work The operation.
+ * @param workCompletionData Receives the result. Must stay valid until the completion was delivered.
+ */
+void WorkQueue::Post(Work work, const ADUC_WorkCompletionData* workCompletionData)
+{
+    {
+        std::lock_guard<std::mutex> lock{ _mutex };
+        _pending.push_back(PendingWork{ std::move(work), workCompletionData });
+    }
+
+    _workAvailable.notify_one();
+}
+
+/**
+ * @brief Reports the results of all finished operations. Called regularly from the agent's main loop.
+ */
+void WorkQueue::DeliverCompletions()
+{
+    std::vector<Completion> completed;
+    {
+        std::lock_guard<std::mutex> lock{ _mutex };
+        if (_completed.empty())
+        {
+            return;
+        }
+
+        completed.swap(_completed);
+    }
+
+    // Completion callbacks may start the next operation, so they must run without holding the lock.
+    for (const Completion& completion : completed)
+    {
+        completion.WorkCompletionData->WorkCompletionCallback(
+            completion.WorkCompletionData->WorkCompletionToken, completion.Result);
+    }
+}
+
+/**
+ * @brief Worker thread. Runs queued operations in order until the queue is destroyed.
+ */
+void WorkQueue::Run()
+{
+    std::unique_lock<std::mutex> lock{ _mutex };
+    for (;;)
+    {
+        _workAvailable.wait(lock, [this]() { return _stopping || !_pending.empty(); });
+        if (_stopping)
+        {
+            break;
+        }
+
+        PendingWork work{ std::move(_pending.front()) };
+        _pending.pop_front();
+
+        lock.unlock();
+        const ADUC_Result result{ work.Operation() };
+        lock.lock();
+
+        _completed.push_back(Completion{ work.WorkCompletionData, result });
+
+        // The main loop delivers the completion on its next iteration, which is now rather than on its timer.
+        ADUC_EventLoop_Wake();
+    }
+}
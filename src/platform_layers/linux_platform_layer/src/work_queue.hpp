@@ -0,0 +1,73 @@
+/**
+ * @file work_queue.hpp
+ * @brief Runs long operations of the platform layer off the agent's main loop.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef WORK_QUEUE_HPP
+#define WORK_QUEUE_HPP
+
+#include <aduc/adu_core_exports.h>
+#include <aduc/result.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ADUC
+{
+/**
+ * @brief A single long-lived worker thread that runs Download, Install and Apply one at a time.
+ *
+ * The main loop must keep servicing the IoT Hub connection while an operation runs for minutes, so operations are
+ * posted here and the callback returns InProgress right away. Results are not reported from the worker thread:
+ * they are queued and handed to the WorkCompletionCallback by DeliverCompletions(), which runs on the main loop
+ * from DoWork. The agent's workflow state is therefore only ever touched by the main thread.
+ */
+class WorkQueue
+{
+public:
+    /**
+     * @brief An operation to run on the worker thread.
+     */
+    using Work = std::function<ADUC_Result()>;
+
+    WorkQueue();
+    ~WorkQueue();
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+    WorkQueue(WorkQueue&&) = delete;
+    WorkQueue& operator=(WorkQueue&&) = delete;
+
+    void Post(Work work, const ADUC_WorkCompletionData* workCompletionData);
+    void DeliverCompletions();
+
+private:
+    struct PendingWork
+    {
+        Work Operation;
+        const ADUC_WorkCompletionData* WorkCompletionData;
+    };
+
+    struct Completion
+    {
+        const ADUC_WorkCompletionData* WorkCompletionData;
+        ADUC_Result Result;
+    };
+
+    void Run();
+
+    std::mutex _mutex;
+    std::condition_variable _workAvailable;
+    std::deque<PendingWork> _pending;
+    std::vector<Completion> _completed;
+    bool _stopping{ false };
+    std::thread _thread;
+};
+} // namespace ADUC
+
+#endif // WORK_QUEUE_HPP
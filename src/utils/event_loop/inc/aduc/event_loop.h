@@ -0,0 +1,35 @@
+/**
+ * @file event_loop.h
+ * @brief The agent's main loop. Sleeps until there is work instead of polling at a fixed rate.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef ADUC_EVENT_LOOP_H
+#define ADUC_EVENT_LOOP_H
+
+#include <aduc/c_utils.h>
+#include <signal.h>
+#include <stdbool.h>
+
+EXTERN_C_BEGIN
+
+/**
+ * @brief Called on each iteration of the loop.
+ */
+typedef void (*ADUC_EventLoop_WorkFunc)(void* context);
+
+_Bool ADUC_EventLoop_Init(const sigset_t* signals, unsigned int activePeriodMs, unsigned int maxIdlePeriodMs);
+
+int ADUC_EventLoop_Run(ADUC_EventLoop_WorkFunc doWork, void* context);
+
+void ADUC_EventLoop_Wake(void);
+
+_Bool ADUC_EventLoop_WatchFd(int fd);
+
+void ADUC_EventLoop_LogStatistics(void);
+
+void ADUC_EventLoop_Uninit(void);
+
+EXTERN_C_END
+
+#endif // ADUC_EVENT_LOOP_H
@@ -0,0 +1,354 @@
+/**
+ * @file event_loop.c
+ * @brief Implements the agent's main loop on epoll.
+ *
+ * The loop sleeps in epoll_wait on up to four descriptors:
+ * - a signalfd for the signals that end the loop,
+ * - an eventfd that ADUC_EventLoop_Wake() writes to, e.g. when a worker thread completed or a message arrived,
+ * - a one-shot timerfd for the periodic work the IoT Hub SDK needs, e.g. MQTT keep-alive and retries,
+ * - a descriptor passed to ADUC_EventLoop_WatchFd(), e.g. the IoT Hub connection, that wakes the loop when it
+ *   becomes readable.
+ *
+ * The timer runs at the active period after each wake-up, and the period doubles with each iteration that had
+ * nothing to do, up to the idle period.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "aduc/event_loop.h"
+
+#include <aduc/logging.h>
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Number of buckets of the iteration latency histogram. Bucket i counts iterations that took less than
+ * 2^i ms, the last bucket all longer ones.
+ */
+#define EVENT_LOOP_HISTOGRAM_BUCKETS 12
+
+/**
+ * @brief How often statistics are logged while the loop runs.
+ */
+static const uint64_t c_statisticsIntervalNs = 3600ULL * 1000 * 1000 * 1000;
+
+static int s_epollFd = -1;
+static int s_signalFd = -1;
+static int s_wakeFd = -1;
+static int s_timerFd = -1;
+static int s_watchedFd = -1;
+static unsigned int s_activePeriodMs = 100;
+static unsigned int s_maxIdlePeriodMs = 100;
+
+/**
+ * @brief Iteration counters and latency histogram.
+ */
+static struct
+{
+    uint64_t Iterations;
+    uint64_t TimerWakeups;
+    uint64_t EventWakeups;
+    uint64_t MaxLatencyUs;
+    uint64_t Histogram[EVENT_LOOP_HISTOGRAM_BUCKETS];
+} s_statistics;
+
+static uint64_t GetMonotonicNs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Adds @p fd to the epoll set, for input.
+ */
+static _Bool AddToEpoll(int fd)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    return epoll_ctl(s_epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+}
+
+/**
+ * @brief Arms the timer to expire once, @p periodMs from now.
+ */
+static void ArmTimer(unsigned int periodMs)
+{
+    struct itimerspec timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = periodMs / 1000;
+    timer.it_value.tv_nsec = (long)(periodMs % 1000) * 1000 * 1000;
+    timerfd_settime(s_timerFd, 0, &timer, NULL);
+}
+
+/**
+ * @brief Drains the counter of the eventfd or timerfd @p fd.
+ */
+static void DrainCounter(int fd)
+{
+    uint64_t count;
+    ssize_t ignored = read(fd, &count, sizeof(count));
+    (void)ignored;
+}
+
+/**
+ * @brief Adds an iteration that took @p latencyNs to the statistics.
+ */
+static void RecordIteration(uint64_t latencyNs)
+{
+    const uint64_t latencyUs = latencyNs / 1000;
+    unsigned int bucket = 0;
+
+    while (bucket < EVENT_LOOP_HISTOGRAM_BUCKETS - 1 && latencyUs >= (1000ULL << bucket))
+    {
+        ++bucket;
+    }
+
+    ++s_statistics.Histogram[bucket];
+    ++s_statistics.Iterations;
+    if (latencyUs > s_statistics.MaxLatencyUs)
+    {
+        s_statistics.MaxLatencyUs = latencyUs;
+    }
+}
+
+/**
+ * @brief Sets up the loop. @p signals are delivered through the loop instead of signal handlers, so they must be
+ * blocked in every thread: the caller blocks them before any thread is started, and they are blocked in the calling
+ * thread here as well. Child processes are started with no signal blocked, see process_utils.
+ *
+ * @param signals The signals that end ADUC_EventLoop_Run().
+ * @param activePeriodMs Period of the periodic work after a wake-up.
+ * @param maxIdlePeriodMs Longest period of the periodic work while nothing happens.
+ * @return _Bool True on success. On failure the signals are not blocked.
+ */
+_Bool ADUC_EventLoop_Init(const sigset_t* signals, unsigned int activePeriodMs, unsigned int maxIdlePeriodMs)
+{
+    sigset_t previousMask;
+
+    s_activePeriodMs = activePeriodMs > 0 ? activePeriodMs : 1;
+    s_maxIdlePeriodMs = maxIdlePeriodMs > s_activePeriodMs ? maxIdlePeriodMs : s_activePeriodMs;
+    memset(&s_statistics, 0, sizeof(s_statistics));
+
+    if (pthread_sigmask(SIG_BLOCK, signals, &previousMask) != 0)
+    {
+        return false;
+    }
+
+    s_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    s_signalFd = signalfd(-1, signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    s_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    s_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (s_epollFd == -1 || s_signalFd == -1 || s_wakeFd == -1 || s_timerFd == -1 || !AddToEpoll(s_signalFd)
+        || !AddToEpoll(s_wakeFd) || !AddToEpoll(s_timerFd))
+    {
+        Log_Error("Cannot create the main loop, errno %d", errno);
+        ADUC_EventLoop_Uninit();
+        pthread_sigmask(SIG_SETMASK, &previousMask, NULL);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Calls @p doWork on every wake-up until one of the signals passed to ADUC_EventLoop_Init() arrives.
+ *
+ * @param doWork Called on each iteration.
+ * @param context Passed to @p doWork.
+ * @return int The signal that ended the loop.
+ */
+int ADUC_EventLoop_Run(ADUC_EventLoop_WorkFunc doWork, void* context)
+{
+    unsigned int periodMs = s_activePeriodMs;
+    uint64_t lastStatisticsNs = GetMonotonicNs();
+
+    // The first iteration runs right away.
+    ADUC_EventLoop_Wake();
+
+    for (;;)
+    {
+        struct epoll_event events[4];
+        const int eventCount = epoll_wait(s_epollFd, events, ARRAY_SIZE(events), -1);
+        if (eventCount == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            Log_Error("Main loop wait failed, errno %d", errno);
+            return SIGTERM;
+        }
+
+        _Bool woken = false;
+        for (int i = 0; i < eventCount; ++i)
+        {
+            const int fd = events[i].data.fd;
+            if (fd == s_signalFd)
+            {
+                struct signalfd_siginfo info;
+                if (read(s_signalFd, &info, sizeof(info)) == sizeof(info))
+                {
+                    return (int)info.ssi_signo;
+                }
+            }
+            else if (fd == s_wakeFd)
+            {
+                DrainCounter(s_wakeFd);
+                woken = true;
+            }
+            else if (fd == s_timerFd)
+            {
+                DrainCounter(s_timerFd);
+            }
+            else if (fd == s_watchedFd)
+            {
+                // Edge-triggered: doWork reads the data, the next arrival wakes the loop again.
+                woken = true;
+            }
+        }
+
+        if (woken)
+        {
+            ++s_statistics.EventWakeups;
+            periodMs = s_activePeriodMs;
+        }
+        else
+        {
+            ++s_statistics.TimerWakeups;
+        }
+
+        const uint64_t startNs = GetMonotonicNs();
+        doWork(context);
+        const uint64_t endNs = GetMonotonicNs();
+        RecordIteration(endNs - startNs);
+
+        ArmTimer(periodMs);
+
+        // Nothing happened, so the next time is allowed to be later.
+        if (!woken && periodMs < s_maxIdlePeriodMs)
+        {
+            periodMs = (periodMs * 2 < s_maxIdlePeriodMs) ? periodMs * 2 : s_maxIdlePeriodMs;
+        }
+
+        if (endNs - lastStatisticsNs >= c_statisticsIntervalNs)
+        {
+            ADUC_EventLoop_LogStatistics();
+            lastStatisticsNs = endNs;
+        }
+    }
+}
+
+/**
+ * @brief Makes the loop run its next iteration now, at the active period. Can be called from any thread.
+ */
+void ADUC_EventLoop_Wake(void)
+{
+    if (s_wakeFd != -1)
+    {
+        const uint64_t one = 1;
+        ssize_t ignored = write(s_wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+/**
+ * @brief Makes the loop wake up when @p fd becomes readable, in place of the descriptor watched before.
+ * The descriptor is not owned by the loop. A watched descriptor that is closed is dropped from the loop by the
+ * kernel, so the caller watches its replacement, e.g. after a reconnect. Must be called from the loop's thread.
+ *
+ * @param fd The descriptor, e.g. a socket.
+ * @return _Bool True if the descriptor is watched.
+ */
+_Bool ADUC_EventLoop_WatchFd(int fd)
+{
+    if (s_epollFd == -1)
+    {
+        return false;
+    }
+
+    if (s_watchedFd != -1)
+    {
+        // Fails harmlessly if the descriptor was closed meanwhile.
+        epoll_ctl(s_epollFd, EPOLL_CTL_DEL, s_watchedFd, NULL);
+        s_watchedFd = -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(s_epollFd, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        Log_Warn("Cannot watch descriptor %d in the main loop, errno %d", fd, errno);
+        return false;
+    }
+
+    s_watchedFd = fd;
+    return true;
+}
+
+/**
+ * @brief Logs the wake-up counters and the iteration latency histogram.
+ */
+void ADUC_EventLoop_LogStatistics(void)
+{
+    char histogram[EVENT_LOOP_HISTOGRAM_BUCKETS * 32] = "";
+    size_t length = 0;
+
+    for (unsigned int bucket = 0; bucket < EVENT_LOOP_HISTOGRAM_BUCKETS && length < sizeof(histogram); ++bucket)
+    {
+        const int written = snprintf(
+            histogram + length,
+            sizeof(histogram) - length,
+            bucket < EVENT_LOOP_HISTOGRAM_BUCKETS - 1 ? " <%ums:%" PRIu64 : " >=%ums:%" PRIu64,
+            bucket < EVENT_LOOP_HISTOGRAM_BUCKETS - 1 ? 1U << bucket : 1U << (bucket - 1),
+            s_statistics.Histogram[bucket]);
+        if (written < 0)
+        {
+            break;
+        }
+
+        length += (size_t)written;
+    }
+
+    Log_Info(
+        "Main loop: %" PRIu64 " iterations, %" PRIu64 " on timer, %" PRIu64 " on events, max %" PRIu64 " us,%s",
+        s_statistics.Iterations,
+        s_statistics.TimerWakeups,
+        s_statistics.EventWakeups,
+        s_statistics.MaxLatencyUs,
+        histogram);
+}
+
+/**
+ * @brief Releases the loop. Signals stay blocked.
+ */
+void ADUC_EventLoop_Uninit(void)
+{
+    s_watchedFd = -1;
+
+    int* fds[] = { &s_timerFd, &s_wakeFd, &s_signalFd, &s_epollFd };
+    for (size_t i = 0; i < ARRAY_SIZE(fds); ++i)
+    {
+        if (*fds[i] != -1)
+        {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
@@ -0,0 +1,248 @@
+/**
+ * @file main.c
+ * @brief Compares the throughput of the hash_utils backends.
+ *
+ * Usage: hash_utils_benchmark [-s <size in MiB>] [-a <sha1|sha224|sha256|sha384|sha512>] [file]
+ *
+ * Without a file, a file of the given size (default 1024 MiB) filled with pseudo-random data is created in /tmp
+ * and removed afterwards. The file is read once before the runs, so with enough RAM all runs read from the page
+ * cache and compare hashing rather than storage speed.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include <aduc/hash_utils.h>
+#include <aduc/logging.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief A single benchmark run.
+ */
+typedef struct tagBenchmarkRun
+{
+    const char* Name; /**< Printed name. */
+    ADUC_HashUtils_Backend Backend; /**< Backend to hash with. */
+    size_t ReadSize; /**< Size of each read. */
+} BenchmarkRun;
+
+static const BenchmarkRun c_runs[] = {
+    { "portable, 128 B reads (previous file hashing)", ADUC_HashUtils_Backend_Portable, 128 },
+    { "portable, 1 MiB reads", ADUC_HashUtils_Backend_Portable, 1024 * 1024 },
+    { "openssl, 1 MiB reads (file hashing)", ADUC_HashUtils_Backend_OpenSSL, 1024 * 1024 },
+};
+
+/**
+ * @brief Largest ReadSize of c_runs.
+ */
+static const size_t c_maxReadSize = 1024 * 1024;
+
+/**
+ * @brief Returns the monotonic clock in seconds.
+ */
+static double NowSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Creates @p path with @p sizeMb MiB of pseudo-random data.
+ * @return bool True on success.
+ */
+static bool CreateInput(const char* path, unsigned long sizeMb, uint8_t* buffer)
+{
+    bool success = false;
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    for (unsigned long block = 0; block < sizeMb; ++block)
+    {
+        // xorshift64, hashing speed does not depend on the data, it just must not be trivially compressible.
+        for (size_t i = 0; i < c_maxReadSize; i += sizeof(state))
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            memcpy(buffer + i, &state, sizeof(state));
+        }
+
+        if (write(fd, buffer, c_maxReadSize) != (ssize_t)c_maxReadSize)
+        {
+            fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+            goto done;
+        }
+    }
+
+    success = true;
+
+done:
+    close(fd);
+    return success;
+}
+
+/**
+ * @brief Hashes the file at @p path as described by @p run.
+ * @return double Seconds taken, or a negative value on error.
+ */
+static double RunBenchmark(const BenchmarkRun* run, const char* path, SHAversion algorithm, uint8_t* buffer)
+{
+    ADUC_HashUtils_Stream stream;
+    double seconds = -1;
+
+    if (!ADUC_HashUtils_StreamInitWithBackend(&stream, algorithm, run->Backend))
+    {
+        return -1;
+    }
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    const double start = NowSeconds();
+
+    for (;;)
+    {
+        const ssize_t readSize = read(fd, buffer, run->ReadSize);
+        if (readSize == 0)
+        {
+            break;
+        }
+
+        if (readSize < 0 || !ADUC_HashUtils_StreamUpdate(&stream, buffer, (size_t)readSize))
+        {
+            fprintf(stderr, "Error hashing %s\n", path);
+            goto done;
+        }
+    }
+
+    seconds = NowSeconds() - start;
+
+done:
+    close(fd);
+    return seconds;
+}
+
+int main(int argc, char** argv)
+{
+    int ret = EXIT_FAILURE;
+    unsigned long sizeMb = 1024;
+    const char* algorithmName = "sha256";
+    SHAversion algorithm;
+    char tempPath[] = "/tmp/hash_utils_benchmark.XXXXXX";
+    const char* path = NULL;
+    void* buffer = NULL;
+    struct stat st;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            sizeMb = strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            algorithmName = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s <size in MiB>] [-a <algorithm>] [file]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!ADUC_HashUtils_GetShaVersionForTypeString(algorithmName, &algorithm) || sizeMb == 0)
+    {
+        fprintf(stderr, "Invalid algorithm or size\n");
+        return EXIT_FAILURE;
+    }
+
+    ADUC_Logging_Init(ADUC_LOG_WARN);
+
+    if (posix_memalign(&buffer, 4096, c_maxReadSize) != 0)
+    {
+        buffer = NULL;
+        goto done;
+    }
+
+    if (optind < argc)
+    {
+        path = argv[optind];
+    }
+    else
+    {
+        const int fd = mkstemp(tempPath);
+        if (fd == -1)
+        {
+            fprintf(stderr, "Cannot create a temporary file: %s\n", strerror(errno));
+            goto done;
+        }
+
+        close(fd);
+        path = tempPath;
+
+        printf("Creating %lu MiB input %s\n", sizeMb, path);
+        if (!CreateInput(path, sizeMb, buffer))
+        {
+            goto done;
+        }
+    }
+
+    // Warm up the page cache.
+    {
+        const BenchmarkRun warmUp = { "warm-up", ADUC_HashUtils_Backend_Default, c_maxReadSize };
+        if (RunBenchmark(&warmUp, path, algorithm, buffer) < 0)
+        {
+            goto done;
+        }
+    }
+
+    if (stat(path, &st) != 0)
+    {
+        goto done;
+    }
+
+    for (size_t i = 0; i < sizeof(c_runs) / sizeof(c_runs[0]); ++i)
+    {
+        const double seconds = RunBenchmark(&c_runs[i], path, algorithm, buffer);
+        if (seconds < 0)
+        {
+            printf("%-48s not available\n", c_runs[i].Name);
+            continue;
+        }
+
+        printf(
+            "%-48s %8.2f s %10.1f MiB/s\n",
+            c_runs[i].Name,
+            seconds,
+            (double)st.st_size / (1024.0 * 1024.0) / seconds);
+    }
+
+    ret = EXIT_SUCCESS;
+
+done:
+    if (path == tempPath)
+    {
+        unlink(tempPath);
+    }
+
+    free(buffer);
+    ADUC_Logging_Uninit();
+    return ret;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file hash_chunks.h
+ * @brief Parallel verification of large files against a manifest of per-chunk hashes.
+ *
+ * A chunk manifest is a JSON file that splits a file into fixed-size chunks and lists the hash of each one:
+ *
+ *     {
+ *         "algorithm": "sha256",
+ *         "chunkSize": 4194304,
+ *         "fileSize": 1073741824,
+ *         "chunks": [ "<base64 hash of chunk 0>", ... ],
+ *         "root": "<base64 hash over the concatenated raw chunk hashes>"
+ *     }
+ *
+ * The chunks are independent, so they can be verified on all cores, and a corrupt chunk is identified instead of
+ * just the whole file failing. The manifest itself must come from a trusted source, e.g. as a file of the update
+ * whose hash is signed.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef ADUC_HASH_CHUNKS_H
+#define ADUC_HASH_CHUNKS_H
+
+#include <aduc/c_utils.h>
+
+#include <azure_c_shared_utility/sha.h> // for SHAversion
+
+#include <stdbool.h> // for _Bool
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t, uint64_t
+
+EXTERN_C_BEGIN
+
+/**
+ * @brief A loaded chunk manifest.
+ */
+typedef struct tagADUC_HashUtils_ChunkManifest
+{
+    SHAversion Algorithm; /**< Algorithm of all hashes. */
+    uint64_t ChunkSize; /**< Size of every chunk but the last one. */
+    uint64_t FileSize; /**< Size of the whole file. */
+    size_t ChunkCount; /**< Number of chunks. */
+    size_t HashSize; /**< Size of a raw hash of Algorithm. */
+    uint8_t* Hashes; /**< ChunkCount raw hashes of HashSize bytes each. */
+} ADUC_HashUtils_ChunkManifest;
+
+_Bool ADUC_HashUtils_ChunkManifest_Load(const char* path, ADUC_HashUtils_ChunkManifest* manifest);
+
+void ADUC_HashUtils_ChunkManifest_Uninit(ADUC_HashUtils_ChunkManifest* manifest);
+
+_Bool ADUC_HashUtils_VerifyFileChunks(
+    const char* path, const ADUC_HashUtils_ChunkManifest* manifest, unsigned int threadCount, _Bool* chunkIsValid);
+
+EXTERN_C_END
+
+#endif // ADUC_HASH_CHUNKS_H
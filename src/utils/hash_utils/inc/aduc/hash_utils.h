@@ -13,11 +13,85 @@
 
 #include <stdbool.h> // for _Bool
 #include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t, uint64_t
 
 EXTERN_C_BEGIN
 
+/**
+ * @brief Bytes reserved in ADUC_HashUtils_Stream for the OpenSSL state.
+ * openssl/sha.h cannot be included here, its SHA1() etc. functions clash with the SHAversion values.
+ */
+#define ADUC_HASH_UTILS_OPENSSL_STATE_SIZE 256
+
+/**
+ * @brief Implementations of the SHA algorithms.
+ */
+typedef enum tagADUC_HashUtils_Backend
+{
+    ADUC_HashUtils_Backend_Default = 0, /**< OpenSSL when built with ADUC_HASH_WITH_OPENSSL, Portable otherwise. */
+    ADUC_HashUtils_Backend_Portable = 1, /**< The azure-c-shared-utility USHA code. */
+    ADUC_HashUtils_Backend_OpenSSL = 2, /**< OpenSSL, which uses the CPU's SHA instructions where available. */
+} ADUC_HashUtils_Backend;
+
+/**
+ * @brief Running hash over data that arrives in pieces, e.g. while a file is being downloaded.
+ *
+ * The state is a plain value without pointers, so it can be copied and persisted to resume a hash later.
+ */
+typedef struct tagADUC_HashUtils_Stream
+{
+    union
+    {
+        USHAContext Portable; /**< State of the Portable backend. */
+        uint64_t OpenSSL[ADUC_HASH_UTILS_OPENSSL_STATE_SIZE / sizeof(uint64_t)]; /**< SHA*_CTX of OpenSSL. */
+    } Context; /**< The SHA context the data is fed into. */
+    SHAversion Algorithm; /**< The algorithm @p Context was reset with. */
+    ADUC_HashUtils_Backend Backend; /**< The backend @p Context belongs to, never Default. */
+    uint64_t BytesHashed; /**< Total number of bytes fed into the stream so far. */
+} ADUC_HashUtils_Stream;
+
+/**
+ * @brief Maximum number of algorithms of an ADUC_HashUtils_MultiStream, one per SHAversion.
+ */
+#define ADUC_HASH_UTILS_MAX_ALGORITHMS 5
+
+/**
+ * @brief Computes several hashes of the same data in a single pass.
+ */
+typedef struct tagADUC_HashUtils_MultiStream
+{
+    ADUC_HashUtils_Stream Streams[ADUC_HASH_UTILS_MAX_ALGORITHMS]; /**< One stream per algorithm. */
+    size_t StreamCount; /**< Number of used entries of @p Streams. */
+} ADUC_HashUtils_MultiStream;
+
+_Bool ADUC_HashUtils_StreamInit(ADUC_HashUtils_Stream* stream, SHAversion algorithm);
+
+_Bool ADUC_HashUtils_StreamInitWithBackend(
+    ADUC_HashUtils_Stream* stream, SHAversion algorithm, ADUC_HashUtils_Backend backend);
+
+_Bool ADUC_HashUtils_StreamUpdate(ADUC_HashUtils_Stream* stream, const uint8_t* buffer, size_t bufferLen);
+
+_Bool ADUC_HashUtils_StreamFinal(ADUC_HashUtils_Stream* stream, uint8_t* hash);
+
+_Bool ADUC_HashUtils_StreamIsValid(ADUC_HashUtils_Stream* stream, const char* hashBase64);
+
+_Bool ADUC_HashUtils_MultiStreamInit(
+    ADUC_HashUtils_MultiStream* stream, const SHAversion* algorithms, size_t algorithmCount);
+
+_Bool ADUC_HashUtils_MultiStreamUpdate(ADUC_HashUtils_MultiStream* stream, const uint8_t* buffer, size_t bufferLen);
+
+_Bool ADUC_HashUtils_MultiStreamIsValid(ADUC_HashUtils_MultiStream* stream, const char* const* hashesBase64);
+
 _Bool ADUC_HashUtils_IsValidFileHash(const char* path, const char* hashBase64, SHAversion algorithm);
 
+_Bool ADUC_HashUtils_IsValidFileHashes(
+    const char* path, const char* const* hashesBase64, const SHAversion* algorithms, size_t algorithmCount);
+
+_Bool ADUC_HashUtils_IsValidFileHashesUncached(
+    const char* path, const char* const* hashesBase64, const SHAversion* algorithms, size_t algorithmCount);
+
+void ADUC_HashUtils_RecordVerifiedFileHash(const char* path, const char* hashBase64, SHAversion algorithm);
+
 _Bool ADUC_HashUtils_IsValidBufferHash(
     const uint8_t* buffer, size_t bufferLen, const char* hashBase64, SHAversion algorithm);
 
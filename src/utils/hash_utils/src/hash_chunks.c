@@ -0,0 +1,360 @@
+/**
+ * @file hash_chunks.c
+ * @brief Implements parallel verification of files against chunk manifests.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#include "aduc/hash_chunks.h"
+#include "aduc/hash_utils.h"
+
+#include <errno.h> // for errno, EINTR
+#include <fcntl.h> // for open
+#include <pthread.h> // for pthread_create, pthread_mutex_t
+#include <stdlib.h> // for calloc, free, posix_memalign
+#include <string.h> // for memcmp, memcpy, memset
+#include <sys/stat.h> // for fstat
+#include <unistd.h> // for pread, close, sysconf
+
+#include <azure_c_shared_utility/azure_base64.h>
+#include <azure_c_shared_utility/buffer_.h>
+
+#include <aduc/logging.h>
+
+#include <parson.h>
+
+/**
+ * @brief Size of each read while hashing a chunk.
+ */
+static const size_t c_chunkReadBlockSize = 1024 * 1024;
+
+/**
+ * @brief Work shared by the verification threads.
+ */
+typedef struct tagChunkVerifier
+{
+    const ADUC_HashUtils_ChunkManifest* Manifest; /**< The manifest to verify against. */
+    int Fd; /**< The file being verified, read with pread by all threads. */
+    pthread_mutex_t Mutex; /**< Guards NextChunk and InvalidCount. */
+    size_t NextChunk; /**< Next chunk to be taken by a thread. */
+    size_t InvalidCount; /**< Number of corrupt chunks found so far. */
+    _Bool* ChunkIsValid; /**< Optional per-chunk result. */
+} ChunkVerifier;
+
+/**
+ * @brief Decodes @p hashBase64 into @p hash.
+ * @returns bool True if it decoded to exactly @p hashSize bytes.
+ */
+static bool DecodeHash(const char* hashBase64, uint8_t* hash, size_t hashSize)
+{
+    bool success = false;
+
+    BUFFER_HANDLE decoded = Azure_Base64_Decode(hashBase64);
+    if (decoded == NULL)
+    {
+        return false;
+    }
+
+    if (BUFFER_length(decoded) == hashSize)
+    {
+        memcpy(hash, BUFFER_u_char(decoded), hashSize);
+        success = true;
+    }
+
+    BUFFER_delete(decoded);
+    return success;
+}
+
+/**
+ * @brief Loads and checks the chunk manifest at @p path.
+ * The chunk count must match the file size, and the root hash must match the chunk hashes.
+ *
+ * @param path The manifest file.
+ * @param manifest Receives the manifest. Free with ADUC_HashUtils_ChunkManifest_Uninit.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_ChunkManifest_Load(const char* path, ADUC_HashUtils_ChunkManifest* manifest)
+{
+    _Bool success = false;
+    ADUC_HashUtils_Stream rootStream;
+    uint8_t expectedRoot[USHAMaxHashSize];
+    uint8_t root[USHAMaxHashSize];
+
+    memset(manifest, 0, sizeof(*manifest));
+
+    JSON_Value* rootValue = json_parse_file(path);
+    const JSON_Object* object = json_value_get_object(rootValue);
+    if (object == NULL)
+    {
+        Log_Error("Cannot parse chunk manifest %s", path);
+        goto done;
+    }
+
+    const char* algorithmName = json_object_get_string(object, "algorithm");
+    const double chunkSize = json_object_get_number(object, "chunkSize");
+    const double fileSize = json_object_get_number(object, "fileSize");
+    const JSON_Array* chunks = json_object_get_array(object, "chunks");
+    const char* rootBase64 = json_object_get_string(object, "root");
+
+    if (algorithmName == NULL || !ADUC_HashUtils_GetShaVersionForTypeString(algorithmName, &manifest->Algorithm)
+        || chunkSize < 1 || fileSize < 0 || chunks == NULL || rootBase64 == NULL)
+    {
+        Log_Error("Chunk manifest %s is incomplete", path);
+        goto done;
+    }
+
+    manifest->ChunkSize = (uint64_t)chunkSize;
+    manifest->FileSize = (uint64_t)fileSize;
+    manifest->ChunkCount = json_array_get_count(chunks);
+    manifest->HashSize = (size_t)USHAHashSize(manifest->Algorithm);
+
+    if (manifest->ChunkCount != (manifest->FileSize + manifest->ChunkSize - 1) / manifest->ChunkSize)
+    {
+        Log_Error(
+            "Chunk manifest %s lists %zu chunks for %llu bytes",
+            path,
+            manifest->ChunkCount,
+            (unsigned long long)manifest->FileSize);
+        goto done;
+    }
+
+    manifest->Hashes = (uint8_t*)calloc(manifest->ChunkCount + 1, manifest->HashSize);
+    if (manifest->Hashes == NULL)
+    {
+        goto done;
+    }
+
+    if (!ADUC_HashUtils_StreamInit(&rootStream, manifest->Algorithm))
+    {
+        goto done;
+    }
+
+    for (size_t i = 0; i < manifest->ChunkCount; ++i)
+    {
+        uint8_t* hash = manifest->Hashes + i * manifest->HashSize;
+        const char* hashBase64 = json_array_get_string(chunks, i);
+
+        if (hashBase64 == NULL || !DecodeHash(hashBase64, hash, manifest->HashSize)
+            || !ADUC_HashUtils_StreamUpdate(&rootStream, hash, manifest->HashSize))
+        {
+            Log_Error("Chunk manifest %s has an invalid hash for chunk %zu", path, i);
+            goto done;
+        }
+    }
+
+    if (!DecodeHash(rootBase64, expectedRoot, manifest->HashSize) || !ADUC_HashUtils_StreamFinal(&rootStream, root)
+        || memcmp(root, expectedRoot, manifest->HashSize) != 0)
+    {
+        Log_Error("Root hash of chunk manifest %s does not match its chunks", path);
+        goto done;
+    }
+
+    success = true;
+
+done:
+    if (!success)
+    {
+        ADUC_HashUtils_ChunkManifest_Uninit(manifest);
+    }
+
+    json_value_free(rootValue);
+    return success;
+}
+
+/**
+ * @brief Frees the hashes of @p manifest.
+ *
+ * @param manifest A manifest loaded with ADUC_HashUtils_ChunkManifest_Load.
+ */
+void ADUC_HashUtils_ChunkManifest_Uninit(ADUC_HashUtils_ChunkManifest* manifest)
+{
+    free(manifest->Hashes);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+/**
+ * @brief Hashes chunk @p index of the file and compares it to the manifest.
+ *
+ * @param verifier The shared state.
+ * @param index The chunk.
+ * @param buffer Read buffer of c_chunkReadBlockSize bytes.
+ * @return bool True if the chunk is complete and its hash matches.
+ */
+static bool VerifyChunk(const ChunkVerifier* verifier, size_t index, uint8_t* buffer)
+{
+    const ADUC_HashUtils_ChunkManifest* manifest = verifier->Manifest;
+    ADUC_HashUtils_Stream stream;
+    uint8_t hash[USHAMaxHashSize];
+
+    uint64_t offset = (uint64_t)index * manifest->ChunkSize;
+    uint64_t remaining = manifest->FileSize - offset;
+    if (remaining > manifest->ChunkSize)
+    {
+        remaining = manifest->ChunkSize;
+    }
+
+    if (!ADUC_HashUtils_StreamInit(&stream, manifest->Algorithm))
+    {
+        return false;
+    }
+
+    while (remaining > 0)
+    {
+        const size_t readSize = (remaining > c_chunkReadBlockSize) ? c_chunkReadBlockSize : (size_t)remaining;
+        const ssize_t bytesRead = pread(verifier->Fd, buffer, readSize, (off_t)offset);
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        // A short file leaves its last chunks incomplete.
+        if (bytesRead <= 0 || !ADUC_HashUtils_StreamUpdate(&stream, buffer, (size_t)bytesRead))
+        {
+            return false;
+        }
+
+        offset += (uint64_t)bytesRead;
+        remaining -= (uint64_t)bytesRead;
+    }
+
+    return ADUC_HashUtils_StreamFinal(&stream, hash)
+           && memcmp(hash, manifest->Hashes + index * manifest->HashSize, manifest->HashSize) == 0;
+}
+
+/**
+ * @brief Verification thread. Takes chunks until none are left.
+ *
+ * @param context The ChunkVerifier.
+ * @return void* Always NULL.
+ */
+static void* VerifyChunksThread(void* context)
+{
+    ChunkVerifier* verifier = (ChunkVerifier*)context;
+    void* buffer = NULL;
+
+    if (posix_memalign(&buffer, 4096, c_chunkReadBlockSize) != 0)
+    {
+        buffer = NULL;
+    }
+
+    for (;;)
+    {
+        pthread_mutex_lock(&verifier->Mutex);
+        const size_t index = verifier->NextChunk++;
+        pthread_mutex_unlock(&verifier->Mutex);
+
+        if (index >= verifier->Manifest->ChunkCount)
+        {
+            break;
+        }
+
+        const bool isValid = (buffer != NULL) && VerifyChunk(verifier, index, (uint8_t*)buffer);
+        if (!isValid)
+        {
+            Log_Warn("Chunk %zu is corrupt", index);
+
+            pthread_mutex_lock(&verifier->Mutex);
+            ++verifier->InvalidCount;
+            pthread_mutex_unlock(&verifier->Mutex);
+        }
+
+        if (verifier->ChunkIsValid != NULL)
+        {
+            verifier->ChunkIsValid[index] = isValid;
+        }
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * @brief Verifies every chunk of the file at @p path against @p manifest, using several threads.
+ *
+ * @param path The file to verify.
+ * @param manifest The chunk manifest of the file.
+ * @param threadCount Number of threads to use, 0 for one per online CPU.
+ * @param chunkIsValid Optional, receives the result of each of the manifest's ChunkCount chunks.
+ * @return bool True if the file has the expected size and all chunks are valid. False with all chunks valid
+ * means the file is longer than the manifest says.
+ */
+_Bool ADUC_HashUtils_VerifyFileChunks(
+    const char* path, const ADUC_HashUtils_ChunkManifest* manifest, unsigned int threadCount, _Bool* chunkIsValid)
+{
+    _Bool success = false;
+    ChunkVerifier verifier;
+    pthread_t* threads = NULL;
+    size_t startedCount = 0;
+    struct stat st;
+
+    memset(&verifier, 0, sizeof(verifier));
+    verifier.Manifest = manifest;
+    verifier.ChunkIsValid = chunkIsValid;
+    pthread_mutex_init(&verifier.Mutex, NULL);
+
+    if (chunkIsValid != NULL)
+    {
+        memset(chunkIsValid, 0, manifest->ChunkCount * sizeof(chunkIsValid[0]));
+    }
+
+    verifier.Fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (verifier.Fd == -1 || fstat(verifier.Fd, &st) != 0)
+    {
+        Log_Error("Cannot open %s, errno: %d", path, errno);
+        goto done;
+    }
+
+    if (threadCount == 0)
+    {
+        const long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+        threadCount = (cpuCount > 0) ? (unsigned int)cpuCount : 1;
+    }
+
+    if (threadCount > manifest->ChunkCount)
+    {
+        threadCount = (manifest->ChunkCount > 0) ? (unsigned int)manifest->ChunkCount : 1;
+    }
+
+    // The calling thread is a verifier as well.
+    threads = (pthread_t*)calloc(threadCount, sizeof(pthread_t));
+    for (unsigned int i = 1; threads != NULL && i < threadCount; ++i)
+    {
+        if (pthread_create(&threads[startedCount], NULL, VerifyChunksThread, &verifier) != 0)
+        {
+            Log_Warn("Cannot start chunk verification thread, continuing with %zu", startedCount + 1);
+            break;
+        }
+
+        ++startedCount;
+    }
+
+    Log_Info("Verifying %zu chunks of %s using %zu threads", manifest->ChunkCount, path, startedCount + 1);
+
+    VerifyChunksThread(&verifier);
+
+    for (size_t i = 0; i < startedCount; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    if ((uint64_t)st.st_size != manifest->FileSize)
+    {
+        Log_Error(
+            "%s has %lld bytes, expected %llu",
+            path,
+            (long long)st.st_size,
+            (unsigned long long)manifest->FileSize);
+    }
+
+    success = (verifier.InvalidCount == 0) && (uint64_t)st.st_size == manifest->FileSize;
+
+done:
+    free(threads);
+
+    if (verifier.Fd != -1)
+    {
+        close(verifier.Fd);
+    }
+
+    pthread_mutex_destroy(&verifier.Mutex);
+    return success;
+}
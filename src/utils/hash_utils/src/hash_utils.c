@@ -6,9 +6,21 @@
  */
 #include "aduc/hash_utils.h"
 
-#include <stdio.h> // for FILE
-#include <stdlib.h> // for calloc
+#ifdef ADUC_HASH_UTILS_OPENSSL
+#    include "hash_utils_openssl.h"
+#endif
+
+#include <errno.h> // for errno, EINTR
+#include <fcntl.h> // for open, posix_fadvise
+#include <inttypes.h> // for uintmax_t, intmax_t
+#include <limits.h> // for UINT_MAX
+#include <stdio.h> // for snprintf
+#include <stdlib.h> // for posix_memalign, free
+#include <string.h> // for memset, strcmp
 #include <strings.h> // for strcasecmp
+#include <sys/stat.h> // for fstat
+#include <sys/xattr.h> // for fgetxattr, fsetxattr
+#include <unistd.h> // for read, close
 
 #include <azure_c_shared_utility/azure_base64.h>
 #include <azure_c_shared_utility/buffer_.h>
@@ -17,24 +29,42 @@
 #include <aduc/logging.h>
 
 /**
- * @brief Helper function gets the calculated hash from the @p context, compares it to @p hashBase64, and returns the appropraite value
- * @param context Context in which the hash was calculated and stored
- * @param hashBase64 The expected hash from the context
- * @param algorithm the algorithm used to calculate the hash
- * @returns bool True if the hash is valid and equals @p hashBase64
+ * @brief Read size of ADUC_HashUtils_IsValidFileHash. Large reads keep the per-call overhead negligible next to the
+ * hashing itself, even with SHA instructions.
  */
-static bool GetResultAndCompareHashes(USHAContext* context, const char* hashBase64, SHAversion algorithm)
-{
-    // "USHAHashSize(algorithm)" is more precise, but requires a variable length array, or heap allocation.
-    uint8_t buffer_hash[USHAMaxHashSize];
+static const size_t c_fileReadBlockSize = 1024 * 1024;
 
-    if (USHAResult(context, (uint8_t*)buffer_hash) != 0)
-    {
-        Log_Error("Error in SHA Result, SHAversion: %d", algorithm);
-        return false;
-    }
+/**
+ * @brief Alignment of the read buffer, lets the kernel copy whole pages.
+ */
+static const size_t c_fileReadBlockAlignment = 4096;
+
+/**
+ * @brief Slice of a block that ADUC_HashUtils_MultiStreamUpdate feeds to each algorithm in turn. Small enough to
+ * stay in the CPU cache while all algorithms pass over it, so the data is fetched from memory only once.
+ */
+static const size_t c_multiStreamSliceSize = 64 * 1024;
+
+/**
+ * @brief Prefix of the extended attributes that record a verified hash, followed by the algorithm name.
+ */
+static const char* c_verifiedHashAttributePrefix = "user.adu.verified.";
 
-    STRING_HANDLE encoded_file_hash = Azure_Base64_Encode_Bytes((unsigned char*)buffer_hash, USHAHashSize(algorithm));
+/**
+ * @brief Large enough for a verified-hash record with a base64 SHA512 hash.
+ */
+#define VERIFIED_HASH_RECORD_SIZE 256
+
+/**
+ * @brief Helper function compares the calculated @p hash to @p hashBase64, and returns the appropraite value
+ * @param hash The calculated hash, USHAHashSize(algorithm) bytes
+ * @param hashBase64 The expected hash
+ * @param algorithm the algorithm used to calculate the hash
+ * @returns bool True if the hash equals @p hashBase64
+ */
+static bool CompareHashes(const uint8_t* hash, const char* hashBase64, SHAversion algorithm)
+{
+    STRING_HANDLE encoded_file_hash = Azure_Base64_Encode_Bytes((const unsigned char*)hash, USHAHashSize(algorithm));
     if (encoded_file_hash == NULL)
     {
         Log_Error("Error in Base64 Encoding");
@@ -43,9 +73,6 @@ static bool GetResultAndCompareHashes(USHAContext* context, const char* hashBase
 
     const bool hashMatches = strcmp(hashBase64, STRING_c_str(encoded_file_hash)) == 0;
 
-    STRING_delete(encoded_file_hash);
-    encoded_file_hash = NULL;
-
     if (!hashMatches)
     {
         Log_Error(
@@ -53,12 +80,363 @@ static bool GetResultAndCompareHashes(USHAContext* context, const char* hashBase
             hashBase64,
             STRING_c_str(encoded_file_hash),
             algorithm);
+    }
+
+    STRING_delete(encoded_file_hash);
+    encoded_file_hash = NULL;
+
+    return hashMatches;
+}
+
+/**
+ * @brief Returns the lower-case name of @p algorithm, as used in update manifests.
+ */
+static const char* GetAlgorithmName(SHAversion algorithm)
+{
+    switch (algorithm)
+    {
+    case SHA1:
+        return "sha1";
+    case SHA224:
+        return "sha224";
+    case SHA256:
+        return "sha256";
+    case SHA384:
+        return "sha384";
+    case SHA512:
+        return "sha512";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * @brief Formats the verified-hash record of a file.
+ * The record names the file's device, inode, size and mtime, so any modification or replacement of the file
+ * invalidates it. Copies of the file carry the attribute along, but have another inode.
+ *
+ * @param st The file's status.
+ * @param hashBase64 The verified hash.
+ * @param record Receives the record.
+ * @return bool True if the record fit.
+ */
+static bool FormatVerifiedHashRecord(const struct stat* st, const char* hashBase64, char* record)
+{
+    const int length = snprintf(
+        record,
+        VERIFIED_HASH_RECORD_SIZE,
+        "1 %ju %ju %jd %jd.%09ld %s",
+        (uintmax_t)st->st_dev,
+        (uintmax_t)st->st_ino,
+        (intmax_t)st->st_size,
+        (intmax_t)st->st_mtim.tv_sec,
+        st->st_mtim.tv_nsec,
+        hashBase64);
+
+    return length > 0 && length < VERIFIED_HASH_RECORD_SIZE;
+}
+
+/**
+ * @brief Checks whether the file was verified against @p hashBase64 before and not modified since.
+ *
+ * @param fd The open file.
+ * @param st The file's status.
+ * @param hashBase64 The expected hash.
+ * @param algorithm The algorithm of @p hashBase64.
+ * @return bool True if a matching record exists.
+ */
+static bool IsVerifiedHashCached(int fd, const struct stat* st, const char* hashBase64, SHAversion algorithm)
+{
+    char name[64];
+    char expected[VERIFIED_HASH_RECORD_SIZE];
+    char stored[VERIFIED_HASH_RECORD_SIZE];
+
+    snprintf(name, sizeof(name), "%s%s", c_verifiedHashAttributePrefix, GetAlgorithmName(algorithm));
+
+    if (!FormatVerifiedHashRecord(st, hashBase64, expected))
+    {
+        return false;
+    }
+
+    const ssize_t length = fgetxattr(fd, name, stored, sizeof(stored) - 1);
+    if (length <= 0)
+    {
+        return false;
+    }
+
+    stored[length] = '\0';
+    return strcmp(stored, expected) == 0;
+}
+
+/**
+ * @brief Records that the file matches @p hashBase64. Best effort: on file systems without user extended
+ * attributes, or without write access to the file, nothing is recorded and the next check reads the file again.
+ *
+ * @param fd The open file.
+ * @param st The file's status while it was hashed.
+ * @param hashBase64 The verified hash.
+ * @param algorithm The algorithm of @p hashBase64.
+ */
+static void CacheVerifiedHash(int fd, const struct stat* st, const char* hashBase64, SHAversion algorithm)
+{
+    char name[64];
+    char record[VERIFIED_HASH_RECORD_SIZE];
+
+    snprintf(name, sizeof(name), "%s%s", c_verifiedHashAttributePrefix, GetAlgorithmName(algorithm));
+
+    if (FormatVerifiedHashRecord(st, hashBase64, record) && fsetxattr(fd, name, record, strlen(record), 0) != 0)
+    {
+        Log_Debug("Cannot record verified hash in %s, errno: %d", name, errno);
+    }
+}
+
+/**
+ * @brief Resets @p stream so that it is ready to hash new data with @p algorithm.
+ *
+ * @param stream The stream to initialize.
+ * @param algorithm The hashing algorithm to use.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_StreamInit(ADUC_HashUtils_Stream* stream, SHAversion algorithm)
+{
+    return ADUC_HashUtils_StreamInitWithBackend(stream, algorithm, ADUC_HashUtils_Backend_Default);
+}
+
+/**
+ * @brief Resets @p stream so that it is ready to hash new data with @p algorithm, using a specific implementation.
+ * Meant for comparing the backends; everything else should use ADUC_HashUtils_StreamInit.
+ *
+ * @param stream The stream to initialize.
+ * @param algorithm The hashing algorithm to use.
+ * @param backend The implementation to use.
+ * @return bool True on success, false if @p backend is not available in this build.
+ */
+_Bool ADUC_HashUtils_StreamInitWithBackend(
+    ADUC_HashUtils_Stream* stream, SHAversion algorithm, ADUC_HashUtils_Backend backend)
+{
+    memset(stream, 0, sizeof(*stream));
+
+    if (backend == ADUC_HashUtils_Backend_Default)
+    {
+#ifdef ADUC_HASH_UTILS_OPENSSL
+        backend = ADUC_HashUtils_Backend_OpenSSL;
+#else
+        backend = ADUC_HashUtils_Backend_Portable;
+#endif
+    }
+
+    switch (backend)
+    {
+    case ADUC_HashUtils_Backend_Portable:
+        if (USHAReset(&stream->Context.Portable, algorithm) != 0)
+        {
+            Log_Error("Error in SHA Reset, SHAversion: %d", algorithm);
+            return false;
+        }
+        break;
+
+#ifdef ADUC_HASH_UTILS_OPENSSL
+    case ADUC_HashUtils_Backend_OpenSSL:
+        if (!ADUC_HashUtils_OpenSSL_Reset(stream->Context.OpenSSL, USHAHashSize(algorithm)))
+        {
+            Log_Error("Error in OpenSSL SHA Init, SHAversion: %d", algorithm);
+            return false;
+        }
+        break;
+#endif
+
+    default:
+        Log_Error("Hash backend %d is not available", backend);
+        return false;
+    }
+
+    stream->Algorithm = algorithm;
+    stream->Backend = backend;
+    return true;
+}
+
+/**
+ * @brief Feeds the next @p bufferLen bytes of the data into @p stream.
+ *
+ * @param stream A stream initialized with ADUC_HashUtils_StreamInit.
+ * @param buffer The data to hash.
+ * @param bufferLen The length of @p buffer.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_StreamUpdate(ADUC_HashUtils_Stream* stream, const uint8_t* buffer, size_t bufferLen)
+{
+#ifdef ADUC_HASH_UTILS_OPENSSL
+    if (stream->Backend == ADUC_HashUtils_Backend_OpenSSL)
+    {
+        if (!ADUC_HashUtils_OpenSSL_Input(
+                stream->Context.OpenSSL, USHAHashSize(stream->Algorithm), buffer, bufferLen))
+        {
+            Log_Error("Error in OpenSSL SHA Update, SHAversion: %d", stream->Algorithm);
+            return false;
+        }
+
+        stream->BytesHashed += bufferLen;
+        return true;
+    }
+#endif
+
+    // USHAInput takes an unsigned int length, so feed very large buffers in slices.
+    while (bufferLen > 0)
+    {
+        const unsigned int sliceLen = (bufferLen > UINT_MAX) ? UINT_MAX : (unsigned int)bufferLen;
+
+        if (USHAInput(&stream->Context.Portable, buffer, sliceLen) != 0)
+        {
+            Log_Error("Error in SHA Input, SHAversion: %d", stream->Algorithm);
+            return false;
+        }
+
+        buffer += sliceLen;
+        bufferLen -= sliceLen;
+        stream->BytesHashed += sliceLen;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Finishes @p stream and returns the hash of all data fed into it.
+ * The stream must be re-initialized before it can be used again.
+ *
+ * @param stream A stream initialized with ADUC_HashUtils_StreamInit.
+ * @param hash Receives USHAHashSize(stream->Algorithm) bytes, at most USHAMaxHashSize.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_StreamFinal(ADUC_HashUtils_Stream* stream, uint8_t* hash)
+{
+#ifdef ADUC_HASH_UTILS_OPENSSL
+    if (stream->Backend == ADUC_HashUtils_Backend_OpenSSL)
+    {
+        if (!ADUC_HashUtils_OpenSSL_Result(stream->Context.OpenSSL, USHAHashSize(stream->Algorithm), hash))
+        {
+            Log_Error("Error in OpenSSL SHA Final, SHAversion: %d", stream->Algorithm);
+            return false;
+        }
+
+        return true;
+    }
+#endif
+
+    if (USHAResult(&stream->Context.Portable, hash) != 0)
+    {
+        Log_Error("Error in SHA Result, SHAversion: %d", stream->Algorithm);
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Finishes @p stream and checks whether the hash of all data fed into it matches @p hashBase64.
+ * The stream must be re-initialized before it can be used again.
+ *
+ * @param stream A stream initialized with ADUC_HashUtils_StreamInit.
+ * @param hashBase64 The expected hash of the data.
+ * @return bool True if the hash is valid and matches @p hashBase64
+ */
+_Bool ADUC_HashUtils_StreamIsValid(ADUC_HashUtils_Stream* stream, const char* hashBase64)
+{
+    // "USHAHashSize(algorithm)" is more precise, but requires a variable length array, or heap allocation.
+    uint8_t buffer_hash[USHAMaxHashSize];
+
+    if (!ADUC_HashUtils_StreamFinal(stream, buffer_hash))
+    {
+        return false;
+    }
+
+    return CompareHashes(buffer_hash, hashBase64, stream->Algorithm);
+}
+
+/**
+ * @brief Resets @p stream so that it computes a hash for each of @p algorithms in a single pass over the data.
+ *
+ * @param stream The stream to initialize.
+ * @param algorithms The hashing algorithms to use.
+ * @param algorithmCount Number of @p algorithms, 1 to ADUC_HASH_UTILS_MAX_ALGORITHMS.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_MultiStreamInit(
+    ADUC_HashUtils_MultiStream* stream, const SHAversion* algorithms, size_t algorithmCount)
+{
+    memset(stream, 0, sizeof(*stream));
+
+    if (algorithmCount == 0 || algorithmCount > ADUC_HASH_UTILS_MAX_ALGORITHMS)
+    {
+        Log_Error("Unsupported number of hash algorithms: %zu", algorithmCount);
         return false;
     }
 
+    for (size_t i = 0; i < algorithmCount; ++i)
+    {
+        if (!ADUC_HashUtils_StreamInit(&stream->Streams[i], algorithms[i]))
+        {
+            return false;
+        }
+    }
+
+    stream->StreamCount = algorithmCount;
+    return true;
+}
+
+/**
+ * @brief Feeds the next @p bufferLen bytes of the data into every algorithm of @p stream.
+ * The algorithms are updated in lockstep, slice by slice, so each slice is hashed while it is still cached.
+ *
+ * @param stream A stream initialized with ADUC_HashUtils_MultiStreamInit.
+ * @param buffer The data to hash.
+ * @param bufferLen The length of @p buffer.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_MultiStreamUpdate(ADUC_HashUtils_MultiStream* stream, const uint8_t* buffer, size_t bufferLen)
+{
+    while (bufferLen > 0)
+    {
+        const size_t sliceLen = (bufferLen > c_multiStreamSliceSize) ? c_multiStreamSliceSize : bufferLen;
+
+        for (size_t i = 0; i < stream->StreamCount; ++i)
+        {
+            if (!ADUC_HashUtils_StreamUpdate(&stream->Streams[i], buffer, sliceLen))
+            {
+                return false;
+            }
+        }
+
+        buffer += sliceLen;
+        bufferLen -= sliceLen;
+    }
+
     return true;
 }
 
+/**
+ * @brief Finishes @p stream and checks whether every hash of the data matches the expected one.
+ * All hashes are checked, so that each mismatch is logged. The stream must be re-initialized before it can be
+ * used again.
+ *
+ * @param stream A stream initialized with ADUC_HashUtils_MultiStreamInit.
+ * @param hashesBase64 The expected hashes, in the order of the algorithms passed to ADUC_HashUtils_MultiStreamInit.
+ * @return bool True if all hashes are valid and match.
+ */
+_Bool ADUC_HashUtils_MultiStreamIsValid(ADUC_HashUtils_MultiStream* stream, const char* const* hashesBase64)
+{
+    _Bool allValid = (stream->StreamCount > 0);
+
+    for (size_t i = 0; i < stream->StreamCount; ++i)
+    {
+        if (!ADUC_HashUtils_StreamIsValid(&stream->Streams[i], hashesBase64[i]))
+        {
+            allValid = false;
+        }
+    }
+
+    return allValid;
+}
+
 /**
  * @brief Checks if the hash of the file at @p path matches @p hashBase64
  *
@@ -68,51 +446,181 @@ static bool GetResultAndCompareHashes(USHAContext* context, const char* hashBase
  * @return bool True if the hash is valid and matches @p hashBase64
  */
 _Bool ADUC_HashUtils_IsValidFileHash(const char* path, const char* hashBase64, SHAversion algorithm)
+{
+    return ADUC_HashUtils_IsValidFileHashes(path, &hashBase64, &algorithm, 1);
+}
+
+/**
+ * @brief Checks if the file at @p path matches all of @p hashesBase64, reading it only once unless
+ * @p useVerifiedRecord and the file has a matching record.
+ */
+static _Bool IsValidFileHashes(
+    const char* path,
+    const char* const* hashesBase64,
+    const SHAversion* algorithms,
+    size_t algorithmCount,
+    _Bool useVerifiedRecord)
 {
     _Bool success = false;
+    ADUC_HashUtils_MultiStream stream;
+    void* buffer = NULL;
+    struct stat before;
+    struct stat after;
+    size_t cachedCount = 0;
 
-    FILE* file = fopen(path, "rb");
-    if (file == NULL)
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
         Log_Error("No such file or directory: %s", path);
         goto done;
     }
 
-    USHAContext context;
+    if (fstat(fd, &before) != 0)
+    {
+        Log_Error("Cannot stat %s, errno: %d", path, errno);
+        goto done;
+    }
+
+    while (useVerifiedRecord && cachedCount < algorithmCount
+           && IsVerifiedHashCached(fd, &before, hashesBase64[cachedCount], algorithms[cachedCount]))
+    {
+        ++cachedCount;
+    }
+
+    if (algorithmCount > 0 && cachedCount == algorithmCount)
+    {
+        Log_Info("%s is unchanged since its hash was verified, not reading it again", path);
+        success = true;
+        goto done;
+    }
+
+    // The file is read once front to back; let the kernel read ahead aggressively and not keep it cached.
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (posix_memalign(&buffer, c_fileReadBlockAlignment, c_fileReadBlockSize) != 0)
+    {
+        buffer = NULL;
+        Log_Error("Out of memory hashing %s", path);
+        goto done;
+    }
 
-    if (USHAReset(&context, algorithm) != 0)
+    if (!ADUC_HashUtils_MultiStreamInit(&stream, algorithms, algorithmCount))
     {
-        Log_Error("Error in SHA Reset, SHAversion: %d", algorithm);
         goto done;
-    };
+    }
 
-    // Repeatedly read and hash chunks of the file
-    while (!feof(file))
+    // Repeatedly read and hash blocks of the file
+    for (;;)
     {
-        uint8_t buffer[USHA_Max_Message_Block_Size];
-        const size_t readSize = fread(buffer, sizeof(buffer[0]), ARRAY_SIZE(buffer), file);
+        const ssize_t readSize = read(fd, buffer, c_fileReadBlockSize);
         if (readSize == 0)
         {
             break;
         }
 
-        if (USHAInput(&context, buffer, readSize) != 0)
+        if (readSize < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            Log_Error("Error reading %s, errno: %d", path, errno);
+            goto done;
+        }
+
+        if (!ADUC_HashUtils_MultiStreamUpdate(&stream, (const uint8_t*)buffer, (size_t)readSize))
         {
-            Log_Error("Error in SHA Input, SHAversion: %d", algorithm);
             goto done;
-        };
+        }
     }
 
-    success = GetResultAndCompareHashes(&context, hashBase64, algorithm);
-    if (!success)
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+    success = ADUC_HashUtils_MultiStreamIsValid(&stream, hashesBase64);
+
+    // Only record the result if the file was not modified while it was read.
+    if (success && fstat(fd, &after) == 0 && after.st_size == before.st_size
+        && after.st_mtim.tv_sec == before.st_mtim.tv_sec && after.st_mtim.tv_nsec == before.st_mtim.tv_nsec)
     {
-        goto done;
+        for (size_t i = 0; i < algorithmCount; ++i)
+        {
+            CacheVerifiedHash(fd, &before, hashesBase64[i], algorithms[i]);
+        }
     }
 
 done:
+    free(buffer);
+
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
     return success;
 }
 
+/**
+ * @brief Checks if the file at @p path matches all of @p hashesBase64, reading it only once.
+ *
+ * Successful checks are recorded in extended attributes of the file. A later check of the unchanged file against
+ * the same hashes returns without reading it, e.g. when a payload is validated again after a restart.
+ *
+ * @param path The path to the file to check
+ * @param hashesBase64 The expected hashes of the file at @p path
+ * @param algorithms The algorithm of each of @p hashesBase64.
+ * @param algorithmCount Number of hashes, 1 to ADUC_HASH_UTILS_MAX_ALGORITHMS.
+ * @return bool True if all hashes are valid and match
+ */
+_Bool ADUC_HashUtils_IsValidFileHashes(
+    const char* path, const char* const* hashesBase64, const SHAversion* algorithms, size_t algorithmCount)
+{
+    return IsValidFileHashes(path, hashesBase64, algorithms, algorithmCount, true /*useVerifiedRecord*/);
+}
+
+/**
+ * @brief Like ADUC_HashUtils_IsValidFileHashes, but always reads the file.
+ * The verified-hash record only proves that the file is unchanged against writers that cannot also rewrite the
+ * record and the mtime, i.e. against anyone but the file's owner. Use this for files whose owner is not trusted.
+ *
+ * @param path The path to the file to check
+ * @param hashesBase64 The expected hashes of the file at @p path
+ * @param algorithms The algorithm of each of @p hashesBase64.
+ * @param algorithmCount Number of hashes, 1 to ADUC_HASH_UTILS_MAX_ALGORITHMS.
+ * @return bool True if all hashes are valid and match
+ */
+_Bool ADUC_HashUtils_IsValidFileHashesUncached(
+    const char* path, const char* const* hashesBase64, const SHAversion* algorithms, size_t algorithmCount)
+{
+    return IsValidFileHashes(path, hashesBase64, algorithms, algorithmCount, false /*useVerifiedRecord*/);
+}
+
+/**
+ * @brief Records that the file at @p path matches @p hashBase64, after it was verified while being written.
+ * A later ADUC_HashUtils_IsValidFileHash of the unchanged file then does not need to read it.
+ *
+ * @param path The verified file.
+ * @param hashBase64 Its verified hash.
+ * @param algorithm The algorithm of @p hashBase64.
+ */
+void ADUC_HashUtils_RecordVerifiedFileHash(const char* path, const char* hashBase64, SHAversion algorithm)
+{
+    struct stat st;
+
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return;
+    }
+
+    if (fstat(fd, &st) == 0)
+    {
+        CacheVerifiedHash(fd, &st, hashBase64, algorithm);
+    }
+
+    close(fd);
+}
+
 /**
  * @brief Checks if the hash of the @p buffer matches @p hashBase64
  *
@@ -124,21 +632,14 @@ done:
 _Bool ADUC_HashUtils_IsValidBufferHash(
     const uint8_t* buffer, size_t bufferLen, const char* hashBase64, SHAversion algorithm)
 {
-    USHAContext context;
-
-    if (USHAReset(&context, algorithm) != 0)
-    {
-        Log_Error("Error in SHA Reset, SHAversion: %d", algorithm);
-        return false;
-    }
+    ADUC_HashUtils_Stream stream;
 
-    if (USHAInput(&context, buffer, bufferLen) != 0)
+    if (!ADUC_HashUtils_StreamInit(&stream, algorithm) || !ADUC_HashUtils_StreamUpdate(&stream, buffer, bufferLen))
     {
-        Log_Error("Error in SHA Input, SHAversion: %d", algorithm);
         return false;
     }
 
-    return GetResultAndCompareHashes(&context, hashBase64, algorithm);
+    return ADUC_HashUtils_StreamIsValid(&stream, hashBase64);
 }
 
 /**
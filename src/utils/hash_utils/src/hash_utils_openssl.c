@@ -0,0 +1,105 @@
+/**
+ * @file hash_utils_openssl.c
+ * @brief Implements the OpenSSL backend of hash_utils.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+
+// The low-level SHA functions are deprecated in OpenSSL 3 in favor of EVP. Unlike an EVP_MD_CTX, their state is
+// a plain struct, which ADUC_HashUtils_Stream needs to stay copyable and persistable. Both run the same
+// accelerated block functions.
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include "hash_utils_openssl.h"
+
+#include <openssl/sha.h>
+
+/**
+ * @brief Must match ADUC_HASH_UTILS_OPENSSL_STATE_SIZE in aduc/hash_utils.h.
+ */
+#define OPENSSL_STATE_SIZE 256
+
+_Static_assert(sizeof(SHA_CTX) <= OPENSSL_STATE_SIZE, "SHA_CTX does not fit ADUC_HashUtils_Stream");
+_Static_assert(sizeof(SHA256_CTX) <= OPENSSL_STATE_SIZE, "SHA256_CTX does not fit ADUC_HashUtils_Stream");
+_Static_assert(sizeof(SHA512_CTX) <= OPENSSL_STATE_SIZE, "SHA512_CTX does not fit ADUC_HashUtils_Stream");
+
+/**
+ * @brief Resets @p state for the algorithm with @p hashSize.
+ *
+ * @param state ADUC_HashUtils_Stream.Context.OpenSSL.
+ * @param hashSize Hash size of the algorithm in bytes.
+ * @return bool True on success, false for an unknown hash size.
+ */
+_Bool ADUC_HashUtils_OpenSSL_Reset(void* state, size_t hashSize)
+{
+    switch (hashSize)
+    {
+    case SHA_DIGEST_LENGTH:
+        return SHA1_Init((SHA_CTX*)state) == 1;
+    case SHA224_DIGEST_LENGTH:
+        return SHA224_Init((SHA256_CTX*)state) == 1;
+    case SHA256_DIGEST_LENGTH:
+        return SHA256_Init((SHA256_CTX*)state) == 1;
+    case SHA384_DIGEST_LENGTH:
+        return SHA384_Init((SHA512_CTX*)state) == 1;
+    case SHA512_DIGEST_LENGTH:
+        return SHA512_Init((SHA512_CTX*)state) == 1;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Feeds @p bufferLen bytes into @p state.
+ *
+ * @param state State reset with ADUC_HashUtils_OpenSSL_Reset.
+ * @param hashSize Hash size of the algorithm in bytes.
+ * @param buffer The data to hash.
+ * @param bufferLen The length of @p buffer.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_OpenSSL_Input(void* state, size_t hashSize, const uint8_t* buffer, size_t bufferLen)
+{
+    switch (hashSize)
+    {
+    case SHA_DIGEST_LENGTH:
+        return SHA1_Update((SHA_CTX*)state, buffer, bufferLen) == 1;
+    case SHA224_DIGEST_LENGTH:
+        return SHA224_Update((SHA256_CTX*)state, buffer, bufferLen) == 1;
+    case SHA256_DIGEST_LENGTH:
+        return SHA256_Update((SHA256_CTX*)state, buffer, bufferLen) == 1;
+    case SHA384_DIGEST_LENGTH:
+        return SHA384_Update((SHA512_CTX*)state, buffer, bufferLen) == 1;
+    case SHA512_DIGEST_LENGTH:
+        return SHA512_Update((SHA512_CTX*)state, buffer, bufferLen) == 1;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Finishes @p state and writes the hash to @p hash.
+ *
+ * @param state State reset with ADUC_HashUtils_OpenSSL_Reset.
+ * @param hashSize Hash size of the algorithm in bytes.
+ * @param hash Receives @p hashSize bytes.
+ * @return bool True on success.
+ */
+_Bool ADUC_HashUtils_OpenSSL_Result(void* state, size_t hashSize, uint8_t* hash)
+{
+    switch (hashSize)
+    {
+    case SHA_DIGEST_LENGTH:
+        return SHA1_Final(hash, (SHA_CTX*)state) == 1;
+    case SHA224_DIGEST_LENGTH:
+        return SHA224_Final(hash, (SHA256_CTX*)state) == 1;
+    case SHA256_DIGEST_LENGTH:
+        return SHA256_Final(hash, (SHA256_CTX*)state) == 1;
+    case SHA384_DIGEST_LENGTH:
+        return SHA384_Final(hash, (SHA512_CTX*)state) == 1;
+    case SHA512_DIGEST_LENGTH:
+        return SHA512_Final(hash, (SHA512_CTX*)state) == 1;
+    default:
+        return false;
+    }
+}
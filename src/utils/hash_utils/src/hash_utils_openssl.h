@@ -0,0 +1,29 @@
+/**
+ * @file hash_utils_openssl.h
+ * @brief OpenSSL backend of hash_utils.
+ *
+ * Lives in its own translation unit because openssl/sha.h cannot be included together with
+ * azure_c_shared_utility/sha.h. The algorithm is therefore identified by its hash size in bytes.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corporation.
+ */
+#ifndef HASH_UTILS_OPENSSL_H
+#define HASH_UTILS_OPENSSL_H
+
+#include <aduc/c_utils.h>
+
+#include <stdbool.h> // for _Bool
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t
+
+EXTERN_C_BEGIN
+
+_Bool ADUC_HashUtils_OpenSSL_Reset(void* state, size_t hashSize);
+
+_Bool ADUC_HashUtils_OpenSSL_Input(void* state, size_t hashSize, const uint8_t* buffer, size_t bufferLen);
+
+_Bool ADUC_HashUtils_OpenSSL_Result(void* state, size_t hashSize, uint8_t* hash);
+
+EXTERN_C_END
+
+#endif // HASH_UTILS_OPENSSL_H
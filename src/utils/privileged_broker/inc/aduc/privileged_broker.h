@@ -0,0 +1,23 @@
+/**
+ * @file privileged_broker.h
+ * @brief Starts the privileged broker, which runs the agent's root-only commands.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef ADUC_PRIVILEGED_BROKER_H
+#define ADUC_PRIVILEGED_BROKER_H
+
+#include <aduc/c_utils.h>
+#include <aduc/logging.h>
+
+#include <stdbool.h> // for _Bool
+
+EXTERN_C_BEGIN
+
+_Bool ADUC_PrivilegedBroker_Start(ADUC_LOG_SEVERITY logLevel);
+
+_Bool ADUC_PrivilegedBroker_DropPrivileges(void);
+
+EXTERN_C_END
+
+#endif // ADUC_PRIVILEGED_BROKER_H
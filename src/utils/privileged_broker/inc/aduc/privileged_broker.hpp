@@ -0,0 +1,40 @@
+/**
+ * @file privileged_broker.hpp
+ * @brief Runs the agent's root-only commands through the privileged broker.
+ *
+ * The broker is a process forked from the agent at startup, before the agent drops its privileges. It keeps root
+ * and only runs the fixed commands of ADUC_PrivilegedOperation; the agent cannot pass it a command line. Each
+ * request is sent over a socket pair of its own, so requests can run concurrently and be cancelled one by one.
+ *
+ * Without a broker, e.g. in tools that never started one, the same commands are run directly.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef ADUC_PRIVILEGED_BROKER_HPP
+#define ADUC_PRIVILEGED_BROKER_HPP
+
+#include <aduc/privileged_broker.h>
+#include <aduc/process_utils.hpp>
+
+#include <string>
+
+/**
+ * @brief The commands the broker runs.
+ */
+enum class ADUC_PrivilegedOperation
+{
+    FSUpdateInstallApplication, /**< FS-Update -af <image>. */
+    FSUpdateInstallFirmware, /**< FS-Update -ff <image>. */
+    FSUpdateCommit, /**< FS-Update -cu. */
+    FSUpdateRebootState, /**< FS-Update -urs. */
+    Reboot, /**< reboot --reboot --no-wall. */
+    RestartDeliveryOptimization /**< systemctl restart deliveryoptimization-agent.service. */
+};
+
+int ADUC_PrivilegedBroker_Run(
+    ADUC_PrivilegedOperation operation,
+    const std::string& imagePath,
+    const ADUC_ChildProcessLineCallback& lineCallback,
+    const ADUC_ChildProcessOptions& options);
+
+#endif // ADUC_PRIVILEGED_BROKER_HPP
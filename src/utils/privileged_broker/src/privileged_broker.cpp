@@ -0,0 +1,585 @@
+/**
+ * @file privileged_broker.cpp
+ * @brief Implements the privileged broker.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "aduc/privileged_broker.hpp"
+
+#include <aduc/logging.h>
+#include <aduc/system_utils.h>
+#include <aduc/workflow_timing.h>
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * @brief A command of the allow-list.
+ */
+struct PrivilegedCommand
+{
+    ADUC_PrivilegedOperation Operation;
+    const char* Command;
+    std::vector<const char*> Args; /**< nullptr stands for the image path. */
+};
+
+static const PrivilegedCommand c_commands[] = {
+    { ADUC_PrivilegedOperation::FSUpdateInstallApplication, "/usr/bin/FS-Update", { "-af", nullptr, "--debug" } },
+    { ADUC_PrivilegedOperation::FSUpdateInstallFirmware, "/usr/bin/FS-Update", { "-ff", nullptr, "--debug" } },
+    { ADUC_PrivilegedOperation::FSUpdateCommit, "/usr/bin/FS-Update", { "-cu", "--debug" } },
+    { ADUC_PrivilegedOperation::FSUpdateRebootState, "/usr/bin/FS-Update", { "-urs" } },
+    { ADUC_PrivilegedOperation::Reboot, "/sbin/reboot", { "--reboot", "--no-wall" } },
+    { ADUC_PrivilegedOperation::RestartDeliveryOptimization,
+      "/bin/systemctl",
+      { "restart", "deliveryoptimization-agent.service" } },
+};
+
+/**
+ * @brief cgroups the broker creates for a command must be below this folder.
+ */
+static const char c_cgroupRoot[] = "/sys/fs/cgroup/";
+
+/**
+ * @brief A request, the first message on a request socket.
+ */
+struct BrokerRequest
+{
+    uint32_t Operation;
+    uint32_t TimeoutMs;
+    uint32_t KillGracePeriodMs;
+    char ImagePath[PATH_MAX];
+    char CgroupParent[PATH_MAX];
+    char CpuMax[64];
+    char IoMax[256];
+    char MemoryMax[32];
+};
+
+/**
+ * @brief Type of a message on a request socket, its first byte.
+ */
+enum BrokerMessageType : char
+{
+    BrokerMessageType_StdOut = 'O', /**< Broker to agent: a line of standard output. */
+    BrokerMessageType_StdErr = 'E', /**< Broker to agent: a line of standard error. */
+    BrokerMessageType_Exit = 'X', /**< Broker to agent: the command exited, followed by the int32 exit code. */
+    BrokerMessageType_Cancel = 'C' /**< Agent to broker: stop the command. */
+};
+
+/**
+ * @brief Agent side of the socket pair to the broker, -1 without a broker.
+ */
+static int s_controlSocket = -1;
+
+/**
+ * @brief Copies @p value into the fixed-size field @p field, if it fits.
+ * @return bool True if it fits.
+ */
+template<size_t N>
+static bool CopyField(char (&field)[N], const std::string& value)
+{
+    if (value.size() >= N)
+    {
+        return false;
+    }
+
+    memcpy(field, value.c_str(), value.size() + 1);
+    return true;
+}
+
+/**
+ * @brief Opens @p imagePath and checks that the opened file is in one of the agent's sandbox folders.
+ * The check is made on the open file rather than on the path, which the agent owns and could swap for a symlink
+ * before the command opens it.
+ *
+ * @return int The file descriptor, to be closed by the caller, or -1 if the image is not allowed.
+ */
+static int OpenAllowedImage(const std::string& imagePath)
+{
+    char resolvedTemp[PATH_MAX];
+    if (realpath(ADUC_SystemUtils_GetTemporaryPathName(), resolvedTemp) == nullptr)
+    {
+        return -1;
+    }
+
+    // Non-blocking, so opening the FIFO of a streamed install does not wait for its writer.
+    const int fd = open(imagePath.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    char resolvedImage[PATH_MAX];
+    const std::string fdPath{ "/proc/self/fd/" + std::to_string(fd) };
+    const ssize_t length = readlink(fdPath.c_str(), resolvedImage, sizeof(resolvedImage) - 1);
+
+    struct stat st
+    {
+    };
+    if (length <= 0 || fstat(fd, &st) != 0 || !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)))
+    {
+        close(fd);
+        return -1;
+    }
+
+    resolvedImage[length] = '\0';
+
+    const std::string sandboxPrefix{ std::string{ resolvedTemp } + "/aduc-dl-" };
+    if (strncmp(resolvedImage, sandboxPrefix.c_str(), sandboxPrefix.size()) != 0
+        || strchr(resolvedImage + sandboxPrefix.size(), '/') == nullptr)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * @brief Runs the command of @p operation in this process.
+ *
+ * @return int The exit code, or -1 if the request is not allowed.
+ */
+static int RunCommand(
+    ADUC_PrivilegedOperation operation,
+    const std::string& imagePath,
+    const ADUC_ChildProcessLineCallback& lineCallback,
+    const ADUC_ChildProcessOptions& options)
+{
+    for (const PrivilegedCommand& command : c_commands)
+    {
+        if (command.Operation != operation)
+        {
+            continue;
+        }
+
+        if (!options.CgroupParent.empty()
+            && (options.CgroupParent.compare(0, sizeof(c_cgroupRoot) - 1, c_cgroupRoot) != 0
+                || options.CgroupParent.find("/..") != std::string::npos))
+        {
+            Log_Error("Refusing to create a cgroup below %s", options.CgroupParent.c_str());
+            return -1;
+        }
+
+        // The command gets the image that was checked, through the broker's descriptor of it. The descriptor is
+        // close-on-exec, so it is reached through /proc/<broker pid>, which the command may open as root.
+        int imageFd = -1;
+        std::vector<std::string> args;
+        for (const char* arg : command.Args)
+        {
+            if (arg == nullptr && imageFd == -1)
+            {
+                imageFd = OpenAllowedImage(imagePath);
+                if (imageFd == -1)
+                {
+                    Log_Error("Refusing to run %s on %s, it is not in a sandbox", command.Command, imagePath.c_str());
+                    return -1;
+                }
+            }
+
+            args.emplace_back(
+                arg != nullptr ? arg : "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(imageFd));
+        }
+
+        const int exitCode = ADUC_LaunchChildProcess(command.Command, args, lineCallback, options);
+        if (imageFd != -1)
+        {
+            close(imageFd);
+        }
+
+        return exitCode;
+    }
+
+    Log_Error("Unknown privileged operation %d", static_cast<int>(operation));
+    return -1;
+}
+
+/**
+ * @brief Sends @p fd over @p controlSocket.
+ * @return bool True on success.
+ */
+static bool SendSocket(int controlSocket, int fd)
+{
+    char data = 'R';
+    iovec iov{ &data, sizeof(data) };
+    union
+    {
+        char Buffer[CMSG_SPACE(sizeof(int))];
+        cmsghdr Align;
+    } control{};
+
+    msghdr message{};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.Buffer;
+    message.msg_controllen = sizeof(control.Buffer);
+
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(header), &fd, sizeof(int));
+
+    return sendmsg(controlSocket, &message, MSG_NOSIGNAL) == sizeof(data);
+}
+
+/**
+ * @brief Receives a socket sent with SendSocket.
+ * @return int The socket, or -1 once the agent has closed the control socket.
+ */
+static int ReceiveSocket(int controlSocket)
+{
+    for (;;)
+    {
+        char data;
+        iovec iov{ &data, sizeof(data) };
+        union
+        {
+            char Buffer[CMSG_SPACE(sizeof(int))];
+            cmsghdr Align;
+        } control{};
+
+        msghdr message{};
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.Buffer;
+        message.msg_controllen = sizeof(control.Buffer);
+
+        const ssize_t received = recvmsg(controlSocket, &message, MSG_CMSG_CLOEXEC);
+        if (received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (received <= 0)
+        {
+            return -1;
+        }
+
+        const cmsghdr* header = CMSG_FIRSTHDR(&message);
+        if (header != nullptr && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+            return fd;
+        }
+    }
+}
+
+/**
+ * @brief Handles one request in the broker. Runs on a thread of its own.
+ *
+ * @param requestSocket The request socket, closed when done.
+ */
+static void HandleRequest(int requestSocket)
+{
+    BrokerRequest request;
+    if (recv(requestSocket, &request, sizeof(request), 0) != sizeof(request))
+    {
+        close(requestSocket);
+        return;
+    }
+
+    request.ImagePath[sizeof(request.ImagePath) - 1] = '\0';
+    request.CgroupParent[sizeof(request.CgroupParent) - 1] = '\0';
+    request.CpuMax[sizeof(request.CpuMax) - 1] = '\0';
+    request.IoMax[sizeof(request.IoMax) - 1] = '\0';
+    request.MemoryMax[sizeof(request.MemoryMax) - 1] = '\0';
+
+    std::atomic_bool cancellationRequested{ false };
+
+    ADUC_ChildProcessOptions options;
+    options.CancellationRequested = &cancellationRequested;
+    options.Timeout = std::chrono::milliseconds{ request.TimeoutMs };
+    options.KillGracePeriod = std::chrono::milliseconds{ request.KillGracePeriodMs };
+    options.CgroupParent = request.CgroupParent;
+    options.CpuMax = request.CpuMax;
+    options.IoMax = request.IoMax;
+    options.MemoryMax = request.MemoryMax;
+
+    // The command is stopped when the agent cancels it or goes away.
+    std::thread cancelWatcher{ [requestSocket, &cancellationRequested]() {
+        for (;;)
+        {
+            char type;
+            const ssize_t received = recv(requestSocket, &type, sizeof(type), 0);
+            if (received == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (received <= 0 || type == BrokerMessageType_Cancel)
+            {
+                cancellationRequested = true;
+                return;
+            }
+        }
+    } };
+
+    const int exitCode = RunCommand(
+        static_cast<ADUC_PrivilegedOperation>(request.Operation),
+        request.ImagePath,
+        [requestSocket](ADUC_ChildProcessStream stream, const std::string& line) {
+            std::string message{ stream == ADUC_ChildProcessStream::StdErr ? BrokerMessageType_StdErr
+                                                                            : BrokerMessageType_StdOut };
+            message += line;
+            send(requestSocket, message.data(), message.size(), MSG_NOSIGNAL);
+        },
+        options);
+
+    char exitMessage[1 + sizeof(int32_t)];
+    const int32_t exitCode32 = exitCode;
+    exitMessage[0] = BrokerMessageType_Exit;
+    memcpy(exitMessage + 1, &exitCode32, sizeof(exitCode32));
+    send(requestSocket, exitMessage, sizeof(exitMessage), MSG_NOSIGNAL);
+
+    // Wakes up the watcher.
+    shutdown(requestSocket, SHUT_RD);
+    cancelWatcher.join();
+    close(requestSocket);
+}
+
+/**
+ * @brief Main loop of the broker process. Returns once the agent is gone.
+ *
+ * @param controlSocket The broker side of the control socket pair.
+ * @return int The broker's exit code.
+ */
+static int ServeBroker(int controlSocket)
+{
+    Log_Info("Privileged broker running as pid %d", getpid());
+
+    for (;;)
+    {
+        const int requestSocket = ReceiveSocket(controlSocket);
+        if (requestSocket == -1)
+        {
+            break;
+        }
+
+        std::thread{ HandleRequest, requestSocket }.detach();
+    }
+
+    Log_Info("Agent is gone, privileged broker exits");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * @brief Drops the root privileges the agent was started with, keeping its real user and group.
+ * Called once the broker was started and the agent no longer needs them, e.g. for its log and data folders.
+ *
+ * @return _Bool True on success, or if there was nothing to drop.
+ */
+_Bool ADUC_PrivilegedBroker_DropPrivileges(void)
+{
+    const uid_t uid = getuid();
+    const gid_t gid = getgid();
+
+    if (uid == 0)
+    {
+        Log_Warn("Agent was started by root, it keeps root privileges");
+        return true;
+    }
+
+    if (geteuid() == uid && getegid() == gid)
+    {
+        return true;
+    }
+
+    if (setresgid(gid, gid, gid) != 0 || setresuid(uid, uid, uid) != 0)
+    {
+        Log_Error("Cannot drop privileges, errno %d", errno);
+        return false;
+    }
+
+    Log_Info("Agent dropped its privileges to uid %d, gid %d", uid, gid);
+    return true;
+}
+
+/**
+ * @brief Forks the privileged broker. The agent drops its privileges afterwards, see
+ * ADUC_PrivilegedBroker_DropPrivileges().
+ * Must be called while the agent has a single thread, before any other thread is started, including the one of
+ * the logger: the broker starts a logger of its own. The caller reports a failure once its logging is set up.
+ *
+ * @param logLevel Log level of the broker.
+ * @return _Bool True on success. On failure, the agent runs the commands itself.
+ */
+_Bool ADUC_PrivilegedBroker_Start(ADUC_LOG_SEVERITY logLevel)
+{
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0)
+    {
+        Log_Error("Cannot create the privileged broker socket, errno %d", errno);
+        return false;
+    }
+
+    const pid_t agentPid = getpid();
+    const pid_t pid = fork();
+    if (pid == -1)
+    {
+        Log_Error("Cannot start the privileged broker, errno %d", errno);
+        close(sockets[0]);
+        close(sockets[1]);
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        close(sockets[0]);
+
+        // The agent blocks the signals its main loop handles; the broker keeps their default action.
+        sigset_t noSignals;
+        sigemptyset(&noSignals);
+        pthread_sigmask(SIG_SETMASK, &noSignals, nullptr);
+
+        // Exit with the agent, even if it is killed.
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != agentPid)
+        {
+            _exit(EXIT_SUCCESS);
+        }
+
+        ADUC_Logging_Init(logLevel);
+        const int exitCode = ServeBroker(sockets[1]);
+        ADUC_Logging_Uninit();
+        _exit(exitCode);
+    }
+
+    close(sockets[1]);
+    s_controlSocket = sockets[0];
+    return true;
+}
+
+/**
+ * @brief Runs the command of @p operation as root, through the broker if it was started.
+ * Lines of the command's output are passed to @p lineCallback; the broker logs them already.
+ *
+ * @param operation The command to run.
+ * @param imagePath The image to install, for the install operations. Must be in a sandbox folder of the agent.
+ * @param lineCallback Called with each line of the command's output.
+ * @param options Cancellation, deadline and resource limits. A cgroup must be below /sys/fs/cgroup.
+ *
+ * @return int The exit code of the command, the signal number if it was stopped, or -1 on error.
+ */
+int ADUC_PrivilegedBroker_Run(
+    ADUC_PrivilegedOperation operation,
+    const std::string& imagePath,
+    const ADUC_ChildProcessLineCallback& lineCallback,
+    const ADUC_ChildProcessOptions& options)
+{
+    if (s_controlSocket == -1)
+    {
+        return RunCommand(operation, imagePath, lineCallback, options);
+    }
+
+    BrokerRequest request{};
+    request.Operation = static_cast<uint32_t>(operation);
+    request.TimeoutMs = static_cast<uint32_t>(options.Timeout.count());
+    request.KillGracePeriodMs = static_cast<uint32_t>(options.KillGracePeriod.count());
+    if (!CopyField(request.ImagePath, imagePath) || !CopyField(request.CgroupParent, options.CgroupParent)
+        || !CopyField(request.CpuMax, options.CpuMax) || !CopyField(request.IoMax, options.IoMax)
+        || !CopyField(request.MemoryMax, options.MemoryMax))
+    {
+        Log_Error("Privileged request does not fit into a message");
+        return -1;
+    }
+
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0)
+    {
+        Log_Error("Cannot create a privileged request socket, errno %d", errno);
+        return -1;
+    }
+
+    const bool sent = SendSocket(s_controlSocket, sockets[1]);
+    close(sockets[1]);
+
+    if (!sent || send(sockets[0], &request, sizeof(request), MSG_NOSIGNAL) != sizeof(request))
+    {
+        Log_Error("Cannot send privileged request, errno %d", errno);
+        close(sockets[0]);
+        return -1;
+    }
+
+    // The command runs in the broker, so its span is recorded here.
+    const uint64_t startNs = ADUC_WorkflowTiming_Now();
+    int exitCode = -1;
+    bool cancelSent = false;
+    std::vector<char> message(1 + ADUC_ChildProcessMaxLineLength);
+
+    for (;;)
+    {
+        if (!cancelSent && options.CancellationRequested != nullptr && *options.CancellationRequested)
+        {
+            const char cancel = BrokerMessageType_Cancel;
+            send(sockets[0], &cancel, sizeof(cancel), MSG_NOSIGNAL);
+            cancelSent = true;
+        }
+
+        // Wake up regularly to check for cancellation.
+        pollfd readFd{ sockets[0], POLLIN, 0 };
+        const int pollResult = poll(&readFd, 1, 100);
+        if (pollResult == 0 || (pollResult == -1 && errno == EINTR))
+        {
+            continue;
+        }
+
+        const ssize_t received = (pollResult == -1) ? -1 : recv(sockets[0], message.data(), message.size(), 0);
+        if (received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (received <= 0)
+        {
+            Log_Error("Privileged broker did not complete the request, errno %d", errno);
+            break;
+        }
+
+        if (message[0] == BrokerMessageType_Exit && received == 1 + sizeof(int32_t))
+        {
+            int32_t exitCode32;
+            memcpy(&exitCode32, message.data() + 1, sizeof(exitCode32));
+            exitCode = exitCode32;
+            break;
+        }
+
+        if (message[0] == BrokerMessageType_StdOut || message[0] == BrokerMessageType_StdErr)
+        {
+            lineCallback(
+                message[0] == BrokerMessageType_StdErr ? ADUC_ChildProcessStream::StdErr
+                                                       : ADUC_ChildProcessStream::StdOut,
+                std::string{ message.data() + 1, static_cast<size_t>(received - 1) });
+        }
+    }
+
+    close(sockets[0]);
+
+    for (const PrivilegedCommand& command : c_commands)
+    {
+        if (command.Operation == operation)
+        {
+            const char* name = strrchr(command.Command, '/');
+            const std::string spanName = std::string{ "exec:" } + (name != nullptr ? name + 1 : command.Command);
+            ADUC_WorkflowTiming_AddSpan(spanName.c_str(), startNs);
+            break;
+        }
+    }
+
+    return exitCode;
+}
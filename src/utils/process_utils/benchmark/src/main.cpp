@@ -0,0 +1,137 @@
+/**
+ * @file main.cpp
+ * @brief Compares the launch latency of the process_utils launchers.
+ *
+ * Usage: process_utils_benchmark [-n <launches>] [-m <heap in MiB>] [command]
+ *
+ * The cost of fork() grows with the size of the parent, so the benchmark first allocates and touches a heap of the
+ * given size (default 256 MiB) to stand in for the agent's SDK, OpenSSL and parson heaps. Each launcher then starts
+ * the command (default /bin/true) the given number of times (default 200).
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include <aduc/logging.h>
+#include <aduc/process_utils.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * @brief A single benchmark run.
+ */
+struct BenchmarkRun
+{
+    const char* Name; /**< Printed name. */
+    ADUC_ChildProcessLauncher Launcher; /**< Launcher to start the command with. */
+};
+
+static const BenchmarkRun c_runs[] = {
+    { "fork (previous launcher)", ADUC_ChildProcessLauncher::Fork },
+    { "clone(CLONE_VM | CLONE_VFORK)", ADUC_ChildProcessLauncher::VFork },
+};
+
+/**
+ * @brief Launches @p command @p count times with the launcher of @p run and prints the latencies.
+ * @return bool True if all launches succeeded.
+ */
+static bool RunBenchmark(const BenchmarkRun& run, const std::string& command, unsigned long count)
+{
+    const ADUC_ChildProcessOptions options{};
+    std::vector<double> latencies;
+    latencies.reserve(count);
+
+    ADUC_SetChildProcessLauncher(run.Launcher);
+
+    for (unsigned long i = 0; i < count; ++i)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const int exitCode = ADUC_LaunchChildProcess(
+            command, {}, [](ADUC_ChildProcessStream /*stream*/, const std::string& /*line*/) {}, options);
+        const std::chrono::duration<double, std::micro> latency = std::chrono::steady_clock::now() - start;
+
+        if (exitCode != 0)
+        {
+            fprintf(stderr, "%s exited with %d\n", command.c_str(), exitCode);
+            return false;
+        }
+
+        latencies.push_back(latency.count());
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+
+    double total = 0;
+    for (const double latency : latencies)
+    {
+        total += latency;
+    }
+
+    printf(
+        "%-32s mean %9.1f us   p50 %9.1f us   p99 %9.1f us\n",
+        run.Name,
+        total / latencies.size(),
+        latencies[latencies.size() / 2],
+        latencies[latencies.size() * 99 / 100]);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long count = 200;
+    unsigned long heapMb = 256;
+    std::string command{ "/bin/true" };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            count = strtoul(optarg, nullptr, 10);
+            break;
+        case 'm':
+            heapMb = strtoul(optarg, nullptr, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n <launches>] [-m <heap in MiB>] [command]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc)
+    {
+        command = argv[optind];
+    }
+
+    if (count == 0)
+    {
+        fprintf(stderr, "Invalid number of launches\n");
+        return EXIT_FAILURE;
+    }
+
+    ADUC_Logging_Init(ADUC_LOG_WARN);
+
+    // Touch every page, so it is mapped and fork has to copy its page table entries.
+    std::vector<char> heap(heapMb * 1024 * 1024);
+    memset(heap.data(), 1, heap.size());
+
+    printf("Launching %s %lu times with %lu MiB of heap\n", command.c_str(), count, heapMb);
+
+    int ret = EXIT_SUCCESS;
+    for (const BenchmarkRun& run : c_runs)
+    {
+        if (!RunBenchmark(run, command, count))
+        {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    ADUC_Logging_Uninit();
+    return ret;
+}
@@ -7,9 +7,63 @@
 #ifndef ADUC_PROCESS_UTILS_HPP
 #define ADUC_PROCESS_UTILS_HPP
 
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <string>
 #include <vector>
 
+/**
+ * @brief Output stream of a child process.
+ */
+enum class ADUC_ChildProcessStream
+{
+    StdOut,
+    StdErr
+};
+
+/**
+ * @brief How child processes are started.
+ */
+enum class ADUC_ChildProcessLauncher
+{
+    VFork, /**< clone(CLONE_VM | CLONE_VFORK): no copy of the agent's page tables. Default. */
+    Fork /**< fork(): copies the agent's page tables on every launch. */
+};
+
+void ADUC_SetChildProcessLauncher(ADUC_ChildProcessLauncher launcher);
+
+/**
+ * @brief Longest line passed to a line callback. Longer lines are passed in pieces of this size.
+ */
+const size_t ADUC_ChildProcessMaxLineLength = 4096;
+
+/**
+ * @brief Called with each line a child process writes, without the line break, as soon as it was written.
+ */
+using ADUC_ChildProcessLineCallback = std::function<void(ADUC_ChildProcessStream stream, const std::string& line)>;
+
+/**
+ * @brief Cancellation, deadline and resource limits of a child process.
+ *
+ * The command runs in a process group of its own. To stop it, the whole group gets SIGTERM, and SIGKILL if it is
+ * still running after KillGracePeriod.
+ *
+ * With a CgroupParent, the command runs in a new cgroup below it that is removed, with any processes left in it,
+ * when the command has exited. CgroupParent must be a cgroup v2 directory the agent can write to, with the
+ * controllers of the configured limits enabled in its cgroup.subtree_control. Limits use the cgroup v2 syntax.
+ */
+struct ADUC_ChildProcessOptions
+{
+    const std::atomic_bool* CancellationRequested{ nullptr }; /**< Set from another thread to stop the command. */
+    std::chrono::milliseconds Timeout{ 0 }; /**< Stop the command after this time, 0 for no deadline. */
+    std::chrono::milliseconds KillGracePeriod{ 10000 }; /**< Time between SIGTERM and SIGKILL. */
+    std::string CgroupParent; /**< cgroup v2 to create the command's cgroup in, empty for none. */
+    std::string CpuMax; /**< cpu.max, e.g. "50000 100000" for half a CPU. */
+    std::string IoMax; /**< io.max, e.g. "179:0 wbps=10485760". */
+    std::string MemoryMax; /**< memory.max, e.g. "256M". */
+};
+
 /**
  * @brief Runs specified command in a new process and captures output, error messages, and exit code.
  *        The captured output and error messages will be written to ADUC_LOG_FILE.
@@ -23,4 +77,39 @@
  */
 int ADUC_LaunchChildProcess(const std::string& command, std::vector<std::string> args, std::string& output);
 
+/**
+ * @brief Runs specified command in a new process like ADUC_LaunchChildProcess above, and stops it as soon as
+ *        @p abortRequested is set.
+ *
+ * @param command Name of a command to run.
+ * @param args List of arguments for the command.
+ * @param output A standard output from the command.
+ * @param abortRequested Set from another thread to stop the command.
+ *
+ * @return An exit code from the command, or the signal number if it was killed.
+ */
+int ADUC_LaunchChildProcess(
+    const std::string& command,
+    std::vector<std::string> args,
+    std::string& output,
+    const std::atomic_bool& abortRequested);
+
+/**
+ * @brief Runs specified command in a new process and passes its output to @p lineCallback line by line while it
+ *        runs, instead of collecting it. Every line is also written to ADUC_LOG_FILE. The command is stopped when
+ *        it is cancelled or its deadline passes, see ADUC_ChildProcessOptions.
+ *
+ * @param command Name of a command to run.
+ * @param args List of arguments for the command.
+ * @param lineCallback Called on the calling thread with each line of standard output and standard error.
+ * @param options Cancellation, deadline and resource limits.
+ *
+ * @return An exit code from the command, the signal number if it was stopped, or -1 if it could not be started.
+ */
+int ADUC_LaunchChildProcess(
+    const std::string& command,
+    std::vector<std::string> args,
+    const ADUC_ChildProcessLineCallback& lineCallback,
+    const ADUC_ChildProcessOptions& options);
+
 #endif // ADUC_PROCESS_UTILS_HPP
@@ -4,6 +4,8 @@
  *
  * @copyright Copyright (c) 2019, Microsoft Corp.
  */
+#include "aduc/process_utils.hpp"
+
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,17 +16,286 @@
 #include <aduc/c_utils.h>
 #include <aduc/logging.h>
 #include <aduc/string_utils.hpp>
+#include <aduc/workflow_timing.h>
 
 #include <iostream>
 #include <sstream>
 #include <string>
 
+#include <atomic>
 #include <chrono>
 
 #include <fcntl.h>
+#include <memory>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+/**
+ * @brief Launcher used by ADUC_LaunchChildProcess.
+ */
+static std::atomic<ADUC_ChildProcessLauncher> s_launcher{ ADUC_ChildProcessLauncher::VFork };
+
+/**
+ * @brief Stack of a child started with clone(CLONE_VM | CLONE_VFORK). It only runs until execvp.
+ */
+static const size_t c_vforkChildStackSize = 64 * 1024;
+
+/**
+ * @brief How long output is still read after the command has exited, if processes it left behind keep it open.
+ */
+static const std::chrono::milliseconds c_outputDrainTime{ 500 };
+
+/**
+ * @brief Numbers the cgroups created for child processes.
+ */
+static std::atomic_uint s_cgroupCounter{ 0 };
+
+/**
+ * @brief Everything the child needs to exec the command, prepared by the parent so the child does not allocate.
+ */
+struct ChildExecData
+{
+    const char* Command;
+    char* const* Argv;
+    int StdOutFd;
+    int StdErrFd;
+    int CgroupProcsFd; /**< cgroup.procs of the cgroup to join, or -1. */
+    sigset_t SignalMask; /**< The agent's signal mask, restored once the child started. */
+};
+
+/**
+ * @brief Writes @p message to stderr. Async-signal-safe.
+ */
+static void WriteChildError(const char* message)
+{
+    ssize_t ignored = write(STDERR_FILENO, message, strlen(message));
+    (void)ignored;
+}
+
+/**
+ * @brief Runs in the child, sets up its stdout, stderr and user and execs the command.
+ * Shares the agent's memory when started with CLONE_VM, so it only uses async-signal-safe calls and never returns.
+ *
+ * @param context The ChildExecData.
+ * @return int Never returns.
+ */
+static int RunChild(void* context)
+{
+    const ChildExecData* data = static_cast<const ChildExecData*>(context);
+
+    // The agent's handlers must not run on this stack; a signal pending from now on takes its default action.
+    for (int signalNumber = 1; signalNumber < NSIG; ++signalNumber)
+    {
+        struct sigaction action;
+        if (sigaction(signalNumber, nullptr, &action) == 0 && action.sa_handler != SIG_IGN
+            && action.sa_handler != SIG_DFL)
+        {
+            action.sa_handler = SIG_DFL;
+            action.sa_flags = 0;
+            sigaction(signalNumber, &action, nullptr);
+        }
+    }
+
+    // The agent blocks the signals its main loop reads from a signalfd; the command must not inherit that.
+    sigset_t noSignals;
+    sigemptyset(&noSignals);
+    sigprocmask(SIG_SETMASK, &noSignals, nullptr);
+
+    // A process group of its own, so the command can be stopped together with everything it starts.
+    setpgid(0, 0);
+
+    if (data->CgroupProcsFd != -1 && write(data->CgroupProcsFd, "0", 1) != 1)
+    {
+        WriteChildError("Cannot join cgroup\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    if (dup2(data->StdOutFd, STDOUT_FILENO) == -1 || dup2(data->StdErrFd, STDERR_FILENO) == -1)
+    {
+        _exit(EXIT_FAILURE);
+    }
+
+    /**
+     * Run child process as 'root'.
+     * fw_setenv and fw_printenv are only accessible to root
+     * This is done in the cild process so we don't mess up the
+     * permissions for logging,conf and do-agent
+     *
+     * The raw system call only changes this process. glibc's setuid() would try to change all threads of the
+     * agent, which share this memory but are not part of this process.
+     */
+#ifdef SYS_setuid32
+    const long setuidResult = syscall(SYS_setuid32, geteuid());
+#else
+    const long setuidResult = syscall(SYS_setuid, geteuid());
+#endif
+    if (setuidResult != 0)
+    {
+        WriteChildError("setuid failed\n");
+        // Never return into the agent from the child, it would keep running alongside the parent.
+        _exit(7);
+    }
+
+    // The exec() functions only return if an error has occurred.
+    // The return value is -1, and errno is set to indicate the error.
+    int ret = execvp(data->Command, data->Argv);
+
+    WriteChildError("execvp failed\n");
+
+    _exit(ret);
+}
+
+/**
+ * @brief Selects how ADUC_LaunchChildProcess starts processes, for all later launches.
+ *
+ * @param launcher The launcher.
+ */
+void ADUC_SetChildProcessLauncher(ADUC_ChildProcessLauncher launcher)
+{
+    s_launcher = launcher;
+}
+
+/**
+ * @brief Starts a process that runs RunChild with @p data, using the selected launcher.
+ *
+ * @param data What to exec.
+ * @return pid_t The child's pid, or -1 on error.
+ */
+static pid_t StartChild(ChildExecData* data)
+{
+    // Block all signals, so no handler of the agent runs in a child that shares its memory before RunChild
+    // resets them. The child unblocks all signals just before exec.
+    sigset_t allSignals;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &data->SignalMask);
+
+    pid_t pid = -1;
+    if (s_launcher == ADUC_ChildProcessLauncher::Fork)
+    {
+        pid = fork();
+        if (pid == 0)
+        {
+            RunChild(data);
+        }
+    }
+    else
+    {
+        // Like vfork: the child borrows the agent's memory instead of copying its page tables, and the agent is
+        // suspended until the child has called execvp or exited. The child gets a stack of its own.
+        std::unique_ptr<char[]> stack{ new (std::nothrow) char[c_vforkChildStackSize] };
+        if (stack)
+        {
+            // The stack grows down from its 16-byte aligned end.
+            const uintptr_t stackTop = (reinterpret_cast<uintptr_t>(stack.get()) + c_vforkChildStackSize)
+                                      & ~static_cast<uintptr_t>(15);
+            pid = clone(RunChild, reinterpret_cast<void*>(stackTop), CLONE_VM | CLONE_VFORK | SIGCHLD, data);
+        }
+    }
+
+    const int startErrno = errno;
+    pthread_sigmask(SIG_SETMASK, &data->SignalMask, nullptr);
+
+    if (pid > 0)
+    {
+        // A forked child may not have run yet, set its group here as well so it can be signalled right away.
+        setpgid(pid, pid);
+    }
+
+    errno = startErrno;
+    return pid;
+}
+
+/**
+ * @brief Writes @p value to the cgroup file at @p path.
+ * @return bool True on success.
+ */
+static bool WriteCgroupFile(const std::string& path, const std::string& value)
+{
+    const int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return false;
+    }
+
+    const bool success = write(fd, value.c_str(), value.size()) == static_cast<ssize_t>(value.size());
+    close(fd);
+    return success;
+}
+
+/**
+ * @brief Kills the processes left in the cgroup at @p cgroupPath and removes it.
+ */
+static void RemoveChildCgroup(const std::string& cgroupPath)
+{
+    // cgroup.kill needs Linux 5.14. Killed processes leave the cgroup asynchronously, so removal is retried.
+    WriteCgroupFile(cgroupPath + "/cgroup.kill", "1");
+
+    for (int attempt = 0; attempt < 50; ++attempt)
+    {
+        if (rmdir(cgroupPath.c_str()) == 0 || errno == ENOENT)
+        {
+            return;
+        }
+
+        usleep(10 * 1000);
+    }
+
+    Log_Warn("Cannot remove cgroup %s, errno %d", cgroupPath.c_str(), errno);
+}
+
+/**
+ * @brief Creates a cgroup for one child process below options.CgroupParent and sets the limits of @p options.
+ *
+ * @param options The limits.
+ * @param cgroupPath Receives the path of the new cgroup.
+ * @return int The open cgroup.procs of the new cgroup, which the child writes itself into, or -1 on error.
+ */
+static int CreateChildCgroup(const ADUC_ChildProcessOptions& options, std::string* cgroupPath)
+{
+    *cgroupPath = options.CgroupParent + "/aduc-child-" + std::to_string(getpid()) + "-"
+                  + std::to_string(s_cgroupCounter++);
+    if (mkdir(cgroupPath->c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0)
+    {
+        Log_Error("Cannot create cgroup %s, errno %d", cgroupPath->c_str(), errno);
+        cgroupPath->clear();
+        return -1;
+    }
+
+    const std::pair<const char*, const std::string*> limits[] = { { "cpu.max", &options.CpuMax },
+                                                                    { "io.max", &options.IoMax },
+                                                                    { "memory.max", &options.MemoryMax } };
+    for (const auto& limit : limits)
+    {
+        if (!limit.second->empty() && !WriteCgroupFile(*cgroupPath + "/" + limit.first, *limit.second))
+        {
+            Log_Error(
+                "Cannot set %s of %s to '%s', errno %d",
+                limit.first,
+                cgroupPath->c_str(),
+                limit.second->c_str(),
+                errno);
+            RemoveChildCgroup(*cgroupPath);
+            cgroupPath->clear();
+            return -1;
+        }
+    }
+
+    const int procsFd = open((*cgroupPath + "/cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC);
+    if (procsFd == -1)
+    {
+        Log_Error("Cannot open cgroup.procs of %s, errno %d", cgroupPath->c_str(), errno);
+        RemoveChildCgroup(*cgroupPath);
+        cgroupPath->clear();
+    }
+
+    return procsFd;
+}
+
 /**
  * @brief Runs specified command in a new process and captures output, error messages, and exit code.
  *        The captured output and error messages will be written to ADUC_LOG_FILE.
@@ -37,17 +308,161 @@
  * @return An exit code from the command.
  */
 int ADUC_LaunchChildProcess(const std::string& command, std::vector<std::string> args, std::string& output)
+{
+    static const std::atomic_bool neverAbort{ false };
+    return ADUC_LaunchChildProcess(command, std::move(args), output, neverAbort);
+}
+
+/**
+ * @brief Runs specified command in a new process like ADUC_LaunchChildProcess above, and stops it as soon as
+ *        @p abortRequested is set.
+ *
+ * @param command Name of a command to run.
+ * @param args List of arguments for the command.
+ * @param output A standard output from the command.
+ * @param abortRequested Set from another thread to stop the command.
+ *
+ * @return An exit code from the command, or the signal number if it was killed.
+ */
+int ADUC_LaunchChildProcess(
+    const std::string& command,
+    std::vector<std::string> args,
+    std::string& output,
+    const std::atomic_bool& abortRequested)
+{
+    ADUC_ChildProcessOptions options;
+    options.CancellationRequested = &abortRequested;
+
+    return ADUC_LaunchChildProcess(
+        command,
+        std::move(args),
+        [&output](ADUC_ChildProcessStream stream, const std::string& line) {
+            if (stream == ADUC_ChildProcessStream::StdOut)
+            {
+                output += line;
+                output += '\n';
+            }
+        },
+        options);
+}
+
+/**
+ * @brief Read end of one output pipe of a child process, with the start of a line that is not complete yet.
+ */
+struct ChildOutputPipe
+{
+    int Fd;
+    ADUC_ChildProcessStream Stream;
+    std::string Pending;
+};
+
+/**
+ * @brief Logs @p line and passes it to @p lineCallback.
+ */
+static void EmitLine(
+    const ChildOutputPipe& outputPipe, const std::string& line, const ADUC_ChildProcessLineCallback& lineCallback)
+{
+    Log_Info("%s: %s", outputPipe.Stream == ADUC_ChildProcessStream::StdErr ? "stderr" : "stdout", line.c_str());
+    lineCallback(outputPipe.Stream, line);
+}
+
+/**
+ * @brief Appends @p data to the pending text of @p outputPipe and emits all complete lines.
+ * Only an incomplete line of at most ADUC_ChildProcessMaxLineLength bytes is kept.
+ */
+static void ConsumeOutput(
+    ChildOutputPipe* outputPipe, const char* data, size_t size, const ADUC_ChildProcessLineCallback& lineCallback)
+{
+    outputPipe->Pending.append(data, size);
+
+    size_t lineStart = 0;
+    for (;;)
+    {
+        const size_t lineEnd = outputPipe->Pending.find('\n', lineStart);
+        if (lineEnd == std::string::npos)
+        {
+            if (outputPipe->Pending.size() - lineStart < ADUC_ChildProcessMaxLineLength)
+            {
+                break;
+            }
+
+            EmitLine(*outputPipe, outputPipe->Pending.substr(lineStart, ADUC_ChildProcessMaxLineLength), lineCallback);
+            lineStart += ADUC_ChildProcessMaxLineLength;
+            continue;
+        }
+
+        size_t length = lineEnd - lineStart;
+        if (length > 0 && outputPipe->Pending[lineEnd - 1] == '\r')
+        {
+            --length;
+        }
+
+        EmitLine(*outputPipe, outputPipe->Pending.substr(lineStart, length), lineCallback);
+        lineStart = lineEnd + 1;
+    }
+
+    outputPipe->Pending.erase(0, lineStart);
+}
+
+/**
+ * @brief Runs specified command in a new process and passes its output to @p lineCallback line by line while it
+ *        runs, instead of collecting it. Every line is also written to ADUC_LOG_FILE. The command is stopped when
+ *        it is cancelled or its deadline passes, see ADUC_ChildProcessOptions.
+ *
+ * @param command Name of a command to run.
+ * @param args List of arguments for the command.
+ * @param lineCallback Called on the calling thread with each line of standard output and standard error.
+ * @param options Cancellation, deadline and resource limits.
+ *
+ * @return An exit code from the command, the signal number if it was stopped, or -1 if it could not be started.
+ */
+int ADUC_LaunchChildProcess(
+    const std::string& command,
+    std::vector<std::string> args,
+    const ADUC_ChildProcessLineCallback& lineCallback,
+    const ADUC_ChildProcessOptions& options)
 {
 #define READ_END 0
 #define WRITE_END 1
 
-    int filedes[2];
-    const int ret = pipe(filedes);
+    int outPipe[2];
+    int errPipe[2];
+    std::string cgroupPath;
+    int cgroupProcsFd = -1;
+
+    if (!options.CgroupParent.empty())
+    {
+        cgroupProcsFd = CreateChildCgroup(options, &cgroupPath);
+        if (cgroupProcsFd == -1)
+        {
+            return -1;
+        }
+    }
+
+    // Close-on-exec, so the command only inherits the write ends that are dup'ed to its stdout and stderr.
+    if (pipe2(outPipe, O_CLOEXEC) != 0)
+    {
+        Log_Error("Cannot create output and error pipes. %s (errno %d).", strerror(errno), errno);
+        outPipe[READ_END] = outPipe[WRITE_END] = -1;
+    }
 
-    if (ret != 0)
+    if (outPipe[READ_END] != -1 && pipe2(errPipe, O_CLOEXEC) != 0)
     {
         Log_Error("Cannot create output and error pipes. %s (errno %d).", strerror(errno), errno);
-        return ret;
+        close(outPipe[READ_END]);
+        close(outPipe[WRITE_END]);
+        outPipe[READ_END] = outPipe[WRITE_END] = -1;
+    }
+
+    if (outPipe[READ_END] == -1)
+    {
+        if (cgroupProcsFd != -1)
+        {
+            close(cgroupProcsFd);
+            RemoveChildCgroup(cgroupPath);
+        }
+
+        return -1;
     }
 
     if (command == "/usr/bin/FS-Update")
@@ -69,74 +484,215 @@ int ADUC_LaunchChildProcess(const std::string& command, std::vector<std::string>
         }
     }
 
-    const int pid = fork();
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 2);
+    argv.emplace_back(const_cast<char*>(command.c_str()));
 
-    if (pid == 0)
+    for (const std::string& arg : args)
     {
-        // Running inside child process.
-        /**
-         * Run child process as 'root'.
-         * fw_setenv and fw_printenv are only accessible to root
-         * This is done in the cild process so we don't mess up the
-         * permissions for logging,conf and do-agent
-         */
-        int defaultUserId = getuid();
-        int effectiveUserId = geteuid();
+        argv.emplace_back(const_cast<char*>(arg.c_str()));
+    }
 
-        if (setuid(effectiveUserId) != 0)
-        {
-            Log_Error(
-                "setuid failed: uid(%d), defaultUid(%d), effectiveUid(%d)", getuid(), defaultUserId, effectiveUserId);
-            return 7;
-        }
+    argv.emplace_back(nullptr);
 
-        std::vector<char*> argv;
-        argv.reserve(args.size() + 2);
-        argv.emplace_back(const_cast<char*>(command.c_str()));
+    ChildExecData execData{};
+    execData.Command = command.c_str();
+    execData.Argv = argv.data();
+    execData.StdOutFd = outPipe[WRITE_END];
+    execData.StdErrFd = errPipe[WRITE_END];
+    execData.CgroupProcsFd = cgroupProcsFd;
 
-        for (const std::string& arg : args)
-        {
-            argv.emplace_back(const_cast<char*>(arg.c_str()));
-        }
+    const uint64_t startNs = ADUC_WorkflowTiming_Now();
+    const pid_t pid = StartChild(&execData);
 
-        argv.emplace_back(nullptr);
+    close(outPipe[WRITE_END]);
+    close(errPipe[WRITE_END]);
 
-        // The exec() functions only return if an error has occurred.
-        // The return value is -1, and errno is set to indicate the error.
-        int ret = execvp(command.c_str(), &argv[0]);
+    if (cgroupProcsFd != -1)
+    {
+        close(cgroupProcsFd);
+    }
 
-        fprintf(stderr, "execvp failed, ret %d, error %d\n", ret, errno);
+    if (pid == -1)
+    {
+        Log_Error("Cannot start child process, error %d", errno);
+        close(outPipe[READ_END]);
+        close(errPipe[READ_END]);
+
+        if (!cgroupPath.empty())
+        {
+            RemoveChildCgroup(cgroupPath);
+        }
 
-        _exit(ret);
+        return -1;
     }
 
-    close(filedes[WRITE_END]);
+    ChildOutputPipe pipes[2]{ { outPipe[READ_END], ADUC_ChildProcessStream::StdOut, {} },
+                              { errPipe[READ_END], ADUC_ChildProcessStream::StdErr, {} } };
+
+    // Wakes up the loop as soon as the child exits. Without pidfds (Linux 5.3), exit is checked every poll.
+    int exitFd = -1;
+#ifdef SYS_pidfd_open
+    exitFd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+#endif
 
+    const auto startTime = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::time_point stopTime;
+    std::chrono::steady_clock::time_point exitTime;
+    bool stopping = false;
+    bool killed = false;
+    bool exited = false;
+    int wstatus = 0;
+
+    // Runs until the child has exited and its output was read to the end. If processes the child left behind keep
+    // the output open, it is read for c_outputDrainTime after the child exited.
     for (;;)
     {
-        char buffer[1024];
-        ssize_t count;
-        count = read(filedes[READ_END], buffer, sizeof(buffer));
+        const auto now = std::chrono::steady_clock::now();
+        const bool outputOpen = pipes[0].Fd != -1 || pipes[1].Fd != -1;
 
-        if (count == -1)
+        if (exited && (!outputOpen || now - exitTime >= c_outputDrainTime))
         {
-            Log_Error("Read failed, error %d", errno);
             break;
         }
 
-        if (count == 0)
+        if (!exited)
+        {
+            const bool cancelled = options.CancellationRequested != nullptr && *options.CancellationRequested;
+            const bool timedOut = options.Timeout.count() > 0 && now - startTime >= options.Timeout;
+
+            // The whole process group is signalled, so processes started by the command stop as well.
+            if ((cancelled || timedOut) && !stopping)
+            {
+                if (timedOut)
+                {
+                    Log_Error(
+                        "Child process %d timed out after %lld ms",
+                        pid,
+                        static_cast<long long>(options.Timeout.count()));
+                }
+                else
+                {
+                    Log_Warn("Aborting child process %d", pid);
+                }
+
+                killed = options.KillGracePeriod.count() <= 0;
+                kill(-pid, killed ? SIGKILL : SIGTERM);
+                stopping = true;
+                stopTime = now;
+            }
+            else if (stopping && !killed && now - stopTime >= options.KillGracePeriod)
+            {
+                Log_Warn("Child process %d did not stop after SIGTERM, killing it", pid);
+                kill(-pid, SIGKILL);
+                killed = true;
+            }
+
+            const pid_t waitResult = waitpid(pid, &wstatus, WNOHANG);
+            if (waitResult == pid || (waitResult == -1 && errno != EINTR))
+            {
+                if (waitResult == -1)
+                {
+                    Log_Error("waitpid failed, error %d", errno);
+                    wstatus = W_EXITCODE(EXIT_FAILURE, 0);
+                }
+
+                exited = true;
+                exitTime = now;
+                continue;
+            }
+        }
+
+        // Wake up regularly to check for cancellation and the deadline. Closed pipes have a negative fd and are
+        // skipped. Without a pidfd, check for exit more often once there is no output left to wait for.
+        pollfd readFds[3]{ { pipes[0].Fd, POLLIN, 0 },
+                           { pipes[1].Fd, POLLIN, 0 },
+                           { exited ? -1 : exitFd, POLLIN, 0 } };
+        const int pollTimeout = (outputOpen || exitFd != -1) ? 100 : 5;
+        const int pollResult = poll(readFds, ARRAY_SIZE(readFds), pollTimeout);
+        if (pollResult == 0 || (pollResult == -1 && errno == EINTR))
         {
+            continue;
+        }
+
+        if (pollResult == -1)
+        {
+            Log_Error("Poll failed, error %d", errno);
             break;
         }
 
-        buffer[count] = 0;
-        output += buffer;
+        for (size_t i = 0; i < ARRAY_SIZE(pipes); ++i)
+        {
+            if (pipes[i].Fd == -1 || readFds[i].revents == 0)
+            {
+                continue;
+            }
+
+            char buffer[4096];
+            const ssize_t count = read(pipes[i].Fd, buffer, sizeof(buffer));
+            if (count == -1 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (count > 0)
+            {
+                ConsumeOutput(&pipes[i], buffer, static_cast<size_t>(count), lineCallback);
+                continue;
+            }
+
+            if (count == -1)
+            {
+                Log_Error("Read failed, error %d", errno);
+            }
+
+            // End of output, pass on a last line without line break.
+            if (!pipes[i].Pending.empty())
+            {
+                EmitLine(pipes[i], pipes[i].Pending, lineCallback);
+                pipes[i].Pending.clear();
+            }
+
+            close(pipes[i].Fd);
+            pipes[i].Fd = -1;
+        }
+    }
+
+    if (exited && (pipes[0].Fd != -1 || pipes[1].Fd != -1))
+    {
+        Log_Warn("Child process %d exited, but processes it started still hold its output open", pid);
     }
 
-    int wstatus;
-    int childExitStatus;
+    for (const ChildOutputPipe& outputPipe : pipes)
+    {
+        if (outputPipe.Fd != -1)
+        {
+            close(outputPipe.Fd);
+        }
+    }
 
-    waitpid(pid, &wstatus, 0);
+    if (exitFd != -1)
+    {
+        close(exitFd);
+    }
+
+    if (!exited)
+    {
+        // Only after a poll failure.
+        while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR)
+        {
+        }
+    }
+
+    if (!cgroupPath.empty())
+    {
+        RemoveChildCgroup(cgroupPath);
+    }
+
+    const std::string spanName = "exec:" + command.substr(command.find_last_of('/') + 1);
+    ADUC_WorkflowTiming_AddSpan(spanName.c_str(), startNs);
+
+    int childExitStatus;
 
     // Get the child process exit code.
     if (WIFEXITED(wstatus))
@@ -167,7 +723,5 @@ int ADUC_LaunchChildProcess(const std::string& command, std::vector<std::string>
         Log_Error("Child process terminated abnormally.", childExitStatus);
     }
 
-    close(filedes[READ_END]);
-
     return childExitStatus;
 }
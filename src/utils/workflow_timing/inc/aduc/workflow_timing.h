@@ -0,0 +1,43 @@
+/**
+ * @file workflow_timing.h
+ * @brief Records where the time of an update workflow goes.
+ *
+ * The agent opens a report when a deployment starts downloading and closes it when the workflow returns to Idle.
+ * In between, any layer adds spans measured with the monotonic clock, e.g. the phases, the sandbox creation, hash
+ * checks and child processes. Spans added while no report is open are dropped.
+ *
+ * A report is written to ADUC_DATA_FOLDER/workflow_timing.json when it is closed, and kept there across a reboot
+ * or agent restart of the workflow, which is added as a span measured with the wall clock.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#ifndef ADUC_WORKFLOW_TIMING_H
+#define ADUC_WORKFLOW_TIMING_H
+
+#include <aduc/c_utils.h>
+#include <parson.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+EXTERN_C_BEGIN
+
+/**
+ * @brief Most spans kept in a report. Later spans are only counted.
+ */
+#define ADUC_WORKFLOW_TIMING_MAX_SPANS 128
+
+uint64_t ADUC_WorkflowTiming_Now(void);
+
+void ADUC_WorkflowTiming_Begin(const char* workflowId);
+
+void ADUC_WorkflowTiming_AddSpan(const char* name, uint64_t startNs);
+
+void ADUC_WorkflowTiming_Suspend(const char* reason);
+
+_Bool ADUC_WorkflowTiming_Resume(void);
+
+JSON_Value* ADUC_WorkflowTiming_End(const char* updateId, const char* outcome);
+
+EXTERN_C_END
+
+#endif // ADUC_WORKFLOW_TIMING_H
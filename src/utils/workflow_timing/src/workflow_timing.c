@@ -0,0 +1,336 @@
+/**
+ * @file workflow_timing.c
+ * @brief Implements the workflow timing report.
+ *
+ * Sample report:
+ * {
+ *     "workflowId": "211015093000",
+ *     "updateId": "fus:fsupdate:1.2.0",
+ *     "outcome": "Installed",
+ *     "totalMs": 95310,
+ *     "spans": [
+ *         { "name": "sandbox", "startMs": 2, "ms": 1 },
+ *         { "name": "hash", "startMs": 40120, "ms": 310 },
+ *         { "name": "Download", "startMs": 0, "ms": 40433 },
+ *         ...
+ *     ]
+ * }
+ *
+ * A span starts at startMs after the workflow began and took ms; spans that contain others end after them.
+ *
+ * @copyright Copyright (c) 2019, Microsoft Corp.
+ */
+#include "aduc/workflow_timing.h"
+
+#include <aduc/logging.h>
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WORKFLOW_TIMING_PATH ADUC_DATA_FOLDER "/workflow_timing.json"
+
+/**
+ * @brief A measured span.
+ */
+typedef struct tagADUC_WorkflowTimingSpan
+{
+    char Name[48]; /**< What was measured, e.g. "download" or "exec:FS-Update". */
+    int64_t StartMs; /**< Start, relative to the start of the workflow. */
+    int64_t DurationMs; /**< Duration. */
+} ADUC_WorkflowTimingSpan;
+
+/**
+ * @brief The open report.
+ */
+static struct
+{
+    pthread_mutex_t Lock;
+    _Bool Open;
+    char WorkflowId[sizeof("191121010203")];
+    int64_t BeginNs; /**< Monotonic time the workflow began; before boot if it spans a reboot. */
+    ADUC_WorkflowTimingSpan Spans[ADUC_WORKFLOW_TIMING_MAX_SPANS];
+    unsigned int SpanCount;
+    unsigned int DroppedSpanCount;
+} s_timing = { .Lock = PTHREAD_MUTEX_INITIALIZER };
+
+/**
+ * @brief Returns the monotonic time, in nanoseconds.
+ */
+uint64_t ADUC_WorkflowTiming_Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 * 1000 * 1000 + (uint64_t)now.tv_nsec;
+}
+
+/**
+ * @brief Returns the wall clock time, in milliseconds since the epoch.
+ */
+static int64_t GetEpochMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / (1000 * 1000);
+}
+
+/**
+ * @brief Adds a span. Caller holds the lock.
+ */
+static void AddSpanLocked(const char* name, int64_t startMs, int64_t durationMs)
+{
+    if (s_timing.SpanCount == ADUC_WORKFLOW_TIMING_MAX_SPANS)
+    {
+        ++s_timing.DroppedSpanCount;
+        return;
+    }
+
+    ADUC_WorkflowTimingSpan* span = s_timing.Spans + s_timing.SpanCount;
+    snprintf(span->Name, sizeof(span->Name), "%s", name);
+    span->StartMs = startMs;
+    span->DurationMs = durationMs;
+    ++s_timing.SpanCount;
+}
+
+/**
+ * @brief Builds the report of the open workflow, as of @p nowNs. Caller holds the lock.
+ *
+ * @return JSON_Value* The report, or NULL on error.
+ */
+static JSON_Value* BuildReportLocked(uint64_t nowNs)
+{
+    JSON_Value* reportValue = json_value_init_object();
+    JSON_Value* spansValue = json_value_init_array();
+    JSON_Object* reportObject = json_value_get_object(reportValue);
+    JSON_Array* spansArray = json_value_get_array(spansValue);
+
+    if (reportObject == NULL || spansArray == NULL)
+    {
+        goto error;
+    }
+
+    for (unsigned int i = 0; i < s_timing.SpanCount; ++i)
+    {
+        JSON_Value* spanValue = json_value_init_object();
+        JSON_Object* spanObject = json_value_get_object(spanValue);
+        if (spanObject == NULL || json_object_set_string(spanObject, "name", s_timing.Spans[i].Name) != JSONSuccess
+            || json_object_set_number(spanObject, "startMs", (double)s_timing.Spans[i].StartMs) != JSONSuccess
+            || json_object_set_number(spanObject, "ms", (double)s_timing.Spans[i].DurationMs) != JSONSuccess
+            || json_array_append_value(spansArray, spanValue) != JSONSuccess)
+        {
+            json_value_free(spanValue);
+            goto error;
+        }
+    }
+
+    if (json_object_set_string(reportObject, "workflowId", s_timing.WorkflowId) != JSONSuccess
+        || json_object_set_number(reportObject, "totalMs", (double)(((int64_t)nowNs - s_timing.BeginNs) / 1000000))
+               != JSONSuccess
+        || json_object_set_value(reportObject, "spans", spansValue) != JSONSuccess)
+    {
+        goto error;
+    }
+
+    if (s_timing.DroppedSpanCount > 0
+        && json_object_set_number(reportObject, "droppedSpans", s_timing.DroppedSpanCount) != JSONSuccess)
+    {
+        json_value_free(reportValue);
+        return NULL;
+    }
+
+    return reportValue;
+
+error:
+    json_value_free(spansValue);
+    json_value_free(reportValue);
+    return NULL;
+}
+
+/**
+ * @brief Replaces the report file with @p reportValue.
+ */
+static void WriteReport(const JSON_Value* reportValue)
+{
+    const char* tempPath = WORKFLOW_TIMING_PATH ".tmp";
+    if (json_serialize_to_file(reportValue, tempPath) != JSONSuccess || rename(tempPath, WORKFLOW_TIMING_PATH) != 0)
+    {
+        Log_Warn("Cannot write %s", WORKFLOW_TIMING_PATH);
+        unlink(tempPath);
+    }
+}
+
+/**
+ * @brief Opens the report of a new workflow. A report that is still open is discarded.
+ *
+ * @param workflowId The workflow.
+ */
+void ADUC_WorkflowTiming_Begin(const char* workflowId)
+{
+    pthread_mutex_lock(&s_timing.Lock);
+    s_timing.Open = true;
+    snprintf(s_timing.WorkflowId, sizeof(s_timing.WorkflowId), "%s", workflowId != NULL ? workflowId : "");
+    s_timing.BeginNs = (int64_t)ADUC_WorkflowTiming_Now();
+    s_timing.SpanCount = 0;
+    s_timing.DroppedSpanCount = 0;
+    pthread_mutex_unlock(&s_timing.Lock);
+}
+
+/**
+ * @brief Adds a span from @p startNs until now to the open report. Can be called from any thread.
+ * A span that started before the report was opened, e.g. the phase that opened it, is counted from its opening.
+ *
+ * @param name What was measured.
+ * @param startNs When it started, from ADUC_WorkflowTiming_Now().
+ */
+void ADUC_WorkflowTiming_AddSpan(const char* name, uint64_t startNs)
+{
+    const int64_t nowNs = (int64_t)ADUC_WorkflowTiming_Now();
+
+    pthread_mutex_lock(&s_timing.Lock);
+    if (s_timing.Open)
+    {
+        const int64_t spanStartNs = (int64_t)startNs > s_timing.BeginNs ? (int64_t)startNs : s_timing.BeginNs;
+        AddSpanLocked(name, (spanStartNs - s_timing.BeginNs) / 1000000, (nowNs - spanStartNs) / 1000000);
+    }
+
+    pthread_mutex_unlock(&s_timing.Lock);
+}
+
+/**
+ * @brief Saves the open report before the workflow reboots the device or restarts the agent.
+ * ADUC_WorkflowTiming_Resume() picks it up after the restart.
+ *
+ * @param reason Name of the span that covers the restart, e.g. "reboot".
+ */
+void ADUC_WorkflowTiming_Suspend(const char* reason)
+{
+    const uint64_t nowNs = ADUC_WorkflowTiming_Now();
+
+    pthread_mutex_lock(&s_timing.Lock);
+    JSON_Value* reportValue = s_timing.Open ? BuildReportLocked(nowNs) : NULL;
+    const int64_t offsetMs = ((int64_t)nowNs - s_timing.BeginNs) / 1000000;
+    pthread_mutex_unlock(&s_timing.Lock);
+
+    JSON_Object* reportObject = json_value_get_object(reportValue);
+    if (reportObject == NULL)
+    {
+        return;
+    }
+
+    if (json_object_set_string(reportObject, "suspendedBy", reason) == JSONSuccess
+        && json_object_set_number(reportObject, "suspendedAtMs", (double)offsetMs) == JSONSuccess
+        && json_object_set_number(reportObject, "suspendedAtEpochMs", (double)GetEpochMs()) == JSONSuccess)
+    {
+        WriteReport(reportValue);
+    }
+
+    json_value_free(reportValue);
+}
+
+/**
+ * @brief Reopens the report saved by ADUC_WorkflowTiming_Suspend() before this start of the agent, and adds the
+ * restart as a span.
+ *
+ * @return _Bool True if a report was reopened.
+ */
+_Bool ADUC_WorkflowTiming_Resume(void)
+{
+    _Bool resumed = false;
+    JSON_Value* reportValue = json_parse_file(WORKFLOW_TIMING_PATH);
+    JSON_Object* reportObject = json_value_get_object(reportValue);
+    const char* reason = json_object_get_string(reportObject, "suspendedBy");
+    const char* workflowId = json_object_get_string(reportObject, "workflowId");
+    JSON_Array* spansArray = json_object_get_array(reportObject, "spans");
+
+    if (reason == NULL || workflowId == NULL || spansArray == NULL)
+    {
+        goto done;
+    }
+
+    const int64_t offsetMs = (int64_t)json_object_get_number(reportObject, "suspendedAtMs");
+    int64_t restartMs = GetEpochMs() - (int64_t)json_object_get_number(reportObject, "suspendedAtEpochMs");
+    if (restartMs < 0)
+    {
+        // The wall clock was set back during the restart.
+        restartMs = 0;
+    }
+
+    pthread_mutex_lock(&s_timing.Lock);
+
+    s_timing.Open = true;
+    snprintf(s_timing.WorkflowId, sizeof(s_timing.WorkflowId), "%s", workflowId);
+    s_timing.BeginNs = (int64_t)ADUC_WorkflowTiming_Now() - (offsetMs + restartMs) * 1000000;
+    s_timing.SpanCount = 0;
+    s_timing.DroppedSpanCount = (unsigned int)json_object_get_number(reportObject, "droppedSpans");
+
+    for (size_t i = 0; i < json_array_get_count(spansArray); ++i)
+    {
+        JSON_Object* spanObject = json_array_get_object(spansArray, i);
+        const char* name = json_object_get_string(spanObject, "name");
+        if (name != NULL)
+        {
+            AddSpanLocked(
+                name,
+                (int64_t)json_object_get_number(spanObject, "startMs"),
+                (int64_t)json_object_get_number(spanObject, "ms"));
+        }
+    }
+
+    AddSpanLocked(reason, offsetMs, restartMs);
+
+    pthread_mutex_unlock(&s_timing.Lock);
+
+    // A later start of the agent must not resume it again.
+    unlink(WORKFLOW_TIMING_PATH);
+
+    Log_Info("Resumed timing of workflow %s after %s of %" PRId64 " ms", workflowId, reason, restartMs);
+    resumed = true;
+
+done:
+    json_value_free(reportValue);
+    return resumed;
+}
+
+/**
+ * @brief Closes the open report and writes it to the data folder.
+ *
+ * @param updateId The update of the workflow, provider:name:version.
+ * @param outcome How the workflow ended, e.g. "Installed" or "Failed".
+ * @return JSON_Value* The report, to be freed by the caller, or NULL if no report was open.
+ */
+JSON_Value* ADUC_WorkflowTiming_End(const char* updateId, const char* outcome)
+{
+    const uint64_t nowNs = ADUC_WorkflowTiming_Now();
+
+    pthread_mutex_lock(&s_timing.Lock);
+    JSON_Value* reportValue = s_timing.Open ? BuildReportLocked(nowNs) : NULL;
+    s_timing.Open = false;
+    pthread_mutex_unlock(&s_timing.Lock);
+
+    JSON_Object* reportObject = json_value_get_object(reportValue);
+    if (reportObject == NULL)
+    {
+        json_value_free(reportValue);
+        return NULL;
+    }
+
+    if (json_object_set_string(reportObject, "updateId", updateId != NULL ? updateId : "") != JSONSuccess
+        || json_object_set_string(reportObject, "outcome", outcome) != JSONSuccess)
+    {
+        json_value_free(reportValue);
+        return NULL;
+    }
+
+    WriteReport(reportValue);
+
+    Log_Info(
+        "Workflow %s ended (%s) after %.0f ms",
+        json_object_get_string(reportObject, "workflowId"),
+        outcome,
+        json_object_get_number(reportObject, "totalMs"));
+
+    return reportValue;
+}